@@ -65,7 +65,7 @@ int AuthPlugin::determineGroup(std::string &user, int &fg)
 	String ue(u);
 	ue += "=";
 
-	char *i = o.filter_groups_list.findStartsWithPartial(ue.toCharArray());
+	const char *i = o.filter_groups_list.findStartsWithPartial(ue.toCharArray());
 
 	if (i == NULL) {
 #ifdef DGDEBUG
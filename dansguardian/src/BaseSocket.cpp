@@ -19,7 +19,7 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <syslog.h>
-#include <sys/select.h>
+#include <sys/poll.h>
 
 #ifdef DGDEBUG
 #include <iostream>
@@ -31,64 +31,31 @@
 extern bool reloadconfig;
 
 
-// DEFINITIONS
-
-#define dgtimercmp(a, b, cmp) \
-	(((a)->tv_sec == (b)->tv_sec) ? ((a)->tv_usec cmp (b)->tv_usec) : ((a)->tv_sec cmp (b)->tv_sec))
-
-#define dgtimersub(a, b, result) \
-	(result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
-	(result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
-	if ((result)->tv_usec < 0) { \
-		(result)->tv_sec--; \
-		(result)->tv_usec += 1000000; \
-	}
-
-
 // IMPLEMENTATION
 
-// a wrapper for select so that it auto-restarts after an EINTR.
+// a wrapper for poll so that it auto-restarts after an EINTR, waiting only for
+// whatever remains of the timeout (in milliseconds; negative waits forever).
 // can be instructed to watch out for signal triggered config reloads.
-int selectEINTR(int numfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval *timeout, bool honour_reloadconfig)
+int pollEINTR(struct pollfd *fds, nfds_t nfds, int timeout, bool honour_reloadconfig)
 {
 	int rc;
 	errno = 0;
-	// Fix for OSes that do not explicitly modify select()'s timeout value
-	// from Soner Tari <list@kulustur.org> (namely OpenBSD)
-	// Modified to use custom code in preference to timersub/timercmp etc.
-	// to avoid that particular portability nightmare.
 	timeval entrytime;
-	timeval exittime;
-	timeval elapsedtime;
-	timeval timeoutcopy;
+	timeval now;
+	long remaining = timeout;
+	if (timeout > 0)
+		gettimeofday(&entrytime, NULL);
 	while (true) {  // using the while as a restart point with continue
-		if (timeout != NULL) {
-			gettimeofday(&entrytime, NULL);
-			timeoutcopy = *timeout;
-			rc = select(numfds, readfds, writefds, exceptfds, &timeoutcopy);
-			// explicitly modify the timeout if the OS hasn't done this for us
-			if (timeoutcopy.tv_sec == timeout->tv_sec && timeoutcopy.tv_usec == timeout->tv_usec) {
-				gettimeofday(&exittime, NULL);
-				// calculate time spent sleeping this iteration
-				dgtimersub(&exittime, &entrytime, &elapsedtime);
-				// did we wait longer than/as long as was left?
-				if (!dgtimercmp(timeout, &elapsedtime, <)) {
-					// no - reduce the amount that is left
-					dgtimersub(timeout, &elapsedtime, timeout);
-				} else {
-					// yes - we've timed out, so exit
-					timeout->tv_sec = timeout->tv_usec = 0;
-					break;
-				}
-			} else {
-				// if the OS has modified the timeout for us,
-				// propogate the change back to the caller
-				*timeout = timeoutcopy;
-			}
-		} else
-			rc = select(numfds, readfds, writefds, exceptfds, NULL);
+		rc = poll(fds, nfds, remaining);
 		if (rc < 0) {
 			if (errno == EINTR && (honour_reloadconfig? !reloadconfig : true)) {
+				if (timeout > 0) {
+					// take off the time already spent waiting
+					gettimeofday(&now, NULL);
+					remaining = timeout - ((now.tv_sec - entrytime.tv_sec) * 1000 + (now.tv_usec - entrytime.tv_usec) / 1000);
+					if (remaining < 0)
+						remaining = 0;
+				}
 				continue;  // was interupted by a signal so restart
 			}
 		}
@@ -97,6 +64,16 @@ int selectEINTR(int numfds, fd_set * readfds, fd_set * writefds, fd_set * except
 	return rc;  // return status
 }
 
+// wait for a single FD to become ready for the given events - returns as pollEINTR
+int waitForFD(int fd, short events, int timeout, bool honour_reloadconfig)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	return pollEINTR(&pfd, 1, timeout, honour_reloadconfig);
+}
+
 // This class contains client and server socket init and handling
 // code as well as functions for testing and working with the socket FDs.
 
@@ -195,14 +172,7 @@ bool BaseSocket::checkForInput()
 	if ((bufflen - buffstart) > 0)
 		return true;
 
-	fd_set fdSet;
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(sck, &fdSet);  // add fd to the set
-	timeval t;  // timeval struct
-	t.tv_sec = 0;
-	t.tv_usec = 0;
-
-	if (selectEINTR(sck + 1, &fdSet, NULL, NULL, &t) < 1) {
+	if (waitForFD(sck, POLLIN, 0) < 1) {
 		return false;
 	}
 
@@ -221,14 +191,8 @@ void BaseSocket::checkForInput(int timeout, bool honour_reloadconfig) throw(std:
 
 	// blocks if socket blocking
 	// until timeout
-	fd_set fdSet;
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(sck, &fdSet);  // add fd to the set
-	timeval t;  // timeval struct
-	t.tv_sec = timeout;
-	t.tv_usec = 0;
-	if (selectEINTR(sck + 1, &fdSet, NULL, NULL, &t, honour_reloadconfig) < 1) {
-		std::string err("select() on input: ");
+	if (waitForFD(sck, POLLIN, timeout * 1000, honour_reloadconfig) < 1) {
+		std::string err("poll() on input: ");
 		throw std::runtime_error(err + (errno ? ErrStr() : "timeout"));
 	}
 }
@@ -236,13 +200,7 @@ void BaseSocket::checkForInput(int timeout, bool honour_reloadconfig) throw(std:
 // non-blocking check to see if a socket is ready to be written
 bool BaseSocket::readyForOutput()
 {
-	fd_set fdSet;
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(sck, &fdSet);  // add fd to the set
-	timeval t;  // timeval struct
-	t.tv_sec = 0;
-	t.tv_usec = 0;
-	if (selectEINTR(sck + 1, NULL, &fdSet, NULL, &t) < 1) {
+	if (waitForFD(sck, POLLOUT, 0) < 1) {
 		return false;
 	}
 	return true;
@@ -253,14 +211,8 @@ void BaseSocket::readyForOutput(int timeout, bool honour_reloadconfig) throw(std
 {
 	// blocks if socket blocking
 	// until timeout
-	fd_set fdSet;
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(sck, &fdSet);  // add fd to the set
-	timeval t;  // timeval struct
-	t.tv_sec = timeout;
-	t.tv_usec = 0;
-	if (selectEINTR(sck + 1, NULL, &fdSet, NULL, &t, honour_reloadconfig) < 1) {
-		std::string err("select() on output: ");
+	if (waitForFD(sck, POLLOUT, timeout * 1000, honour_reloadconfig) < 1) {
+		std::string err("poll() on output: ");
 		throw std::runtime_error(err + (errno ? ErrStr() : "timeout"));
 	}
 }
@@ -16,10 +16,14 @@
 #include <exception>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/poll.h>
 
 #include "Debug.hpp"
 
-int selectEINTR(int numfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval *timeout, bool honour_reloadconfig = false);
+// poll, restarting after signals - timeouts are in milliseconds, negative for none
+int pollEINTR(struct pollfd *fds, nfds_t nfds, int timeout, bool honour_reloadconfig = false);
+// wait for one FD to be ready for the given poll events (POLLIN, POLLOUT)
+int waitForFD(int fd, short events, int timeout, bool honour_reloadconfig = false);
 
 class BaseSocket
 {
@@ -30,7 +34,7 @@ public:
 	// make a socket a listening server socket
 	int listen(int queue);
 
-	// grab socket's FD, e.g. for passing to selectEINTR
+	// grab socket's FD, e.g. for passing to pollEINTR
 	// use sparingly, and DO NOT do manual data transfer with it
 	int getFD();
 	
@@ -14,6 +14,8 @@
 #include "BackedStore.hpp"
 #include "ImageContainer.hpp"
 #include "FDFuncs.hpp"
+#include "DynamicURLList.hpp"
+#include "Scoreboard.hpp"
 
 #ifdef __SSLMITM
 #include "CertificateAuthority.hpp"
@@ -50,6 +52,8 @@
 extern OptionContainer o;
 extern bool is_daemonised;
 extern bool reloadconfig;
+extern DynamicURLList urlcache;
+extern Scoreboard scoreboard;
 
 #ifdef DGDEBUG
 int dbgPeerPort;
@@ -75,48 +79,11 @@ bool wasClean(String &url, const int fg)
 {
 	if (reloadconfig)
 		return false;
-	UDSocket ipcsock;
-	if (ipcsock.getFD() < 0) {
-		syslog(LOG_ERR, "Error creating ipc socket to url cache");
-		return false;
-	}
-	if (ipcsock.connect(o.urlipc_filename.c_str()) < 0) {	// conn to dedicated url cach proc
-		syslog(LOG_ERR, "Error connecting via ipc to url cache: %s", ErrStr().c_str());
-		ipcsock.close();
-		return false;
-	}
-	std::string myurl(" ");
-	myurl += url.after("://").toCharArray();
-	myurl[0] = fg+1;
-	myurl += "\n";
-#ifdef DGDEBUG
-	std::cout << dbgPeerPort << " -sending cache search request: " << myurl;
-#endif
-	try {
-		ipcsock.writeString(myurl.c_str());  // throws on err
-	}
-	catch(std::exception & e) {
+	String myurl(url.after("://"));
 #ifdef DGDEBUG
-		std::cerr << dbgPeerPort << " -Exception writing to url cache" << std::endl;
-		std::cerr << e.what() << std::endl;
-#endif
-		syslog(LOG_ERR, "Exception writing to url cache");
-		syslog(LOG_ERR, "%s", e.what());
-	}
-	char reply;
-	try {
-		ipcsock.readFromSocket(&reply, 1, 0, 6);  // throws on err
-	}
-	catch(std::exception & e) {
-#ifdef DGDEBUG
-		std::cerr << dbgPeerPort << " -Exception reading from url cache" << std::endl;
-		std::cerr << e.what() << std::endl;
+	std::cout << dbgPeerPort << " -searching url cache: " << myurl << std::endl;
 #endif
-		syslog(LOG_ERR, "Exception reading from url cache");
-		syslog(LOG_ERR, "%s", e.what());
-	}
-	ipcsock.close();
-	return reply == 'Y';
+	return urlcache.inURLList(myurl.toCharArray(), fg);
 }
 
 // add a known clean URL to the cache
@@ -124,34 +91,48 @@ void addToClean(String &url, const int fg)
 {
 	if (reloadconfig)
 		return;
-	UDSocket ipcsock;
-	if (ipcsock.getFD() < 0) {
-		syslog(LOG_ERR, "Error creating ipc socket to url cache");
-		return;
-	}
-	if (ipcsock.connect(o.urlipc_filename.c_str()) < 0) {	// conn to dedicated url cach proc
-		syslog(LOG_ERR, "Error connecting via ipc to url cache: %s", ErrStr().c_str());
+	String myurl(url.after("://"));
+	urlcache.addEntry(myurl.toCharArray(), fg);
+}
+
+// check the URL cache to see if we've already blocked an address, and if so, fill in why
+bool wasBlocked(String &url, const int fg, const bool ssl, NaughtyFilter *checkme)
+{
+	if (reloadconfig)
+		return false;
+	std::string data;
+	if (!urlcache.inBlockedList(url.toCharArray(), fg, ssl, data))
+		return false;
+	// log type, reason, log reason & categories, separated by nulls
+	std::string::size_type reason = data.find('\0');
+	std::string::size_type log = (reason == std::string::npos) ? reason : data.find('\0', reason + 1);
+	std::string::size_type cats = (log == std::string::npos) ? log : data.find('\0', log + 1);
+	if (cats == std::string::npos)
+		return false;
 #ifdef DGDEBUG
-		std::cout << dbgPeerPort << " -Error connecting via ipc to url cache: " << ErrStr() << std::endl;
+	std::cout << dbgPeerPort << " -url found in blocked cache: " << url << std::endl;
 #endif
+	checkme->isItNaughty = true;
+	checkme->blocktype = atoi(data.substr(0, reason).c_str());
+	checkme->whatIsNaughty = data.substr(reason + 1, log - reason - 1);
+	checkme->whatIsNaughtyLog = data.substr(log + 1, cats - log - 1);
+	checkme->whatIsNaughtyCategories = data.substr(cats + 1);
+	return true;
+}
+
+// add a blocked URL to the cache, along with the reason it was blocked
+void addToBlocked(String &url, const int fg, const bool ssl, NaughtyFilter *checkme)
+{
+	if (reloadconfig)
 		return;
-	}
-	std::string myurl("g ");
-	myurl += url.after("://").toCharArray();
-	myurl[1] = fg+1;
-	myurl += "\n";
-	try {
-		ipcsock.writeString(myurl.c_str());  // throws on err
-	}
-	catch(std::exception & e) {
-#ifdef DGDEBUG
-		std::cerr << dbgPeerPort << " -Exception adding to url cache" << std::endl;
-		std::cerr << e.what() << std::endl;
-#endif
-		syslog(LOG_ERR, "Exception adding to url cache");
-		syslog(LOG_ERR, "%s", e.what());
-	}
-	ipcsock.close();
+	std::string data(String(checkme->blocktype).toCharArray());
+	data.append(1, '\0');
+	data.append(checkme->whatIsNaughty);
+	data.append(1, '\0');
+	data.append(checkme->whatIsNaughtyLog);
+	data.append(1, '\0');
+	data.append(checkme->whatIsNaughtyCategories);
+	urlcache.addBlockedEntry(url.toCharArray(), fg, ssl, data);
 }
 
 //
@@ -331,22 +312,29 @@ off_t ConnectionHandler::sendFile(Socket * peerconn, String & filename, String &
 
 // pass data between proxy and client, filtering as we go.
 // this is the only public function of ConnectionHandler
-void ConnectionHandler::handlePeer(Socket &peerconn, String &ip)
+bool ConnectionHandler::handlePeer(Socket &peerconn, String &ip, PeerState *state)
 {
-	persistent_authed = false;
+	if (state != NULL) {
+		// carry on where we left off with this connection
+		persistent_authed = state->persistent_authed;
+		clientuser = state->clientuser;
+		filtergroup = state->filtergroup;
+	} else
+		persistent_authed = false;
 
 #ifdef DGDEBUG
 	// for debug info only - TCP peer port
 	dbgPeerPort = peerconn.getPeerSourcePort();
 #endif
 
-	handleConnection(peerconn, ip);
-
-	return;
+	bool keep = handleConnection(peerconn, ip, state);
+	scoreboard.clientEnd(clientheld);
+	scoreboard.setActivity(SB_WAITING);
+	return keep;
 }
 
 // all content blocking/filtering is triggered from calls inside here
-void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
+bool ConnectionHandler::handleConnection(Socket &peerconn, String &ip, PeerState *handback)
 {
 	struct timeval thestart;
 	gettimeofday(&thestart, NULL);
@@ -442,11 +430,16 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 		std::string room;
 
 		int oldfg = 0, gmode;
+		if (handback != NULL) {
+			oldclientuser = handback->oldclientuser;
+			oldfg = handback->oldfg;
+		}
 		bool authed = false;
 		bool isbanneduser = false;
 		
 		FDTunnel fdt;
-		NaughtyFilter checkme;
+		// our filter lives as long as we do (so that its scratch space gets reused), so reset it
+		checkme.reset();
 		AuthPlugin* auth_plugin = NULL;
 
 		// RFC states that connections are persistent
@@ -455,10 +448,12 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 		bool persistProxy = true;
 
 		bool firsttime = true;
-		header.in(&peerconn, true, true);  // get header from client, allowing persistency and breaking on reloadconfig
+		// get header from client, allowing persistency.  the client is expecting an answer,
+		// so this first request is seen through even if we're told to reload.
+		header.in(&peerconn, true);
 
 		// maintain a persistent connection
-		while ((firsttime || persistPeer) && !reloadconfig) {
+		while (firsttime || (persistPeer && !reloadconfig)) {
 			if (firsttime) {
 				// reset flags & objects next time round the loop
 				firsttime = false;
@@ -475,6 +470,22 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 				}
 #endif // __SSLMITM
 
+				// hand the connection back whilst it waits for its next request,
+				// unless that has already started arriving.  not done with
+				// connection-based auth (NTLM), as the proxy has authenticated
+				// our connection to it, which would be closed on the way out.
+				if (handback != NULL && !o.auth_connection_based && !peerconn.checkForInput()) {
+#ifdef DGDEBUG
+					std::cout << dbgPeerPort << " -handing back persistent connection" << std::endl;
+#endif
+					handback->persistent_authed = persistent_authed;
+					handback->clientuser = clientuser;
+					handback->filtergroup = filtergroup;
+					handback->oldclientuser = oldclientuser;
+					handback->oldfg = oldfg;
+					return true;
+				}
+
 #ifdef DGDEBUG
 				std::cout << dbgPeerPort << " -persisting (count " << ++pcount << ")" << std::endl;
 				syslog(LOG_ERR, "Served %d requests on this connection so far", pcount);
@@ -556,7 +567,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 						std::cerr << dbgPeerPort << " -Error connecting to proxy" << std::endl;
 #endif
 						syslog(LOG_ERR, "Error connecting to proxy");
-						return;
+						return false;
 					}
 				}
 				catch(std::exception & e) {
@@ -735,6 +746,17 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 			urld = header.decode(url);
 			urldomain = url.getHostname();
 
+			// let anyone looking at the scoreboard know what we're up to
+			scoreboard.startRequest(url.toCharArray(), clientip.c_str());
+			scoreboard.setUser(clientuser.c_str());
+
+			// check as much content as the parent says there's time for
+			if (o.load_shed_max_tier > 0)
+				loadtier = scoreboard.loadTier();
+			filtersize = o.maxContentFilterSize(loadtier);
+			checkme.setFilterMode(o.phraseFilterMode(loadtier), o.preserveCase(loadtier));
+			docbody.setFilterSize(filtersize);
+
 			// checks for bad URLs to prevent security holes/domain obfuscation.
 			if (header.malformedURL(url))
 			{
@@ -762,6 +784,37 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 #endif
 			}
 
+			// don't let any one client or user have more than their share of the children.
+			// wait a while for them to finish some of what they're doing, if allowed to.
+			if (o.client_limits) {
+				scoreboard.clientEnd(clientheld);
+				int limited;
+				int tries = o.client_limit_wait * 10;
+				const char *limituser = (clientuser == "-") ? "" : clientuser.c_str();
+				while ((limited = scoreboard.clientBegin(clientip.c_str(), limituser, clientheld, tries < 1)) != SB_CLIENTOK
+					&& tries-- > 0)
+				{
+					usleep(100000);
+				}
+				if (limited != SB_CLIENTOK) {
+#ifdef DGDEBUG
+					std::cout << dbgPeerPort << " -client over its limits: " << clientip << " " << clientuser << std::endl;
+#endif
+					try {
+						peerconn.writeString("HTTP/1.0 429 Too Many Requests\r\nRetry-After: 5\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n");
+						peerconn.writeString("<HTML><HEAD><TITLE>DansGuardian - 429 Too Many Requests</TITLE></HEAD><BODY><H1>DansGuardian - 429 Too Many Requests</H1>");
+						if (limited == SB_TOOMANY)
+							peerconn.writeString("You have too many requests in progress.");
+						else
+							peerconn.writeString("You are making requests too quickly.");
+						peerconn.writeString("  Please try again in a few moments.</BODY></HTML>\n");
+					}
+					catch(std::exception & e) {
+					}
+					break;
+				}
+			}
+
 			// is this machine banned?
 			bool isbannedip = o.inBannedIPList(&clientip, clienthost);
 			if (isbannedip)
@@ -796,7 +849,8 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 					break;
 				}
 
-				std::string orig_dest_ip(inet_ntoa(origaddr.sin_addr));
+				char ipbuf[INET_ADDRSTRLEN];
+				std::string orig_dest_ip(inet_ntop(AF_INET, &origaddr.sin_addr, ipbuf, sizeof(ipbuf)));
 				if (orig_dest_ip == peerconn.getLocalIP())
 				{
 					// The destination IP before redirection is the same as the IP the
@@ -825,7 +879,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 					bool matched = false;
 					while (current != NULL)
 					{
-						if (orig_dest_ip == inet_ntoa(((sockaddr_in*)(current->ai_addr))->sin_addr))
+						if (orig_dest_ip == inet_ntop(AF_INET, &((sockaddr_in*)(current->ai_addr))->sin_addr, ipbuf, sizeof(ipbuf)))
 						{
 #ifdef DGDEBUG
 							std::cout << dbgPeerPort << urldomain << " matched to original destination of " << orig_dest_ip << std::endl;
@@ -914,7 +968,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 						writestring += "\r\n\r\n";
 						peerconn.writeString(writestring.toCharArray());
 
-						return;
+						return false;
 					}
 
 #ifdef DGDEBUG
@@ -929,7 +983,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 					writestring += "\r\n\r\n";
 					peerconn.writeString(writestring.toCharArray());
 
-					return;
+					return false;
 				}
 
 				/* Accept request. */
@@ -1030,6 +1084,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 			if (!(isbanneduser || isbannedip || isbypass)) {
 				bool is_ssl = header.requestType() == "CONNECT";
 				bool is_ip = isIPHostnameStrip(urld);
+				ListResult listresult;
 				if ((gmode == 2)) {	// admin user
 					isexception = true;
 					exceptionreason = o.language_list.getTranslation(601);
@@ -1041,21 +1096,21 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 					exceptionreason = o.language_list.getTranslation(600);
 					// Exception client IP match.
 				}
-				else if (o.fg[filtergroup]->inExceptionSiteList(urld, true, is_ip, is_ssl)) {	// allowed site
+				else if (o.fg[filtergroup]->inExceptionSiteList(urld, true, is_ip, is_ssl, &listresult)) {	// allowed site
 					if (o.fg[0]->isOurWebserver(url)) {
 						isourwebserver = true;
 					} else {
 						isexception = true;
 						exceptionreason = o.language_list.getTranslation(602);
 						// Exception site match.
-						exceptioncat = o.lm.l[o.fg[filtergroup]->exception_site_list]->lastcategory.toCharArray();
+						exceptioncat = listresult.category();
 					}
 				}
-				else if (o.fg[filtergroup]->inExceptionURLList(urld, true, is_ip, is_ssl)) {	// allowed url
+				else if (o.fg[filtergroup]->inExceptionURLList(urld, true, is_ip, is_ssl, &listresult)) {	// allowed url
 					isexception = true;
 					exceptionreason = o.language_list.getTranslation(603);
 					// Exception url match.
-					exceptioncat = o.lm.l[o.fg[filtergroup]->exception_url_list]->lastcategory.toCharArray();
+					exceptioncat = listresult.category();
 				}
 				else if ((rc = o.fg[filtergroup]->inExceptionRegExpURLList(urld)) > -1) {
 					isexception = true;
@@ -1213,21 +1268,22 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 				if (o.recheck_replaced_urls && !(isbanneduser || isbannedip)) {
 					bool is_ssl = header.requestType() == "CONNECT";
 					bool is_ip = isIPHostnameStrip(urld);
-					if (o.fg[filtergroup]->inExceptionSiteList(urld, true, is_ip, is_ssl)) {	// allowed site
+					ListResult listresult;
+					if (o.fg[filtergroup]->inExceptionSiteList(urld, true, is_ip, is_ssl, &listresult)) {	// allowed site
 						if (o.fg[0]->isOurWebserver(url)) {
 							isourwebserver = true;
 						} else {
 							isexception = true;
 							exceptionreason = o.language_list.getTranslation(602);
 							// Exception site match.
-							exceptioncat = o.lm.l[o.fg[filtergroup]->exception_site_list]->lastcategory.toCharArray();
+							exceptioncat = listresult.category();
 						}
 					}
-					else if (o.fg[filtergroup]->inExceptionURLList(urld, true, is_ip, is_ssl)) {	// allowed url
+					else if (o.fg[filtergroup]->inExceptionURLList(urld, true, is_ip, is_ssl, &listresult)) {	// allowed url
 						isexception = true;
 						exceptionreason = o.language_list.getTranslation(603);
 						// Exception url match.
-						exceptioncat = o.lm.l[o.fg[filtergroup]->exception_url_list]->lastcategory.toCharArray();
+						exceptioncat = listresult.category();
 					}
 					else if ((rc = o.fg[filtergroup]->inExceptionRegExpURLList(urld)) > -1) {
 						isexception = true;
@@ -1814,6 +1870,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 #endif
 													if (csrc > 0)
 													{
+														CSScanLock scanlock(*i);
 														csrc = (*i)->scanMemory(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
 															data + offset, part->getLength() - offset, &checkme,
 															&disposition, &mimetype);
@@ -2086,6 +2143,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 #endif
 							if (csrc > 0)
 							{
+								CSScanLock scanlock(*i);
 								String mimetype("text/plain");
 								csrc = (*i)->scanMemory(&header, NULL, clientuser.c_str(), filtergroup, clientip.c_str(),
 									result.c_str(), result.length(), &checkme, NULL, &mimetype);
@@ -2189,10 +2247,11 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 			if (!checkme.isItNaughty) {
 				// the request is ok, so we can	now pass it to the proxy, and check the returned header
 				// temp char used in various places here
-				char *i;
+				const char *i;
 
 				// send header to proxy
 				if (!wasrequested) {
+					scoreboard.setActivity(SB_FETCHING);
 					proxysock.readyForOutput(10);
 					header.out(&peerconn, &proxysock, __DGHEADER_SENDALL, true);
 
@@ -2340,8 +2399,8 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 						unsigned int elist, blist;
 						elist = o.fg[filtergroup]->exception_extension_list;
 						blist = o.fg[filtergroup]->banned_extension_list;
-						char* e = NULL;
-						char* b = NULL;
+						const char* e = NULL;
+						const char* b = NULL;
 						if (tempdispos.length() > 1) {
 							// dispos filename must take presidense
 #ifdef DGDEBUG
@@ -2417,7 +2476,8 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 				// check body from proxy
 				// can't do content filtering on HEAD or redirections (no content)
 				// actually, redirections CAN have content
-				if (!checkme.isItNaughty && (cl != 0) && !ishead) {
+				// at load shedding tier 3, only URLs & headers are checked
+				if (!checkme.isItNaughty && (cl != 0) && !ishead && loadtier < 3) {
 					if (((docheader.isContentType("text") || docheader.isContentType("-")) && !isexception) || !responsescanners.empty()) {
 						// don't search the cache if scan_clean_cache disabled & runav true (won't have been cached)
 						// also don't search cache for auth required headers (same reason)
@@ -2498,13 +2558,14 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 					&header, contentmodified, urlmodified, headermodified);
 				if (denyAccess(&peerconn, &proxysock, &header, &docheader, &url, &checkme, &clientuser,&clientip, filtergroup, ispostblock, headersent, wasinfected, scanerror))
 				{
-					return;  // not stealth mode
+					return false;  // not stealth mode
 				}
 
 				// if get here in stealth mode
 			}
 
 			if (!wasrequested) {
+				scoreboard.setActivity(SB_FETCHING);
 				proxysock.readyForOutput(10);  // exceptions on error/timeout
 				header.out(&peerconn, &proxysock, __DGHEADER_SENDALL, true);  // exceptions on error/timeout
 				proxysock.checkForInput(120);  // exceptions on error/timeout
@@ -2517,6 +2578,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 			}
 
 			//TODO: need to change connection: close if there is plugin involved.
+			scoreboard.setActivity(SB_SENDING);
 #ifdef DGDEBUG
 			std::cout << dbgPeerPort << " -sending header to client" << std::endl;
 #endif
@@ -2580,7 +2642,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 						sendurl = sendurl + "?GSBYPASS=" + hashed + "&N=";
 					}
 					sendurl += tempfilename + "&M=" + tempfilemime + "&D=" + tempfiledis;
-					docbody.dm_plugin->sendLink(peerconn, sendurl, url);
+					docbody.dm_plugin->sendLink(&docbody, peerconn, sendurl, url);
 
 					// can't persist after this - DM plugins don't generally send a Content-Length.
 					//TODO: need to change connection: close if there is plugin involved.
@@ -2650,7 +2712,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 		// close connection to proxy
 		proxysock.close();
 
-		return;
+		return false;
 	}
 	catch(std::exception & e) {
 #ifdef DGDEBUG
@@ -2660,7 +2722,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 		// close connection to proxy
 		proxysock.close();
 
-		return;
+		return false;
 	}
 
 	try {
@@ -2681,7 +2743,7 @@ void ConnectionHandler::handleConnection(Socket &peerconn, String &ip)
 		peerconn.close();
 	}
 
-	return;
+	return false;
 }
 
 // decide whether or not to perform logging, categorise the log entry, and write it.
@@ -2691,6 +2753,9 @@ void ConnectionHandler::doLog(std::string &who, std::string &from, String &where
 		int code, std::string &mimetype, bool wasinfected, bool wasscanned, int naughtiness, int filtergroup,
 		HTTPHeader* reqheader, bool contentmodified, bool urlmodified, bool headermodified)
 {
+	// every request ends up here, logged or not - let the parent know how long it took
+	scoreboard.endRequest(thestart);
+	scoreboard.clientEnd(clientheld);
 
 	// don't log if logging disabled entirely, or if it's an ad block and ad logging is disabled,
 	// or if it's an exception and exception logging is disabled
@@ -2813,6 +2878,7 @@ void ConnectionHandler::doLog(std::string &who, std::string &from, String &where
 			data += cr;
 		data += urlparams + cr;
 		data += postdata.str().c_str() + cr;
+		data += String(loadtier) + cr;
 
 #ifdef DGDEBUG   
 		std::cout << dbgPeerPort << " -...built" << std::endl;
@@ -2881,8 +2947,9 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 		return;
 	}
 
-	char *i;
+	const char *i;
 	int j;
+	ListResult listresult;
 	String temp;
 	temp = (*urld);
 	bool is_ssl = header->requestType() == "CONNECT";
@@ -2916,11 +2983,20 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 		}
 	}
 
+	// blocks which come from the URL lists alone can be cached, unless those lists are time limited,
+	// in which case the block might not apply later on.  banned IPs/users, search terms, header
+	// regexes and deep URL analysis all depend on more than the URL, so aren't.
+	bool cacheblock = (o.url_cache_number > 0) && !o.fg[filtergroup]->urlListsTimeLimited();
+	if (cacheblock && wasBlocked(*urld, filtergroup, is_ssl, checkme))
+		return;
+	bool blockfromlists = false;
+
 	// only apply bans to things not in the grey lists
 	bool is_ip = isIPHostnameStrip(temp);
 
 	if (((j = o.fg[filtergroup]->inBannedRegExpURLList(temp)) >= 0) && (o.fg[filtergroup]->enable_regex_grey == true)) {
 		checkme->isItNaughty = true;
+		blockfromlists = true;
 		checkme->whatIsNaughtyLog = o.language_list.getTranslation(503);
 		// Banned Regular Expression URL:
 		checkme->whatIsNaughtyLog += o.fg[filtergroup]->banned_regexpurl_list_source[j].toCharArray();
@@ -2931,27 +3007,30 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 
 	if (!(o.fg[filtergroup]->inGreySiteList(temp, true, is_ip, is_ssl) || o.fg[filtergroup]->inGreyURLList(temp, true, is_ip, is_ssl))) {
 		if (!checkme->isItNaughty) {
-			if ((i = o.fg[filtergroup]->inBannedSiteList(temp, true, is_ip, is_ssl)) != NULL) {
+			if ((i = o.fg[filtergroup]->inBannedSiteList(temp, true, is_ip, is_ssl, &listresult)) != NULL) {
 				// need to reintroduce ability to produce the blanket block messages
 				checkme->whatIsNaughty = o.language_list.getTranslation(500);  // banned site
 				checkme->whatIsNaughty += i;
 				checkme->whatIsNaughtyLog = checkme->whatIsNaughty;
 				checkme->isItNaughty = true;
-				checkme->whatIsNaughtyCategories = o.lm.l[o.fg[filtergroup]->banned_site_list]->lastcategory.toCharArray();
+				checkme->whatIsNaughtyCategories = listresult.category();
+				blockfromlists = true;
 			}
 		}
 
 		if (!checkme->isItNaughty) {
-			if ((i = o.fg[filtergroup]->inBannedURLList(temp, true, is_ip, is_ssl)) != NULL) {
+			if ((i = o.fg[filtergroup]->inBannedURLList(temp, true, is_ip, is_ssl, &listresult)) != NULL) {
 				checkme->whatIsNaughty = o.language_list.getTranslation(501);
 				// Banned URL:
 				checkme->whatIsNaughty += i;
 				checkme->whatIsNaughtyLog = checkme->whatIsNaughty;
 				checkme->isItNaughty = true;
-				checkme->whatIsNaughtyCategories = o.lm.l[o.fg[filtergroup]->banned_url_list]->lastcategory.toCharArray();
+				checkme->whatIsNaughtyCategories = listresult.category();
+				blockfromlists = true;
 			}
 			else if (((j = o.fg[filtergroup]->inBannedRegExpURLList(temp)) >= 0) && (o.fg[filtergroup]->enable_regex_grey == false)) {
 				checkme->isItNaughty = true;
+				blockfromlists = true;
 				checkme->whatIsNaughtyLog = o.language_list.getTranslation(503);
 				// Banned Regular Expression URL:
 				checkme->whatIsNaughtyLog += o.fg[filtergroup]->banned_regexpurl_list_source[j].toCharArray();
@@ -2990,23 +3069,23 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 #endif
 					continue;
 				}
-				if ((i = o.fg[filtergroup]->inBannedSiteList(deepurl)) != NULL) {
+				if ((i = o.fg[filtergroup]->inBannedSiteList(deepurl, false, false, false, &listresult)) != NULL) {
 					checkme->whatIsNaughty = o.language_list.getTranslation(500); // banned site
 					checkme->whatIsNaughty += i;
 					checkme->whatIsNaughtyLog = checkme->whatIsNaughty;
 					checkme->isItNaughty = true;
-					checkme->whatIsNaughtyCategories = o.lm.l[o.fg[filtergroup]->banned_site_list]->lastcategory.toCharArray();
+					checkme->whatIsNaughtyCategories = listresult.category();
 #ifdef DGDEBUG
 					std::cout << dbgPeerPort << " -deep site: " << deepurl << std::endl;
 #endif
 				}
-				else if ((i = o.fg[filtergroup]->inBannedURLList(deepurl)) != NULL) {
+				else if ((i = o.fg[filtergroup]->inBannedURLList(deepurl, false, false, false, &listresult)) != NULL) {
 					checkme->whatIsNaughty = o.language_list.getTranslation(501);
 					 // Banned URL:
 					checkme->whatIsNaughty += i;
 					checkme->whatIsNaughtyLog = checkme->whatIsNaughty;
 					checkme->isItNaughty = true;
-					checkme->whatIsNaughtyCategories = o.lm.l[o.fg[filtergroup]->banned_url_list]->lastcategory.toCharArray();
+					checkme->whatIsNaughtyCategories = listresult.category();
 #ifdef DGDEBUG
 					std::cout << dbgPeerPort << " -deep url: " << deepurl << std::endl;
 #endif
@@ -3018,6 +3097,10 @@ void ConnectionHandler::requestChecks(HTTPHeader *header, NaughtyFilter *checkme
 		}
 	} // grey site/URL list
 
+	if (cacheblock && blockfromlists) {
+		addToBlocked(*urld, filtergroup, is_ssl, checkme);
+	}
+
 #ifdef __SSLCERT
 	//check the certificate if
 	//its a connect,
@@ -3418,6 +3501,7 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
 	String &url, String &domain, bool *scanerror, bool &contentmodified, String *csmessage)
 {
 	int rc = 0;
+	scoreboard.setActivity(SB_SCANNING);
 
 	proxysock->checkForInput(120);
 	bool compressed = docheader->isCompressed();
@@ -3431,7 +3515,17 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
 	std::cout << dbgPeerPort << docheader->contentEncoding() << std::endl;
 	std::cout << dbgPeerPort << " -about to get body from proxy" << std::endl;
 #endif
+	// if the body is going to be phrase filtered, try to filter it as it arrives.
+	// not possible with compressed bodies, or when content scanners need the lot.
+	if (!wasclean && responsescanners.empty() && !compressed && !checkme->isItNaughty && !checkme->isException
+		&& !isbypass && !docheader->authRequired() && (docheader->isContentType("text") || docheader->isContentType("-"))
+		&& (docheader->contentLength() <= filtersize)
+		&& checkme->startStream(filtergroup, o.fg[filtergroup]->banned_phrase_list, o.fg[filtergroup]->naughtyness_limit))
+	{
+		docbody->streamfilter = checkme;
+	}
 	(*pausedtoobig) = docbody->in(proxysock, peerconn, header, docheader, !responsescanners.empty(), headersent);  // get body from proxy
+	docbody->streamfilter = NULL;
 	// checkme: surely if pausedtoobig is true, we just want to break here?
 	// the content is larger than max_content_filecache_scan_size if it was downloaded for scanning,
 	// and larger than max_content_filter_size if not.
@@ -3476,6 +3570,7 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
 #endif
 			for (std::deque<CSPlugin *>::iterator i = responsescanners.begin(); i != responsescanners.end(); i++) {
 				(*wasscanned) = true;
+				CSScanLock scanlock(*i);
 				if (isfile) {
 #ifdef DGDEBUG
 					std::cout << dbgPeerPort << " -Running scanFile" << std::endl;
@@ -3547,16 +3642,19 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
 		}
 		rc = system("date");
 #endif
-		if (!checkme->isItNaughty && !checkme->isException && !isbypass && (dblen <= o.max_content_filter_size)
+		if (!checkme->isItNaughty && !checkme->isException && !isbypass && (dblen <= filtersize)
 			&& !docheader->authRequired() && (docheader->isContentType("text") || docheader->isContentType("-")))
 		{
-			checkme->checkme(docbody->data, docbody->buffer_length, &url, &domain,
-				filtergroup, o.fg[filtergroup]->banned_phrase_list, o.fg[filtergroup]->naughtyness_limit);
+			if (checkme->streaming)
+				checkme->finishStream(docbody->data, docbody->buffer_length);
+			else
+				checkme->checkme(docbody->data, docbody->buffer_length, &url, &domain,
+					filtergroup, o.fg[filtergroup]->banned_phrase_list, o.fg[filtergroup]->naughtyness_limit);
 		}
 #ifdef DGDEBUG
 		else {
 			std::cout << dbgPeerPort << " -Skipping content filtering: ";
-			if (dblen > o.max_content_filter_size)
+			if (dblen > filtersize)
 				std::cout << dbgPeerPort << " -Content too large";
 			else if (checkme->isException)
 				std::cout << dbgPeerPort << " -Is flagged as an exception";
@@ -3580,14 +3678,14 @@ void ConnectionHandler::contentFilter(HTTPHeader *docheader, HTTPHeader *header,
 		return;
 	}
 
-	if ((dblen <= o.max_content_filter_size) && !checkme->isItNaughty && docheader->isContentType("text")) {
+	if ((dblen <= filtersize) && !checkme->isItNaughty && docheader->isContentType("text")) {
 		contentmodified = docbody->contentRegExp(filtergroup);
 		// content modifying uses global variable
 	}
 #ifdef DGDEBUG
 	else {
 		std::cout << dbgPeerPort << " -Skipping content modification: ";
-		if (dblen > o.max_content_filter_size)
+		if (dblen > filtersize)
 			std::cout << dbgPeerPort << " -Content too large";
 		else if (!docheader->isContentType("text"))
 			std::cout << dbgPeerPort << " -Not text";
@@ -41,16 +41,33 @@ struct postinfo
 	postinfo():size(0), bodyoffset(0), blocked(false) {};
 };
 
+// what a client connection carries over from one request to the next, so that
+// it can be put aside between requests and picked up again (see handlePeer)
+struct PeerState
+{
+	// have the client's credentials been established for the whole connection?
+	bool persistent_authed;
+	std::string clientuser;
+	int filtergroup;
+	// user & group most recently found by the auth plugins
+	std::string oldclientuser;
+	int oldfg;
+	PeerState():persistent_authed(false), filtergroup(0), oldfg(0) {};
+};
+
 // the ConnectionHandler class - handles filtering, scanning, and blocking of
 // data passed between a client and the external proxy.
 class ConnectionHandler
 {
 public:
-	ConnectionHandler():clienthost(NULL) {};
+	ConnectionHandler():clienthost(NULL), loadtier(0), filtersize(0) { clientheld[0] = clientheld[1] = -1; };
 	~ConnectionHandler() { delete clienthost; };
 
 	// pass data between proxy and client, filtering as we go.
-	void handlePeer(Socket &peerconn, String &ip);
+	// if given a PeerState, the connection is handed back between requests: returns
+	// true once a request is done & the client connection is idle but still open,
+	// with state filled out ready for the next handlePeer call on it.
+	bool handlePeer(Socket &peerconn, String &ip, PeerState *state = NULL);
 private:
 	int filtergroup;
 	bool matchedip;
@@ -60,8 +77,17 @@ private:
 	std::string *clienthost;
 	std::string urlparams;
 	std::list<postinfo> postparts;
+	// how far content checking was scaled back for the current request (loadshedmaxtier),
+	// and so how much of a body may be content filtered
+	int loadtier;
+	off_t filtersize;
+	// scoreboard entries counting the current request against its client IP & user
+	int clientheld[2];
+
+	// content/search term filter, reused from one request to the next
+	NaughtyFilter checkme;
 
-	void handleConnection(Socket &peerconn, String &ip);
+	bool handleConnection(Socket &peerconn, String &ip, PeerState *handback = NULL);
 
 	// write a log entry containing the given data (if required)
 	void doLog(std::string &who, std::string &from, String &where, unsigned int &port,
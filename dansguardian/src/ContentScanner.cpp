@@ -61,6 +61,7 @@ CSPlugin::CSPlugin(ConfigVar & definition)
 	:scanpost(false)
 {
 	cv = definition;
+	pthread_mutex_init(&scanlock, NULL);
 }
 
 // start the plugin - i.e. read in the configuration
@@ -293,7 +294,7 @@ int CSPlugin::willScanRequest(const String &url, const char *user, int filtergro
 	}
 	while (tempurl.before("/").contains("."))
 	{
-		char *i = exceptionvirusurllist.findStartsWith(tempurl.toCharArray());
+		const char *i = exceptionvirusurllist.findStartsWith(tempurl.toCharArray());
 		if (i != NULL)
 		{
 			foundurl = i;
@@ -19,6 +19,7 @@
 #include "FDFuncs.hpp"
 #include "Plugin.hpp"
 #include <stdexcept>
+#include <pthread.h>
 
 
 // DEFINES
@@ -53,7 +54,7 @@ public:
 	//constructor with CS plugin configuration passed in
 	CSPlugin(ConfigVar &definition);
 
-	virtual ~CSPlugin() {};
+	virtual ~CSPlugin() { pthread_mutex_destroy(&scanlock); };
 
 	// Test for whether or nor a particular ContentScanner is likely to be interested
 	// in scanning data associated with the given HTTP request.  If "post" is true,
@@ -88,6 +89,12 @@ public:
 	const String &getLastMessage() {return lastmessage;};
 	const String &getLastVirusName() {return lastvirusname;};
 
+	// plugins keep the results of their last scan to themselves, so threads sharing
+	// a plugin must take turns with it - hold the lock (see CSScanLock) from the start
+	// of a scan until its results have been read
+	void lock() { pthread_mutex_lock(&scanlock); };
+	void unlock() { pthread_mutex_unlock(&scanlock); };
+
 	// start, restart and stop the plugin
 	virtual int init(void* args);
 	virtual int quit() {return DGCS_OK;};
@@ -99,6 +106,8 @@ private:
 	ListContainer exceptionvirussitelist;
 	ListContainer exceptionvirusurllist;
 
+	pthread_mutex_t scanlock;
+
 protected:
 	ConfigVar cv;
 	String lastmessage;
@@ -116,6 +125,17 @@ protected:
 	int writeMemoryTempFile(const char *object, unsigned int objectsize, String *filename);
 };
 
+// holds a CS plugin's scan lock for as long as it is in scope
+class CSScanLock
+{
+public:
+	CSScanLock(CSPlugin *p): plugin(p) { plugin->lock(); };
+	~CSScanLock() { plugin->unlock(); };
+
+private:
+	CSPlugin *plugin;
+};
+
 // Return an instance of the plugin defined in the given configuration file
 CSPlugin* cs_plugin_load( const char *pluginConfigPath );
 
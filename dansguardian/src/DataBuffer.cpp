@@ -38,13 +38,15 @@ extern OptionContainer o;
 // IMPLEMENTATION
 
 DataBuffer::DataBuffer():data(new char[1]), buffer_length(0), compresseddata(NULL), compressed_buffer_length(0),
-	tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), timeout(20), bytesalreadysent(0), preservetemp(false)
+	tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), streamfilter(NULL), timeout(20), filtersize(o.max_content_filter_size),
+	bytesalreadysent(0), preservetemp(false), toobig_unscanned(false), toobig_notdownloaded(false)
 {
 	data[0] = '\0';
 }
 
 DataBuffer::DataBuffer(const void* indata, off_t length):data(new char[length]), buffer_length(length), compresseddata(NULL), compressed_buffer_length(0),
-	tempfilesize(0), dontsendbody(false), tempfilefd(-1), timeout(20), bytesalreadysent(0), preservetemp(false)
+	tempfilesize(0), dontsendbody(false), tempfilefd(-1), dm_plugin(NULL), streamfilter(NULL), timeout(20), filtersize(o.max_content_filter_size),
+	bytesalreadysent(0), preservetemp(false), toobig_unscanned(false), toobig_notdownloaded(false)
 {
 	memcpy(data, indata, length);
 }
@@ -74,7 +76,10 @@ void DataBuffer::reset()
 	bytesalreadysent = 0;
 	dontsendbody = false;
 	preservetemp = false;
+	toobig_unscanned = false;
+	toobig_notdownloaded = false;
 	decompress = "";
+	streamfilter = NULL;
 }
 
 // delete the memory block when the class is destroyed
@@ -387,7 +392,7 @@ void DataBuffer::zlibinflate(bool header)
 			}
 			return;
 		}
-		if (bytesgot > o.max_content_filter_size) {
+		if (bytesgot > filtersize) {
 			delete[]block;  // don't forget to free claimed memory
 #ifdef DGDEBUG
 			std::cerr << "inflated file larger than maxcontentfiltersize, not inflating further" << std::endl;
@@ -444,6 +449,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
 	unsigned int matches;
 	unsigned int submatch, submatches;
 	RegExp *re;
+	RegResult res;
 	String *replacement;
 	unsigned int replen;
 	int sizediff;
@@ -457,20 +463,20 @@ bool DataBuffer::contentRegExp(int filtergroup)
 
 	for (i = 0; i < s; i++) {
 		re = &((*o.fg[filtergroup]).content_regexp_list_comp[i]);
-		if (re->match(data)) {
+		if (re->match(data, res)) {
 			replacement = &((*o.fg[filtergroup]).content_regexp_list_rep[i]);
 			//replen = replacement->length();
-			matches = re->numberOfMatches();
+			matches = res.numberOfMatches();
 
 			sizediff = 0;
 			m = 0;
 			for (j = 0; j < matches; j++) {
-				srcoff = re->offset(j);
-				matchlen = re->length(j);
+				srcoff = res.offset(j);
+				matchlen = res.length(j);
 
 				// Count matches for ()'s
 				for (submatches = 0; j+submatches+1 < matches; submatches++)
-					if (re->offset(j+submatches+1) + re->length(j+submatches+1) > srcoff + matchlen)
+					if (res.offset(j+submatches+1) + res.length(j+submatches+1) > srcoff + matchlen)
 						break;
 
 				// \1 and $1 replacement
@@ -487,7 +493,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
 						submatch = (*replacement)[++k] - '0';
 						// add submatch contents to replacement string
 						if (submatch <= submatches) {
-							newrep->replacement += re->result(j + submatch).c_str();
+							newrep->replacement += res.result(j + submatch).c_str();
 						}
 					} else {
 						// unescape \\ and \$, and add other non-backreference characters
@@ -499,7 +505,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
 				matchqueue.push(newrep);
 
 				// update size difference between original and modified content
-				sizediff -= re->length(j);
+				sizediff -= res.length(j);
 				sizediff += newrep->replacement.length();
 				// skip submatches to next top level match
 				j += submatches;
@@ -520,7 +526,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
 			newreplacement* newrep;
 			for (j = 0; j < matches; j++) {
 				newrep = matchqueue.front();
-				nextoffset = re->offset(newrep->match);
+				nextoffset = res.offset(newrep->match);
 				if (nextoffset > srcoff) {
 					memcpy(dstpos, data + srcoff, nextoffset - srcoff);
 					dstpos += nextoffset - srcoff;
@@ -529,7 +535,7 @@ bool DataBuffer::contentRegExp(int filtergroup)
 				replen = newrep->replacement.length();
 				memcpy(dstpos, newrep->replacement.toCharArray(), replen);
 				dstpos += replen;
-				srcoff += re->length(newrep->match);
+				srcoff += res.length(newrep->match);
 				delete newrep;
 				matchqueue.pop();
 			}
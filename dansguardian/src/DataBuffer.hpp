@@ -12,6 +12,7 @@
 #include "FDFuncs.hpp"
 
 class DMPlugin;
+class NaughtyFilter;
 
 class DataBuffer
 {
@@ -27,6 +28,9 @@ public:
 	
 	// the download manager we used during the last "in"
 	DMPlugin *dm_plugin;
+	// content filter to pass the body to as it arrives, if streaming
+	// (see NaughtyFilter::startStream) - DM plugins need not support this
+	NaughtyFilter *streamfilter;
 
 	DataBuffer();
 	DataBuffer(const void* indata, off_t length);
@@ -44,6 +48,8 @@ public:
 
 	void setTimeout(int t) { timeout = t; };
 	void setDecompress(String d) { decompress = d; };
+	// how much of a body may be content filtered (maxcontentfiltersize, or less under load)
+	void setFilterSize(off_t s) { filtersize = s; };
 	
 	// swap back to compressed version of body data (if data was decompressed but not modified; saves bandwidth)
 	void swapbacktocompressed();
@@ -67,9 +73,15 @@ private:
 #endif
 
 	int timeout;
+	off_t filtersize;
 	off_t bytesalreadysent;
 	bool preservetemp;
 
+	// set by the fancy DM - was the file too large to be scanned, or even to be downloaded?
+	// (kept here rather than in the plugin, as one plugin may be downloading several at once)
+	bool toobig_unscanned;
+	bool toobig_notdownloaded;
+
 	String decompress;
 
 	void zlibinflate(bool header);
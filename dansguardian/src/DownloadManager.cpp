@@ -82,7 +82,7 @@ int DMPlugin::init(void* args)
 }
 
 // default method for sending the client a download link
-void DMPlugin::sendLink(Socket &peersock, String &linkurl, String &prettyurl)
+void DMPlugin::sendLink(DataBuffer *d, Socket &peersock, String &linkurl, String &prettyurl)
 {
 	// 1220 "<p>Scan complete.</p><p>Click here to download: "
 	String message(o.language_list.getTranslation(1220));
@@ -94,7 +94,8 @@ void DMPlugin::sendLink(Socket &peersock, String &linkurl, String &prettyurl)
 bool DMPlugin::willHandle(HTTPHeader *requestheader, HTTPHeader *docheader)
 {
 	// match user agent first (quick)
-	if (!(alwaysmatchua || ua_match.match(requestheader->userAgent().toCharArray())))
+	RegResult r;
+	if (!(alwaysmatchua || ua_match.match(requestheader->userAgent().toCharArray(), r)))
 		return false;
 	
 	// then check standard lists (mimetypes & extensions)
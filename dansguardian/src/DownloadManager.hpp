@@ -49,7 +49,8 @@ public:
 		HTTPHeader *requestheader, HTTPHeader *docheader, bool wantall, int *headersent, bool *toobig) = 0;
 
 	// send a download link to the client (the actual link, and the clean "display" version of the link)
-	virtual void sendLink(Socket &peersock, String &linkurl, String &prettyurl);
+	// for the body downloaded into the given buffer
+	virtual void sendLink(DataBuffer *d, Socket &peersock, String &linkurl, String &prettyurl);
 
 private:
 	// regular expression for matching supported user agents
@@ -11,12 +11,18 @@
 #include "OptionContainer.hpp"
 #include "DynamicURLList.hpp"
 
+#include <string>
 #include <string.h>
 #include <syslog.h>
-#include <algorithm>
+#include <cerrno>
 #include <ctime>
-#include <sys/stat.h>
-#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef DGDEBUG
+	#include <iostream>
+#endif
 
 
 // GLOBALS
@@ -25,337 +31,596 @@ extern OptionContainer o;
 extern bool is_daemonised;
 
 
+// DEFINES
+
+// number of separately locked parts of the list, when it's big enough to split,
+// and the most entries we want in any one part before splitting it further
+#define URLCACHE_STRIPES 16
+#define URLCACHE_MAXSTRIPES 1024
+#define URLCACHE_STRIPESIZE 65536
+// arena bytes allowed per entry - a record header plus a URL of average length
+#define URLCACHE_ENTRYBYTES 128
+// smallest arena, so that small lists can still hold reasonably long URLs
+#define URLCACHE_MINARENA 8192
+// how long to wait for a lock which can't be recovered if its holder dies, in milliseconds
+#define URLCACHE_LOCKWAIT 50
+// number of URLs each process keeps to itself in front of the shared list
+#define URLCACHE_LOCALSIZE 256
+// seconds for which an entry there is trusted before the shared list is checked again,
+// so that URLs used often still count as recently used when the shared list is full
+#define URLCACHE_LOCALAGE 2
+// kinds of record - blocked URLs are kept separately for CONNECT requests,
+// and a record whose data has been replaced by a newer one is dead
+#define URLCACHE_CLEAN 0
+#define URLCACHE_BLOCKED 1
+#define URLCACHE_BLOCKEDSSL 2
+#define URLCACHE_DEAD 255
+// flag in a bucket's offset marking its record as looked up since it last reached the head
+#define URLCACHE_REFERENCED 0x80000000u
+
+#ifndef MAP_ANON
+	#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+
+// DECLARATIONS
+
+// lock & record arena for one part of the list
+struct URLCacheStripe
+{
+	pthread_mutex_t mutex;
+	// records run from head to tail, wrapping round at wrapat if wrapped is set
+	unsigned int head;
+	unsigned int tail;
+	unsigned int wrapat;
+	unsigned int items;
+	unsigned char wrapped;
+	// set when a lock couldn't be had in time, so that others don't wait for it too
+	volatile unsigned char stuck;
+};
+
+// header of a record in a stripe's arena - the URL itself follows, unterminated,
+// then any data stored with it
+struct URLCacheRecord
+{
+	unsigned int reftime;
+	unsigned int hash;
+	unsigned short len;
+	unsigned short datalen;
+	// filter group this record applies to, and what kind of record it is
+	unsigned short group;
+	unsigned char type;
+};
+
+// hash table entry - the record's hash is kept alongside its offset, so that
+// searches only need to look at records whose hashes match
+struct URLCacheBucket
+{
+	unsigned int hash;
+	// offset of the record plus one (zero meaning empty), and the referenced flag
+	unsigned int offset;
+};
+
+// entry in a process's own small list of URLs recently found in the shared one
+struct URLCacheLocal
+{
+	unsigned int filltime;
+	unsigned int reftime;
+	unsigned int hash;
+	int group;
+	bool used;
+	std::string url;
+};
+
+// FNV-1a hash of a URL, filter group and record type, also giving the URL's length
+static unsigned int hashURL(const char *url, unsigned short group, unsigned char type, unsigned int &len)
+{
+	unsigned int hash = 2166136261u;
+	const char *p = url;
+	while (*p != '\0') {
+		hash ^= (unsigned char) *p++;
+		hash *= 16777619u;
+	}
+	len = p - url;
+	hash ^= group;
+	hash *= 16777619u;
+	hash ^= type;
+	hash *= 16777619u;
+	return hash;
+}
+
+// size of a record holding a URL & data of the given length, keeping headers aligned
+static inline unsigned int recordSize(unsigned int len)
+{
+	return (sizeof(URLCacheRecord) + len + 7) & ~7u;
+}
+
+
 // IMPLEMENTATION
 
-// note - the list of URLs itself is simply a ring buffer, so the oldest entry/next empty entry is always the
-// last position we wrote to plus one, wrapping round when we get to the top.
-// however, we also maintain a seperate index list, which points to the entries in alphabetical order.
+// note - entries are either clean URLs, or blocked URLs together with the reason they were blocked.
+// each stripe's records are stored one after another in a byte ring, and new ones are
+// written at the tail, taking records from the head until there is room.  a record which won't
+// fit before the end of the arena goes at the start, and the space left at the end is skipped.
+// the head works as the hand of a CLOCK: a record which has been looked up since it was last
+// there is given a second chance by moving it to the tail, so busy URLs stay in the list.
+// the records are found through an open addressing hash table (linear probing), whose buckets
+// hold hashes and arena offsets.  each table is kept no more than half full.
+// each process also keeps a small direct-mapped list of URLs it has recently found there,
+// checked first, so that repeated lookups of popular URLs don't need to take any lock.
+// these entries carry the time of the shared record, so go stale with it, and
+// are only trusted for a couple of seconds, so that the shared record is still marked as used.
 
 // constructor - initialise values to empty defaults
 DynamicURLList::DynamicURLList()
-:index(NULL), urlreftime(NULL), urls(NULL), groups(NULL), size(0), agepos(0), timeout(0), items(0)
+:region(NULL), regionlen(0), stripes(NULL), buckets(NULL), arenas(NULL),
+	local(NULL), localhits(0), localmisses(0), numstripes(0), stripesize(0), bucketmask(0),
+	arenasize(0), maxrecord(0), timeout(0)
 {
 }
 
-// delete the memory block when the class is destryed
+// unmap the shared memory when the class is destroyed
 DynamicURLList::~DynamicURLList()
 {
-	delete[]index;
-	delete[]urlreftime;
-	delete[]urls;
-	delete[]groups;
+	release();
 }
 
-// "flush" the list (not quite)
-void DynamicURLList::flush()
+void DynamicURLList::release()
 {
-	// make all entries old so they won't be used
-	for (int i = 0; i < items; i++) {
-		urlreftime[index[i]] = 0;
+	if (region != NULL) {
+		munmap(region, regionlen);
+		region = NULL;
 	}
+	delete[] local;
+	local = NULL;
+	stripes = NULL;
+	buckets = NULL;
+	arenas = NULL;
 }
 
-// find the position of the given URL in the list
-// return value ranges:
-// -ve if not found. 0-(pos + 1) is where it should be inserted to retain sorting.
-// 0 to size if found
-int DynamicURLList::posInList(const char *url)
+// sets how many URLs the list should store, and the maximum age of an entry before it goes inactive.
+// must be called before forking off the processes which are to share the list.
+bool DynamicURLList::setListSize(unsigned int s, unsigned int t)
 {
-	if (items == 0) {
-#ifdef DGDEBUG
-		std::cout << "url list cache is empty" << std::endl;
+	release();
+	if (s < 2) {
+		return false;
+	}
+	timeout = t;
+	numstripes = (s >= (URLCACHE_STRIPES * 4)) ? URLCACHE_STRIPES : 1;
+	while (((s / numstripes) > URLCACHE_STRIPESIZE) && (numstripes < URLCACHE_MAXSTRIPES))
+		numstripes <<= 1;
+	stripesize = (s + numstripes - 1) / numstripes;
+	if (stripesize > (0x7fffffffu / URLCACHE_ENTRYBYTES)) {
+		syslog(LOG_ERR, "%s", "URL cache too large");
+		return false;
+	}
+	unsigned int numbuckets = 2;
+	while (numbuckets < (stripesize * 2))
+		numbuckets <<= 1;
+	bucketmask = numbuckets - 1;
+	arenasize = stripesize * URLCACHE_ENTRYBYTES;
+	if (arenasize < URLCACHE_MINARENA)
+		arenasize = URLCACHE_MINARENA;
+	// don't let one URL push out more than a quarter of its stripe
+	maxrecord = (arenasize / 4) - sizeof(URLCacheRecord);
+	if (maxrecord > 65535)
+		maxrecord = 65535;
+
+	// anonymous mappings start out zeroed, so every stripe starts out empty
+	size_t headerlen = ((sizeof(URLCacheStripe) * numstripes) + 7) & ~((size_t) 7);
+	regionlen = headerlen + (sizeof(URLCacheBucket) * numbuckets * numstripes) + ((size_t) arenasize * numstripes);
+	region = mmap(NULL, regionlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (region == MAP_FAILED) {
+		region = NULL;
+		syslog(LOG_ERR, "Cannot allocate shared memory for URL cache: %s", ErrStr().c_str());
+		return false;
+	}
+	stripes = (URLCacheStripe*) region;
+	buckets = (URLCacheBucket*) ((char*) region + headerlen);
+	arenas = (char*) (buckets + (numbuckets * numstripes));
+
+	// the locks must work between processes, and must not stay locked forever
+	// if a process is killed whilst holding one
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
 #endif
-		// if the list is empty, indicate that the entry should go in pos 0
-		return -1;
+	for (unsigned int i = 0; i < numstripes; i++) {
+		int rc = pthread_mutex_init(&(stripes[i].mutex), &attr);
+		if (rc != 0) {
+			syslog(LOG_ERR, "Cannot initialise URL cache lock: %s", strerror(rc));
+			pthread_mutexattr_destroy(&attr);
+			release();
+			return false;
+		}
 	}
+	pthread_mutexattr_destroy(&attr);
+	local = new URLCacheLocal[URLCACHE_LOCALSIZE];
+	for (unsigned int i = 0; i < URLCACHE_LOCALSIZE; i++)
+		local[i].used = false;
 #ifdef DGDEBUG
-		std::cout << "url list cache: performing search..." << std::endl;
+	std::cout << "url cache: " << numstripes << " stripes of " << stripesize << " entries, " << regionlen << " bytes" << std::endl;
 #endif
-	return search(0, items - 1, url);
+	return true;
 }
 
-// binary search the list for a given URL
-// note the list itself is not ordered, but the index array is
-int DynamicURLList::search(int a, int s, const char *url)
+bool DynamicURLList::lock(unsigned int stripe)
 {
-	if (a > s)
-		return (-1 - a);
-	int m = (a + s) / 2;
-	// look up the url pointed to by this entry in the index
-	char *i = index[m] * 1000 + urls;
-
-/*#ifdef DGDEBUG
-	std::cout << "url list cache: comparing " << i << " to " << url << std::endl;
-#endif*/
-
-	int alen = strlen(i);
-	int blen = strlen(url);
-	int maxlen = alen < blen ? alen : blen;
-	char *apos = (char *) i;
-	char *bpos = (char *) url;
-	int j = 0;
-	int c = 0;
-	unsigned char achar;
-	unsigned char bchar;
-	while (j < maxlen) {
-		achar = apos[0];
-		bchar = bpos[0];
-		if (achar > bchar) {
-			c = 1;
-			break;
+	URLCacheStripe *s = stripes + stripe;
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+	int rc = pthread_mutex_lock(&(s->mutex));
+	if (rc == EOWNERDEAD) {
+		// a process died part way through changing this stripe,
+		// so there's no telling what state it's in
+		syslog(LOG_ERR, "%s", "URL cache lock holder died - clearing its part of the cache");
+		clear(stripe);
+		pthread_mutex_consistent(&(s->mutex));
+		return true;
+	}
+	return (rc == 0);
+#else
+	// without robust locks, one held by a process which was killed stays locked for good,
+	// so never wait long - a lock we can't have is simply treated as a cache miss.
+	// once a stripe has been found stuck, don't make everyone else wait for it too.
+	if (s->stuck) {
+		if (pthread_mutex_trylock(&(s->mutex)) != 0)
+			return false;
+		s->stuck = 0;
+		return true;
+	}
+#ifdef HAVE_PTHREAD_MUTEX_TIMEDLOCK
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += URLCACHE_LOCKWAIT * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	if (pthread_mutex_timedlock(&(s->mutex), &until) == 0)
+		return true;
+#else
+	for (int i = 0; i < URLCACHE_LOCKWAIT; i++) {
+		if (pthread_mutex_trylock(&(s->mutex)) == 0)
+			return true;
+		usleep(1000);
+	}
+#endif
+	s->stuck = 1;
+	syslog(LOG_ERR, "%s", "URL cache lock not released in time - treating its part of the cache as empty");
+	return false;
+#endif
+}
+
+void DynamicURLList::unlock(unsigned int stripe)
+{
+	pthread_mutex_unlock(&(stripes[stripe].mutex));
+}
+
+// remove all entries from the given stripe - must be locked
+void DynamicURLList::clear(unsigned int stripe)
+{
+	URLCacheStripe *s = stripes + stripe;
+	s->head = 0;
+	s->tail = 0;
+	s->wrapat = 0;
+	s->wrapped = 0;
+	s->items = 0;
+	memset(buckets + (stripe * (bucketmask + 1)), 0, sizeof(URLCacheBucket) * (bucketmask + 1));
+}
+
+inline URLCacheRecord *DynamicURLList::record(unsigned int stripe, unsigned int offset)
+{
+	return (URLCacheRecord*) (arenas + ((size_t) stripe * arenasize) + offset);
+}
+
+// find the bucket holding the given URL, or the empty bucket where it would go
+unsigned int DynamicURLList::findBucket(unsigned int stripe, unsigned int hash, unsigned short group, unsigned char type,
+	const char *url, unsigned int len)
+{
+	URLCacheBucket *b = buckets + (stripe * (bucketmask + 1));
+	unsigned int pos = (hash / numstripes) & bucketmask;
+	while (b[pos].offset != 0) {
+		if (b[pos].hash == hash) {
+			URLCacheRecord *r = record(stripe, (b[pos].offset & ~URLCACHE_REFERENCED) - 1);
+			if ((r->len == len) && (r->group == group) && (r->type == type) && (memcmp(r + 1, url, len) == 0))
+				break;
 		}
-		if (achar < bchar) {
-			c = -1;
+		pos = (pos + 1) & bucketmask;
+	}
+	return pos;
+}
+
+// empty a bucket, then move back any later entries in the same run which
+// would otherwise no longer be found by a search starting from their hash
+void DynamicURLList::removeBucket(unsigned int stripe, unsigned int bucket)
+{
+	URLCacheBucket *b = buckets + (stripe * (bucketmask + 1));
+	unsigned int pos = bucket;
+	unsigned int home;
+	while (true) {
+		pos = (pos + 1) & bucketmask;
+		if (b[pos].offset == 0)
 			break;
-		}
-		j++;
-		apos++;
-		bpos++;
+		home = (b[pos].hash / numstripes) & bucketmask;
+		// leave it alone if its home lies after the emptied bucket
+		if ((bucket <= pos) ? ((bucket < home) && (home <= pos)) : ((bucket < home) || (home <= pos)))
+			continue;
+		b[bucket] = b[pos];
+		bucket = pos;
+	}
+	b[bucket].offset = 0;
+}
+
+// move the head of the given stripe on by one record - must be locked, and not empty.
+// the record is removed, unless it has been used since it was added or last moved,
+// in which case it's moved to the tail.
+void DynamicURLList::evict(unsigned int stripe)
+{
+	URLCacheStripe *s = stripes + stripe;
+	URLCacheRecord *r = record(stripe, s->head);
+	unsigned int size = recordSize(r->len + r->datalen);
+	unsigned int bucket = 0;
+	URLCacheBucket *b = NULL;
+	if (r->type != URLCACHE_DEAD) {
+		bucket = findBucket(stripe, r->hash, r->group, r->type, (const char*) (r + 1), r->len);
+		b = buckets + (stripe * (bucketmask + 1)) + bucket;
 	}
-	if (c == 0) {
-		if (alen > blen) {
-			c = 1;
+
+	if ((b != NULL) && (b->offset & URLCACHE_REFERENCED)
+		&& ((timeout == 0) || ((unsigned int) time(NULL) - r->reftime) <= timeout))
+	{
+		if (!s->wrapped && ((s->tail + size) > arenasize)) {
+			s->wrapat = s->tail;
+			s->tail = 0;
+			s->wrapped = 1;
 		}
-		else if (alen < blen) {
-			c = -1;
+		// when wrapped, the free space runs from the tail right up to this record,
+		// so it can always be moved down to the tail
+		memmove(record(stripe, s->tail), r, size);
+		b->offset = s->tail + 1;
+		s->tail += size;
+	} else {
+		if (b != NULL)
+			removeBucket(stripe, bucket);
+		s->items--;
+		if (s->items == 0) {
+			s->head = s->tail = s->wrapat = 0;
+			s->wrapped = 0;
+			return;
 		}
 	}
-	// otherwise, assume both equal
-
-	// we found the entry
-	if (c == 0)
-		return m;
-	// we didn't, but it's in the lower half
-	if (c == -1)
-		return search(m + 1, s, url);
-	// we got the search window down to 1 entry
-	if (a == s)
-		// therefore, we know where the entry we were looking for
-		// should be added if we are to maintain a sorted list.
-		// return its position, -ve (and strictly below 0), so as to
-		// provide useful information and not mess up return value checks.
-		return (-1 - a);
-	// we didn't find it, but it's in the upper half
-	return search(a, m - 1, url);
+	s->head += size;
+	if (s->wrapped && (s->head >= s->wrapat)) {
+		s->head = 0;
+		s->wrapped = 0;
+	}
 }
 
-// sets how many URLs the list should store, and the maximum age of an entry before it goes inactive
-bool DynamicURLList::setListSize(unsigned int s, unsigned int t)
+// find room for a record of the given size at the tail of the given stripe,
+// removing the oldest records as necessary - must be locked
+unsigned int DynamicURLList::allocate(unsigned int stripe, unsigned int size)
 {
-	if (s < 2) {
-		return false;
-	}
-	if (t < 2) {
-		return false;
+	URLCacheStripe *s = stripes + stripe;
+	// keep the hash table no more than half full - this ends because
+	// moving a record on to the tail clears its referenced flag
+	while (s->items >= stripesize)
+		evict(stripe);
+	while (true) {
+		if (!s->wrapped) {
+			// free space runs from the tail to the end of the arena, then from the start to the head
+			if ((s->tail + size) <= arenasize)
+				break;
+			s->wrapat = s->tail;
+			s->tail = 0;
+			s->wrapped = 1;
+		}
+		// free space runs from the tail up to the head
+		else if ((s->tail + size) <= s->head)
+			break;
+		else
+			evict(stripe);
 	}
-	size = s;
-	timeout = t;
-	agepos = 0;
-	items = 0;
-	delete[]index;
-	delete[]urlreftime;
-	delete[]urls;
-	delete[]groups;
-
-	index = new unsigned int[size];
-	urlreftime = new unsigned long int[size];
-	urls = new char[size * 1000];  // allows url up to 999 in length
-	groups = new std::string[size];
-	return true;
+	unsigned int offset = s->tail;
+	s->tail += size;
+	s->items++;
+	return offset;
 }
 
-// see if the given URL is in the list
-bool DynamicURLList::inURLList(const char *url, const int fg)
+// stop keeping a list of our own - it isn't locked, so can't be shared by threads
+void DynamicURLList::disableLocal()
 {
-#ifdef DGDEBUG
-	std::cout << "url cache search request: " << fg << " " << url << std::endl;
-#endif
-	if (items == 0) {
+	delete[] local;
+	local = NULL;
+}
+
+// look for a URL in this process's own list
+bool DynamicURLList::inLocalList(const char *url, unsigned int len, unsigned int hash, int group)
+{
+	URLCacheLocal &l = local[hash % URLCACHE_LOCALSIZE];
+	if (!l.used || (l.hash != hash) || (l.group != group) || (l.url.length() != len) || (memcmp(l.url.data(), url, len) != 0))
+		return false;
+	unsigned int timenow = time(NULL);
+	if (((timenow - l.filltime) > URLCACHE_LOCALAGE)
+		|| ((timeout > 0) && ((timenow - l.reftime) > timeout)))
+	{
+		l.used = false;
 		return false;
 	}
-#ifdef DGDEBUG
-	std::cout << "****** url cache table ******" << std::endl;
-	std::cout << "items: " << items << std::endl;
-	for (int i = 0; i < items; i++) {
-		for (unsigned int j = 0; j < groups[index[i]].length(); j++) {
-			std::cout << (unsigned int) (groups[index[i]][j]) << " ";
-		}
-		std::cout << (char*) (index[i] * 1000 + urls) << std::endl;
-	}
-	std::cout << "****** url cache table ******" << std::endl;
-#endif
+	return true;
+}
 
-	// truncate URL if necessary, as we have a length limit on our buffers
-	int pos;
-	if (strlen(url) > 999) {
-		String r(String(url, 999));
-		pos = posInList(r.toCharArray());
-	} else {
-		pos = posInList(url);
-	}
+// remember a URL found in the shared list - ones just added aren't remembered, as most
+// are only used once, and would push out the popular ones
+void DynamicURLList::addLocal(const char *url, unsigned int len, unsigned int hash, int group, unsigned int reftime)
+{
+	URLCacheLocal &l = local[hash % URLCACHE_LOCALSIZE];
+	l.used = true;
+	l.filltime = time(NULL);
+	l.hash = hash;
+	l.group = group;
+	l.reftime = reftime;
+	l.url.assign(url, len);
+}
 
-#ifdef DGDEBUG
-	std::cout << "pos: " << pos << std::endl;
-#endif
+// look for a record in the shared list, returning any data stored with it
+bool DynamicURLList::find(const char *url, unsigned int len, unsigned int hash, unsigned short group, unsigned char type, std::string *data)
+{
+	unsigned int stripe = hash % numstripes;
+	if (!lock(stripe))
+		return false;
+	URLCacheBucket *b = buckets + (stripe * (bucketmask + 1)) + findBucket(stripe, hash, group, type, url, len);
+	bool found = false;
 
 	// if we have found an entry, also check to see that it hasn't gone inactive.
-	// todo: could we speed things up a little by simply refreshing the timer on the
-	// old entry here, instead of having addEntry look for possible duplicates?
-	// actually, i dunno. are URLs from time-limited lists cached? this might cause them to
+	// are URLs from time-limited lists cached? this might cause them to
 	// continue being seen as good/bad (depending on the nature of the list) outside the
 	// allotted window if they get put in the cache during it.
-	if (pos > -1) {
-		unsigned long int timenow = time(NULL);
-		if ((timenow - urlreftime[index[pos]]) > timeout) {
+	if (b->offset != 0) {
+		URLCacheRecord *r = record(stripe, (b->offset & ~URLCACHE_REFERENCED) - 1);
+		unsigned int timenow = time(NULL);
+		if ((timeout > 0) && ((timenow - r->reftime) > timeout)) {
 #ifdef DGDEBUG
-			std::cout << "found but url ttl exceeded: " << (timenow - urlreftime[index[pos]]) << std::endl;
+			std::cout << "found but url ttl exceeded: " << (timenow - r->reftime) << std::endl;
 #endif
-			return false;
+		} else {
+			b->offset |= URLCACHE_REFERENCED;
+			if (data != NULL)
+				data->assign((char*) (r + 1) + r->len, r->datalen);
+			if (type == URLCACHE_CLEAN && local != NULL)
+				addLocal(url, len, hash, group, r->reftime);
+			found = true;
+		}
+	}
+	unlock(stripe);
+	return found;
+}
+
+// add a record to the shared list - if it's already there, refresh its timer and data
+void DynamicURLList::add(const char *url, unsigned int len, unsigned int hash, unsigned short group, unsigned char type,
+	const char *data, unsigned int datalen)
+{
+	unsigned int stripe = hash % numstripes;
+	URLCacheBucket *b = buckets + (stripe * (bucketmask + 1));
+	if (!lock(stripe))
+		return;
+	unsigned int bucket = findBucket(stripe, hash, group, type, url, len);
+
+	if (b[bucket].offset != 0) {
+		// found - reset refresh counter
+		URLCacheRecord *r = record(stripe, (b[bucket].offset & ~URLCACHE_REFERENCED) - 1);
+		if (r->datalen == datalen) {
+			if (datalen > 0)
+				memcpy((char*) (r + 1) + len, data, datalen);
+			r->reftime = time(NULL);
+			unlock(stripe);
+			return;
 		}
-		// o.filter_groups + 1 is a special case, meaning clean for all groups
-		std::string lookfor;
-		lookfor += (char)fg;
-		lookfor += (char)o.filter_groups + 1;
-		if (groups[index[pos]].find_first_of(lookfor) == std::string::npos) {
+		// the data has changed size, so leave the old record for eviction to skip over
+		r->type = URLCACHE_DEAD;
+		removeBucket(stripe, bucket);
+	}
+
+	// making room may remove other entries and move the rest, so look again for where the new one goes
+	unsigned int offset = allocate(stripe, recordSize(len + datalen));
+	bucket = findBucket(stripe, hash, group, type, url, len);
+	URLCacheRecord *r = record(stripe, offset);
+	r->reftime = time(NULL);
+	r->hash = hash;
+	r->len = len;
+	r->datalen = datalen;
+	r->group = group;
+	r->type = type;
+	memcpy(r + 1, url, len);
+	if (datalen > 0)
+		memcpy((char*) (r + 1) + len, data, datalen);
+	b[bucket].hash = hash;
+	b[bucket].offset = offset + 1;
+	unlock(stripe);
+}
+
+// see if the given URL is in the list
+bool DynamicURLList::inURLList(const char *url, const int fg)
+{
 #ifdef DGDEBUG
-			std::cout << "found but url not flagged clean for this group: " << fg << " (is clean for: ";
-			for (unsigned int j = 0; j < groups[index[pos]].length(); j++) {
-				std::cout << (unsigned int) (groups[index[pos]][j]) << " ";
-			}
-			std::cout << ")" << std::endl;
+	std::cout << "url cache search request: " << fg << " " << url << std::endl;
 #endif
-			return false;
+	if (region == NULL || fg < 0) {
+		return false;
+	}
+
+	// o.filter_groups + 1 is a special case, meaning clean for all groups
+	unsigned short groups[2];
+	groups[0] = fg;
+	groups[1] = o.filter_groups + 1;
+	unsigned int len;
+	unsigned int hashes[2];
+	for (int i = 0; i < 2; i++) {
+		hashes[i] = hashURL(url, groups[i], URLCACHE_CLEAN, len);
+		if (local != NULL && inLocalList(url, len, hashes[i], groups[i])) {
+			localhits++;
+			return true;
 		}
-		return true;
 	}
-	return false;
+	if (local != NULL)
+		localmisses++;
+	if (len > maxrecord)
+		return false;
+	return (find(url, len, hashes[0], groups[0], URLCACHE_CLEAN, NULL) || find(url, len, hashes[1], groups[1], URLCACHE_CLEAN, NULL));
 }
 
 // add an entry to the URL list - if it's already there, but timed out due to age, simply refresh the timer
-// also, maintain the lists' sorting, to allow binary search to be performed
 void DynamicURLList::addEntry(const char *url, const int fg)
 {
 #ifdef DGDEBUG
 	std::cout << "url cache add request: " << fg << " " << url << std::endl;
-	std::cout << "itemsbeforeadd: " << items << std::endl;
 #endif
-	int len = strlen(url);
-	bool resized = false;
-	char *u;
-	// truncate the URL if it's too long
-	if (len > 999) {
-		u = new char[1000];
-		u[999] = '\0';
-		// bugfix - previously, truncation did the above termination, but no string copy!
-		// this might never have been noticed due to high buffer size & correct termination preventing the bug causing a crash.
-		memcpy(u, url, 999);
-		resized = true;
-		len = 999;
-	} else {
-		u = (char *) url;
-	}
-	int pos = posInList(u);
-	if (pos >= 0) {		// found
-		if (resized) {
-			delete[]u;
-		}
-#ifdef DGDEBUG
-		std::cout << "Entry found at pos: " << pos << std::endl;
-#endif
-		urlreftime[index[pos]] = time(NULL);  // reset refresh counter
-		if (groups[index[pos]].find((char)fg, 0) == std::string::npos)
-			groups[index[pos]] += (char)fg;  // flag it as clean for this filter group
-		return;  // not going to add entry thats there already
+	if (region == NULL || fg < 0 || fg > 65535) {
+		return;
 	}
 
-	pos = 0 - pos - 1;  // now contains the insertion point
+	// URLs too long to store aren't cached at all, rather than being cut short
+	unsigned int len;
+	unsigned int hash = hashURL(url, fg, URLCACHE_CLEAN, len);
+	if (len > maxrecord) {
+		return;
+	}
+	add(url, len, hash, fg, URLCACHE_CLEAN, NULL, 0);
+}
 
+// see if the given URL is in the list of blocked URLs, and if so, fetch the data stored with it
+bool DynamicURLList::inBlockedList(const char *url, const int fg, const bool ssl, std::string &data)
+{
 #ifdef DGDEBUG
-	std::cout << "insertion pos: " << pos << std::endl;
-	std::cout << "size: " << size << std::endl;
+	std::cout << "url cache blocked search request: " << fg << " " << url << std::endl;
 #endif
+	if (region == NULL || fg < 0 || fg > 65535) {
+		return false;
+	}
+	unsigned char type = ssl ? URLCACHE_BLOCKEDSSL : URLCACHE_BLOCKED;
+	unsigned int len;
+	unsigned int hash = hashURL(url, fg, type, len);
+	if (len > maxrecord)
+		return false;
+	return find(url, len, hash, fg, type, &data);
+}
 
-	// the list isn't full, so simply push new entry onto the back
-	if (items < size) {
+// add a blocked URL to the list, along with data describing why it was blocked
+void DynamicURLList::addBlockedEntry(const char *url, const int fg, const bool ssl, const std::string &data)
+{
 #ifdef DGDEBUG
-		std::cout << "items<size: " << items << "<" << size << std::endl;
+	std::cout << "url cache blocked add request: " << fg << " " << url << std::endl;
 #endif
-		char *urlref;
-		urlref = items * 1000 + urls;
-		memcpy(urlref, u, len);
-		urlref[len] = '\0';
-		urlreftime[items] = time(NULL);
-		int i;
-		// shift alphabetical index list below the insertion point down by one,
-		// and insert our new item.
-		for (i = items; i > pos; i--) {
-			index[i] = index[i - 1];
-		}
-		index[pos] = items;
-		groups[items] = (char)fg;
-		items++;
-		if (resized) {
-			delete[]u;
-		}
+	if (region == NULL || fg < 0 || fg > 65535) {
 		return;
 	}
-
-	// list is full, so we can't simply push a new entry on to it.
-	// now replace the oldest entry but first need to find it in
-	// the index to remove from there. old entries don't get deleted, just overwritten!
-
-	// we know the pos in the list of the oldest URL, but not where it is in our sorted index list
-	char *oldestref = urls + agepos * 1000;
-
-	// now contains pos in sorted index of what we're going to overwrite
-	int delpos = posInList(oldestref);  
-
-	// do the actual overwriting, including termination and setting birthdate to now
-	memcpy(oldestref, u, len);
-	oldestref[len] = '\0';
-	urlreftime[agepos] = time(NULL);
-	groups[agepos] = (char)fg;
-
-	// now shuffle the index list to remain sorted
-	// remember: pos contains the alphabetical position of what we just added,
-	// delpos contains the alphabetical position of the previous oldest entry,
-	// and agepos contains the actual position in the string list of the entry we just wrote
-	if (delpos == pos) {
-		// the alphabetical pos of what we just deleted and what we just wrote are one and the same
-		// so simply update the one index value to contain a ref to the new entry
-		index[pos] = agepos;
-	}
-	else if (delpos < pos) {
-		// the alphabetical pos of what we deleted was less than what we just wrote
-		// so shift the list entries between the two up by one (losing delpos), and insert our entry
-		int endpos = pos - 1;
-		for (int i = delpos; i < endpos; i++) {
-			index[i] = index[i + 1];
-		}
-		index[pos - 1] = agepos;
-	}
-	else if (delpos > pos) {
-		// the alphabetical pos of what we just deleted was greater than what we just added,
-		// so starting from the old pos, work backwards, shifting the entries down by one
-		// then insert our new entry
-		for (int i = delpos; i > pos; i--) {
-			index[i] = index[i - 1];
-		}
-		index[pos] = agepos;
-	}
-	// the index is now sorted, but the actual list of strings itself is sorted oldest first.
-	// increase the age pointer to the next empty entry - once we get to the end, wrap round
-	// to the top, and overwrite the entries oldest first.
-	
-	// todo: things might speed up if we simply maintain the agepos as an index into the sorted index array,
-	// rather than an index on the real URL list. then we wouldn't need to do a posInList to find the agepos's
-	// sorted index every time we do an add.
-	agepos++;
-	if (agepos == size) {
-		agepos = 0;
-	}
-
-	if (resized) {
-		delete[]u;
+	unsigned char type = ssl ? URLCACHE_BLOCKEDSSL : URLCACHE_BLOCKED;
+	unsigned int len;
+	unsigned int hash = hashURL(url, fg, type, len);
+	if ((len + data.length()) > maxrecord || data.length() > 65535) {
+		return;
 	}
+	add(url, len, hash, fg, type, data.data(), data.length());
 }
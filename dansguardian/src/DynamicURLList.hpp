@@ -5,44 +5,115 @@
 #ifndef __HPP_DYNAMICURLLIST
 #define __HPP_DYNAMICURLLIST
 
-// dynamic URL lists - used to cache known clean URLs so filtering can be bypassed
+
+// INCLUDES
+
+#include <cstddef>
+#include <string>
+
+
+// DECLARATIONS
+
+struct URLCacheStripe;
+struct URLCacheRecord;
+struct URLCacheBucket;
+struct URLCacheLocal;
+
+// dynamic URL lists - used to cache known clean URLs so filtering can be bypassed,
+// and blocked URLs along with the reason they were blocked, so list lookups can be.
+// the list lives in a shared memory region, set up by setListSize, so that all
+// processes forked afterwards read and write the same list directly.
+// it is split into stripes, each a hash table with its own lock, so that
+// processes working on different URLs rarely have to wait for each other,
+// and the URLs themselves are kept in a ring of variable length records.
+// entries least recently looked up are replaced first (CLOCK).
+// each generation of children gets a list of its own, which starts out empty.
+// each process also keeps a few of the URLs it has recently used to itself,
+// so that it can find them again without taking any locks.
 class DynamicURLList
 {
 public:
 	DynamicURLList();
 	~DynamicURLList();
 
-	// set list size and timeout on entries (old entries aren't deleted, simply overwritten)
+	// set list size and timeout on entries (old entries aren't deleted, simply overwritten).
+	// a timeout of 0 means entries never go stale.
 	bool setListSize(unsigned int s, unsigned int t);
-	// flush the list (set all entries to old)
-	void flush();
 	// is an entry in the list?
 	bool inURLList(const char *url, const int fg);
 	// add a URL - if it's already there but marked as too old, simply rejuvenate it
 	void addEntry(const char *url, const int fg);
+	// is a blocked URL in the list, and if so, what data was stored with it?
+	// blocked CONNECT requests are kept apart from all others.
+	bool inBlockedList(const char *url, const int fg, const bool ssl, std::string &data);
+	// add a blocked URL, along with data saying why it was blocked
+	void addBlockedEntry(const char *url, const int fg, const bool ssl, const std::string &data);
+
+	// don't keep a list of recently used URLs for this process alone -
+	// for processes in which several threads look things up at once
+	void disableLocal();
+
+	// number of lookups answered by this process's own list, and passed on to the shared one
+	unsigned long int localHits() { return localhits; };
+	unsigned long int localMisses() { return localmisses; };
 
 private:
-	// index list - points to URL list entries in alphabetical order
-	unsigned int *index;
-	// age list, sorted in the same order as index
-	unsigned long int *urlreftime;
-	// actual URL list
-	char *urls;
-	// group list - which group(s) is this URL clean for?
-	std::string *groups;
-
-	// size of list
-	int size;
-	// pointer to oldest entry (real entry, not sorted index)
-	int agepos;
+	// the shared memory region, and its length
+	void *region;
+	size_t regionlen;
+
+	// stripes, then all their hash buckets and then all their record arenas
+	URLCacheStripe *stripes;
+	URLCacheBucket *buckets;
+	char *arenas;
+
+	// this process's own list, and its counters
+	URLCacheLocal *local;
+	unsigned long int localhits;
+	unsigned long int localmisses;
+
+	// number of stripes, and entries, hash buckets & arena bytes per stripe
+	unsigned int numstripes;
+	unsigned int stripesize;
+	unsigned int bucketmask;
+	unsigned int arenasize;
+	// longest URL (plus data) we will store
+	unsigned int maxrecord;
 	unsigned int timeout;
-	int items;
-	
-	// binary search for the pos of the given url in the sorted index
-	// returns 0-(pos+1) on failure, where pos is where the entry would be inserted to retain sorting
-	int search(int a, int s, const char *url);
-	// find the index for the given url - makes use of the above search func
-	int posInList(const char *url);
+
+	// disallow copying
+	DynamicURLList(const DynamicURLList&);
+	DynamicURLList& operator=(const DynamicURLList&);
+
+	// unmap the shared memory region, if there is one
+	void release();
+
+	// lock & unlock the given stripe - lock returns false if it couldn't be had
+	bool lock(unsigned int stripe);
+	void unlock(unsigned int stripe);
+	// remove all entries from the given stripe
+	void clear(unsigned int stripe);
+
+	// get the record at the given offset in the given stripe's arena
+	URLCacheRecord *record(unsigned int stripe, unsigned int offset);
+	// find the bucket holding the given url in the given stripe, or the
+	// empty bucket at which the search for it stopped
+	unsigned int findBucket(unsigned int stripe, unsigned int hash, unsigned short group, unsigned char type,
+		const char *url, unsigned int len);
+	// empty the given bucket, moving up any entries which collided with it
+	void removeBucket(unsigned int stripe, unsigned int bucket);
+	// move on past the record at the head of the given stripe, either removing it
+	// or giving it a second chance at the tail
+	void evict(unsigned int stripe);
+	// look for, and remember, a URL in this process's own list
+	bool inLocalList(const char *url, unsigned int len, unsigned int hash, int group);
+	void addLocal(const char *url, unsigned int len, unsigned int hash, int group, unsigned int reftime);
+	// look for, and add, a record of the given type in the shared list
+	bool find(const char *url, unsigned int len, unsigned int hash, unsigned short group, unsigned char type, std::string *data);
+	void add(const char *url, unsigned int len, unsigned int hash, unsigned short group, unsigned char type,
+		const char *data, unsigned int datalen);
+	// make room for a record of the given size, returning its offset
+	unsigned int allocate(unsigned int stripe, unsigned int size);
 };
 
 #endif
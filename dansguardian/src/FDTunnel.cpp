@@ -3,7 +3,7 @@
 // Released under the GPL v2, with the OpenSSL exception described in the README file.
 
 // This class is a generic multiplexing tunnel
-// that uses blocking select() to be as efficient as possible.  It tunnels
+// that uses blocking poll() to be as efficient as possible.  It tunnels
 // between the two supplied FDs.
 
 
@@ -20,7 +20,7 @@
 #include <sys/socket.h>
 #include <string.h>
 #include <algorithm>
-#include <sys/select.h>
+#include <sys/poll.h>
 
 #ifdef DGDEBUG
 #include <iostream>
@@ -70,31 +70,16 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 		sockfrom.buffstart = 0;
 	}
 
-	int maxfd, rc, fdfrom, fdto;
+	int rc, fdfrom, fdto;
 
 	fdfrom = sockfrom.getFD();
 	fdto = sockto.getFD();
 
-	maxfd = fdfrom > fdto ? fdfrom : fdto;  // find the maximum file
-	// descriptor.  As Linux normally allows each process
-	// to have up to 1024 file descriptors, maxfd
-	// prevents the kernel having to look through all
-	// 1024 fds each fdSet could contain
-
 	char buff[32768];  // buffer for the input
-	timeval timeout;  // timeval struct
-	timeout.tv_sec = 120;  // modify the struct so its a 120 sec timeout
-	timeout.tv_usec = 0;
-
-	fd_set fdSet;  // file descriptor set
+	int timeout = 120 * 1000;  // 120 sec timeout
 
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(fdto, &fdSet);  // add fdto to the set
-	FD_SET(fdfrom, &fdSet);  // add fdfrom to the set
-
-	timeval t;  // we need a 2nd copy used later
-	fd_set inset;  // we need a 2nd copy used later
-	fd_set outset;  // we need a 3rd copy used later
+	// fdfrom first, then fdto
+	struct pollfd inset[2];
 
 	bool done = false;  // so we get past the first while
 
@@ -102,14 +87,16 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 		done = true;  // if we don't make a sucessful read and write this
 		// flag will stay true and so the while() will exit
 
-		inset = fdSet;  // as select() can modify the sets we need to take
-		t = timeout;  // a copy each time round and use that
-
-		if (ignore && !twoway) FD_CLR(fdto, &inset);
+		inset[0].fd = fdfrom;
+		// a negative FD is ignored by poll
+		inset[1].fd = (ignore && !twoway) ? -1 : fdto;
+		inset[0].events = inset[1].events = POLLIN;
+		inset[0].revents = POLLIN;
+		inset[1].revents = (inset[1].fd < 0) ? 0 : POLLIN;
 
 #ifdef __SSLMITM
 		//<TODO> This if is a nasty hack for ssl man in the middle
-		//FD_SET sets the fd to a readable state then data is read 
+		//the fds are left marked readable, then data is read 
 		//from the server until the server runs out of data then it
 		//gets gets dumped out to the client.
 		//This will break if the server is ever expecting data from
@@ -122,11 +109,12 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 		}
 		else
 #endif
-		if (selectEINTR(maxfd + 1, &inset, NULL, NULL, &t) < 1) {
+		if (pollEINTR(inset, 2, timeout) < 1) {
 			break;  // an error occured or it timed out so end while()
 		}
 
-		if (FD_ISSET(fdfrom, &inset)) {	// fdfrom is ready to be read from
+		// as with select(), errors & hangups count as readable - the read will find them
+		if (inset[0].revents) {	// fdfrom is ready to be read from
 			if (targetthroughput > -1)
 				// we have a target throughput - only read in the exact amount of data we've been told to
 				// plus 2 bytes to "solve" an IE post bug with multipart/form-data forms:
@@ -144,27 +132,19 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 			}
 			else {	// some data read
 				throughput += rc;  // increment our counter used to log
-				outset = fdSet;  // take a copy to work with
-				FD_CLR(fdfrom, &outset);  // remove fdfrom from the set
-				// as we are only interested in writing to fdto
 
-				t = timeout;  // take a copy to work with
-
-				if (selectEINTR(fdto + 1, NULL, &outset, NULL, &t) < 1) {
+				// we are only interested in writing to fdto
+				if (waitForFD(fdto, POLLOUT, timeout) < 1) {
 					break;  // an error occured or timed out so end while()
 				}
 
-				if (FD_ISSET(fdto, &outset)) {	// fdto ready to write to
-					if (!sockto.writeToSocket(buff, rc, 0, 0, false)) {	// write data
-						break;  // was an error writing
-					}
-					done = false;  // flag to say data still to be handled
-				} else {
-					break;  // should never get here
+				if (!sockto.writeToSocket(buff, rc, 0, 0, false)) {	// write data
+					break;  // was an error writing
 				}
+				done = false;  // flag to say data still to be handled
 			}
 		}
-		if (FD_ISSET(fdto, &inset)) {	// fdto is ready to be read from
+		if (inset[1].revents) {	// fdto is ready to be read from
 			if (!twoway) {
 				// since HTTP works on a simple request/response basis, with no explicit
 				// communications from the client until the response has been completed
@@ -190,24 +170,15 @@ bool FDTunnel::tunnel(Socket &sockfrom, Socket &sockto, bool twoway, off_t targe
 				break;
 			}
 			else {	// some data read
-				outset = fdSet;  // take a copy to work with
-				FD_CLR(fdto, &outset);  // remove fdto from the set
-				// as we are only interested in writing to fdfrom
-
-				t = timeout;  // take a copy to work with
-
-				if (selectEINTR(fdfrom + 1, NULL, &outset, NULL, &t) < 1) {
+				// we are only interested in writing to fdfrom
+				if (waitForFD(fdfrom, POLLOUT, timeout) < 1) {
 					break;  // an error occured or timed out so end while()
 				}
 
-				if (FD_ISSET(fdfrom, &outset)) {	// fdfrom ready to write to
-					if (!sockfrom.writeToSocket(buff, rc, 0, 0, false)) {	// write data
-						break;  // was an error writing
-					}
-					done = false;  // flag to say data still to be handled
-				} else {
-					break;  // should never get here
+				if (!sockfrom.writeToSocket(buff, rc, 0, 0, false)) {	// write data
+					break;  // was an error writing
 				}
+				done = false;  // flag to say data still to be handled
 			}
 		}
 	}
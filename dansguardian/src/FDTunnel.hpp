@@ -1,5 +1,5 @@
 // This class is a generic multiplexing tunnel
-// that uses blocking select() to be as efficient as possible.  It tunnels
+// that uses blocking poll() to be as efficient as possible.  It tunnels
 // between the two supplied FDs.
 
 // For all support, instructions and copyright go to:
@@ -15,10 +15,11 @@
 #include "OptionContainer.hpp"
 
 #include <cstdlib>
+#include <cstring>
 #include <syslog.h>
 #include <iostream>
 #include <fstream>
-#include <netdb.h>		// for gethostby
+#include <netdb.h>		// for getnameinfo
 #include <netinet/in.h>		// for address structures
 #include <arpa/inet.h>		// for inet_aton()
 #include <sys/socket.h>
@@ -34,18 +35,19 @@ extern OptionContainer o;
 // IMPLEMENTATION
 
 // reverse DNS lookup on IP. be aware that this can return multiple results, unlike a standard lookup.
+// (getnameinfo rather than gethostbyaddr, as the latter's answer is kept in a static buffer, so lookups
+// can't safely be made from several threads at once.)
 std::deque<String> * ipToHostname(const char *ip)
 {
 	std::deque<String> *result = new std::deque<String>;
-	struct in_addr address, **addrptr;
-	if (inet_aton(ip, &address)) {	// convert to in_addr
-		struct hostent *answer;
-		answer = gethostbyaddr((char *) &address, sizeof(address), AF_INET);
-		if (answer) {	// sucess in reverse dns
-			result->push_back(String(answer->h_name));
-			for (addrptr = (struct in_addr **) answer->h_addr_list; *addrptr; addrptr++) {
-				result->push_back(String(inet_ntoa(**addrptr)));
-			}
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	if (inet_aton(ip, &address.sin_addr)) {	// convert to in_addr
+		char host[NI_MAXHOST];
+		if (getnameinfo((struct sockaddr *) &address, sizeof(address), host, sizeof(host), NULL, 0, NI_NAMEREQD) == 0) {	// sucess in reverse dns
+			result->push_back(String(host));
+			result->push_back(String(ip));
 		}
 	}
 	return result;
@@ -495,6 +497,13 @@ bool FOptionContainer::read(const char *filename)
 					return false;
 			}
 
+			// Phrase search engine per group - only meaningful if quick search isn't forced.
+			// streaming filtering can only resume searches with the Aho-Corasick engine.
+			if (!force_quick_search && (streaming_filter || findoptionS("phrasesearchengine") == "ahocorasick"))
+				aho_corasick_search = true;
+			else
+				aho_corasick_search = false;
+
 			std::string exception_phrase_list_location(findoptionS("exceptionphraselist"));
 			std::string weighted_phrase_list_location(findoptionS("weightedphraselist"));
 			std::string banned_phrase_list_location(findoptionS("bannedphraselist"));
@@ -653,7 +662,7 @@ bool FOptionContainer::read(const char *filename)
 				if (!o.lm.readbplfile(banned_phrase_list_location.c_str(),
 					exception_phrase_list_location.c_str(),
 					weighted_phrase_list_location.c_str(), banned_phrase_list,
-					force_quick_search))
+					force_quick_search, aho_corasick_search))
 				{
 					return false;
 				}		// read banned, exception, weighted phrase list
@@ -738,7 +747,7 @@ bool FOptionContainer::read(const char *filename)
 							if (!o.lm.readbplfile(banned_searchterm_list_location.c_str(),
 								exception_searchterm_list_location.c_str(),
 								weighted_searchterm_list_location.c_str(), searchterm_list,
-								force_quick_search))
+								force_quick_search, aho_corasick_search))
 							{
 								return false;
 							}
@@ -903,6 +912,7 @@ bool FOptionContainer::compileRegExMatchFile(unsigned int list, std::deque<RegEx
 		list_source.push_back(source);
 		list_ref.push_back(list);
 	}
+	(*o.lm.l[list]).freeze();
 	(*o.lm.l[list]).used = true;
 	return true;
 }
@@ -922,6 +932,7 @@ bool FOptionContainer::readRegExReplacementFile(const char *filename, const char
 	listid = (unsigned) result;
 	if (!(*o.lm.l[listid]).used) {
 		//(*o.lm.l[listid]).doSort(true);
+		(*o.lm.l[listid]).freeze();
 		(*o.lm.l[listid]).used = true;
 	}
 	RegExp r;
@@ -959,20 +970,20 @@ bool FOptionContainer::readRegExReplacementFile(const char *filename, const char
 }
 
 // Recursively check site & URL lists for blanket matches
-char *FOptionContainer::testBlanketBlock(unsigned int list, bool ip, bool ssl) {
+const char *FOptionContainer::testBlanketBlock(unsigned int list, bool ip, bool ssl) {
 	if (not o.lm.l[list]->isNow())
 		return NULL;
 	if (o.lm.l[list]->blanketblock) {
-		return (char*)o.language_list.getTranslation(502);
+		return o.language_list.getTranslation(502);
 	} else if (o.lm.l[list]->blanket_ip_block and ip) {
-		return (char*)o.language_list.getTranslation(505);
+		return o.language_list.getTranslation(505);
 	} else if (o.lm.l[list]->blanketsslblock and ssl) {
-		return (char*)o.language_list.getTranslation(506);
+		return o.language_list.getTranslation(506);
 	} else if (o.lm.l[list]->blanketssl_ip_block and ssl and ip) {
-		return (char*)o.language_list.getTranslation(507);
+		return o.language_list.getTranslation(507);
 	}
 	for (std::vector<int>::iterator i = o.lm.l[list]->morelists.begin(); i != o.lm.l[list]->morelists.end(); i++) {
-		char *r = testBlanketBlock(*i, ip, ssl);
+		const char *r = testBlanketBlock(*i, ip, ssl);
 		if (r) {
 			return r;
 		}
@@ -983,11 +994,11 @@ char *FOptionContainer::testBlanketBlock(unsigned int list, bool ip, bool ssl) {
 // checkme: there's an awful lot of removing whitespace, PTP, etc. going on here.
 // perhaps connectionhandler could keep a suitably modified version handy to prevent repitition of work?
 
-char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanket, bool ip, bool ssl)
+const char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanket, bool ip, bool ssl, ListResult *result)
 {
 	// Perform blanket matching if desired
 	if (doblanket) {
-		char *r = testBlanketBlock(list, ip, ssl);
+		const char *r = testBlanketBlock(list, ip, ssl);
 		if (r) {
 			return r;
 		}
@@ -999,7 +1010,7 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
 	if (url.contains("/")) {
 		url = url.before("/");  // chop off any path after the domain
 	}
-	char *i;
+	const char *i;
 	bool isipurl = isIPHostname(url);
 	if (reverse_lookups && isipurl) {	// change that ip into hostname
 		std::deque<String > *url2s = ipToHostname(url.toCharArray());
@@ -1007,7 +1018,7 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
 		for (std::deque<String>::iterator j = url2s->begin(); j != url2s->end(); j++) {
 			url2 = *j;
 			while (url2.contains(".")) {
-				i = (*o.lm.l[list]).findInList(url2.toCharArray());
+				i = (*o.lm.l[list]).findInList(url2.toCharArray(), result);
 				if (i != NULL) {
 					delete url2s;
 					return i;  // exact match
@@ -1018,7 +1029,7 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
 		delete url2s;
 	}
 	while (url.contains(".")) {
-		i = (*o.lm.l[list]).findInList(url.toCharArray());
+		i = (*o.lm.l[list]).findInList(url.toCharArray(), result);
 		if (i != NULL) {
 			return i;  // exact match
 		}
@@ -1026,7 +1037,7 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
 	}
 	if (url.length() > 1) {	// allows matching of .tld
 		url = "." + url;
-		i = (*o.lm.l[list]).findInList(url.toCharArray());
+		i = (*o.lm.l[list]).findInList(url.toCharArray(), result);
 		if (i != NULL) {
 			return i;  // exact match
 		}
@@ -1036,9 +1047,9 @@ char *FOptionContainer::inSiteList(String &url, unsigned int list, bool doblanke
 
 // checkme: remove things like this & make inSiteList/inIPList public?
 
-char *FOptionContainer::inBannedSiteList(String url, bool doblanket, bool ip, bool ssl)
+const char *FOptionContainer::inBannedSiteList(String url, bool doblanket, bool ip, bool ssl, ListResult *result)
 {
-	return inSiteList(url, banned_site_list, doblanket, ip, ssl);
+	return inSiteList(url, banned_site_list, doblanket, ip, ssl, result);
 }
 
 bool FOptionContainer::inGreySiteList(String url, bool doblanket, bool ip, bool ssl)
@@ -1046,9 +1057,9 @@ bool FOptionContainer::inGreySiteList(String url, bool doblanket, bool ip, bool
 	return inSiteList(url, grey_site_list, doblanket, ip, ssl) != NULL;
 }
 
-bool FOptionContainer::inExceptionSiteList(String url, bool doblanket, bool ip, bool ssl)
+bool FOptionContainer::inExceptionSiteList(String url, bool doblanket, bool ip, bool ssl, ListResult *result)
 {
-	return inSiteList(url, exception_site_list, doblanket, ip, ssl) != NULL;
+	return inSiteList(url, exception_site_list, doblanket, ip, ssl, result) != NULL;
 }
 
 bool FOptionContainer::inExceptionFileSiteList(String url)
@@ -1060,17 +1071,17 @@ bool FOptionContainer::inExceptionFileSiteList(String url)
 }
 
 // look in given URL list for given URL
-char *FOptionContainer::inURLList(String &url, unsigned int list, bool doblanket, bool ip, bool ssl) {
+const char *FOptionContainer::inURLList(String &url, unsigned int list, bool doblanket, bool ip, bool ssl, ListResult *result) {
 	// Perform blanket matching if desired
 	if (doblanket) {
-		char *r = testBlanketBlock(list, ip, ssl);
+		const char *r = testBlanketBlock(list, ip, ssl);
 		if (r) {
 			return r;
 		}
 	}
 
 	unsigned int fl;
-	char *i;
+	const char *i;
 	String foundurl;
 #ifdef DGDEBUG
 	std::cout << "inURLList: " << url << std::endl;
@@ -1102,7 +1113,7 @@ char *FOptionContainer::inURLList(String &url, unsigned int list, bool doblanket
 				url2 += "/";
 				url2 += url.after("/");
 				while (url2.before("/").contains(".")) {
-					i = (*o.lm.l[list]).findStartsWith(url2.toCharArray());
+					i = (*o.lm.l[list]).findStartsWith(url2.toCharArray(), result);
 					if (i != NULL) {
 						foundurl = i;
 						fl = foundurl.length();
@@ -1126,7 +1137,7 @@ char *FOptionContainer::inURLList(String &url, unsigned int list, bool doblanket
 		}
 	}
 	while (url.before("/").contains(".")) {
-		i = (*o.lm.l[list]).findStartsWith(url.toCharArray());
+		i = (*o.lm.l[list]).findStartsWith(url.toCharArray(), result);
 		if (i != NULL) {
 			foundurl = i;
 			fl = foundurl.length();
@@ -1147,12 +1158,12 @@ char *FOptionContainer::inURLList(String &url, unsigned int list, bool doblanket
 	return NULL;
 }
 
-char *FOptionContainer::inBannedURLList(String url, bool doblanket, bool ip, bool ssl)
+const char *FOptionContainer::inBannedURLList(String url, bool doblanket, bool ip, bool ssl, ListResult *result)
 {
 #ifdef DGDEBUG
 	std::cout<<"inBannedURLList"<<std::endl;
 #endif
-	return inURLList(url, banned_url_list, doblanket, ip, ssl);
+	return inURLList(url, banned_url_list, doblanket, ip, ssl, result);
 }
 
 bool FOptionContainer::inGreyURLList(String url, bool doblanket, bool ip, bool ssl)
@@ -1163,12 +1174,12 @@ bool FOptionContainer::inGreyURLList(String url, bool doblanket, bool ip, bool s
 	return inURLList(url, grey_url_list, doblanket, ip, ssl) != NULL;
 }
 
-bool FOptionContainer::inExceptionURLList(String url, bool doblanket, bool ip, bool ssl)
+bool FOptionContainer::inExceptionURLList(String url, bool doblanket, bool ip, bool ssl, ListResult *result)
 {
 #ifdef DGDEBUG
 	std::cout<<"inExceptionURLList"<<std::endl;
 #endif
-	return inURLList(url, exception_url_list, doblanket, ip, ssl) != NULL;
+	return inURLList(url, exception_url_list, doblanket, ip, ssl, result) != NULL;
 }
 
 // New log-only site lists
@@ -1176,8 +1187,9 @@ const char* FOptionContainer::inLogURLList(String url)
 {
 	if (!log_url_flag)
 		return NULL;
-	if (inURLList(url, log_url_list) != NULL) {
-		return o.lm.l[log_url_list]->lastcategory.toCharArray();
+	ListResult result;
+	if (inURLList(url, log_url_list, false, false, false, &result) != NULL) {
+		return result.category();
 	}
 	return NULL;
 }
@@ -1186,8 +1198,9 @@ const char* FOptionContainer::inLogSiteList(String url)
 {
 	if (!log_site_flag)
 		return NULL;
-	if (inSiteList(url, log_site_list) != NULL) {
-		return o.lm.l[log_site_list]->lastcategory.toCharArray();
+	ListResult result;
+	if (inSiteList(url, log_site_list, false, false, false, &result) != NULL) {
+		return result.category();
 	}
 	return NULL;
 }
@@ -1203,7 +1216,7 @@ const char* FOptionContainer::inLogRegExpURLList(String url) {
 
 // TODO: Store the modified URL somewhere, instead of re-processing it every time.
 
-char *FOptionContainer::inExtensionList(unsigned int list, String url)
+const char *FOptionContainer::inExtensionList(unsigned int list, String url)
 {
 	url.removeWhiteSpace();  // just in case of weird browser crap
 	url.toLower();
@@ -1230,25 +1243,26 @@ bool FOptionContainer::extractSearchTerms(String url, String &terms)
 	std::cout << "extractSearchTerms: " << url << std::endl;
 #endif
 	unsigned int i = 0;
+	RegResult r;
 	// iterate over all regexes in the compiled list.  if the source list is enabled
 	// at the current time, test to see if the regex itself matches the URL.
 	for (std::deque<RegExp>::iterator j = searchengine_regexp_list_comp.begin(); j != searchengine_regexp_list_comp.end(); j++) {
 		if (o.lm.l[searchengine_regexp_list_ref[i]]->isNow()) {
-			j->match(url.toCharArray());
-			if (j->matched()) {
+			j->match(url.toCharArray(), r);
+			if (r.matched()) {
 				// return the first submatch.
 				// if there are no submatches, the regex isn't suitable for
 				// actually extracting search terms; treat this as an error.
 				// match 1 is the whole string matched by the regex - we need
 				// at least 2 matches for there to have been a submatch.
-				if (j->numberOfMatches() < 2) {
+				if (r.numberOfMatches() < 2) {
 #ifdef DGDEBUG
 					std::cout << "extractSearchTerms: matched a regex with no submatches: " << searchengine_regexp_list_source[i] << std::endl;
 #endif
 					syslog(LOG_ERR, "extractSearchTerms: no submatches in regex! (%s)", searchengine_regexp_list_source[i].toCharArray());
 					return false;
 				}
-				terms = j->result(1);
+				terms = r.result(1);
 				// change '+' to ' ' then hex decode (remove URL parameter encoding)
 				terms.replaceall("+", " ");
 				terms.hexDecode();
@@ -1270,6 +1284,7 @@ bool FOptionContainer::extractSearchTerms(String url, String &terms)
 // is this line of the headers in the banned regexp header list?
 int FOptionContainer::inBannedRegExpHeaderList(std::deque<String> &header)
 {
+	RegResult r;
 
 	for (std::deque<String>::iterator k = header.begin(); k != header.end(); k++) {
 #ifdef DGDEBUG
@@ -1278,8 +1293,7 @@ int FOptionContainer::inBannedRegExpHeaderList(std::deque<String> &header)
 		unsigned int i = 0;
 		for (std::deque<RegExp>::iterator j = banned_regexpheader_list_comp.begin(); j != banned_regexpheader_list_comp.end(); j++) {
 			if (o.lm.l[banned_regexpheader_list_ref[i]]->isNow()) {
-				j->match(k->toCharArray());
-				if (j->matched())
+				if (j->match(k->toCharArray(), r))
 					return i;
 			}
 #ifdef DGDEBUG
@@ -1298,6 +1312,7 @@ int FOptionContainer::inRegExpURLList(String &url, std::deque<RegExp> &list_comp
 #ifdef DGDEBUG
 	std::cout<<"inRegExpURLList: "<<url<<std::endl;
 #endif
+	RegResult r;
 	// check parent list's time limit
 	if (o.lm.l[list]->isNow()) {
 		url.removeWhiteSpace();  // just in case of weird browser crap
@@ -1334,8 +1349,7 @@ int FOptionContainer::inRegExpURLList(String &url, std::deque<RegExp> &list_comp
 		unsigned int i = 0;
 		for (std::deque<RegExp>::iterator j = list_comp.begin(); j != list_comp.end(); j++) {
 			if (o.lm.l[list_ref[i]]->isNow()) {
-				j->match(url.toCharArray());
-				if (j->matched())
+				if (j->match(url.toCharArray(), r))
 					return i;
 			}
 #ifdef DGDEBUG
@@ -1372,7 +1386,8 @@ int FOptionContainer::inExceptionRegExpURLList(String url)
 
 bool FOptionContainer::isIPHostname(String url)
 {
-	if (!isiphost.match(url.toCharArray())) {
+	RegResult r;
+	if (!isiphost.match(url.toCharArray(), r)) {
 		return true;
 	}
 	return false;
@@ -1466,6 +1481,15 @@ bool FOptionContainer::precompileregexps()
 }
 
 
+bool FOptionContainer::urlListsTimeLimited()
+{
+	return (banned_site_flag && o.lm.l[banned_site_list]->isTimeLimited())
+		|| (banned_url_flag && o.lm.l[banned_url_list]->isTimeLimited())
+		|| (grey_site_flag && o.lm.l[grey_site_list]->isTimeLimited())
+		|| (grey_url_flag && o.lm.l[grey_url_list]->isTimeLimited())
+		|| (banned_regexpurl_flag && o.lm.l[banned_regexpurl_list]->isTimeLimited());
+}
+
 bool FOptionContainer::isOurWebserver(String url)
 {
 	// reporting levels 0 and 3 don't use the CGI
@@ -73,6 +73,10 @@ public:
 	
 	bool reverse_lookups;
 	bool force_quick_search;
+	// search phrase lists with an Aho-Corasick automaton rather than the graph
+	bool aho_corasick_search;
+	// streaming content filtering is enabled - needs the Aho-Corasick automaton
+	bool streaming_filter;
 	int bypass_mode;
 	int infection_bypass_mode;
 	int pics_rsac_violence;
@@ -235,7 +239,7 @@ public:
 	bool extractSearchTerms(String url, String &terms);
 
 	FOptionContainer():
-		block_downloads(false), searchterm_flag(false), banned_page(NULL),
+		block_downloads(false), aho_corasick_search(false), streaming_filter(false), searchterm_flag(false), banned_page(NULL),
 		banned_phrase_flag(false), exception_site_flag(false), exception_url_flag(false),
 		banned_extension_flag(false), banned_mimetype_flag(false), banned_site_flag(false),
 		banned_url_flag(false), grey_site_flag(false), grey_url_flag(false),
@@ -259,18 +263,20 @@ public:
 	void resetJustListData();
 	
 	bool isOurWebserver(String url);
-	char *inBannedSiteList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
-	char *inBannedURLList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
+	const char *inBannedSiteList(String url, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
+	const char *inBannedURLList(String url, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
 	bool inGreySiteList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
 	bool inGreyURLList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
-	bool inExceptionSiteList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
-	bool inExceptionURLList(String url, bool doblanket = false, bool ip = false, bool ssl = false);
+	bool inExceptionSiteList(String url, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
+	bool inExceptionURLList(String url, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
 	bool inExceptionFileSiteList(String url);
 	int inBannedRegExpURLList(String url);
 	int inExceptionRegExpURLList(String url);
 	int inBannedRegExpHeaderList(std::deque<String> &header);
-	char *inExtensionList(unsigned int list, String url);
+	const char *inExtensionList(unsigned int list, String url);
 	bool isIPHostname(String url);
+	// do any of the lists deciding whether a URL is banned only apply at certain times?
+	bool urlListsTimeLimited();
 
 	// log-only lists - return category
 	const char* inLogURLList(String url);
@@ -328,10 +334,10 @@ private:
 	bool realitycheck(int l, int minl, int maxl, const char *emessage);
 	int inRegExpURLList(String &url, std::deque<RegExp> &list_comp, std::deque<unsigned int> &list_ref, unsigned int list);
 
-	char *inURLList(String &url, unsigned int list, bool doblanket = false, bool ip = false, bool ssl = false);
-	char *inSiteList(String &url, unsigned int list, bool doblanket = false, bool ip = false, bool ssl = false);
+	const char *inURLList(String &url, unsigned int list, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
+	const char *inSiteList(String &url, unsigned int list, bool doblanket = false, bool ip = false, bool ssl = false, ListResult *result = NULL);
 
-	char *testBlanketBlock(unsigned int list, bool ip, bool ssl);
+	const char *testBlanketBlock(unsigned int list, bool ip, bool ssl);
 };
 
 #endif
@@ -24,10 +24,18 @@
 #include <sys/poll.h>
 #include <istream>
 #include <map>
+#include <deque>
 #include <memory>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #ifdef ENABLE_SEGV_BACKTRACE
 #include <execinfo.h>
@@ -47,6 +55,7 @@
 #include "SocketArray.hpp"
 #include "UDSocket.hpp"
 #include "SysV.hpp"
+#include "Scoreboard.hpp"
 
 
 // GLOBALS
@@ -63,21 +72,89 @@ extern OptionContainer o;
 extern bool is_daemonised;
 
 int numchildren;  // to keep count of our children
-int busychildren;  // to keep count of our children
-int waitingfor;  // num procs waiting for to be preforked
-int *childrenpids;  // so when one exits we know who
-int *childrenstates;  // so we know what they're up to
-struct pollfd *pids;
-UDSocket **childsockets;
+Scoreboard scoreboard;  // what our children are up to, in memory shared with them
+UDSocket **childsockets;  // to tell children to accept connections, unless they do so themselves
+int lifeline[2];  // children with no socket to the parent watch this to see if it has gone away
 int failurecount;
+pid_t loggerpid = 0;  // to hold the logging process pid
+pid_t iplistpid = 0; // ip cache process id
+pid_t loaderpid = -1;  // process loading the next generation of config & lists
+int loaderpipe = -1;  // written to by the loader once it has taken over
+bool takeover = false;  // are we a loader, taking over from the previous generation?
+bool restarthelpers = false;  // ...and, once we have, should we replace its logger & IP list processes?
 int serversocketcount;
 SocketArray serversockets;  // the sockets we will listen on for connections
+DynamicURLList urlcache;  // clean URL cache, in memory shared with the children
+
+// what the adaptive pool controller saw last time it ran
+struct PoolSignals
+{
+	time_t last;
+	// scoreboard totals of requests finished & time taken over them
+	unsigned long served;
+	unsigned long servicemsecs;
+	// smoothed requests finished per second, milliseconds per request, and busy children
+	double rate;
+	double service;
+	double busy;
+	// children called for by the load last time round
+	double demand;
+	// how long the pool has been bigger than called for
+	int oversized;
+	// connections handed to children since the controller last ran, and how long they waited for one
+	unsigned long dispatches;
+	unsigned long dispatchmsecs;
+	// are connections waiting for a free child right now?
+	bool starved;
+};
+PoolSignals poolsignals;
+
+// what the load shedding controller has seen since it last made a decision (loadshedmaxtier)
+struct LoadSignals
+{
+	time_t last;
+	time_t decided;
+	// sums of the percentage of children busy, & runnable processes per 100 CPUs, once a second
+	long busy;
+	long runqueue;
+	int samples;
+	// scoreboard histogram of request times when the last decision was made
+	unsigned long hist[SB_HISTBUCKETS];
+	int tier;
+};
+LoadSignals loadsignals;
+
+// idle persistent connections parked with the parent until their next request arrives
+// (parkedconnections).  children hand them over along with their persistent auth state
+// through the parking socket; the parent waits on them with parkfd, and passes them to
+// free children along with the same state.  also used to tell children to accept a
+// connection, in which case only "which" is sent.
+struct ParkedPeer
+{
+	// server socket to accept a connection from, or -1 if it's a parked one
+	char which;
+	char persistent_authed;
+	// the filter port the client connected to
+	int port;
+	int filtergroup;
+	int oldfg;
+	char clientuser[SB_USERLEN];
+	char oldclientuser[SB_USERLEN];
+	// the client's IP address, for maxclientconnections & co.
+	char ip[SB_IPLEN];
+	// parent only: when to give up on the client sending another request, or 0 if it has
+	time_t deadline;
+};
+UDSocket *parkin = NULL;  // parent's end of the parking socket
+UDSocket *parkout = NULL;  // children's end
+int parkfd = -1;
+bool parking = false;  // do children hand idle connections to the parent?
+std::map<int, ParkedPeer> parked;  // parked connections, by FD
+std::deque<int> unparked;  // held connections whose request has arrived, waiting for a free child - priorityports first
+unsigned long queuedcount = 0;  // connections which have had to wait for a free child
+unsigned long rejectedcount = 0;  // connections turned away as too many were waiting (overloadqueue)
 UDSocket loggersock;  // the unix domain socket to be used for ipc with the forked children
-UDSocket urllistsock;
 UDSocket iplistsock;
-Socket *peersock(NULL);  // the socket which will contain the connection
-
-String peersockip;  // which will contain the connection ip
 
 
 // DECLARATIONS
@@ -98,42 +175,79 @@ extern "C"
 
 // logging & URL cache processes
 int log_listener(std::string log_location, bool logconerror, bool logsyslog);
-int url_list_listener(bool logconerror);
-// send flush message over URL cache IPC socket
-void flush_urlcache();
+// replace the previous generation's logger & IP list processes with ones using our options
+void restart_helpers();
 
 // fork off into background
 bool daemonise();
 // create specified amount of child processes
 int prefork(int num);
 
-// check child process is ready to start work
-bool check_kid_readystatus(int tofind);
-// child process informs parent process that it is ready
-int send_readystatus(UDSocket &pipe);
-
 // child process main loop - sits waiting for incoming connections & processes them
 int handle_connections(UDSocket &pipe);
+#ifdef HAVE_SYS_EPOLL_H
+// alternative child process main loop - holds many connections at once,
+// and processes requests as they arrive on them
+int handle_connections_evented(UDSocket &pipe, ConnectionHandler &h, int &cycle);
+#endif
 // tell a non-busy child process to accept the incoming connection
 void tellchild_accept(int num, int whichsock);
-// child process accept()s connection from server socket
-bool getsock_fromparent(UDSocket &fd);
+// hand a parked connection whose next request has arrived to a non-busy child process
+bool tellchild_parked(int num, int peerfd);
+// child process accept()s connection from server socket, or receives a parked one & its state
+Socket *getsock_fromparent(UDSocket &fd, PeerState &state);
+// child process hands an idle persistent connection to the parent
+bool park_connection(Socket &peersock, PeerState &state);
+// parent: forget a parked connection, closing our copy of it
+void unpark(int peerfd);
+// parent: accept new connections into the parked set, to wait for their request headers
+void accept_toparked(int whichsock);
+// parent: accept connections for which there is no free child, to wait for one (overloadqueue)
+void admit_connections(int whichsock);
+// parent: put a held connection whose request has arrived in the queue for a free child
+void queue_connection(int peerfd);
+// parent: send a held connection a response of our own, and forget it
+void turn_away(int peerfd, const char *response, int len);
+// parent: pass the connections we're holding to the generation taking over from us
+void handover_parked();
+// parent: close all parked connections
+void close_parked();
+// child process waits for & accept()s connection from server sockets without the parent's help
+Socket *getsock_fromlisteners(UDSocket &fd);
+// child process asks to be replaced if it has grown too big or old (maxchildmemory & co.)
+void check_recycle();
 
-// add known info about a child to our info lists
-void addchild(int pos, int fd, pid_t child_pid);
 // find ID of first non-busy child
 int getfreechild();
-// find an empty slot in our child info lists
-int getchildslot();
-// cull up to this number of non-busy children
+// cull up to this number of non-busy children, those wanting replacing first
 void cullchildren(int num);
-// delete this child from our info lists
+// cull the child in this slot, if it isn't busy
+bool cullchild(int slot);
+// start replacements for children which want them, and cull them once they're ready
+void recycle_children();
+// start more children when connections are waiting & none are free
+void prefork_underload(int waitingfor);
+// grow or shrink the pool according to the load (adaptivechildren)
+void adapt_pool(int *serversockfds, int freechildren, int waitingfor);
+// number of connections waiting to be accepted on the given server sockets
+int acceptqueue_length(int *serversockfds);
+// move the load shedding tier up or down according to the load (loadshedmaxtier)
+void shed_load();
+// number of processes waiting for a CPU, per 100 CPUs
+int runqueue_length();
+// delete this child from the scoreboard
 void deletechild(int child_pid);
 // clean up any dead child processes (calls deletechild with exit values)
 void mopup_afterkids();
 
 // tidy up resources for a brand new child process (uninstall signal handlers, delete copies of unnecessary data, etc.)
 void tidyup_forchild();
+// tidy up resources for a config loader process (delete the previous generation's child info, etc.)
+void tidyup_forloader();
+// tidy up resources for a logger or IP list process started once the parent is up & running
+void tidyup_forhelper();
+// re-read the filter group config, keeping the main options as they are
+bool reload_filtergroups();
 
 // send SIGTERM or SIGHUP to call children
 void kill_allchildren();
@@ -244,38 +358,6 @@ bool drop_priv_completely()
 	return true;
 }
 
-// signal the URL cache to flush via IPC
-void flush_urlcache()
-{
-	if (o.url_cache_number < 1) {
-		return;  // no cache running to flush
-	}
-	UDSocket fipcsock;
-	if (fipcsock.getFD() < 0) {
-		syslog(LOG_ERR, "%s", "Error creating ipc socket to url cache for flush");
-		return;
-	}
-	if (fipcsock.connect(o.urlipc_filename.c_str()) < 0) {	// conn to dedicated url cach proc
-		syslog(LOG_ERR, "%s", "Error connecting via ipc to url cache for flush");
-#ifdef DGDEBUG
-		std::cout << "Error connecting via ipc to url cache for flush" << std::endl;
-#endif
-		return;
-	}
-	String request("f\n");
-	try {
-		fipcsock.writeString(request.toCharArray());  // throws on err
-	}
-	catch(std::exception & e) {
-#ifdef DGDEBUG
-		std::cerr << "Exception flushing url cache" << std::endl;
-		std::cerr << e.what() << std::endl;
-#endif
-		syslog(LOG_ERR, "%s", "Exception flushing url cache");
-		syslog(LOG_ERR, "%s", e.what());
-	}
-}
-
 // Fork ourselves off into the background
 bool daemonise()
 {
@@ -339,7 +421,7 @@ bool daemonise()
 // prefork specified num of children and set them handling connections
 int prefork(int num)
 {
-	if (num < waitingfor) {
+	if (num < scoreboard.startingChildren()) {
 		return 3;  // waiting for forks already
 	}
 #ifdef DGDEBUG
@@ -347,13 +429,23 @@ int prefork(int num)
 #endif
 	int sv[2];
 	pid_t child_pid;
+	int child_slot;
 	while (num--) {
 		if (numchildren >= o.max_children) {
 			return 2;  // too many - geddit?
 		}
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		// children which accept connections themselves only need the lifeline
+		if (!o.child_accept && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
 			return -1;  // error
 		}
+		// take a slot before forking, so the child knows which is its own
+		if ((child_slot = scoreboard.addChild(0)) < 0) {
+			if (!o.child_accept) {
+				close(sv[0]);
+				close(sv[1]);
+			}
+			return 2;
+		}
 
 		child_pid = fork();
 
@@ -371,41 +463,43 @@ int prefork(int num)
 			// too many children in the conf will
 			// kill the server.  But this is user
 			// error.
+			scoreboard.deleteChild(child_slot);
+			if (!o.child_accept) {
+				close(sv[0]);
+				close(sv[1]);
+			}
 			sleep(1);  // need to wait until we have a spare slot
 			num--;
 			continue;  // Nothing doing, go back to listening
 		}
 		else if (child_pid == 0) {
 			// I am the child - I am alive!
-			close(sv[0]);  // we only need our copy of this
+			if (!o.child_accept)
+				close(sv[0]);  // we only need our copy of this
 			tidyup_forchild();
 			if (!drop_priv_completely()) {
 				return -1;  //error
 			}
+			scoreboard.setSlot(child_slot);
 			// no need to deallocate memory etc as already done when fork()ed
 			// right - let's do our job!
-			UDSocket sock(sv[1]);
+			UDSocket sock(o.child_accept ? lifeline[0] : sv[1]);
 			int rc = handle_connections(sock);
 
 			// ok - job done, time to tidy up.
 			_exit(rc);  // baby go bye bye
 		} else {
 			// I am the parent
-			// close the end of the socketpair we don't need
-			close(sv[1]);
-
-			int child_slot;
-#ifdef DGDEBUG
-			std::cout << "child_slot" << child_slot << std::endl;
-#endif
-
-			// add the child and its FD/PID to an empty child slot
-			if ((child_slot = getchildslot()) >= 0) {
-				addchild(child_slot, sv[0], child_pid);
+			scoreboard.setPid(child_slot, child_pid);
+			numchildren++;
+			if (!o.child_accept) {
+				// close the end of the socketpair we don't need
+				close(sv[1]);
+				childsockets[child_slot] = new UDSocket(sv[0]);
+			}
 #ifdef DGDEBUG
-				std::cout << "Preforked parent added child to list" << std::endl;
+			std::cout << "Preforked parent added child to slot " << child_slot << std::endl;
 #endif
-			}
 		}
 	}
 
@@ -444,73 +538,343 @@ void tidyup_forchild()
 		syslog(LOG_ERR, "%s", "Error resetting signal for SIGHUP");
 	}
 	// now close open socket pairs don't need
+	if (childsockets != NULL) {
+		for (int i = 0; i < o.max_children; i++) {
+			if (childsockets[i] != NULL) {
+				delete childsockets[i];
+			}
+		}
+		delete[]childsockets;
+		childsockets = NULL;
+	}
+	// only the parent should hold the lifeline open for writing
+	close(lifeline[1]);
+	if (!o.child_accept)
+		close(lifeline[0]);
+	// parked connections are the parent's to hand out
+	close_parked();
+	delete parkin;
+	parkin = NULL;
+}
 
-	for (int i = 0; i < o.max_children; i++) {
-		if (pids[i].fd != -1) {
-			delete childsockets[i];
+// cleaning up for config loader processes - the previous generation's children,
+// scoreboard & IPC sockets belong to the previous generation's parent
+void tidyup_forloader()
+{
+	if (childsockets != NULL) {
+		for (int i = 0; i < o.max_children; i++) {
+			if (childsockets[i] != NULL) {
+				delete childsockets[i];
+			}
+		}
+		delete[]childsockets;
+		childsockets = NULL;
+	}
+	close(lifeline[0]);
+	close(lifeline[1]);
+	scoreboard.release();
+	// the parking socket is kept, for the previous generation to hand its connections over
+	close_parked();
+	loggersock.close();
+	iplistsock.close();
+}
+
+// cleaning up for logger & IP list processes forked by a parent which already has
+// children - they mustn't hold open anything the children watch to see if it has gone
+void tidyup_forhelper()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &sa, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	serversockets.deleteAll();
+	if (childsockets != NULL) {
+		for (int i = 0; i < o.max_children; i++) {
+			if (childsockets[i] != NULL) {
+				delete childsockets[i];
+			}
 		}
+		delete[]childsockets;
+		childsockets = NULL;
+	}
+	close(lifeline[0]);
+	close(lifeline[1]);
+	scoreboard.release();
+	close_parked();
+	delete parkin;
+	delete parkout;
+	parkin = parkout = NULL;
+}
+
+// forget a parked connection, closing our copy of it.  take it out of the epoll
+// set first - whilst a child has a copy, closing ours won't.
+void unpark(int peerfd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	if (parkfd >= 0)
+		epoll_ctl(parkfd, EPOLL_CTL_DEL, peerfd, &ev);
+#endif
+	close(peerfd);
+	parked.erase(peerfd);
+}
+
+// did the client connect to one of the priorityports?
+bool priority_port(int port)
+{
+	for (std::deque<int>::iterator i = o.priority_ports.begin(); i != o.priority_ports.end(); i++) {
+		if (*i == port)
+			return true;
 	}
-	delete[]childrenpids;
-	delete[]childrenstates;
-	delete[]childsockets;
-	delete[]pids;  // 4 deletes good, memory leaks bad
+	return false;
 }
 
-// send Ready signal to parent process over the socketpair (used in handle_connections)
-int send_readystatus(UDSocket &pipe)
-{				// blocks until timeout
-	String message("2\n");
-	try {
-		if (!pipe.writeToSocket(message.toCharArray(), message.length(), 0, 15, true, true)) {
-			return -1;
+// accept connections from the given server socket whilst there's no free child for them,
+// holding on to them until there is - rather than leaving them in the listen queue
+void admit_connections(int whichsock)
+{
+	// don't get stuck here if they're arriving as fast as we can take them
+	for (int n = 0; n < 64; n++) {
+		struct sockaddr_in peer;
+		socklen_t peerlen = sizeof(peer);
+		int peerfd = accept(serversockets[whichsock]->getFD(), (struct sockaddr*) &peer, &peerlen);
+		if (peerfd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED && o.logconerror)
+				syslog(LOG_ERR, "Error accepting: %s", ErrStr().c_str());
+			return;
 		}
+		ParkedPeer &msg = parked[peerfd];
+		memset(&msg, 0, sizeof(msg));
+		msg.which = -1;
+		msg.port = serversockets[whichsock]->getPort();
+		inet_ntop(AF_INET, &peer.sin_addr, msg.ip, SB_IPLEN);
+		queue_connection(peerfd);
 	}
-	catch(std::exception & e) {
-		return -1;
+}
+
+// queue a held connection for the next free child.  once overloadqueue connections are
+// waiting, turn away the newest connection which isn't to one of the priorityports
+// instead - or this one, if they all are.  this holds whilst more children are still
+// starting up too, so that a flood can't grow the queue without limit.
+void queue_connection(int peerfd)
+{
+	ParkedPeer &msg = parked[peerfd];
+	msg.deadline = 0;
+	bool priority = priority_port(msg.port);
+	if (o.overload_queue > 0 && (int) unparked.size() >= o.overload_queue) {
+		int victim = peerfd;
+		if (priority && !priority_port(parked[unparked.back()].port)) {
+			victim = unparked.back();
+			unparked.pop_back();
+		}
+		turn_away(victim, o.overload_response.c_str(), o.overload_response.length());
+		++rejectedcount;
+		if (victim == peerfd)
+			return;
+	}
+	if ((int) unparked.size() >= scoreboard.idleChildren())
+		++queuedcount;
+	std::deque<int>::iterator i = unparked.end();
+	if (priority) {
+		i = unparked.begin();
+		while (i != unparked.end() && priority_port(parked[*i].port))
+			i++;
+	}
+	unparked.insert(i, peerfd);
+}
+
+// send a response to a held connection ourselves, then close it.  read what the client has
+// sent first, as closing a connection with unread data resets it, and the response with it.
+void turn_away(int peerfd, const char *response, int len)
+{
+	char buff[4096];
+	for (int n = 0; n < 16 && recv(peerfd, buff, sizeof(buff), MSG_DONTWAIT) > 0; n++);
+	if (send(peerfd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {}
+	shutdown(peerfd, SHUT_WR);
+	unpark(peerfd);
+}
+
+// pass the connections we're holding to the generation taking over from us, through the
+// parking socket it shares with us - those waiting for a child before those waiting for a request
+void handover_parked()
+{
+	if (parkout != NULL) {
+		std::deque<int> handover(unparked);
+		for (std::map<int, ParkedPeer>::iterator i = parked.begin(); i != parked.end(); i++) {
+			if (i->second.deadline > 0)
+				handover.push_back(i->first);
+		}
+		for (std::deque<int>::iterator i = handover.begin(); i != handover.end(); i++) {
+			ParkedPeer &msg = parked[*i];
+			msg.which = -1;
+			try {
+				parkout->readyForOutput(5);
+			}
+			catch (std::exception &e) {
+				syslog(LOG_ERR, "%s", "Error handing connections over to new configuration");
+				break;
+			}
+			if (!parkout->sendFD(*i, &msg, sizeof(msg)))
+				break;
+		}
 	}
-	return 0;
+	close_parked();
+}
+
+// accept as many new connections from the given server socket as there is
+// room for, and park them until their request headers have arrived
+void accept_toparked(int whichsock)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	while ((int) parked.size() < o.parked_connections) {
+		struct sockaddr_in peer;
+		socklen_t peerlen = sizeof(peer);
+		int peerfd = accept(serversockets[whichsock]->getFD(), (struct sockaddr*) &peer, &peerlen);
+		if (peerfd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED && o.logconerror)
+				syslog(LOG_ERR, "Error accepting: %s", ErrStr().c_str());
+			return;
+		}
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = peerfd;
+		if (epoll_ctl(parkfd, EPOLL_CTL_ADD, peerfd, &ev) < 0) {
+			syslog(LOG_ERR, "Error adding connection to epoll set: %s", ErrStr().c_str());
+			close(peerfd);
+			return;
+		}
+		// a brand new connection - no persistent state yet
+		ParkedPeer &msg = parked[peerfd];
+		memset(&msg, 0, sizeof(msg));
+		msg.which = -1;
+		msg.port = serversockets[whichsock]->getPort();
+		inet_ntop(AF_INET, &peer.sin_addr, msg.ip, SB_IPLEN);
+		msg.deadline = time(NULL) + 120;
+	}
+#endif
+}
+
+// close all parked connections - the clients will open new ones
+void close_parked()
+{
+	for (std::map<int, ParkedPeer>::iterator i = parked.begin(); i != parked.end(); i++)
+		close(i->first);
+	parked.clear();
+	unparked.clear();
+	if (parkfd >= 0) {
+		close(parkfd);
+		parkfd = -1;
+	}
+}
+
+// re-read the filter group config, content scanning & auth plugins, and rooms
+bool reload_filtergroups()
+{
+	o.deleteFilterGroups();
+	if (!o.readFilterGroupConf())
+		return false;
+	if (o.use_filter_groups_list) {
+		o.filter_groups_list.reset();
+		if (!o.doReadItemList(o.filter_groups_list_location.c_str(),&(o.filter_groups_list),"filtergroupslist",true))
+			return false;
+	}
+	o.deletePlugins(o.csplugins);
+	if (!o.loadCSPlugins())
+		return false;  // content scan plugs problem
+	o.deletePlugins(o.authplugins);
+	if (!o.loadAuthPlugins())
+		return false;  // auth plugs problem
+	o.deleteRooms();
+	o.loadRooms();
+	o.lm.garbageCollect();
+	return true;
 }
 
 // handle any connections received by this child (also tell parent we're ready each time we become idle)
 int handle_connections(UDSocket &pipe)
 {
 	ConnectionHandler h;  // the class that handles the connections
-	String ip;
+	Socket *peersock;  // the socket which will contain the connection
+	String peersockip;  // which will contain the connection ip
 	bool toldparentready = false;
 	int cycle = o.maxage_children;
 	int stat = 0;
 	reloadconfig = false;
 
+	bool evented = false;
+#ifdef HAVE_SYS_EPOLL_H
+	if (o.child_accept && (o.child_connections > 1 || o.child_threads > 1)) {
+		evented = true;
+		stat = handle_connections_evented(pipe, h, cycle);
+		toldparentready = true;
+		if (cycle < 1)
+			cycle = -1;  // as if used up by the loop below
+	}
+#endif
+
 	// stay alive both for the maximum allowed age of child processes, and whilst we aren't supposed to be re-reading configuration
-	while (cycle-- && !reloadconfig) {
+	while (!evented && cycle-- && !reloadconfig) {
+		check_recycle();
 		if (!toldparentready) {
-			if (send_readystatus(pipe) == -1) {	// non-blocking (timed)
+			scoreboard.setActivity(SB_WAITING);
+			if (!scoreboard.setState(SB_IDLE)) {
 #ifdef DGDEBUG
-				std::cout << "parent timed out telling it we're ready" << std::endl;
+				std::cout << "parent has told us to exit" << std::endl;
 #endif
-				break;  // parent timed out telling it we're ready
-				// so either parent gone or problem so lets exit this joint
+				break;
 			}
 			toldparentready = true;
 		}
 
-		if (!getsock_fromparent(pipe)) {	// blocks waiting for a few mins
+		PeerState state;
+		if (o.child_accept)
+			peersock = getsock_fromlisteners(pipe);  // blocks waiting for a few mins
+		else
+			peersock = getsock_fromparent(pipe, state);  // blocks waiting for a few mins
+		if (peersock == NULL) {
+			// the parent may have marked us busy for a connection someone else got
+			toldparentready = false;
 			continue;
 		}
 		toldparentready = false;
 
 		// now check the connection is actually good
+		peersockip = peersock->getPeerIP();
 		if (peersock->getFD() < 0 || peersockip.length() < 7) {
 			if (o.logconerror)
 				syslog(LOG_INFO, "Error accepting. (Ignorable)");
+			delete peersock;
 			continue;
 		}
 
-		h.handlePeer(*peersock, peersockip);  // deal with the connection
+		scoreboard.setConnections(1);
+		if (parking) {
+			// deal with the connection, handing it to the parent whenever it's waiting
+			// for its next request - if we can't, wait for it here
+			while (h.handlePeer(*peersock, peersockip, &state) && !reloadconfig && !park_connection(*peersock, state)) {
+				try {
+					peersock->checkForInput(120, true);
+				} catch (std::exception &e) {
+					break;
+				}
+			}
+		} else
+			h.handlePeer(*peersock, peersockip);  // deal with the connection
+		scoreboard.setConnections(0);
 		delete peersock;
 	}
 	if (!(++cycle) && o.logchildprocs)
 		syslog(LOG_ERR, "Child has handled %d requests and is exiting", o.maxage_children);
+	if (o.logchildprocs && (o.url_cache_number > 0))
+		syslog(LOG_INFO, "Child URL cache lookups: %lu found locally, %lu passed to shared cache", urlcache.localHits(), urlcache.localMisses());
+#ifdef DGDEBUG
+	std::cout << "url cache: " << urlcache.localHits() << " local hits, " << urlcache.localMisses() << " local misses" << std::endl;
+#endif
 #ifdef DGDEBUG
 	if (reloadconfig) {
 		std::cout << "child been told to exit by hup" << std::endl;
@@ -522,20 +886,463 @@ int handle_connections(UDSocket &pipe)
 	return stat;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+// a client connection held by an event-driven child whilst its next request arrives
+struct WaitingPeer
+{
+	Socket *sock;
+	// the socket's FD - handling a request may close the socket itself
+	int fd;
+	String ip;
+	PeerState state;
+	// when to stop waiting - the same 120 seconds handleConnection allows
+	time_t deadline;
+	// is a worker thread dealing with a request on it? if so, should the
+	// connection be kept open once it's done?
+	bool busy;
+	bool keep;
+	// has it yet to send its first request?  if so, it's owed an answer even if we're retiring.
+	bool fresh;
+};
+
+// worker threads for event-driven children with childthreads > 1.  connections whose
+// request headers have arrived are queued for the next free thread, which hands them
+// back once the request has been dealt with.  each thread has a ConnectionHandler of
+// its own, but the lists, plugins & URL cache are shared by all of them.
+struct WorkerPool
+{
+	pthread_mutex_t lock;
+	// signalled when a connection is queued, or it's time to stop
+	pthread_cond_t wakeup;
+	std::deque<WaitingPeer*> todo;
+	std::deque<WaitingPeer*> done;
+	bool stopping;
+	// written to by the threads to wake the event loop when they add to done
+	int donepipe[2];
+	int numthreads;
+	pthread_t *threads;
+	ConnectionHandler **handlers;
+};
+
+struct WorkerArgs
+{
+	WorkerPool *pool;
+	ConnectionHandler *h;
+};
+
+// worker thread main loop - handle queued connections until told to stop
+void *worker_thread(void *arg)
+{
+	WorkerPool *pool = ((WorkerArgs*)arg)->pool;
+	ConnectionHandler *h = ((WorkerArgs*)arg)->h;
+	delete (WorkerArgs*)arg;
+	WaitingPeer *wp;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->todo.empty() && !pool->stopping)
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+		if (pool->todo.empty())
+			break;  // stopping, and nothing left to do
+		wp = pool->todo.front();
+		pool->todo.pop_front();
+		pthread_mutex_unlock(&pool->lock);
+
+		wp->keep = h->handlePeer(*(wp->sock), wp->ip, &(wp->state));
+
+		pthread_mutex_lock(&pool->lock);
+		pool->done.push_back(wp);
+		// the pipe is non-blocking - if it's full, the event loop has plenty of wake-ups waiting already
+		if (write(pool->donepipe[1], "D", 1) < 0 && errno != EAGAIN) {
+			syslog(LOG_ERR, "Error waking event loop: %s", ErrStr().c_str());
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// start the worker threads, the first of which uses the given handler.  the others'
+// handlers are made here, before any threads are running, as making one is not thread safe.
+WorkerPool *start_workers(ConnectionHandler &h)
+{
+	WorkerPool *pool = new WorkerPool;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+	pool->stopping = false;
+	pool->numthreads = 0;
+	pool->threads = new pthread_t[o.child_threads];
+	pool->handlers = new ConnectionHandler*[o.child_threads];
+	pool->handlers[0] = &h;
+	for (int i = 1; i < o.child_threads; i++)
+		pool->handlers[i] = new ConnectionHandler;
+	if (pipe(pool->donepipe) < 0) {
+		syslog(LOG_ERR, "Error creating worker thread pipe: %s", ErrStr().c_str());
+		pool->donepipe[0] = pool->donepipe[1] = -1;
+		return pool;
+	}
+	fcntl(pool->donepipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(pool->donepipe[1], F_SETFL, O_NONBLOCK);
+
+	// signals are for the event loop - the threads inherit this mask, so block them all first
+	sigset_t allsignals, oldsignals;
+	sigfillset(&allsignals);
+	pthread_sigmask(SIG_SETMASK, &allsignals, &oldsignals);
+	for (int i = 0; i < o.child_threads; i++) {
+		WorkerArgs *args = new WorkerArgs;
+		args->pool = pool;
+		args->h = pool->handlers[i];
+		int rc = pthread_create(&(pool->threads[i]), NULL, &worker_thread, args);
+		if (rc != 0) {
+			syslog(LOG_ERR, "Error creating worker thread: %s", strerror(rc));
+			delete args;
+			break;
+		}
+		pool->numthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+	return pool;
+}
+
+// tell the worker threads to finish once the queue is empty, wait for them, and tidy up
+void stop_workers(WorkerPool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->numthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	for (int i = 1; i < o.child_threads; i++)
+		delete pool->handlers[i];
+	if (pool->donepipe[0] >= 0) {
+		close(pool->donepipe[0]);
+		close(pool->donepipe[1]);
+	}
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->lock);
+	delete[] pool->threads;
+	delete[] pool->handlers;
+	delete pool;
+}
+
+// how much of a request header to look at for its end before passing the
+// connection on regardless (HTTPHeader::in will sort out over-long headers)
+#define REQUEST_HEAD_PEEK 32768
+
+// what the parent sends to clients which connect & don't speak HTTP
+const char *badrequest = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n"
+	"<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD><BODY><H1>400 Bad Request</H1></BODY></HTML>\n";
+
+// does the given data (the start of a request) contain a whole request header?
+bool got_requesthead(const char *buff, int len)
+{
+	// a blank line ends the header (as far as HTTPHeader::in is concerned,
+	// a lone LF is as good as CRLF)
+	for (const char *p = buff; (p = (const char*)memchr(p, '\n', len - (p - buff))) != NULL; ) {
+		++p;
+		if (p < buff + len && *p == '\r')
+			++p;
+		if (p < buff + len && *p == '\n')
+			return true;
+	}
+	return false;
+}
+
+// does the given request header start with a request line - method, URL & HTTP version?
+bool valid_requestline(const char *buff, int len)
+{
+	const char *p = buff;
+	const char *end = buff + len;
+	// clients may send blank lines before a request
+	while (p < end && (*p == '\r' || *p == '\n'))
+		++p;
+	if (p >= end)
+		return false;
+	const char *eol = (const char*) memchr(p, '\n', (size_t) (end - p));
+	if (eol != NULL)
+		end = eol;
+	const char *method = p;
+	while (p < end && isalpha(*p))
+		++p;
+	if (p == method || p >= end || *p != ' ')
+		return false;
+	const char *url = ++p;
+	while (p < end && *p != ' ')
+		++p;
+	return (p > url) && (end - p >= 6) && (strncmp(p, " HTTP/", 6) == 0);
+}
+
+// start or stop watching the server sockets, telling the parent whether we have room for
+// more connections (which is what idle & busy mean to it when children accept connections)
+bool watch_listeners(int waitfd, bool watch)
+{
+	struct epoll_event ev;
+	for (int i = 0; i < serversocketcount; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+		ev.events |= EPOLLEXCLUSIVE;
+#endif
+		ev.data.fd = serversockets[i]->getFD();
+		if (epoll_ctl(waitfd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ev.data.fd, &ev) < 0) {
+			syslog(LOG_ERR, "Error updating epoll set: %s", ErrStr().c_str());
+			return false;
+		}
+	}
+	// fails if the parent has told us to exit
+	return scoreboard.setState(watch ? SB_IDLE : SB_BUSY);
+}
+
+// wait for requests on a set of connections, handling each one as its request header
+// arrives & then putting the connection back into the set to wait for the next.
+// up to o.child_connections connections are held at once.  with o.child_threads > 1,
+// requests are passed to a pool of worker threads rather than handled here, and there
+// is room for at least one connection per thread.  returns once told to exit by the
+// parent, or once cycle requests have been handled & all the connections closed.
+int handle_connections_evented(UDSocket &pipe, ConnectionHandler &h, int &cycle)
+{
+	std::map<int, WaitingPeer*> peers;
+	std::map<int, WaitingPeer*>::iterator j;
+	WaitingPeer *wp;
+	struct epoll_event ev;
+	struct epoll_event *events = new struct epoll_event[64];
+	char *peek = new char[REQUEST_HEAD_PEEK];
+	bool listening = false;
+	bool retiring = false;
+	time_t now, lastexpiry = 0;
+	int stat = 0;
+	int n, len, fd;
+	int capacity = o.child_connections;
+	WorkerPool *pool = NULL;
+	std::deque<WaitingPeer*> done;
+
+	if (o.child_threads > 1) {
+		if (capacity < o.child_threads)
+			capacity = o.child_threads;
+		// this process's own list of recently used clean URLs isn't thread safe
+		urlcache.disableLocal();
+		pool = start_workers(h);
+	}
+
+	int waitfd = epoll_create(capacity + serversocketcount + 2);
+	if (waitfd < 0) {
+		syslog(LOG_ERR, "Error creating epoll set: %s", ErrStr().c_str());
+		retiring = true;
+	} else {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = pipe.getFD();
+		if (epoll_ctl(waitfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+			syslog(LOG_ERR, "Error adding parent socket to epoll set: %s", ErrStr().c_str());
+			retiring = true;
+		}
+		if (pool != NULL) {
+			ev.data.fd = pool->donepipe[0];
+			if (pool->numthreads < 1 || epoll_ctl(waitfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+				syslog(LOG_ERR, "Error starting worker threads: %s", ErrStr().c_str());
+				retiring = true;
+			}
+		}
+	}
+
+	while (!retiring || !peers.empty()) {
+		if (!retiring)
+			check_recycle();
+		if (!retiring && (reloadconfig || cycle < 1)) {
+			// time to go - no new connections, and don't keep idle ones hanging around
+			retiring = true;
+			for (j = peers.begin(); j != peers.end(); ) {
+				wp = (j++)->second;
+				if (wp->busy || wp->fresh)
+					continue;
+				fd = wp->fd;
+				len = recv(fd, peek, 1, MSG_PEEK | MSG_DONTWAIT);
+				if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					delete wp->sock;
+					delete wp;
+					peers.erase(fd);
+				}
+			}
+		}
+		// only watch the server sockets whilst we have room for more connections
+		bool wantlisten = !retiring && ((int)peers.size() < capacity);
+		if (wantlisten != listening) {
+			listening = wantlisten;
+			if (!watch_listeners(waitfd, wantlisten)) {
+				retiring = true;
+				continue;
+			}
+		}
+		scoreboard.setConnections(peers.size());
+
+		// wake up at least once a second to time out connections which have gone quiet
+		n = epoll_wait(waitfd, events, 64, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;  // signal - reloadconfig checked above
+			syslog(LOG_ERR, "Error waiting on epoll set: %s", ErrStr().c_str());
+			retiring = true;
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == pipe.getFD()) {
+				// parent has gone away
+				reloadconfig = true;
+				continue;
+			}
+			if (pool != NULL && fd == pool->donepipe[0]) {
+				// worker threads have finished with some connections - keep them or close them
+				char drain[64];
+				while (read(fd, drain, sizeof(drain)) > 0);
+				pthread_mutex_lock(&pool->lock);
+				done.swap(pool->done);
+				pthread_mutex_unlock(&pool->lock);
+				while (!done.empty()) {
+					wp = done.front();
+					done.pop_front();
+					wp->busy = false;
+					fd = wp->fd;
+					if (wp->keep && !retiring) {
+						wp->deadline = time(NULL) + 120;
+						memset(&ev, 0, sizeof(ev));
+						ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+						ev.data.fd = fd;
+						if (epoll_ctl(waitfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+							continue;
+					}
+					delete wp->sock;
+					delete wp;
+					peers.erase(fd);
+				}
+				continue;
+			}
+			j = peers.find(fd);
+			if (j == peers.end()) {
+				// it's a server socket - take as many connections as we have room for
+				if (!listening)
+					continue;
+				for (int k = 0; k < serversocketcount; k++) {
+					if (serversockets[k]->getFD() != fd)
+						continue;
+					while ((int)peers.size() < capacity) {
+						Socket *sock = serversockets[k]->accept();
+						if (sock == NULL) {
+							if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED && o.logconerror)
+								syslog(LOG_ERR, "Error accepting: %s", ErrStr().c_str());
+							break;
+						}
+						wp = new WaitingPeer;
+						wp->sock = sock;
+						wp->fd = sock->getFD();
+						wp->ip = sock->getPeerIP();
+						wp->deadline = time(NULL) + 120;
+						wp->busy = false;
+						wp->keep = false;
+						wp->fresh = true;
+						memset(&ev, 0, sizeof(ev));
+						// edge-triggered, as we only peek at the data until the header is complete
+						ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+						ev.data.fd = sock->getFD();
+						if (wp->ip.length() < 7 || epoll_ctl(waitfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+							if (o.logconerror)
+								syslog(LOG_INFO, "Error accepting. (Ignorable)");
+							delete sock;
+							delete wp;
+							continue;
+						}
+						peers[ev.data.fd] = wp;
+					}
+					break;
+				}
+				continue;
+			}
+
+			// a client connection - is its request header all there yet?
+			wp = j->second;
+			len = recv(fd, peek, REQUEST_HEAD_PEEK, MSG_PEEK | MSG_DONTWAIT);
+			if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				continue;
+			if (len > 0 && len < REQUEST_HEAD_PEEK && !got_requesthead(peek, len)) {
+				if (!(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+					continue;
+				// client has stopped sending part way through a header
+				len = 0;
+			}
+			epoll_ctl(waitfd, EPOLL_CTL_DEL, fd, &ev);
+			wp->fresh = false;
+			if (len > 0 && pool != NULL) {
+				// over to the worker threads - it comes back via donepipe
+				--cycle;
+				wp->busy = true;
+				pthread_mutex_lock(&pool->lock);
+				pool->todo.push_back(wp);
+				pthread_cond_signal(&pool->wakeup);
+				pthread_mutex_unlock(&pool->lock);
+				continue;
+			}
+			if (len > 0) {
+				--cycle;
+				if (h.handlePeer(*(wp->sock), wp->ip, &(wp->state)) && !retiring) {
+					wp->deadline = time(NULL) + 120;
+					memset(&ev, 0, sizeof(ev));
+					ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+					ev.data.fd = fd;
+					if (epoll_ctl(waitfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+						continue;
+				}
+			}
+			delete wp->sock;
+			delete wp;
+			peers.erase(fd);
+		}
+
+		// time out connections which haven't sent a whole request in time
+		time(&now);
+		if (now != lastexpiry) {
+			lastexpiry = now;
+			for (j = peers.begin(); j != peers.end(); ) {
+				wp = (j++)->second;
+				if (!wp->busy && wp->deadline <= now) {
+#ifdef DGDEBUG
+					std::cout << "timing out connection from " << wp->ip << std::endl;
+#endif
+					fd = wp->fd;
+					epoll_ctl(waitfd, EPOLL_CTL_DEL, fd, &ev);
+					delete wp->sock;
+					delete wp;
+					peers.erase(fd);
+				}
+			}
+		}
+	}
+
+	if (pool != NULL)
+		stop_workers(pool);
+	if (waitfd >= 0)
+		close(waitfd);
+	delete[] events;
+	delete[] peek;
+	return stat;
+}
+#endif
+
 // the parent process recieves connections - children receive notifications of this over their socketpair, and accept() them for handling
-bool getsock_fromparent(UDSocket &fd)
+Socket *getsock_fromparent(UDSocket &fd, PeerState &state)
 {
-	String message;
-	char buf;
+	ParkedPeer msg;
+	int peerfd;
 	int rc;
 	try {
-		rc = fd.readFromSocket(&buf, 1, 0, 360, true, true);  // blocks for a few mins
+		fd.checkForInput(360, true);  // blocks for a few mins
+		rc = fd.receiveFD(peerfd, &msg, sizeof(msg));
 	}
 	catch(std::exception & e) {
 		// whoop! we received a SIGHUP. we should reload our configuration - and no, we didn't get an FD.
 
 		reloadconfig = true;
-		return false;
+		return NULL;
 	}
 	// that way if child does nothing for a long time it will eventually
 	// exit reducing the forkpool depending on o.maxage_children which is
@@ -545,13 +1352,33 @@ bool getsock_fromparent(UDSocket &fd)
 
 	// check the message from the parent
 	if (rc < 1) {
-		return false;
+		return NULL;
+	}
+
+	Socket *peersock = NULL;
+	if (peerfd >= 0) {
+		// a parked connection whose next request has arrived - carry on where its last child left off
+		struct sockaddr_in myip, peerip;
+		socklen_t mylen = sizeof(myip), peerlen = sizeof(peerip);
+		if (rc == sizeof(msg) && getsockname(peerfd, (struct sockaddr*) &myip, &mylen) == 0
+			&& getpeername(peerfd, (struct sockaddr*) &peerip, &peerlen) == 0)
+		{
+			peersock = new Socket(peerfd, myip, peerip);
+			peersock->setPort(msg.port);
+			msg.clientuser[SB_USERLEN - 1] = msg.oldclientuser[SB_USERLEN - 1] = '\0';
+			state.persistent_authed = msg.persistent_authed;
+			state.clientuser = msg.clientuser;
+			state.filtergroup = msg.filtergroup;
+			state.oldclientuser = msg.oldclientuser;
+			state.oldfg = msg.oldfg;
+		} else
+			close(peerfd);
+	}
+	else if (msg.which >= 0 && msg.which < serversocketcount) {
+		// woo! we have a connection. accept it.
+		peersock = serversockets[msg.which]->accept();
 	}
 
-	// woo! we have a connection. accept it.
-	peersock = serversockets[buf]->accept();
-	peersockip = peersock->getPeerIP();
-
 	try {
 		fd.writeToSockete("K", 1, 0, 10, true);  // need to make parent wait for OK
 		// so effectively providing a lock
@@ -559,11 +1386,148 @@ bool getsock_fromparent(UDSocket &fd)
 	catch(std::exception & e) {
 		if (o.logconerror)
 			syslog(LOG_ERR, "Error telling parent we accepted: %s", e.what());
-		peersock->close();
-		return false;
+		delete peersock;
+		return NULL;
 	}
 
-	return true;
+	return peersock;
+}
+
+// hand an idle persistent connection to the parent, to wait for its next request
+bool park_connection(Socket &peersock, PeerState &state)
+{
+	if (state.clientuser.length() >= SB_USERLEN || state.oldclientuser.length() >= SB_USERLEN)
+		return false;  // too long to pass along
+	ParkedPeer msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.which = -1;
+	msg.persistent_authed = state.persistent_authed;
+	msg.port = peersock.getPort();
+	msg.filtergroup = state.filtergroup;
+	msg.oldfg = state.oldfg;
+	strcpy(msg.clientuser, state.clientuser.c_str());
+	strcpy(msg.oldclientuser, state.oldclientuser.c_str());
+	strncpy(msg.ip, peersock.getPeerIP().c_str(), SB_IPLEN - 1);
+#ifdef DGDEBUG
+	std::cout << "parking persistent connection with parent" << std::endl;
+#endif
+	return parkout->sendFD(peersock.getFD(), &msg, sizeof(msg));
+}
+
+// in childaccept mode, children wait on the server sockets themselves, along with
+// their socketpair so they notice if the parent goes away.  the server sockets are
+// non-blocking, so children which lose the race to accept() a connection simply
+// go back to waiting.
+#ifdef HAVE_SYS_EPOLL_H
+int acceptwaitfd = -1;
+#endif
+
+Socket *getsock_fromlisteners(UDSocket &fd)
+{
+	Socket *peersock;
+	int rc, ready;
+	while (true) {
+		ready = -1;
+#ifdef HAVE_SYS_EPOLL_H
+		struct epoll_event ev;
+		if (acceptwaitfd < 0) {
+			acceptwaitfd = epoll_create(serversocketcount + 1);
+			if (acceptwaitfd < 0) {
+				syslog(LOG_ERR, "Error creating epoll set for server sockets: %s", ErrStr().c_str());
+				reloadconfig = true;
+				return NULL;
+			}
+			for (int i = 0; i <= serversocketcount; i++) {
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN;
+				ev.data.u32 = i;
+				if (i < serversocketcount) {
+#ifdef EPOLLEXCLUSIVE
+					// only wake one of the idle children per connection
+					ev.events |= EPOLLEXCLUSIVE;
+#endif
+					rc = epoll_ctl(acceptwaitfd, EPOLL_CTL_ADD, serversockets[i]->getFD(), &ev);
+				} else
+					rc = epoll_ctl(acceptwaitfd, EPOLL_CTL_ADD, fd.getFD(), &ev);
+				if (rc < 0) {
+					syslog(LOG_ERR, "Error adding socket to epoll set: %s", ErrStr().c_str());
+					reloadconfig = true;
+					return NULL;
+				}
+			}
+		}
+		// blocks for a few mins, as in getsock_fromparent
+		rc = epoll_wait(acceptwaitfd, &ev, 1, 360 * 1000);
+		if (rc > 0)
+			ready = ev.data.u32;
+#else
+		struct pollfd *waitfds = new struct pollfd[serversocketcount + 1];
+		for (int i = 0; i < serversocketcount; i++) {
+			waitfds[i].fd = serversockets[i]->getFD();
+			waitfds[i].events = POLLIN;
+			waitfds[i].revents = 0;
+		}
+		waitfds[serversocketcount].fd = fd.getFD();
+		waitfds[serversocketcount].events = POLLIN;
+		waitfds[serversocketcount].revents = 0;
+		rc = poll(waitfds, serversocketcount + 1, 360 * 1000);
+		for (int i = 0; rc > 0 && i <= serversocketcount; i++) {
+			if (waitfds[i].revents) {
+				ready = i;
+				break;
+			}
+		}
+		delete[] waitfds;
+#endif
+		if (rc < 0) {
+			if (errno == EINTR && !reloadconfig)
+				continue;
+			// whoop! we received a SIGHUP (or worse) - no FD for us.
+			reloadconfig = true;
+			return NULL;
+		}
+		if (rc == 0 || ready < 0) {
+			return NULL;  // timed out
+		}
+		if (ready == serversocketcount) {
+			// parent has either gone away or is trying to tell us something we don't understand
+#ifdef DGDEBUG
+			std::cout << "parent socketpair ready in childaccept mode - exiting" << std::endl;
+#endif
+			reloadconfig = true;
+			return NULL;
+		}
+
+		peersock = serversockets[ready]->accept();
+		if (peersock == NULL) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+				continue;  // another child got there first, or client gave up
+			if (o.logconerror)
+				syslog(LOG_ERR, "Error accepting: %s", ErrStr().c_str());
+			return NULL;
+		}
+		break;
+	}
+
+	// as far as the parent is concerned, this is purely so it knows when to spawn
+	// more children.  if it has just told us to exit, deal with this connection first.
+	if (!scoreboard.setState(SB_BUSY))
+		reloadconfig = true;
+
+	return peersock;
+}
+
+// the parent starts our replacement, and tells us to exit once it's ready -
+// until then, carry on as normal
+void check_recycle()
+{
+	if (!o.child_recycling)
+		return;
+	const char *why = scoreboard.outgrown(o.max_child_memory * 1024UL, o.max_child_heap * 1024UL, o.max_child_lifetime);
+	if (why == NULL || !scoreboard.retire())
+		return;
+	if (o.logchildprocs)
+		syslog(LOG_ERR, "Child has gone over its %s limit - asking to be replaced", why);
 }
 
 
@@ -594,56 +1558,300 @@ void mopup_afterkids()
 	}
 }
 
-// get a free slot in out PID list, if there is one - return -1 if not
-int getchildslot()
+// kill give number of non-busy children
+void cullchildren(int num)
 {
+#ifdef DGDEBUG
+	std::cout << "culling childs:" << num << std::endl;
+#endif
 	int i;
-	for (i = 0; i < o.max_children; i++) {
-		if (childrenpids[i] == -1) {
-			return i;
+	int count = 0;
+	// children which want replacing anyway go first
+	for (int pass = o.child_recycling ? 0 : 1; pass < 2; pass++) {
+		for (i = o.max_children - 1; i >= 0 && count < num; i--) {
+			if (pass == 0 && scoreboard.retiringAt(i) == SB_KEEP)
+				continue;
+			if (cullchild(i))
+				count++;
 		}
 	}
-	return -1;
 }
 
-// add the given child, including FD & PID, to the given slot in our lists
-void addchild(int pos, int fd, pid_t child_pid)
+bool cullchild(int slot)
 {
-	if (pos < 0)
+	// children which accept connections themselves may have just done so, in
+	// which case they'll have marked themselves busy and this will fail
+	if (!scoreboard.cullChild(slot))
+		return false;
+	// if they're about to, they'll find out they're dying when they try,
+	// so let them finish it
+	kill(scoreboard.pidAt(slot), o.child_accept ? SIGHUP : SIGTERM);
+	numchildren--;
+	if (childsockets != NULL && childsockets[slot] != NULL) {
+		delete childsockets[slot];
+		childsockets[slot] = NULL;
+	}
+	return true;
+}
+
+// children which have grown too big or old carry on until a replacement is ready, so
+// that there are never fewer to hand.  if there's no room for a replacement, they go
+// as soon as they're free, and are replaced as any other child would be.
+void recycle_children()
+{
+	time_t now = time(NULL);
+	for (int i = 0; i < o.max_children; i++) {
+		int retiring = scoreboard.retiringAt(i);
+		int state = scoreboard.stateAt(i);
+		if (state == SB_EMPTY || state == SB_DYING)
+			continue;
+		// children which are idle won't notice they've got too old until they next get
+		// a connection - but we know when they were started
+		if (retiring == SB_KEEP && state == SB_IDLE && o.max_child_lifetime > 0
+			&& now - scoreboard.startedAt(i) > o.max_child_lifetime)
+		{
+			retiring = SB_RETIRE;
+			scoreboard.setRetiring(i, retiring);
+		}
+		if (retiring == SB_KEEP)
+			continue;
+		if (retiring == SB_RETIRE && numchildren < o.max_children) {
+			int before = numchildren;
+			if (prefork(1) < 0) {
+				syslog(LOG_ERR, "Error forking a replacement child process.");
+				failurecount++;
+			}
+			if (numchildren > before)
+				scoreboard.setRetiring(i, SB_REPLACED);
+			continue;
+		}
+		if (retiring == SB_REPLACED && scoreboard.startingChildren() > 0)
+			continue;  // replacement not ready yet
+		pid_t pid = scoreboard.pidAt(i);
+		if (cullchild(i) && o.logchildprocs)
+			syslog(LOG_ERR, "Replaced child process %d", (int) pid);
+	}
+}
+
+// start more children when connections are waiting & none are free, unless
+// some are already on their way
+void prefork_underload(int waitingfor)
+{
+	if (waitingfor > 0 || numchildren >= o.max_children)
 		return;
+	int num = o.prefork_children;
+	if ((o.max_children - numchildren) < num)
+		num = o.max_children - numchildren;
+	if (o.logchildprocs)
+		syslog(LOG_ERR, "Under load - Spawning %d process(es)", num);
+	if (prefork(num) < 0) {
+		syslog(LOG_ERR, "Error forking %d extra process(es).", num);
+		failurecount++;
+	}
+}
 
-	childrenpids[pos] = (int) child_pid;
-	childrenstates[pos] = 4;  // busy waiting for init
-	numchildren++;
-	busychildren++;
-	waitingfor++;
-	pids[pos].fd = fd;
-	UDSocket* sock = new UDSocket(fd);
-	childsockets[pos] = sock;
+// number of runnable processes per 100 CPUs - right now where the kernel will
+// tell us, otherwise averaged over the last minute
+int runqueue_length()
+{
+	static long cpus = 0;
+	if (cpus < 1) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus < 1)
+			cpus = 1;
+	}
+#ifdef __linux__
+	std::ifstream loadavg("/proc/loadavg");
+	std::string avg1, avg5, avg15;
+	long running = 0;
+	if (loadavg >> avg1 >> avg5 >> avg15 >> running)
+		return (running - 1) * 100 / cpus;  // not counting ourselves
+#endif
+	double avg;
+	if (getloadavg(&avg, 1) == 1)
+		return (int) (avg * 100 / cpus);
+	return 0;
 }
 
-// kill give number of non-busy children
-void cullchildren(int num)
+// once a second, sample how busy the children & the machine are.  every loadsheddelay
+// seconds, go up a tier if the load is over any of the loadshed thresholds - busy
+// children, runnable processes or the time 99% of requests are finished in - or down
+// a tier if it's well under all of them.  children look at the tier as they start
+// each request.
+void shed_load()
 {
-#ifdef DGDEBUG
-	std::cout << "culling childs:" << num << std::endl;
+	LoadSignals &l = loadsignals;
+	time_t now = time(NULL);
+	if (now == l.last)
+		return;
+	l.last = now;
+	if (l.decided == 0 || now < l.decided) {
+		// first time round, or the clock went backwards
+		memset(&l, 0, sizeof(l));
+		l.last = l.decided = now;
+		l.tier = scoreboard.loadTier();
+		scoreboard.serviceHistogram(l.hist);
+		return;
+	}
+	int busy = numchildren - scoreboard.idleChildren() - scoreboard.startingChildren();
+	l.busy += (busy > 0 ? busy : 0) * 100 / o.max_children;
+	l.runqueue += runqueue_length();
+	l.samples++;
+	if (now - l.decided < o.load_shed_delay)
+		return;
+
+	// 99th percentile of the time taken over the requests since last time
+	unsigned long hist[SB_HISTBUCKETS];
+	unsigned long total = 0, seen = 0;
+	scoreboard.serviceHistogram(hist);
+	for (int i = 0; i < SB_HISTBUCKETS; i++) {
+		unsigned long n = hist[i];
+		hist[i] -= l.hist[i];
+		l.hist[i] = n;
+		total += hist[i];
+	}
+	long p99 = 0;
+	for (int i = 0; i < SB_HISTBUCKETS && total > 0; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * 99) {
+			p99 = 1L << i;
+			break;
+		}
+	}
+	long avgbusy = l.busy / l.samples;
+	long avgrunqueue = l.runqueue / l.samples;
+	l.busy = l.runqueue = l.samples = 0;
+	l.decided = now;
+
+	int tier = l.tier;
+	if (avgbusy >= o.load_shed_busy || avgrunqueue >= o.load_shed_runqueue || p99 >= o.load_shed_response) {
+		if (tier < o.load_shed_max_tier)
+			tier++;
+	}
+	else if (avgbusy * 5 < o.load_shed_busy * 4 && avgrunqueue * 5 < o.load_shed_runqueue * 4
+		&& p99 * 5 < o.load_shed_response * 4 && tier > 0)
+	{
+		tier--;
+	}
+	if (tier == l.tier)
+		return;
+	syslog(LOG_INFO, "Load shedding: tier %d -> %d (%ld%% of children busy, %ld runnable processes per 100 CPUs, 99%% of requests in under %ldms)",
+		l.tier, tier, avgbusy, avgrunqueue, p99);
+	l.tier = tier;
+	scoreboard.setLoadTier(tier);
+}
+
+// number of connections the kernel has waiting to be accepted on the given
+// server sockets, where it will tell us
+int acceptqueue_length(int *serversockfds)
+{
+	int queued = 0;
+#if defined(__linux__) && defined(TCP_INFO)
+	// for listening sockets, linux reports the accept queue length as unacked
+	struct tcp_info info;
+	for (int i = 0; i < serversocketcount; i++) {
+		socklen_t len = sizeof(info);
+		if (getsockopt(serversockfds[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+			queued += info.tcpi_unacked;
+	}
 #endif
-	int i;
-	int count = 0;
-	for (i = o.max_children - 1; i >= 0; i--) {
-		if (childrenstates[i] == 0) {
-			kill(childrenpids[i], SIGTERM);
-			count++;
-			childrenstates[i] = -2;  // dieing
-			numchildren--;
-			delete childsockets[i];
-			childsockets[i] = NULL;
-			pids[i].fd = -1;
-			if (count >= num) {
-				break;
-			}
+	return queued;
+}
+
+// grow or shrink the pool according to the load - run at most once a second.
+// the load is sized up from the rate at which requests are being finished and
+// how long each takes (by Little's law, the number being worked on at once),
+// or the number of children busy, whichever is more; if it is rising, it is
+// assumed to carry on rising at the same rate whilst new children start up.
+// connections left waiting, either in the kernel or for a free child, call for
+// more children whatever the averages say.
+void adapt_pool(int *serversockfds, int freechildren, int waitingfor)
+{
+	PoolSignals &p = poolsignals;
+	time_t now = time(NULL);
+	unsigned long served, servicemsecs;
+	scoreboard.serviceStats(served, servicemsecs);
+	if (p.last == 0 || now < p.last) {
+		// first time round, or the clock went backwards
+		p.last = now;
+		p.served = served;
+		p.servicemsecs = servicemsecs;
+		return;
+	}
+	if (now == p.last)
+		return;
+	int elapsed = now - p.last;
+	p.last = now;
+
+	unsigned long done = served - p.served;
+	double rate = (double) done / elapsed;
+	double service = (done > 0) ? (double) (servicemsecs - p.servicemsecs) / done : p.service;
+	p.served = served;
+	p.servicemsecs = servicemsecs;
+	int busy = numchildren - freechildren - waitingfor;
+	if (busy < 0)
+		busy = 0;
+	int queued = acceptqueue_length(serversockfds);
+	double dispatchwait = (p.dispatches > 0) ? (double) p.dispatchmsecs / p.dispatches : 0;
+	p.dispatches = 0;
+	p.dispatchmsecs = 0;
+
+	// smooth out the noise, but not so much that we can't keep up with a rush
+	p.rate = 0.7 * p.rate + 0.3 * rate;
+	p.service = 0.7 * p.service + 0.3 * service;
+	p.busy = 0.7 * p.busy + 0.3 * busy;
+
+	// threaded children can work on several requests at once
+	double demand = p.rate * p.service / 1000.0 / (o.child_accept ? o.child_threads : 1);
+	if (p.busy > demand)
+		demand = p.busy;
+	double predicted = demand;
+	if (demand > p.demand)
+		predicted += demand - p.demand;
+	p.demand = demand;
+
+	int target = (int) (predicted * o.adaptive_headroom / 100.0 + 0.999) + queued;
+	if (target < busy + o.minspare_children)
+		target = busy + o.minspare_children;
+	if ((queued > 0 || dispatchwait >= 1 || p.starved) && target <= numchildren)
+		target = numchildren + (queued > 0 ? queued : 1);
+	if (target < o.min_children)
+		target = o.min_children;
+	if (target > o.max_children)
+		target = o.max_children;
+
+	if (target > numchildren) {
+		p.oversized = 0;
+		if (waitingfor > 0)
+			return;  // wait for the last lot to start before deciding on more
+		// at most double the pool each time round, so a blip doesn't fill it
+		int num = target - numchildren;
+		if (num > numchildren && num > o.prefork_children)
+			num = (numchildren > o.prefork_children) ? numchildren : o.prefork_children;
+		if (o.logchildprocs)
+			syslog(LOG_ERR, "Pool controller: spawning %d process(es) for %d (%.1f requests/s, %.0fms each, %.1f busy, %d queued, %.1fms dispatch wait)",
+				num, target, p.rate, p.service, p.busy, queued, dispatchwait);
+		if (prefork(num) < 0) {
+			syslog(LOG_ERR, "Error forking %d extra process(es).", num);
+			failurecount++;
 		}
 	}
+	else if (target < numchildren && freechildren > 0) {
+		p.oversized += elapsed;
+		if (p.oversized < o.adaptive_shrink_delay)
+			return;
+		p.oversized = 0;
+		// come down in steps, halving the difference each time
+		int num = (numchildren - target + 1) / 2;
+		if (num > freechildren)
+			num = freechildren;
+		if (o.logchildprocs)
+			syslog(LOG_ERR, "Pool controller: killing %d process(es) for %d (%.1f requests/s, %.0fms each, %.1f busy, %d queued, %.1fms dispatch wait)",
+				num, target, p.rate, p.service, p.busy, queued, dispatchwait);
+		cullchildren(num);
+	}
+	else
+		p.oversized = 0;
 }
 
 // send SIGTERM to all child processes
@@ -653,13 +1861,17 @@ void kill_allchildren()
 	std::cout << "killing all childs:" << std::endl;
 #endif
 	for (int i = o.max_children - 1; i >= 0; i--) {
-		if (childrenstates[i] >= 0) {
-			kill(childrenpids[i], SIGTERM);
-			childrenstates[i] = -2;  // dieing
+		int state = scoreboard.stateAt(i);
+		if (state == SB_EMPTY || scoreboard.pidAt(i) < 1)
+			continue;
+		kill(scoreboard.pidAt(i), SIGTERM);
+		if (state != SB_DYING) {
+			scoreboard.killChild(i);
 			numchildren--;
+		}
+		if (childsockets != NULL && childsockets[i] != NULL) {
 			delete childsockets[i];
 			childsockets[i] = NULL;
-			pids[i].fd = -1;
 		}
 	}
 }
@@ -671,106 +1883,42 @@ void hup_allchildren()
 	std::cout << "huping all childs:" << std::endl;
 #endif
 	for (int i = o.max_children - 1; i >= 0; i--) {
-		if (childrenstates[i] >= 0) {
-			kill(childrenpids[i], SIGHUP);
+		if (scoreboard.stateAt(i) != SB_EMPTY && scoreboard.pidAt(i) > 0) {
+			kill(scoreboard.pidAt(i), SIGHUP);
 		}
 	}
 }
 
-// attempt to receive the message from the child's send_readystatus call
-bool check_kid_readystatus(int tofind)
-{
-	bool found = false;
-	char *buf = new char[5];
-	int rc = -1;  // for compiler warnings
-	for (int f = 0; f < o.max_children; f++) {
-
-		if (tofind < 1) {
-			break;  // no point looping through all if all found
-		}
-		if (pids[f].fd == -1) {
-			continue;
-		}
-		if ((pids[f].revents & POLLIN) > 0) {
-			if (childrenstates[f] < 0) {
-				tofind--;
-				continue;
-			}
-			try {
-				rc = childsockets[f]->getLine(buf, 4, 100, true);
-			}
-			catch(std::exception & e) {
-				kill(childrenpids[f], SIGTERM);
-				deletechild(childrenpids[f]);
-				tofind--;
-				continue;
-			}
-			if (rc > 0) {
-				if (buf[0] == '2') {
-					if (childrenstates[f] == 4) {
-						waitingfor--;
-					}
-					childrenstates[f] = 0;
-					busychildren--;
-					tofind--;
-				}
-			} else {	// child -> parent communications failure so kill it
-				kill(childrenpids[f], SIGTERM);
-				deletechild(childrenpids[f]);
-				tofind--;
-			}
-		}
-		if (childrenstates[f] == 0) {
-			found = true;
-		} else {
-			found = false;
-		}
-	}
-	// if unbusy found then true otherwise false
-	delete[]buf;
-	return found;
-}
-
-// remove child from our PID/FD and slot lists
+// remove child from the scoreboard, closing its socket
 void deletechild(int child_pid)
 {
-	int i;
-	for (i = 0; i < o.max_children; i++) {
-		if (childrenpids[i] == child_pid) {
-			childrenpids[i] = -1;
-			// Delete a busy child
-			if (childrenstates[i] == 1)
-				busychildren--;
-			// Delete a child which isn't "ready" yet
-			if (childrenstates[i] == 4)
-			{
-				busychildren--;
-				waitingfor--;
-			}
-			// Common code for any non-"culled" child
-			if (childrenstates[i] != -2) {
-				numchildren--;
-				delete childsockets[i];
-				childsockets[i] = NULL;
-				pids[i].fd = -1;
-			}
-			childrenstates[i] = -1;  // unused
-			break;
-		}
-	}
+	int i = scoreboard.findChild(child_pid);
 	// never should happen that passed pid is not known,
 	// unless its the logger or url cache process, in which case we
 	// don't want to do anything anyway. and this can only happen
 	// when shutting down or restarting.
+	if (i < 0)
+		return;
+	// Common code for any non-"culled" child
+	if (scoreboard.stateAt(i) != SB_DYING)
+		numchildren--;
+	if (childsockets != NULL && childsockets[i] != NULL) {
+		delete childsockets[i];
+		childsockets[i] = NULL;
+	}
+	// it didn't get to say which clients' requests it had finished
+	if (scoreboard.clientsHeld(i))
+		scoreboard.clientReset();
+	scoreboard.deleteChild(i);
 }
 
-// get the index of the first non-busy child
+// get the index of the first non-busy child, marking it busy
 int getfreechild()
 {				// check that there is 1 free done
 	// before calling
 	int i;
 	for (i = 0; i < o.max_children; i++) {
-		if (childrenstates[i] == 0) {	// not busy (free)
+		if (scoreboard.giveConnection(i)) {	// was not busy (free)
 			return i;
 		}
 	}
@@ -787,24 +1935,45 @@ void tellchild_accept(int num, int whichsock)
 	try {
 		childsockets[num]->writeToSockete(sstr.c_str(), 1, 0, 5, true);
 	} catch(std::exception & e) {
-		kill(childrenpids[num], SIGTERM);
-		deletechild(childrenpids[num]);
+		kill(scoreboard.pidAt(num), SIGTERM);
+		deletechild(scoreboard.pidAt(num));
+		return;
+	}
+
+	// check for response from child
+	char buf;
+	try {
+		childsockets[num]->readFromSocket(&buf, 1, 0, 5, false, true);
+	} catch(std::exception & e) {
+		kill(scoreboard.pidAt(num), SIGTERM);
+		deletechild(scoreboard.pidAt(num));
 		return;
 	}
+	// no need to check what it actually contains,
+	// as the very fact the child sent something back is a good sign 
+}
+
+// hand a parked connection whose next request has arrived to a non-busy child,
+// returning false if it couldn't be sent
+bool tellchild_parked(int num, int peerfd)
+{
+	ParkedPeer &msg = parked[peerfd];
+	msg.which = -1;
+	if (!childsockets[num]->sendFD(peerfd, &msg, sizeof(msg))) {
+		kill(scoreboard.pidAt(num), SIGTERM);
+		deletechild(scoreboard.pidAt(num));
+		return false;
+	}
 
 	// check for response from child
 	char buf;
 	try {
 		childsockets[num]->readFromSocket(&buf, 1, 0, 5, false, true);
 	} catch(std::exception & e) {
-		kill(childrenpids[num], SIGTERM);
-		deletechild(childrenpids[num]);
-		return;
+		kill(scoreboard.pidAt(num), SIGTERM);
+		deletechild(scoreboard.pidAt(num));
 	}
-	// no need to check what it actually contains,
-	// as the very fact the child sent something back is a good sign 
-	busychildren++;
-	childrenstates[num] = 1;  // busy
+	return true;
 }
 
 
@@ -848,7 +2017,7 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 	std::string cr("\n");
    
 	std::string where, what, how, cat, clienthost, from, who, mimetype, useragent, ssize, sweight, params;
-	std::string stype, postdata;
+	std::string stype, postdata, loadtier;
 	int port = 80, isnaughty = 0, isexception = 0, code = 200, naughtytype = 0;
 	int cachehit = 0, wasinfected = 0, wasscanned = 0, filtergroup = 0;
 	long tv_sec = 0, tv_usec = 0;
@@ -869,13 +2038,11 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 
 	ipcsockfd = loggersock.getFD();
 
-	fd_set fdSet;  // our set of fds (only 1) that select monitors for us
-	fd_set fdcpy;  // select modifies the set so we need to use a copy
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(ipcsockfd, &fdSet);  // add ipcsock to the set
+	struct pollfd pfd;  // our fd (only 1) that poll monitors for us
+	pfd.fd = ipcsockfd;
+	pfd.events = POLLIN;
 	while (true) {		// loop, essentially, for ever
-		fdcpy = fdSet;  // take a copy
-		rc = select(ipcsockfd + 1, &fdcpy, NULL, NULL, NULL);  // block
+		rc = poll(&pfd, 1, -1);  // block
 
 		// until something happens
 		if (rc < 0) {	// was an error
@@ -893,7 +2060,7 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 			}
 			continue;
 		}
-		if (FD_ISSET(ipcsockfd, &fdcpy)) {
+		if (pfd.revents & POLLIN) {
 #ifdef DGDEBUG
 			std::cout << "received a log request" << std::endl;
 #endif
@@ -915,7 +2082,7 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 			bool error = false;
 			int itemcount = 0;
 			
-			while(itemcount < 27) {
+			while(itemcount < 28) {
 				try {
 					// Loop around reading in data, because we might have huge URLs
 					std::string logline;
@@ -1025,6 +2192,9 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 						break;
 					case 26:
 						postdata = logline;
+						break;
+					case 27:
+						loadtier = logline;
 					}
 				}
 				catch(std::exception & e) {
@@ -1246,6 +2416,14 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 					+ useragent + " " + params + " " + o.logid_1 + " " + o.logid_2 + " " + postdata;
 			}
 
+			// the squid format has no room for anything extra
+			if (o.load_shed_max_tier > 0 && o.log_file_format != 3) {
+				if (o.log_file_format == 2)
+					builtline += ",\"" + loadtier + "\"";
+				else
+					builtline += ((o.log_file_format == 4) ? "\t" : " ") + loadtier;
+			}
+
 			if (!logsyslog)
 				*logfile << builtline << std::endl;  // append the line
 			else
@@ -1449,136 +2627,6 @@ int log_listener(std::string log_location, bool logconerror, bool logsyslog)
 	return 1;  // It is only possible to reach here with an error
 }
 
-int url_list_listener(bool logconerror)
-{
-#ifdef DGDEBUG
-	std::cout << "url listener started" << std::endl;
-#endif
-	if (!drop_priv_completely()) {
-		return 1;  //error
-	}
-	o.deleteFilterGroupsJustListData();
-	o.lm.garbageCollect();
-	UDSocket* ipcpeersock = NULL;  // the socket which will contain the ipc connection
-	int rc, ipcsockfd;
-	char *logline = new char[32000];
-	char reply;
-	DynamicURLList urllist;
-#ifdef DGDEBUG
-	std::cout << "setting url list size-age:" << o.url_cache_number << "-" << o.url_cache_age << std::endl;
-#endif
-	urllist.setListSize(o.url_cache_number, o.url_cache_age);
-	ipcsockfd = urllistsock.getFD();
-#ifdef DGDEBUG
-	std::cout << "url ipcsockfd:" << ipcsockfd << std::endl;
-#endif
-
-	fd_set fdSet;  // our set of fds (only 1) that select monitors for us
-	fd_set fdcpy;  // select modifes the set so we need to use a copy
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(ipcsockfd, &fdSet);  // add ipcsock to the set
-
-#ifdef DGDEBUG
-	std::cout << "url listener entering select()" << std::endl;
-#endif
-	while (true) {		// loop, essentially, for ever
-
-		fdcpy = fdSet;  // take a copy
-
-		rc = select(ipcsockfd + 1, &fdcpy, NULL, NULL, NULL);  // block
-		// until something happens
-#ifdef DGDEBUG
-		std::cout << "url listener select returned" << std::endl;
-#endif
-		if (rc < 0) {	// was an error
-			if (errno == EINTR) {
-				continue;  // was interupted by a signal so restart
-			}
-			if (logconerror) {
-				syslog(LOG_ERR, "%s", "url ipc rc<0. (Ignorable)");
-			}
-			continue;
-		}
-		if (FD_ISSET(ipcsockfd, &fdcpy)) {
-#ifdef DGDEBUG
-			std::cout << "received an url request" << std::endl;
-#endif
-			ipcpeersock = urllistsock.accept();
-			if (ipcpeersock->getFD() < 0) {
-				delete ipcpeersock;
-				if (logconerror) {
-#ifdef DGDEBUG
-					std::cout << "Error accepting url ipc. (Ignorable)" << std::endl;
-#endif
-					syslog(LOG_ERR, "%s", "Error accepting url ipc. (Ignorable)");
-				}
-				continue;  // if the fd of the new socket < 0 there was error
-				// but we ignore it as its not a problem
-			}
-			try {
-				rc = ipcpeersock->getLine(logline, 32000, 3, true);  // throws on err
-			}
-			catch(std::exception & e) {
-				delete ipcpeersock;  // close the connection
-				if (logconerror) {
-#ifdef DGDEBUG
-					std::cout << "Error reading url ipc. (Ignorable)" << std::endl;
-					std::cerr << e.what() << std::endl;
-#endif
-					syslog(LOG_ERR, "%s", "Error reading url ipc. (Ignorable)");
-					syslog(LOG_ERR, "%s", e.what());
-				}
-				continue;
-			}
-			// check the command type
-			// f: flush the cache
-			// g: add a URL to the cache
-			// everything else: search the cache
-			// n.b. we use command characters with ASCII encoding
-			// > 100, because we can have up to 99 filter groups, and
-			// group no. plus 1 is the first character in the 'everything else'
-			// case.
-			if (logline[0] == 'f') {
-				delete ipcpeersock;  // close the connection
-				urllist.flush();
-#ifdef DGDEBUG
-				std::cout << "url FLUSH request" << std::endl;
-#endif
-				continue;
-			}
-			if (logline[0] == 'g') {
-				delete ipcpeersock;  // close the connection
-				urllist.addEntry(logline + 2, logline[1]-1);
-				continue;
-			}
-			if (urllist.inURLList(logline + 1, logline[0]-1)) {
-				reply = 'Y';
-			} else {
-				reply = 'N';
-			}
-			try {
-				ipcpeersock->writeToSockete(&reply, 1, 0, 6);
-			}
-			catch(std::exception & e) {
-				delete ipcpeersock;  // close the connection
-				if (logconerror) {
-					syslog(LOG_ERR, "%s", "Error writing url ipc. (Ignorable)");
-					syslog(LOG_ERR, "%s", e.what());
-				}
-				continue;
-			}
-			delete ipcpeersock;  // close the connection
-#ifdef DGDEBUG
-			std::cout << "url list reply: " << reply << std::endl;
-#endif
-			continue;  // go back to listening
-		}
-	}
-	delete[]logline;
-	urllistsock.close();  // be nice and neat
-	return 1;  // It is only possible to reach here with an error
-}
-
 int ip_list_listener(std::string stat_location, bool logconerror) {
 #ifdef DGDEBUG
 	std::cout << "ip listener started" << std::endl;
@@ -1601,10 +2649,7 @@ int ip_list_listener(std::string stat_location, bool logconerror) {
 	char reply;
 	struct in_addr inaddr;
 
-	struct timeval sleep;  // used later on for a short sleep
-	sleep.tv_sec = 180;
-	sleep.tv_usec = 0;
-	struct timeval scopy;  // copy to use as select() can modify
+	int sleep = 180;  // how long to wait between purges of old entries
 
 	int maxusage = 0;  // usage statistics:
 		// current & highest no. of concurrent IPs using the filter
@@ -1612,23 +2657,21 @@ int ip_list_listener(std::string stat_location, bool logconerror) {
 	double elapsed = 0;  // keep a 3 minute counter so license statistics
 	time_t before;   // are written even on busy networks (don't rely on timeout)
 
-	fd_set fdSet;  // our set of fds (only 1) that select monitors for us
-	fd_set fdcpy;  // select modifes the set so we need to use a copy
-	FD_ZERO(&fdSet);  // clear the set
-	FD_SET(ipcsockfd, &fdSet);  // add ipcsock to the set
+	struct pollfd pfd;  // our fd (only 1) that poll monitors for us
+	pfd.fd = ipcsockfd;
+	pfd.events = POLLIN;
 
 #ifdef DGDEBUG
-	std::cout << "ip listener entering select()" << std::endl;
+	std::cout << "ip listener entering poll()" << std::endl;
 #endif
-	scopy = sleep;
 	// loop, essentially, for ever
 	while (true) {
-		fdcpy = fdSet;  // take a copy
 		before = time(NULL);
-		rc = select(ipcsockfd + 1, &fdcpy, NULL, NULL, &scopy);  // block until something happens
+		// block until something happens, or it's time for the next purge
+		rc = poll(&pfd, 1, (elapsed < sleep) ? (int)((sleep - elapsed) * 1000) : 0);
 		elapsed += difftime(time(NULL), before);
 #ifdef DGDEBUG
-		std::cout << "ip listener select returned: " << rc << ", 3 min timer: " << elapsed << ", scopy: " << scopy.tv_sec << " " << scopy.tv_usec << std::endl;
+		std::cout << "ip listener poll returned: " << rc << ", 3 min timer: " << elapsed << std::endl;
 #endif
 		if (rc < 0) {  // was an error
 			if (errno == EINTR) {
@@ -1662,13 +2705,12 @@ int ip_list_listener(std::string stat_location, bool logconerror) {
 			}
 			close(statfd);
 			// reset sleep timer
-			scopy = sleep;
 			elapsed = 0;
 			// only skip back to top of loop if there was a genuine timeout
 			if (rc == 0)
 				continue;
 		}
-		if (FD_ISSET(ipcsockfd, &fdcpy)) {
+		if (pfd.revents & POLLIN) {
 #ifdef DGDEBUG
 			std::cout << "received an ip request" << std::endl;
 #endif
@@ -1740,16 +2782,72 @@ int ip_list_listener(std::string stat_location, bool logconerror) {
 
 // Does lots and lots of things - forks off url cache & logger processes, preforks child processes for connection handling, does tidying up on exit
 // also handles the various signalling options DG supports (reload config, flush cache, kill all processes etc.)
+// the logger & IP list processes take their options from the parent which forked them,
+// so on a full reload a new generation replaces them once it has taken over - unlinking
+// their sockets & binding new ones, so that any children still finishing off in the
+// previous generation carry on logging to the new processes.
+void restart_helpers()
+{
+	pid_t oldloggerpid = loggerpid;
+	pid_t oldiplistpid = iplistpid;
+	loggerpid = 0;
+	iplistpid = 0;
+
+	if (!o.no_logger) {
+		unlink(o.ipc_filename.c_str());
+		loggersock.reset();
+		if (loggersock.getFD() < 0 || loggersock.bind(o.ipc_filename.c_str()) || loggersock.listen(256)) {
+			syslog(LOG_ERR, "Error binding ipc server file %s - not logging: %s", o.ipc_filename.c_str(), ErrStr().c_str());
+		}
+		else if ((loggerpid = fork()) == 0) {
+			tidyup_forhelper();
+			log_listener(o.log_location, o.logconerror, o.log_syslog);
+			_exit(0);
+		}
+		else if (loggerpid < 0) {
+			syslog(LOG_ERR, "Unable to fork logger: %s", ErrStr().c_str());
+			loggerpid = 0;
+		}
+		loggersock.close();
+	}
+
+	if (o.max_ips > 0) {
+		unlink(o.ipipc_filename.c_str());
+		iplistsock.reset();
+		if (iplistsock.getFD() < 0 || iplistsock.bind(o.ipipc_filename.c_str()) || iplistsock.listen(256)) {
+			syslog(LOG_ERR, "Error binding iplistsock server file %s - not counting IPs: %s", o.ipipc_filename.c_str(), ErrStr().c_str());
+		}
+		else if ((iplistpid = fork()) == 0) {
+			tidyup_forhelper();
+			ip_list_listener(o.stat_location, o.logconerror);
+			_exit(0);
+		}
+		else if (iplistpid < 0) {
+			syslog(LOG_ERR, "Unable to fork IP list listener: %s", ErrStr().c_str());
+			iplistpid = 0;
+		}
+		iplistsock.close();
+	}
+
+	// the new ones are listening, so the old ones can go
+	if (oldloggerpid > 0)
+		::kill(oldloggerpid, SIGTERM);
+	if (oldiplistpid > 0)
+		::kill(oldiplistpid, SIGTERM);
+}
+
 int fc_controlit()
 {
 	int rc, fds;
 
 	o.lm.garbageCollect();
 
-	// allocate & create our server sockets
-	serversocketcount = o.filter_ip.size();
-
-	serversockets.reset(serversocketcount);
+	// allocate & create our server sockets - unless we're taking over
+	// from the previous generation, in which case we have them already
+	if (!takeover) {
+		serversocketcount = o.filter_ip.size();
+		serversockets.reset(serversocketcount);
+	}
 	int *serversockfds = serversockets.getFDAll();
 
 	for (int i = 0; i < serversocketcount; i++) {
@@ -1765,27 +2863,20 @@ int fc_controlit()
 	}
 
 
-	if (o.no_logger) {
+	// the logger & IP list processes carry on from the previous generation
+	// until we have taken over from it (see restart_helpers)
+	if (o.no_logger || takeover) {
 		loggersock.close();
 	} else {
 		loggersock.reset();
 	}
-	if (o.url_cache_number > 0) {
-		urllistsock.reset();
-	} else {
-		urllistsock.close();
-	}
-	if (o.max_ips > 0) {
+	if (o.max_ips > 0 && !takeover) {
 		iplistsock.reset();
 	} else {
 		iplistsock.close();
 	}
 
-	pid_t loggerpid = 0;  // to hold the logging process pid
-	pid_t urllistpid = 0;  // url cache process id
-	pid_t iplistpid = 0; // ip cache process id
-
-	if (!o.no_logger) {
+	if (!o.no_logger && !takeover) {
 		if (loggersock.getFD() < 0) {
 			if (!is_daemonised) {
 				std::cerr << "Error creating ipc socket" << std::endl;
@@ -1832,7 +2923,10 @@ int fc_controlit()
 	// we expect to find a valid filter ip 0 specified in conf if multiple IPs are in use.
 	// if we don't find one, bind to any, as per old behaviour.
 	// XXX AAAARGH!
-	if (o.filter_ip[0].length() > 6) {
+	if (takeover) {
+		// already bound
+	}
+	else if (o.filter_ip[0].length() > 6) {
 		if (serversockets.bindAll(o.filter_ip, o.filter_ports)) {
 			if (!is_daemonised) {
 				std::cerr << "Error binding server socket (is something else running on the filter port and ip?" << std::endl;
@@ -1874,14 +2968,15 @@ int fc_controlit()
 	//}
 
 	// Needs deleting if its there
-	unlink(o.ipc_filename.c_str());  // this would normally be in a -r situation.
-	// disabled as requested by Christopher Weimann <csw@k12hq.com>
-	// Fri, 11 Feb 2005 15:42:28 -0500
-	// re-enabled temporarily
-	unlink(o.urlipc_filename.c_str());
-	unlink(o.ipipc_filename.c_str());
+	if (!takeover) {
+		unlink(o.ipc_filename.c_str());  // this would normally be in a -r situation.
+		// disabled as requested by Christopher Weimann <csw@k12hq.com>
+		// Fri, 11 Feb 2005 15:42:28 -0500
+		// re-enabled temporarily
+		unlink(o.ipipc_filename.c_str());
+	}
 
-	if (!o.no_logger) {
+	if (!o.no_logger && !takeover) {
 		if (loggersock.bind(o.ipc_filename.c_str())) {	// bind to file
 			if (!is_daemonised) {
 				std::cerr << "Error binding ipc server file (try using the SysV to stop DansGuardian then try starting it again or doing an 'rm " << o.ipc_filename << "')." << std::endl;
@@ -1903,29 +2998,20 @@ int fc_controlit()
 		}
 	}
 
+	// the URL cache is shared by all the children we fork from here on
 	if (o.url_cache_number > 0) {
-		if (urllistsock.bind(o.urlipc_filename.c_str())) {	// bind to file
-			if (!is_daemonised) {
-				std::cerr << "Error binding urllistsock server file (try using the SysV to stop DansGuardian then try starting it again or doing an 'rm " << o.urlipc_filename << "')." << std::endl;
-			}
-			syslog(LOG_ERR, "Error binding urllistsock server file (try using the SysV to stop DansGuardian then try starting it again or doing an 'rm %s').", o.urlipc_filename.c_str());
-			close(pidfilefd);
-			free(serversockfds);
-			return 1;
-		}
-		if (urllistsock.listen(256)) {	// set it to listen mode with a kernel
-			// queue of 256 backlog connections
+		if (!urlcache.setListSize(o.url_cache_number, o.url_cache_age)) {
 			if (!is_daemonised) {
-				std::cerr << "Error listening to url ipc server file" << std::endl;
+				std::cerr << "Error creating URL cache" << std::endl;
 			}
-			syslog(LOG_ERR, "Error listening to url ipc server file");
+			syslog(LOG_ERR, "Error creating URL cache");
 			close(pidfilefd);
 			free(serversockfds);
 			return 1;
 		}
 	}
 
-	if (o.max_ips > 0) {
+	if (o.max_ips > 0 && !takeover) {
 		if (iplistsock.bind(o.ipipc_filename.c_str())) {	// bind to file
 			if (!is_daemonised) {
 				std::cerr << "Error binding iplistsock server file (try using the SysV to stop DansGuardian then try starting it again or doing an 'rm " << o.ipipc_filename << "')." << std::endl;
@@ -1958,6 +3044,34 @@ int fc_controlit()
 		return 1;
 	}
 
+	// if children accept connections themselves, those which lose the
+	// race for a connection mustn't block waiting for another one.  the
+	// same goes for children told to accept a connection which another
+	// generation's children got to first, whilst a new one is taking over.
+	for (int i = 0; i < serversocketcount; i++) {
+		int flags = fcntl(serversockfds[i], F_GETFL);
+		if (flags < 0 || fcntl(serversockfds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+			if (!is_daemonised) {
+				std::cerr << "Error making server socket non-blocking" << std::endl;
+			}
+			syslog(LOG_ERR, "Error making server socket non-blocking: %s", ErrStr().c_str());
+			close(pidfilefd);
+			free(serversockfds);
+			return 1;
+		}
+	}
+
+#ifdef TCP_DEFER_ACCEPT
+	// don't wake us up for connections until their clients have something to say
+	if (o.defer_accept) {
+		int secs = 30;
+		for (int i = 0; i < serversocketcount; i++) {
+			if (setsockopt(serversockfds[i], IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) < 0)
+				syslog(LOG_ERR, "Error setting TCP_DEFER_ACCEPT on server socket: %s", ErrStr().c_str());
+		}
+	}
+#endif
+
 	if (!daemonise()) {
 		// detached daemon
 		if (!is_daemonised) {
@@ -2006,8 +3120,8 @@ int fc_controlit()
 	// Next thing we need to do is to split into two processes - one to
 	// handle incoming TCP connections from the clients and one to handle
 	// incoming UDS ipc from our forked children.  This helps reduce
-	// bottlenecks by not having only one select() loop.
-	if (!o.no_logger) {
+	// bottlenecks by not having only one poll() loop.
+	if (!o.no_logger && !takeover) {
 		loggerpid = fork();  // make a child processes copy of self to be logger
 
 		if (loggerpid == 0) {	// ma ma!  i am the child
@@ -2016,9 +3130,6 @@ int fc_controlit()
 			if (o.max_ips > 0) {
 				iplistsock.close();
 			}
-			if (o.url_cache_number > 0) {
-				urllistsock.close();  // we don't need our copy of this so close it
-			}	
 			log_listener(o.log_location, o.logconerror, o.log_syslog);
 #ifdef DGDEBUG
 			std::cout << "Log listener exiting" << std::endl;
@@ -2027,28 +3138,8 @@ int fc_controlit()
 		}
 	}
 
-	// Same for URL list listener
-	if (o.url_cache_number > 0) {
-		urllistpid = fork();
-		if (urllistpid == 0) {	// ma ma!  i am the child
-			serversockets.deleteAll(); // we don't need our copy of this so close it
-			free(serversockfds);
-			if (!o.no_logger) {
-				loggersock.close();  // we don't need our copy of this so close it
-			}
-			if (o.max_ips > 0) {
-				iplistsock.close();
-			}
-			url_list_listener(o.logconerror);
-#ifdef DGDEBUG
-			std::cout << "URL List listener exiting" << std::endl;
-#endif
-			_exit(0);  // is reccomended for child and daemons to use this instead
-		}
-	}
-
 	// and for IP list listener
-	if (o.max_ips > 0) {
+	if (o.max_ips > 0 && !takeover) {
 		iplistpid = fork();
 		if (iplistpid == 0) {	// ma ma!  i am the child
 			serversockets.deleteAll(); // we don't need our copy of this so close it
@@ -2056,9 +3147,6 @@ int fc_controlit()
 			if (!o.no_logger) {
 				loggersock.close();  // we don't need our copy of this so close it
 			}
-			if (o.url_cache_number > 0) {
-			        urllistsock.close();  // we don't need our copy of this so close it
-			}
 			ip_list_listener(o.stat_location, o.logconerror);
 #ifdef DGDEBUG
 			std::cout << "IP List listener exiting" << std::endl;
@@ -2073,9 +3161,6 @@ int fc_controlit()
 	std::cout << "Parent process created children" << std::endl;
 #endif
 
-	if (o.url_cache_number > 0) {
-		urllistsock.close();  // we don't need our copy of this so close it
-	}
 	if (!o.no_logger) {
 		loggersock.close();  // we don't need our copy of this so close it
 	}
@@ -2132,15 +3217,66 @@ int fc_controlit()
 #endif
 
 	numchildren = 0;  // to keep count of our children
-	busychildren = 0;  // to keep count of our children
 	int freechildren = 0;  // to keep count of our children
+	int waitingfor = 0;  // num procs waiting for to be preforked
+	bool draining = false;  // has a new generation taken over from us?
+	bool starved = false;  // are connections waiting for a child to become free?
+	bool pending = false;  // is a connection waiting to be handed to a child?
+	struct timeval pendingsince, dispatched;
+	char *peek = NULL;  // for looking at parked connections' request headers
+
+	// children tell us when they become idle or busy through the scoreboard,
+	// so all we wait on are the server sockets (unless the children are watching
+	// those themselves), the scoreboard's wake-up descriptor, any config loader,
+	// and the parking socket & parked connections
+	// room in the client table for plenty more clients than there are children
+	int clientslots = 0;
+	if (o.client_limits)
+		clientslots = (o.max_children < 32) ? 256 : o.max_children * 8;
+	if (!scoreboard.create(o.status_filename.c_str(), o.max_children, clientslots) || pipe(lifeline) < 0) {
+		syslog(LOG_ERR, "%s", "Error creating child process scoreboard - exiting...");
+		serversockets.deleteAll();
+		free(serversockfds);
+		return 1;
+	}
+	memset(&poolsignals, 0, sizeof(poolsignals));
+	memset(&loadsignals, 0, sizeof(loadsignals));
+	scoreboard.setClientLimits(o.max_client_connections, o.max_client_rate, o.max_user_connections, o.max_user_rate);
+	childsockets = NULL;
+	if (!o.child_accept) {
+		childsockets = new UDSocket* [o.max_children];
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	// a generation which takes over from another shares its parking socket,
+	// so that the connections the old one was holding can be handed over
+	parking = false;
+	if (!o.child_accept && (o.parked_connections > 0 || o.overload_queue > 0)) {
+		int sv[2];
+		if (parkin == NULL) {
+			if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+				syslog(LOG_ERR, "Error creating parking socket - not parking idle connections: %s", ErrStr().c_str());
+			} else {
+				parkin = new UDSocket(sv[0]);
+				parkout = new UDSocket(sv[1]);
+			}
+		}
+		if (parkin != NULL && o.parked_connections > 0) {
+			if ((parkfd = epoll_create(o.parked_connections)) < 0) {
+				syslog(LOG_ERR, "Error creating epoll set - not parking idle connections: %s", ErrStr().c_str());
+			} else {
+				parking = true;
+				peek = new char[REQUEST_HEAD_PEEK];
+			}
+		}
+	} else {
+		delete parkin;
+		delete parkout;
+		parkin = parkout = NULL;
+	}
+#endif
+	fds = 4 + (o.child_accept ? 0 : serversocketcount);
 
-	childrenpids = new int[o.max_children];  // so when one exits we know who
-	childrenstates = new int[o.max_children];  // so we know what they're up to
-	childsockets = new UDSocket* [o.max_children];
-	fds = o.max_children + serversocketcount;
-
-	pids = new struct pollfd[fds];
+	struct pollfd *pids = new struct pollfd[fds];
 
 	int i;
 
@@ -2153,17 +3289,21 @@ int fc_controlit()
 	std::cout << "Parent process pid structs allocated" << std::endl;
 #endif
 
-	// store child fds...
-	for (i = 0; i < o.max_children; i++) {
-		childrenpids[i] = -1;
-		childrenstates[i] = -1;
-		pids[i].fd = -1;
-		pids[i].events = POLLIN;
-
-	}
-	// ...and server fds
-	for (i = o.max_children; i < fds; i++) {
-		pids[i].fd = serversockfds[i - o.max_children];
+	// store wake-up, loader & parking fds...
+	pids[0].fd = scoreboard.wakeFD();
+	pids[0].events = POLLIN;
+	pids[1].fd = -1;
+	pids[1].events = POLLIN;
+	pids[2].fd = (parkin != NULL) ? parkin->getFD() : -1;
+	pids[2].events = POLLIN;
+	pids[3].fd = (parkin != NULL) ? parkfd : -1;
+	pids[3].events = POLLIN;
+	for (i = 0; childsockets != NULL && i < o.max_children; i++) {
+		childsockets[i] = NULL;
+	}
+	// ...and server fds, unless the children are watching those themselves
+	for (i = 4; i < fds; i++) {
+		pids[i].fd = serversockfds[i - 4];
 		pids[i].events = POLLIN;
 	}
 
@@ -2171,13 +3311,12 @@ int fc_controlit()
 	std::cout << "Parent process pid structs zeroed" << std::endl;
 #endif
 
-	failurecount = 0;  // as we don't exit on an error with select()
+	failurecount = 0;  // as we don't exit on an error with poll()
 	// due to the fact that these errors do happen
 	// every so often on a fully working, but busy
 	// system, we just watch for too many errors
 	// consecutivly.
 
-	waitingfor = 0;
 	rc = prefork(o.min_children);
 
 	sleep(2);  // need to allow some of the forks to complete
@@ -2192,56 +3331,88 @@ int fc_controlit()
 		syslog(LOG_ERR, "%s", "Error creating initial fork pool - exiting...");
 	}
 
-	int tofind;
+	if (takeover && !ttg) {
+		// let the previous generation know we're up & running
+		if (write(loaderpipe, "K", 1) < 1) {
+			syslog(LOG_ERR, "Error telling previous parent process we've taken over: %s", ErrStr().c_str());
+		}
+		close(loaderpipe);
+		loaderpipe = -1;
+		takeover = false;
+		if (restarthelpers) {
+			restart_helpers();
+			restarthelpers = false;
+		}
+	}
+
 	reloadconfig = false;
 
 	syslog(LOG_INFO, "Started sucessfully.");
 
-	while (failurecount < 30 && !ttg && !reloadconfig) {
+	while (failurecount < 30 && !ttg && !(draining && numchildren < 1)) {
 
 		// loop, essentially, for ever until 30
 		// consecutive errors in which case something
 		// is badly wrong.
 		// OR, its timetogo - got a sigterm
-		// OR, we need to exit to reread config
-		if (gentlereload) {
-#ifdef DGDEBUG
-			std::cout << "gentle reload activated" << std::endl;
-#endif
-			o.deleteFilterGroups();
-			if (!o.readFilterGroupConf()) {
-				reloadconfig = true;  // filter groups problem so lets
-				// try and reload entire config instead
-				// if that fails it will bomb out
-			} else {
-				if (o.use_filter_groups_list) {
-					o.filter_groups_list.reset();
-					if (!o.doReadItemList(o.filter_groups_list_location.c_str(),&(o.filter_groups_list),"filtergroupslist",true))
-						reloadconfig = true;  // filter groups problem...
-				}
-				if (!reloadconfig) {
-					o.deletePlugins(o.csplugins);
-					if (!o.loadCSPlugins())
-						reloadconfig = true;  // content scan plugs problem
-					if (!reloadconfig) {
-						o.deletePlugins(o.authplugins);
-						if (!o.loadAuthPlugins())
-							reloadconfig = true;  // auth plugs problem
-					}
-					if (!reloadconfig) {
-						o.deleteRooms();
-						o.loadRooms();
-						hup_allchildren();
-						o.lm.garbageCollect();
-						prefork(o.min_children);
-						gentlereload = false;
-						// everything ok - no full reload needed
-						// clear gentle reload flag for next run of the loop
-					}
+		// OR, a new generation has taken over & our children have all finished
+		if ((gentlereload || reloadconfig) && !draining && loaderpid < 0) {
+			// a loader process reads the new config & lists whilst we carry on as normal,
+			// then takes over from us - if it fails, we carry on with what we have
+			bool gentle = gentlereload && !reloadconfig;
+			gentlereload = false;
+			reloadconfig = false;
+			int lp[2];
+			if (pipe(lp) < 0) {
+				syslog(LOG_ERR, "Error creating pipe for config loader: %s", ErrStr().c_str());
+			}
+			else if ((loaderpid = fork()) == 0) {
+				// I am the loader
+				close(lp[0]);
+				loaderpipe = lp[1];
+				loaderpid = -1;
+				takeover = true;
+				tidyup_forloader();
+				delete[]pids;
+				delete[]peek;
+				free(serversockfds);
+				if (gentle) {
+#ifdef DGDEBUG
+					std::cout << "gentle reload activated" << std::endl;
+#endif
+					if (reload_filtergroups())
+						return 3;  // take over with the main options we already have
+					// filter groups problem so lets
+					// try and reload entire config instead
 				}
+				restarthelpers = true;
+				return 2;  // re-read everything, then take over
 			}
-			flush_urlcache();
-			continue;
+			else if (loaderpid < 0) {
+				syslog(LOG_ERR, "Unable to fork config loader: %s", ErrStr().c_str());
+				close(lp[0]);
+				close(lp[1]);
+			} else {
+				close(lp[1]);
+				loaderpipe = lp[0];
+				pids[1].fd = loaderpipe;
+				syslog(LOG_INFO, "Loading new configuration");
+			}
+		}
+
+		// if connections are waiting for a free child, don't watch for more until
+		// there is one - children becoming idle wake us whilst we're starved
+		if (starved && scoreboard.idleChildren() > 0) {
+			starved = false;
+			scoreboard.setStarved(false);
+		}
+		// when new connections are parked until their request headers arrive,
+		// keep accepting them as long as there is room
+		for (i = 4; i < fds; i++) {
+			if (parkfd >= 0)
+				pids[i].fd = (draining || (int) parked.size() >= o.parked_connections) ? -1 : serversockfds[i - 4];
+			else
+				pids[i].fd = ((starved && o.overload_queue < 1) || draining) ? -1 : serversockfds[i - 4];
 		}
 
 		// Lets take the opportunity to clean up our dead children if any
@@ -2249,7 +3420,10 @@ int fc_controlit()
 			pids[i].revents = 0;
 		}
 		mopup_afterkids();
-		rc = poll(pids, fds, 60 * 1000);
+		// children don't wake us when exiting, so keep an eye out whilst draining or starved,
+		// the pool controller & load shedding need to see the load once a second,
+		// and parked connections time out
+		rc = poll(pids, fds, ((draining || starved || o.adaptive_children || o.load_shed_max_tier > 0 || !parked.empty()) ? 1 : 60) * 1000);
 		mopup_afterkids();
 
 		if (rc < 0) {	// was an error
@@ -2266,84 +3440,248 @@ int fc_controlit()
 			continue;  // then continue with the looping
 		}
 
-		tofind = rc;
-		if (rc > 0) {
-			for (i = o.max_children; i < fds; i++) {
-				if (pids[i].revents) {
-					tofind--;
+		if (rc > 0 && pids[0].revents) {
+			scoreboard.clearWake();
+		}
+
+		if (rc > 0 && pids[1].revents) {
+			char c;
+			if (read(loaderpipe, &c, 1) == 1) {
+				// the new generation is serving - stop taking connections,
+				// and let our children finish what they're doing
+				draining = true;
+				syslog(LOG_INFO, "New configuration loaded; waiting for %d old process(es) to finish", numchildren);
+				hup_allchildren();
+				handover_parked();
+				pids[2].fd = -1;
+				pids[3].fd = -1;
+				for (i = 4; i < fds; i++) {
+					pids[i].fd = -1;
+				}
+			} else {
+				syslog(LOG_ERR, "%s", "Error loading new configuration; carrying on with the current one");
+				loaderpid = -1;
+				// the loader may have got as far as writing its own pid out
+				if (seteuid(o.root_user) == 0) {
+					int pidfilefd = sysv_openpidfile(o.pid_filename);
+					if (pidfilefd < 0 || sysv_writepidfile(pidfilefd) != 0)
+						syslog(LOG_ERR, "%s", "Error re-writing pid file.");
+					seteuid(o.proxy_user);
+				}
+			}
+			close(loaderpipe);
+			loaderpipe = -1;
+			pids[1].fd = -1;
+		}
+
+#ifdef HAVE_SYS_EPOLL_H
+		if (rc > 0 && pids[2].revents) {
+			// children handing us idle persistent connections
+			ParkedPeer msg;
+			int peerfd;
+			while (parkin->receiveFD(peerfd, &msg, sizeof(msg)) >= 0) {
+				if (peerfd < 0)
+					continue;
+				if (parkfd < 0) {
+					// handed over by the previous generation, & we don't park them - just find it a child
+					parked[peerfd] = msg;
+					queue_connection(peerfd);
+					continue;
 				}
+				struct epoll_event ev;
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+				ev.data.fd = peerfd;
+				if (draining || (int) parked.size() >= o.parked_connections
+					|| epoll_ctl(parkfd, EPOLL_CTL_ADD, peerfd, &ev) < 0)
+				{
+					// no room - the client will have to open a new connection
+					close(peerfd);
+					continue;
+				}
+				msg.deadline = time(NULL) + 120;
+				parked[peerfd] = msg;
+			}
+		}
+
+		if (rc > 0 && pids[3].revents) {
+			// parked connections with something to say - either the next request, or goodbye.
+			// only hand them to a child once the whole request header is here, so that slow
+			// clients can't hold children up, and turn away anything which isn't HTTP.
+			struct epoll_event ev[64];
+			int n = epoll_wait(parkfd, ev, 64, 0);
+			for (int j = 0; j < n; j++) {
+				int peerfd = ev[j].data.fd;
+				if (parked[peerfd].deadline == 0)
+					continue;  // already waiting for a child
+				int len = recv(peerfd, peek, REQUEST_HEAD_PEEK, MSG_PEEK | MSG_DONTWAIT);
+				if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+					continue;
+				if (len > 0 && len < REQUEST_HEAD_PEEK && !got_requesthead(peek, len)) {
+					if (!(ev[j].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+						continue;
+					len = 0;  // client has stopped sending part way through a header
+				}
+				if (len > 0 && !valid_requestline(peek, len))
+					turn_away(peerfd, badrequest, strlen(badrequest));
+				else if (len > 0)
+					queue_connection(peerfd);
+				else
+					unpark(peerfd);
 			}
 		}
+#endif
+
+		if (draining) {
+			continue;
+		}
 
-		if (tofind > 0) {
-			check_kid_readystatus(tofind);
-			mopup_afterkids();
+		if (!parked.empty()) {
+			// give up on parked connections which have been quiet too long, as handleConnection would
+			time(&tnow);
+			for (std::map<int, ParkedPeer>::iterator j = parked.begin(); j != parked.end(); ) {
+				if (j->second.deadline > 0 && j->second.deadline <= tnow)
+					unpark((j++)->first);
+				else
+					j++;
+			}
 		}
 
-		freechildren = numchildren - busychildren;
+		if (o.child_recycling)
+			recycle_children();
+
+		freechildren = scoreboard.idleChildren();
+		waitingfor = scoreboard.startingChildren();
+
+		// clients which have already been waiting on us come before new connections -
+		// except those with as much going on as they're allowed, which wait their turn
+		bool held = false;
+		while (!unparked.empty() && freechildren > 0) {
+			std::deque<int>::iterator next = unparked.begin();
+			if (o.client_limits) {
+				while (next != unparked.end() && !scoreboard.clientAllowed(parked[*next].ip,
+					parked[*next].persistent_authed ? parked[*next].clientuser : ""))
+				{
+					next++;
+				}
+				if (next == unparked.end()) {
+					held = true;
+					break;
+				}
+			}
+			int childnum = getfreechild();
+			if (childnum < 0) {
+				freechildren = 0;
+				break;
+			}
+			int peerfd = *next;
+			if (tellchild_parked(childnum, peerfd)) {
+				unparked.erase(next);
+				unpark(peerfd);
+			}
+			--freechildren;
+		}
+		if (!unparked.empty() && !held) {
+			prefork_underload(waitingfor);
+			starved = true;
+			scoreboard.setStarved(true);
+		}
 
 #ifdef DGDEBUG
 		std::cout << "numchildren:" << numchildren << std::endl;
-		std::cout << "busychildren:" << busychildren << std::endl;
 		std::cout << "freechildren:" << freechildren << std::endl;
 		std::cout << "waitingfor:" << waitingfor << std::endl << std::endl;
 #endif
 
 		if (rc > 0) {
-			for (i = o.max_children; i < fds; i++) {
-				if ((pids[i].revents & POLLIN) > 0) {
-					// socket ready to accept() a connection
-					failurecount = 0;  // something is clearly working so reset count
-					if (freechildren < 1 && numchildren < o.max_children) {
-						if (waitingfor == 0) {
-							int num = o.prefork_children;
-							if ((o.max_children - numchildren) < num)
-								num = o.max_children - numchildren;
-							if (o.logchildprocs)
-								syslog(LOG_ERR, "Under load - Spawning %d process(es)", num);
-							rc = prefork(num);
-							if (rc < 0) {
-								syslog(LOG_ERR, "Error forking %d extra process(es).", num);
-								failurecount++;
-							}
-						} else
-							usleep(1000);
+			// connections to the priorityports get first call on free children
+			for (int pass = 0; pass < 2 && !ttg; pass++) {
+				for (i = 4; i < fds; i++) {
+					if (priority_port(serversockets[i - 4]->getPort()) == (pass > 0))
 						continue;
-					}
-					if (freechildren > 0) {
-#ifdef DGDEBUG
-						std::cout<<"telling child to accept "<<(i-o.max_children)<<std::endl;
-#endif
-						int childnum = getfreechild();
-						if (childnum < 0)
-						{
-							// Oops! weren't actually any free children.
-							// Not sure why as yet, but it seems this can
-							// sometimes happen. :(  PRA 2009-03-11
-							syslog(LOG_WARNING,
-								"No free children from getfreechild(): numchildren = %d, busychildren = %d, waitingfor = %d",
-								numchildren, busychildren, waitingfor
-							);
-							freechildren = 0;
-							usleep(1000);
+					if ((pids[i].revents & POLLIN) > 0) {
+						// socket ready to accept() a connection
+						failurecount = 0;  // something is clearly working so reset count
+						if (parkfd >= 0) {
+							// take it ourselves, & hand it over once the client has sent its request
+							accept_toparked(i - 4);
+							continue;
 						}
-						else
-						{
-							tellchild_accept(childnum, i - o.max_children);
-							--freechildren;
+						if (o.overload_queue > 0 && (freechildren < 1 || !unparked.empty())) {
+							// no child for it - hold on to it until there is, or turn it away if too many are waiting
+							admit_connections(i - 4);
+							prefork_underload(scoreboard.startingChildren());
+							starved = true;
+							continue;
+						}
+						if (!pending) {
+							pending = true;
+							gettimeofday(&pendingsince, NULL);
+						}
+						if (freechildren < 1 && numchildren < o.max_children) {
+							prefork_underload(waitingfor);
+							starved = true;
+							continue;
+						}
+						if (freechildren > 0) {
+#ifdef DGDEBUG
+							std::cout<<"telling child to accept "<<(i-4)<<std::endl;
+#endif
+							int childnum = getfreechild();
+							if (childnum < 0)
+							{
+								// Oops! weren't actually any free children.
+								// Not sure why as yet, but it seems this can
+								// sometimes happen. :(  PRA 2009-03-11
+								syslog(LOG_WARNING,
+									"No free children from getfreechild(): numchildren = %d, waitingfor = %d",
+									numchildren, waitingfor
+								);
+								freechildren = 0;
+								starved = true;
+							}
+							else
+							{
+								tellchild_accept(childnum, i - 4);
+								--freechildren;
+								gettimeofday(&dispatched, NULL);
+								long waited = (dispatched.tv_sec - pendingsince.tv_sec) * 1000
+									+ (dispatched.tv_usec - pendingsince.tv_usec) / 1000;
+								poolsignals.dispatches++;
+								if (waited > 0)
+									poolsignals.dispatchmsecs += waited;
+								pending = false;
+							}
+						} else {
+							starved = true;
 						}
-					} else {
-						usleep(1000);
 					}
-				}
-				else if (pids[i].revents) {
-					ttg = true;
-					syslog(LOG_ERR, "Error with main listening socket.  Exiting.");
-					break;
+					else if (pids[i].revents) {
+						ttg = true;
+						syslog(LOG_ERR, "Error with main listening socket.  Exiting.");
+						break;
+					}
 				}
 			}
 			if (ttg)
 				break;
+			if (starved)
+				scoreboard.setStarved(true);
+		}
+		scoreboard.setAdmissions(unparked.size(), queuedcount, rejectedcount);
+		if (o.load_shed_max_tier > 0)
+			shed_load();
+
+		// children accepting connections themselves have all gone busy -
+		// same as a connection arriving with no free child in the normal mode
+		if (o.child_accept && freechildren < 1) {
+			prefork_underload(waitingfor);
+		}
+
+		if (o.adaptive_children) {
+			poolsignals.starved = starved;
+			adapt_pool(serversockfds, freechildren, waitingfor);
+			continue;
 		}
 
 		if (freechildren < o.minspare_children && (waitingfor == 0) && numchildren < o.max_children) {
@@ -2369,8 +3707,8 @@ int fc_controlit()
 		}
 	}
 	cullchildren(numchildren);  // remove the fork pool of spare children
-	for (int i = 0; i < o.max_children; i++) {
-		if (pids[i].fd != -1) {
+	for (int i = 0; childsockets != NULL && i < o.max_children; i++) {
+		if (childsockets[i] != NULL) {
 			delete childsockets[i];
 			childsockets[i] = NULL;
 		}
@@ -2388,10 +3726,19 @@ int fc_controlit()
 	sleep(1);
 	mopup_afterkids();
 
-	delete[]childrenpids;
-	delete[]childrenstates;
 	delete[]childsockets;
-	delete[]pids;  // 4 deletes good, memory leaks bad
+	childsockets = NULL;
+	delete[]pids;
+	delete[]peek;
+	close(lifeline[0]);
+	close(lifeline[1]);
+	close_parked();
+	delete parkin;
+	delete parkout;
+	parkin = parkout = NULL;
+	scoreboard.release();
+	if (!draining)
+		unlink(o.status_filename.c_str());
 
 	if (failurecount >= 30) {
 		syslog(LOG_ERR, "%s", "Exiting due to high failure count.");
@@ -2455,14 +3802,25 @@ int fc_controlit()
 		sigaction(SIGTERM, &oldsa, NULL);  // restore prev state
 	}
 
-	if (reloadconfig || ttg) {
+	if (draining) {
+		// the logger & IP list now belong to the new generation.  if we're in the
+		// foreground, stick around for as long as it does.
+		if (o.no_daemon) {
+			while (waitpid(loaderpid, NULL, 0) < 0 && errno == EINTR) {
+			}
+		}
+		return 0;
+	}
+	if (ttg) {
+		if (loaderpid > 0)
+			::kill(loaderpid, SIGTERM);  // abandon any half-loaded config
+		if (takeover)
+			return 1;  // failed to take over - the logger & IP list still belong to the old parent
 		if (!o.no_logger)
 			::kill(loggerpid, SIGTERM);  // get rid of logger
-		if (o.url_cache_number > 0)
-			::kill(urllistpid, SIGTERM);  // get rid of url cache
 		if (o.max_ips > 0)
 			::kill(iplistpid, SIGTERM); // get rid of iplist
-		return reloadconfig ? 2 : 0;
+		return 0;
 	}
 	if (o.logconerror) {
 		syslog(LOG_ERR, "%s", "Main parent process exiting.");
@@ -530,6 +530,7 @@ void HTTPHeader::setURL(String &url) {
 // urlRegExp Code originally from from Ton Gorter 2004
 bool HTTPHeader::regExp(String& line, std::deque<RegExp>& regexp_list, std::deque<String>& replacement_list) {
 	RegExp *re;
+	RegResult res;
 	String replacement;
 	String repstr;
 	String newLine;
@@ -548,15 +549,15 @@ bool HTTPHeader::regExp(String& line, std::deque<RegExp>& regexp_list, std::dequ
 	for (i = 0; i < s; i++) {
 		newLine = "";
 		re = &(regexp_list[i]);
-		if (re->match(line.toCharArray())) {
+		if (re->match(line.toCharArray(), res)) {
 			repstr = replacement_list[i];
-			matches = re->numberOfMatches();
+			matches = res.numberOfMatches();
 
 			srcoff = 0;
 
 			for (j = 0; j < matches; j++) {
-				nextoffset = re->offset(j);
-				matchlen = re->length(j);
+				nextoffset = res.offset(j);
+				matchlen = res.length(j);
 				
 				// copy next chunk of unmodified data
 				if (nextoffset > srcoff) {
@@ -566,7 +567,7 @@ bool HTTPHeader::regExp(String& line, std::deque<RegExp>& regexp_list, std::dequ
 
 				// Count number of submatches (brackets) in replacement string
 				for (submatches = 0; j+submatches+1 < matches; submatches++)
-					if (re->offset(j+submatches+1) + re->length(j+submatches+1) > srcoff + matchlen)
+					if (res.offset(j+submatches+1) + res.length(j+submatches+1) > srcoff + matchlen)
 						break;
 
 				// \1 and $1 replacement
@@ -576,7 +577,7 @@ bool HTTPHeader::regExp(String& line, std::deque<RegExp>& regexp_list, std::dequ
 					if ((repstr[k] == '\\' || repstr[k] == '$') && repstr[k+1] >= '1' && repstr[k+1] <= '9') {
 						match = repstr[++k] - '0';
 						if (match <= submatches) {
-							replacement += re->result(j + match).c_str();
+							replacement += res.result(j + match).c_str();
 						}
 					} else {
 						// unescape \\ and \$, and add non-backreference characters to string
@@ -1446,11 +1447,12 @@ String HTTPHeader::decode(const String &s, bool decodeAll)
 #ifdef DGDEBUG
 	std::cout << "decoding url" << std::endl;
 #endif
-	if (!urldecode_re.match(s.c_str())) {
+	RegResult res;
+	if (!urldecode_re.match(s.c_str(), res)) {
 		return s;
 	}			// exit if not found
 #ifdef DGDEBUG
-	std::cout << "matches:" << urldecode_re.numberOfMatches() << std::endl;
+	std::cout << "matches:" << res.numberOfMatches() << std::endl;
 	std::cout << "removing %XX" << std::endl;
 #endif
 	int match;
@@ -1459,16 +1461,16 @@ String HTTPHeader::decode(const String &s, bool decodeAll)
 	int size = s.length();
 	String result;
 	String n;
-	for (match = 0; match < urldecode_re.numberOfMatches(); match++) {
-		offset = urldecode_re.offset(match);
+	for (match = 0; match < res.numberOfMatches(); match++) {
+		offset = res.offset(match);
 		if (offset > pos) {
 			result += s.subString(pos, offset - pos);
 		}
-		n = urldecode_re.result(match).c_str();
+		n = res.result(match).c_str();
 		n.lop();  // remove %
 		result += hexToChar(n, decodeAll);
 #ifdef DGDEBUG
-		std::cout << "encoded: " << urldecode_re.result(match) << " decoded: " << hexToChar(n) << " string so far: " << result << std::endl;
+		std::cout << "encoded: " << res.result(match) << " decoded: " << hexToChar(n) << " string so far: " << result << std::endl;
 #endif
 		pos = offset + 3;
 	}
@@ -1486,7 +1488,7 @@ String HTTPHeader::hexToChar(const String &n, bool all)
 	if (n.length() < 2) {
 		return String(n);
 	}
-	static char buf[2];
+	char buf[2];
 	unsigned int a, b;
 	unsigned char c;
 	a = n[0];
@@ -1720,7 +1722,7 @@ void HTTPHeader::out(Socket * peersock, Socket * sock, int sendflag, bool reconn
 // discard remainder of POST data
 void HTTPHeader::discard(Socket *sock, off_t cl)
 {
-	static char fred[4096];
+	char fred[4096];
 	if (cl == -2)
 		cl = contentLength();
 	int rc;
@@ -22,8 +22,17 @@
 #include <fstream>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <cstring>
 #include <list>
 
+#ifdef HAVE_SSSE3
+	#include <tmmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+	#include <immintrin.h>
+#endif
+
 
 // GLOBALS
 
@@ -39,14 +48,169 @@ extern OptionContainer o;
 #define MAXLINKS GRAPHENTRYSIZE-4
 #define ROOTOFFSET ROOTNODESIZE - GRAPHENTRYSIZE
 
+// list memory blocks at least this big are put in huge pages, if possible
+#define LISTHUGEPAGE (2 * 1024 * 1024)
+
+
+// phrase tree search prefilter - find which of the 32 characters starting at
+// doc can begin a phrase.  first holds the set of such characters as a pair
+// of 16 byte tables, indexed by the low nibble of a character, in which bit
+// (high nibble % 8) is set if the character is in the set: the first table
+// for characters below 128, the second for the rest.  returns a bitmask with
+// bit n set if doc[n] is a candidate.
+typedef unsigned int (*graphfilter)(const unsigned char *doc, const unsigned char *first);
+
+static unsigned int graphFilterScalar(const unsigned char *doc, const unsigned char *first)
+{
+	unsigned int mask = 0;
+	for (int n = 0; n < 32; n++) {
+		unsigned char c = doc[n];
+		if (first[((c >> 7) << 4) | (c & 15)] & (1 << ((c >> 4) & 7)))
+			mask |= 1u << n;
+	}
+	return mask;
+}
+
+#ifdef HAVE_SSSE3
+// the same, 16 characters at a time - a table lookup of the low nibble
+// gives the bits for each possible high nibble, which are then tested
+// against a bit picked out by a lookup of the high nibble
+__attribute__((target("ssse3"))) static inline unsigned int graphFilterBlock(__m128i v, __m128i lo, __m128i hi)
+{
+	const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	// characters >= 128 index nothing in the first table, and vice versa
+	__m128i t = _mm_or_si128(_mm_shuffle_epi8(lo, v), _mm_shuffle_epi8(hi, _mm_xor_si128(v, _mm_set1_epi8(-128))));
+	__m128i b = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(15)));
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(t, b), _mm_setzero_si128())) & 0xffff;
+}
+
+__attribute__((target("ssse3"))) static unsigned int graphFilterSSSE3(const unsigned char *doc, const unsigned char *first)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i*) first);
+	__m128i hi = _mm_loadu_si128((const __m128i*) (first + 16));
+	return graphFilterBlock(_mm_loadu_si128((const __m128i*) doc), lo, hi)
+		| (graphFilterBlock(_mm_loadu_si128((const __m128i*) (doc + 16)), lo, hi) << 16);
+}
+#endif
+
+#ifdef HAVE_AVX2
+// and 32 characters at a time
+__attribute__((target("avx2"))) static unsigned int graphFilterAVX2(const unsigned char *doc, const unsigned char *first)
+{
+	const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+		1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) first));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (first + 16)));
+	__m256i v = _mm256_loadu_si256((const __m256i*) doc);
+	__m256i t = _mm256_or_si256(_mm256_shuffle_epi8(lo, v), _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, _mm256_set1_epi8(-128))));
+	__m256i b = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(15)));
+	return ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(t, b), _mm256_setzero_si256()));
+}
+#endif
+
+// the best of the above for the CPU we're running on - picked by graphCompact
+static graphfilter graphfilterkernel = NULL;
+
+// put big list memory blocks in huge pages? (hugepagelists)
+static bool listhugepages = true;
+
 
 // IMPLEMENTATION
 
+static size_t listPageSize()
+{
+	static size_t pagesize = 0;
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+	return pagesize;
+}
+
+// length of the mapping holding a block of the given size, or 0 if it comes from the heap.
+// blocks big enough for huge pages are rounded up to whole ones whether or not they
+// got them, so that the length never depends on the setting at the time.
+static size_t listArenaLength(size_t bytes)
+{
+	size_t unit = listPageSize();
+	if (bytes < unit)
+		return 0;
+	if (bytes >= LISTHUGEPAGE)
+		unit = LISTHUGEPAGE;
+	return (bytes + unit - 1) / unit * unit;
+}
+
+void listArenaHugePages(bool enable)
+{
+	listhugepages = enable;
+}
+
+// blocks smaller than a page come from the heap, and are never made read-only.
+// big ones are put in huge pages set aside by the administrator if there are any,
+// and otherwise are aligned for, and marked as wanting, transparent huge pages -
+// the kernel falls back to ordinary pages itself if it has none to hand.
+void *listArenaAlloc(size_t bytes)
+{
+	size_t len = listArenaLength(bytes);
+	if (len == 0)
+		return malloc(bytes > 0 ? bytes : 1);
+	void *p;
+	if (listhugepages && len >= LISTHUGEPAGE) {
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+#endif
+#ifdef MADV_HUGEPAGE
+		// map a huge page more than needed, and trim it down to an aligned block
+		p = mmap(NULL, len + LISTHUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		char *start = (char*) p;
+		char *aligned = (char*) (((unsigned long) start + LISTHUGEPAGE - 1) & ~((unsigned long) LISTHUGEPAGE - 1));
+		if (aligned > start)
+			munmap(start, aligned - start);
+		if (start + LISTHUGEPAGE > aligned)
+			munmap(aligned + len, start + LISTHUGEPAGE - aligned);
+		madvise(aligned, len, MADV_HUGEPAGE);
+		return aligned;
+#endif
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	return p;
+}
+
+void listArenaFree(void *p, size_t bytes)
+{
+	if (p == NULL)
+		return;
+	size_t len = listArenaLength(bytes);
+	if (len == 0)
+		free(p);
+	else
+		munmap(p, len);
+}
+
+void listArenaProtect(void *p, size_t bytes, bool readonly)
+{
+	size_t len = listArenaLength(bytes);
+	if (p == NULL || len == 0)
+		return;
+	if (mprotect(p, len, readonly ? PROT_READ : (PROT_READ | PROT_WRITE)) != 0)
+		syslog(LOG_ERR, "Could not change protection of list memory: %s", ErrStr().c_str());
+}
+
+template <class T> static void listArrayProtect(std::vector<T, ListAllocator<T> > &v, bool readonly)
+{
+	if (!v.empty())
+		listArenaProtect(&v[0], v.capacity() * sizeof(T), readonly);
+}
+
 // Constructor - set default values
-ListContainer::ListContainer():refcount(0), parent(false), filedate(0), used(false), bannedpfiledate(0), exceptionpfiledate(0), weightedpfiledate(0),
+ListContainer::ListContainer():refcount(0), parent(false), filedate(0), used(false), aho_corasick(false), bannedpfiledate(0), exceptionpfiledate(0), weightedpfiledate(0),
 	blanketblock(false), blanket_ip_block(false), blanketsslblock(false), blanketssl_ip_block(false),
 	sourceisexception(false), sourcestartswith(false), sourcefilters(0), data(NULL), current_graphdata_size(0), realgraphdata(NULL), maxchildnodes(0), graphitems(0),
-	data_length(0), data_memory(0), items(0), isSW(false), issorted(false), graphused(false), force_quick_search(false),
+	data_length(0), data_memory(0), items(0), isSW(false), issorted(false), graphused(false), frozen(false), force_quick_search(false),
 	/*sthour(0), stmin(0), endhour(0), endmin(0),*/ istimelimited(false)
 {
 }
@@ -60,7 +224,8 @@ ListContainer::~ListContainer()
 // for both types of list - clear & reset all values
 void ListContainer::reset()
 {
-	free(data);
+	protect(false);
+	listArenaFree(data, data_memory);
 	if (graphused)
 		free(realgraphdata);
 	// dereference this and included lists
@@ -99,10 +264,23 @@ void ListContainer::reset()
 	istimelimited = false;
 	combilist.clear();
 	slowgraph.clear();
+	graphroot.clear();
+	graphnodes.clear();
+	graphpairs.clear();
+	acroot.clear();
+	acfail.clear();
+	acoutput.clear();
+	acdictlink.clear();
+	acfirstchild.clear();
+	acnumchildren.clear();
+	acchildchar.clear();
+	acchildnode.clear();
+	aho_corasick = false;
 	list.clear();
 	lengthlist.clear();
 	weight.clear();
 	itemtype.clear();
+	canonicalindex.clear();
 	timelimitindex.clear();
 	morelists.clear();
 	timelimits.clear();
@@ -506,6 +684,13 @@ bool ListContainer::readAnotherItemList(const char *filename, bool startswith, i
 	return true;
 }
 
+const char *ListResult::category()
+{
+	if (list == NULL)
+		return "";
+	return list->category.toCharArray();
+}
+
 // for item lists - is this item in the list?
 bool ListContainer::inList(const char *string)
 {
@@ -516,20 +701,20 @@ bool ListContainer::inList(const char *string)
 }
 
 // for item lists - is an item in the list that ends with this string?
-bool ListContainer::inListEndsWith(const char *string)
+bool ListContainer::inListEndsWith(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
 			if (search(&ListContainer::greaterThanEW,0, items - 1, string) >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return true;
 			}
 		}
 		bool rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).inListEndsWith(string);
+			rc = (*o.lm.l[morelists[i]]).inListEndsWith(string, result);
 			if (rc) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return true;
 			}
 		}
@@ -538,20 +723,20 @@ bool ListContainer::inListEndsWith(const char *string)
 }
 
 // for item lists - is an item in the list that starts with this string?
-bool ListContainer::inListStartsWith(const char *string)
+bool ListContainer::inListStartsWith(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
 			if (search(&ListContainer::greaterThanSW,0, items - 1, string) >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return true;
 			}
 		}
 		bool rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).inListStartsWith(string);
+			rc = (*o.lm.l[morelists[i]]).inListStartsWith(string, result);
 			if (rc) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return true;
 			}
 		}
@@ -560,7 +745,7 @@ bool ListContainer::inListStartsWith(const char *string)
 }
 
 // find pointer to the part of the data array containing this string
-char *ListContainer::findInList(const char *string)
+const char *ListContainer::findInList(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
@@ -571,15 +756,15 @@ char *ListContainer::findInList(const char *string)
 				r = search(&ListContainer::greaterThanEWF,0, items - 1, string);
 			}
 			if (r >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return (data + list[r]);
 			}
 		}
-		char *rc;
+		const char *rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).findInList(string);
+			rc = (*o.lm.l[morelists[i]]).findInList(string, result);
 			if (rc != NULL) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return rc;
 			}
 		}
@@ -588,21 +773,21 @@ char *ListContainer::findInList(const char *string)
 }
 
 // find an item in the list which starts with this
-char *ListContainer::findStartsWith(const char *string)
+const char *ListContainer::findStartsWith(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
 			int r = search(&ListContainer::greaterThanSW,0, items - 1, string);
 			if (r >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return (data + list[r]);
 			}
 		}
-		char *rc;
+		const char *rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).findStartsWith(string);
+			rc = (*o.lm.l[morelists[i]]).findStartsWith(string, result);
 			if (rc != NULL) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return rc;
 			}
 		}
@@ -610,26 +795,27 @@ char *ListContainer::findStartsWith(const char *string)
 	return NULL;
 }
 
-char *ListContainer::findStartsWithPartial(const char *string)
+const char *ListContainer::findStartsWithPartial(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
 			int r = search(&ListContainer::greaterThanSW,0, items - 1, string);
 			if (r >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return (data + list[r]);
 			}
 			if (r < -1) {
 				r = 0 - r - 2;
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return (data + list[r]);  // nearest match
 			}
 		}
-		char *rc;
+		const char *rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).findStartsWithPartial(string);
+			rc = (*o.lm.l[morelists[i]]).findStartsWithPartial(string, result);
 			if (rc != NULL) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return rc;
 			}
 		}
@@ -637,21 +823,21 @@ char *ListContainer::findStartsWithPartial(const char *string)
 	return NULL;
 }
 
-char *ListContainer::findEndsWith(const char *string)
+const char *ListContainer::findEndsWith(const char *string, ListResult *result)
 {
 	if (isNow()) {
 		if (items > 0) {
 			int r = search(&ListContainer::greaterThanEW,0, items - 1, string);
 			if (r >= 0) {
-				lastcategory = category;
+				if (result != NULL)
+					result->list = this;
 				return (data + list[r]);
 			}
 		}
-		char *rc;
+		const char *rc;
 		for (unsigned int i = 0; i < morelists.size(); i++) {
-			rc = (*o.lm.l[morelists[i]]).findEndsWith(string);
+			rc = (*o.lm.l[morelists[i]]).findEndsWith(string, result);
 			if (rc != NULL) {
-				lastcategory = (*o.lm.l[morelists[i]]).lastcategory;
 				return rc;
 			}
 		}
@@ -673,6 +859,10 @@ int ListContainer::getTypeAt(unsigned int index)
 {
 	return itemtype[index];
 }
+int ListContainer::getCategoryIndexAt(unsigned int index)
+{
+	return categoryindex[index];
+}
 // Phrase lists - check whether the current time is within the limit imposed upon the given phrase
 bool ListContainer::checkTimeAt(unsigned int index)
 {
@@ -740,8 +930,11 @@ void ListContainer::doSort(const bool startsWith)
 {				// sort by ending of line
 	for (size_t i = 0; i < morelists.size(); i++)
 		(*o.lm.l[morelists[i]]).doSort(startsWith);
-	if (items < 2 || issorted)
+	if (items < 2 || issorted) {
+		freeze();
 		return;
+	}
+	protect(false);
 	if (startsWith)
 	{
 		lessThanSWF lts;
@@ -754,9 +947,69 @@ void ListContainer::doSort(const bool startsWith)
 	}
 	isSW = startsWith;
 	issorted = true;
+	freeze();
 	return;
 }
 
+// order phrases by their text, as a std::string comparison would
+struct lessThanPhrase: public std::binary_function<const unsigned int&, const unsigned int&, bool>
+{
+	bool operator()(const unsigned int& a, const unsigned int& b)
+	{
+		size_t alen = (*lengthlist)[a];
+		size_t blen = (*lengthlist)[b];
+		int r = memcmp(data + (*list)[a], data + (*list)[b], (alen < blen) ? alen : blen);
+		if (r != 0)
+			return r < 0;
+		return alen < blen;
+	};
+	char *data;
+	std::vector<size_t, ListAllocator<size_t> > *list;
+	std::vector<size_t, ListAllocator<size_t> > *lengthlist;
+};
+
+void ListContainer::sortHits(PhraseHits &hits)
+{
+	lessThanPhrase ltp;
+	ltp.data = data;
+	ltp.list = &list;
+	ltp.lengthlist = &lengthlist;
+	std::sort(hits.found.begin(), hits.found.end(), ltp);
+}
+
+void PhraseHits::prepare(size_t phrases, size_t categories)
+{
+	if (count.size() < phrases) {
+		count.resize(phrases, 0);
+		found.reserve(phrases);
+	}
+	if (catweight.size() < categories + 1) {
+		catweight.resize(categories + 1, 0);
+		catscored.resize(categories + 1, false);
+		catfound.reserve(categories + 1);
+	}
+}
+
+void PhraseHits::reset()
+{
+	for (std::vector<unsigned int>::iterator i = found.begin(); i != found.end(); i++)
+		count[*i] = 0;
+	found.clear();
+	total = 0;
+	resetScores();
+}
+
+void PhraseHits::resetScores()
+{
+	for (std::vector<int>::iterator i = catfound.begin(); i != catfound.end(); i++) {
+		catweight[*i + 1] = 0;
+		catscored[*i + 1] = false;
+	}
+	catfound.clear();
+	bannedcombis.clear();
+	weightedcombis.clear();
+}
+
 bool ListContainer::createCacheFile()
 {
 	unsigned int i;
@@ -812,15 +1065,30 @@ bool ListContainer::createCacheFile()
 	return true;
 }
 
-bool ListContainer::makeGraph(bool fqs)
+bool ListContainer::makeGraph(bool fqs, bool ac)
 {
 	force_quick_search = fqs;
+	aho_corasick = ac && !fqs;
 	if (data_length == 0)
 		return true;
 	long int i;
+	// until found to be duplicates, every phrase stands for itself
+	canonicalindex.resize(items);
+	for (i = 0; i < items; i++)
+		canonicalindex[i] = i;
+	// phrases go into the search structures shortest first, whichever engine is
+	// in use, so that duplicates are always resolved in the same order
+	std::deque<size_t> sizelist;
+	for (i = 0; i < items; i++) {
+		sizelist.push_back(i);
+	}
+	graphSizeSort(0, items - 1, &sizelist);
+	if (aho_corasick)
+		return acMakeGraph(sizelist);
 	// Quick search has been forced on - put all items on the "slow" list and be done with it
 	if (force_quick_search) {
-		for (i = 0; i < items; i++) {
+		for (std::deque<size_t>::iterator k = sizelist.begin(); k != sizelist.end(); k++) {
+			i = *k;
 			// Check to see if the item is a duplicate
 			std::string thisphrase = getItemAtInt(i);
 			bool found = false;
@@ -836,28 +1104,8 @@ bool ListContainer::makeGraph(bool fqs)
 				// Not a duplicate - store it
 				slowgraph.push_back(i);
 			} else {
-				// Duplicate - resolve the collision
-				// 
-				// Existing entry must be a combi AND
-				// new entry is not a combi so we overwrite the
-				// existing values as combi values and types are
-				// stored in the combilist
-				// OR
-				// both are weighted phrases and the new phrase is higher weighted
-				// OR
-				// the existing phrase is weighted and the new phrase is banned
-				// OR
-				// new phrase is an exception; exception phrases take precedence
-				if ((itemtype[foundindex] > 9 && itemtype[i] < 10) ||
-					(itemtype[foundindex] == 1 && itemtype[i] == 1 && (weight[i] > weight[foundindex])) ||
-					(itemtype[foundindex] == 1 && itemtype[i] == 0) ||
-					itemtype[i] == -1)
-				{
-					itemtype[foundindex] = itemtype[i];
-					weight[foundindex] = weight[i];
-					categoryindex[foundindex] = categoryindex[i];
-					timelimitindex[foundindex] = timelimitindex[i];
-				}
+				canonicalindex[i] = foundindex;
+				graphResolveDuplicate(foundindex, i);
 			}
 		}
 		return true;
@@ -881,12 +1129,6 @@ bool ListContainer::makeGraph(bool fqs)
 		return false;
 	}
 	graphitems++;
-	std::deque<size_t> sizelist;
-
-	for (i = 0; i < items; i++) {
-		sizelist.push_back(i);
-	}
-	graphSizeSort(0, items - 1, &sizelist);
 
 	for (i = 0; i < items; i++) {
 		graphAdd(String(data + list[sizelist[i]], lengthlist[sizelist[i]]), 0, sizelist[i]);
@@ -899,30 +1141,248 @@ bool ListContainer::makeGraph(bool fqs)
 	std::cout << "Second most prolific node has " << secondmaxchildnodes << " children" << std::endl;
 #endif
 
-	realgraphdata = (int*) realloc(realgraphdata, sizeof(int) * ((GRAPHENTRYSIZE * graphitems) + ROOTOFFSET));
-	if (realgraphdata == NULL) {
-		syslog(LOG_ERR, "Cannot reallocate memory for phrase tree: %s", ErrStr().c_str());
-		return false;
-	}
+	return graphCompact();
+}
 
+// copy the phrase tree into its compact, searchable form and free the original
+bool ListContainer::graphCompact()
+{
+	// offset 0 is left unused by real nodes, so that it can mean "no node"
+	graphnodes.assign(2, 0);
+	graphroot.assign(256, 0);
 	int ml = realgraphdata[2];
-	int branches;
-
-	for (i = ml - 1; i >= 0; i--) {
-		branches = graphFindBranches(realgraphdata[4 + i]);
-		if (branches < 12) {	// quicker to use B-M on node with few branches
-			graphCopyNodePhrases(realgraphdata[4 + i]);
-			// remove link to this node and so effectively remove all nodes
-			// it links to but don't recover the memory as its not worth it
-			for (int j = i; j < ml; j++) {
-				realgraphdata[4 + j] = realgraphdata[4 + j + 1];
+	for (int i = 0; i < ml; i++) {
+		unsigned int pos = realgraphdata[4 + i];
+		unsigned int offset = graphCompactNode(pos);
+		if (offset == 0)
+			return false;
+		graphroot[(unsigned char) realgraphdata[ROOTOFFSET + pos * GRAPHENTRYSIZE]] = offset;
+	}
+	std::vector<unsigned int, ListAllocator<unsigned int> >(graphnodes).swap(graphnodes);
+
+	// note the first one and two characters of every phrase, for the prefilter
+	memset(graphfirst, 0, sizeof(graphfirst));
+	graphpairs.assign(65536 / 8, 0);
+	for (int c = 0; c < 256; c++) {
+		if (graphroot[c] == 0)
+			continue;
+		graphfirst[((c >> 7) << 4) | (c & 15)] |= 1 << ((c >> 4) & 7);
+		const unsigned int *node = &graphnodes[graphroot[c]];
+		if (node[0] != 0) {
+			// a single character phrase - any following character will do
+			for (int d = 0; d < 256; d++)
+				graphpairs[(c << 5) | (d >> 3)] |= 1 << (d & 7);
+		}
+		for (unsigned int j = 0; j < node[1]; j++) {
+			unsigned char d = node[2 + j];
+			graphpairs[(c << 5) | (d >> 3)] |= 1 << (d & 7);
+		}
+	}
+
+	if (graphfilterkernel == NULL) {
+		graphfilterkernel = &graphFilterScalar;
+#ifdef HAVE_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+#ifdef DGDEBUG
+			std::cout << "Phrase tree search using AVX2 prefilter" << std::endl;
+#endif
+			graphfilterkernel = &graphFilterAVX2;
+		}
+#endif
+#ifdef HAVE_SSSE3
+		if (graphfilterkernel == &graphFilterScalar && __builtin_cpu_supports("ssse3")) {
+#ifdef DGDEBUG
+			std::cout << "Phrase tree search using SSSE3 prefilter" << std::endl;
+#endif
+			graphfilterkernel = &graphFilterSSSE3;
+		}
+#endif
+	}
+
+#ifdef DGDEBUG
+	std::cout << "Bytes needed for compact phrase tree: " << (sizeof(unsigned int) * (graphnodes.size() + graphroot.size()))
+		<< ", instead of " << (sizeof(int) * ((GRAPHENTRYSIZE * graphitems) + ROOTOFFSET)) << std::endl;
+#endif
+
+	free(realgraphdata);
+	realgraphdata = NULL;
+	current_graphdata_size = 0;
+	return true;
+}
+
+// copy a node and everything beneath it into the compact tree, returning its offset.
+// returns 0 if the tree has grown too big for links to be stored in 24 bits.
+unsigned int ListContainer::graphCompactNode(unsigned int pos)
+{
+	int *graphdata = realgraphdata + ROOTOFFSET + pos * GRAPHENTRYSIZE;
+	unsigned int offset = graphnodes.size();
+	unsigned int links = graphdata[2];
+	if ((offset + 2 + links) > 0xffffff) {
+		syslog(LOG_ERR, "Phrase tree too big for compact storage (more than %d entries)", 0xffffff);
+		if (!is_daemonised)
+			std::cout << "Phrase tree too big for compact storage (more than " << 0xffffff << " entries)" << std::endl;
+		return 0;
+	}
+	graphnodes.push_back((graphdata[1] == 1) ? graphdata[3] + 1 : 0);
+	graphnodes.push_back(links);
+	graphnodes.resize(offset + 2 + links, 0);
+
+	// links are stored sorted by letter, so searches can stop early
+	std::vector<std::pair<unsigned char, unsigned int> > children;
+	unsigned int i;
+	for (i = 0; i < links; i++) {
+		unsigned int child = graphdata[4 + i];
+		children.push_back(std::pair<unsigned char, unsigned int>((unsigned char) realgraphdata[ROOTOFFSET + child * GRAPHENTRYSIZE], child));
+	}
+	std::sort(children.begin(), children.end());
+	for (i = 0; i < links; i++) {
+		unsigned int child = graphCompactNode(children[i].second);
+		if (child == 0)
+			return 0;
+		graphnodes[offset + 2 + i] = (child << 8) | children[i].first;
+	}
+	return offset;
+}
+
+// Resolve a collision between a phrase already in the search structure and a
+// duplicate of it being added.  Combination parts are overridden by normal
+// phrases, higher weights beat lower ones, banned beats weighted, and
+// exceptions beat everything.  Item types are:
+// -1=exception
+// 0=banned
+// 1=weighted
+// 10 = combination exception
+// 11 = combination banned
+// 12 = combination weighted
+// 20,21,22 = end of combi marker
+void ListContainer::graphResolveDuplicate(unsigned int existing, unsigned int item)
+{
+	if ((itemtype[existing] > 9 && itemtype[item] < 10) ||
+		(itemtype[existing] == 1 && itemtype[item] == 1 && (weight[item] > weight[existing])) ||
+		(itemtype[existing] == 1 && itemtype[item] == 0) ||
+		itemtype[item] == -1)
+	{
+		itemtype[existing] = itemtype[item];
+		weight[existing] = weight[item];
+		categoryindex[existing] = categoryindex[item];
+		timelimitindex[existing] = timelimitindex[item];
+	}
+}
+
+// Build an Aho-Corasick automaton containing every phrase in the list.
+// Unlike the graph, this finds all phrases in a single pass over the document,
+// so search time no longer depends on how many phrases begin at each position.
+// Phrases are added in the given order, as for the graph (see makeGraph).
+bool ListContainer::acMakeGraph(const std::deque<size_t> &sizelist)
+{
+	// build the plain trie first, using per-node child lists
+	std::vector<std::vector<std::pair<unsigned char, int> > > trie(1);
+	acoutput.assign(1, -1);
+	long int i;
+	size_t j, k;
+	int node, next;
+	unsigned char c;
+	for (std::deque<size_t>::const_iterator p = sizelist.begin(); p != sizelist.end(); p++) {
+		i = *p;
+		const char *phrase = data + list[i];
+		node = 0;
+		for (j = 0; j < lengthlist[i]; j++) {
+			c = (unsigned char) phrase[j];
+			next = -1;
+			for (k = 0; k < trie[node].size(); k++) {
+				if (trie[node][k].first == c) {
+					next = trie[node][k].second;
+					break;
+				}
+			}
+			if (next < 0) {
+				next = trie.size();
+				trie[node].push_back(std::pair<unsigned char, int>(c, next));
+				trie.push_back(std::vector<std::pair<unsigned char, int> >());
+				acoutput.push_back(-1);
 			}
-			realgraphdata[2]--;
+			node = next;
+		}
+		if (acoutput[node] < 0)
+			acoutput[node] = i;
+		else
+			graphResolveDuplicate(acoutput[node], i);
+		canonicalindex[i] = acoutput[node];
+	}
+
+	// flatten child lists into sorted runs
+	size_t nodes = trie.size();
+	acroot.assign(256, 0);
+	acfirstchild.assign(nodes, 0);
+	acnumchildren.assign(nodes, 0);
+	acfail.assign(nodes, 0);
+	acdictlink.assign(nodes, 0);
+	acchildchar.clear();
+	acchildnode.clear();
+	acchildchar.reserve(nodes);
+	acchildnode.reserve(nodes);
+	for (j = 0; j < nodes; j++) {
+		std::sort(trie[j].begin(), trie[j].end());
+		if (j == 0) {
+			for (k = 0; k < trie[0].size(); k++)
+				acroot[trie[0][k].first] = trie[0][k].second;
+			continue;
+		}
+		acfirstchild[j] = acchildchar.size();
+		acnumchildren[j] = trie[j].size();
+		for (k = 0; k < trie[j].size(); k++) {
+			acchildchar.push_back(trie[j][k].first);
+			acchildnode.push_back(trie[j][k].second);
 		}
+		std::vector<std::pair<unsigned char, int> >().swap(trie[j]);
+	}
+
+	// breadth-first walk to fill in failure and dictionary links
+	std::deque<int> queue;
+	for (k = 0; k < 256; k++) {
+		if (acroot[k] > 0)
+			queue.push_back(acroot[k]);
 	}
+	int u, f, t;
+	while (!queue.empty()) {
+		u = queue.front();
+		queue.pop_front();
+		for (k = acfirstchild[u]; k < (size_t) (acfirstchild[u] + acnumchildren[u]); k++) {
+			c = acchildchar[k];
+			next = acchildnode[k];
+			f = acfail[u];
+			while ((t = acGoto(f, c)) < 0)
+				f = acfail[f];
+			acfail[next] = t;
+			acdictlink[next] = (acoutput[t] >= 0) ? t : acdictlink[t];
+			queue.push_back(next);
+		}
+	}
+
+#ifdef DGDEBUG
+	std::cout << "Aho-Corasick automaton: " << nodes << " nodes, " << acchildchar.size() << " transitions" << std::endl;
+#endif
 	return true;
 }
 
+// follow the transition for the given char from the given node.
+// the root always has a transition (to itself, if nothing else); other
+// nodes return -1 if they have no transition for this char.
+int ListContainer::acGoto(int node, unsigned char c)
+{
+	if (node == 0)
+		return acroot[c];
+	int k = acfirstchild[node];
+	int e = k + acnumchildren[node];
+	for (; k < e; k++) {
+		if (acchildchar[k] == c)
+			return acchildnode[k];
+		if (acchildchar[k] > c)
+			break;
+	}
+	return -1;
+}
+
 void ListContainer::graphSizeSort(int l, int r, std::deque<size_t> *sizelist)
 {
 	if (r <= l)
@@ -974,81 +1434,10 @@ void ListContainer::graphSizeSort(int l, int r, std::deque<size_t> *sizelist)
 	graphSizeSort(i, r, sizelist);
 }
 
-// find the total number of children a node has, along all branches
-int ListContainer::graphFindBranches(unsigned int pos)
+// count occurrences of the phrase in the document.  the document is only read:
+// it may be shared with other threads, or with other searches of the same text.
+int ListContainer::bmsearch(const char *file, off_t fl, const char *phrase, off_t pl)
 {
-	int branches = 0;
-	int * graphdata;
-	if (pos == 0)
-		graphdata = realgraphdata;
-	else
-		graphdata = realgraphdata + ROOTOFFSET;
-	int links = graphdata[pos * GRAPHENTRYSIZE + 2];
-	for (int i = 0; i < links; i++) {
-		branches += graphFindBranches(graphdata[pos * GRAPHENTRYSIZE + 4 + i]);
-	}
-	if (links > 1) {
-		branches += links - 1;
-	}
-
-	return branches;
-}
-
-// copy all phrases starting from a given root link into the slowgraph
-void ListContainer::graphCopyNodePhrases(unsigned int pos)
-{
-	int * graphdata;
-	if (pos == 0)
-		graphdata = realgraphdata;
-	else
-		graphdata = realgraphdata + ROOTOFFSET;
-	int links = graphdata[pos * GRAPHENTRYSIZE + 2];
-	int i;
-	for (i = 0; i < links; i++) {
-		graphCopyNodePhrases(graphdata[pos * GRAPHENTRYSIZE + 4 + i]);
-	}
-	bool found = false;
-	unsigned int foundindex = 0;
-	unsigned int phrasenumber = graphdata[pos * GRAPHENTRYSIZE + 3];
-	std::string thisphrase = getItemAtInt(phrasenumber);
-	for (std::vector<unsigned int>::iterator i = slowgraph.begin(); i != slowgraph.end(); i++) {
-		if (getItemAtInt(*i) == thisphrase) {
-			found = true;
-			foundindex = *i;
-			break;
-		}
-	}
-	if (!found) {
-		slowgraph.push_back(phrasenumber);
-	} else {
-		// Duplicate - resolve the collision
-		// 
-		// Existing entry must be a combi AND
-		// new entry is not a combi so we overwrite the
-		// existing values as combi values and types are
-		// stored in the combilist
-		// OR
-		// both are weighted phrases and the new phrase is higher weighted
-		// OR
-		// the existing phrase is weighted and the new phrase is banned
-		// OR
-		// new phrase is an exception; exception phrases take precedence
-		if ((itemtype[foundindex] > 9 && itemtype[phrasenumber] < 10) ||
-			(itemtype[foundindex] == 1 && itemtype[phrasenumber] == 1 && (weight[phrasenumber] > weight[foundindex])) ||
-			(itemtype[foundindex] == 1 && itemtype[phrasenumber] == 0) ||
-			itemtype[phrasenumber] == -1)
-		{
-			itemtype[foundindex] = itemtype[phrasenumber];
-			weight[foundindex] = weight[phrasenumber];
-			categoryindex[foundindex] = categoryindex[phrasenumber];
-			timelimitindex[foundindex] = timelimitindex[phrasenumber];
-		}
-	}
-}
-
-int ListContainer::bmsearch(char *file, off_t fl, const std::string& s)
-{
-	off_t pl = s.length();
 	if (fl < pl)
 		return 0;  // reality checking
 	if (pl > 126)
@@ -1057,29 +1446,12 @@ int ListContainer::bmsearch(char *file, off_t fl, const std::string& s)
 	// must match all
 	off_t j, l;  // counters
 	int p;  // to hold precalcuated value for speed
-	bool match;  // flag
 	int qsBc[256];  // Quick Search Boyer Moore shift table (256 alphabet)
-	char *k;  // pointer used in matching
+	const char *k;  // pointer used in matching
 
 	int count = 0;
 
-	char *phrase = new char[pl + 1];
-	for (j = 0; j < pl; j++) {
-		phrase[j] = s[j];
-	}
-	phrase[pl] = 0;
-
-	// For speed we append the phrase to the end of the memory block so it
-	// is always found, thus eliminating some checking.  This is possible as
-	// we know an extra 127 bytes have been provided by NaughtyFilter.cpp
-	// and also the OptionContainer does not allow phrase lengths greater
-	// than 126 chars
-	k = file + fl;
-	for (j = 0; j < pl; j++) {
-		k[j] = s[j];
-	}
-
-	// Next we need to make the Quick Search Boyer Moore shift table
+	// First we need to make the Quick Search Boyer Moore shift table
 
 	p = pl + 1;
 	for (j = 0; j < 256; j++) {	// Preprocessing
@@ -1089,149 +1461,147 @@ int ListContainer::bmsearch(char *file, off_t fl, const std::string& s)
 		qsBc[(unsigned char) phrase[j]] = pl - j;
 	}
 
-	// Now do the searching!
+	// Now do the searching!  the shift looks at the character just past the
+	// window, so stop once there isn't one, checking the last window by itself.
 
-	for (j = 0;;) {
+	for (j = 0; j + pl < fl; j += qsBc[(unsigned char) file[j + pl]]) {
 		k = file + j;
-		match = true;
 		for (l = 0; l < pl; l++) {	// quiv, but faster, memcmp()
-			if (k[l] != phrase[l]) {
-				match = false;
+			if (k[l] != phrase[l])
 				break;
-			}
 		}
-		if (match) {
-			if (j >= fl) {
-				break;  // is the end of file marker
-			}
+		if (l == pl)
 			count++;
-		}
-		j += qsBc[(unsigned char) file[j + pl]];  // shift
 	}
-	delete[]phrase;
+	if (j + pl == fl && memcmp(file + j, phrase, pl) == 0)
+		count++;
 	return count;
 }
 
-// Format of the data is each entry has GRAPHENTRYSIZE int values with format of:
-// [letter][last letter flag][num links][from phrase][link0][link1]...
+// find all phrases in the document with the Aho-Corasick automaton.
+// results are in the same form as those of the graph search.
+void ListContainer::acSearch(PhraseHits &hits, char *doc, off_t len)
+{
+	int state = 0;
+	streamSearch(hits, doc, len, state);
+#ifdef DGDEBUG
+	std::cout << "Hits (Aho-Corasick) start" << std::endl;
+	for (std::vector<unsigned int>::iterator i = hits.found.begin(); i != hits.found.end(); i++) {
+		std::cout << "Hit: " << getItemAtInt(*i) << " " << hits.count[*i] << std::endl;
+	}
+	std::cout << "Hits (Aho-Corasick) end" << std::endl;
+#endif
+}
+
+// continue an Aho-Corasick search from the given state, which is updated
+// so that phrases spanning the end of this piece are found in the next
+void ListContainer::streamSearch(PhraseHits &hits, const char *doc, off_t len, int &state)
+{
+	int t;
+	for (off_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) doc[i];
+		while ((t = acGoto(state, c)) < 0)
+			state = acfail[state];
+		state = t;
+		// report the phrase ending here, plus any that are suffixes of it
+		for (t = (acoutput[state] >= 0) ? state : acdictlink[state]; t > 0; t = acdictlink[t]) {
+			hits.hit(acoutput[t]);
+#ifdef DGDEBUG
+			std::cout << "Found this phrase: " << getItemAtInt(acoutput[t]) << std::endl;
+#endif
+		}
+	}
+}
 
-void ListContainer::graphSearch(std::map<std::string, std::pair<unsigned int, int> >& result, char *doc, off_t len)
+// see ListContainer.hpp for the format of the compact phrase tree searched here
+
+// hits must have been prepared for this list (see PhraseHits::prepare)
+void ListContainer::graphSearch(PhraseHits &hits, char *doc, off_t len)
 {
-	off_t i, j, k;
-	std::map<std::string, std::pair<unsigned int, int> >::iterator existingitem;
+	if (aho_corasick) {
+		acSearch(hits, doc, len);
+		return;
+	}
+
+	off_t i, j;
 	
-	//do standard quick search on short branches (or everything, if force_quick_search is on)
+	//do standard quick search if force_quick_search is on
 	for (std::vector<unsigned int>::iterator i = slowgraph.begin(); i != slowgraph.end(); i++) {
-		std::string phrase = getItemAtInt(*i);
-		j = bmsearch(doc, len, phrase);
-		for (k = 0; k < j; k++) {
-			existingitem = result.find(phrase);
-			if (existingitem == result.end()) {
-				result[phrase] = std::pair<unsigned int, int>(*i, 1);
-			} else {
-				existingitem->second.second++;
-			}
-		}
+		j = bmsearch(doc, len, data + list[*i], lengthlist[*i]);
+		if (j > 0)
+			hits.hit(*i, j);
 	}
 	
 	if (force_quick_search || graphitems == 0) {
 #ifdef DGDEBUG
-		std::cout << "Map (quicksearch) start" << std::endl;
-		for (std::map<std::string, std::pair<unsigned int, int> >::iterator i = result.begin(); i != result.end(); i++) {
-			std::cout << "Map: " << i->first << " " << i->second.second << std::endl;
+		std::cout << "Hits (quicksearch) start" << std::endl;
+		for (std::vector<unsigned int>::iterator i = hits.found.begin(); i != hits.found.end(); i++) {
+			std::cout << "Hit: " << getItemAtInt(*i) << " " << hits.count[*i] << std::endl;
 		}
-		std::cout << "Map (quicksearch) end" << std::endl;
+		std::cout << "Hits (quicksearch) end" << std::endl;
 #endif
 		return;
 	}
 	
-	off_t sl;
-	off_t ppos;
-	off_t currnode;
-	int * graphdata = realgraphdata;
-	off_t ml;
-	char p;
-	off_t pos;
-	off_t depth;
-	// number of links from root node to first letter of phrase
-	ml = graphdata[2] + 4;
-	// iterate over entire document
-	for (i = 0; i < len; i++) {
-		// iterate over all children of the root node
-		for (j = 4; j < ml; j++) {
-			// grab the endpoint of this link
-			pos = realgraphdata[j];
-			sl = 0;
-
-			// now comes the main graph search!
-			// this is basically a depth-first tree search
-			depth = 0;
-			while (true) {
-				// get the address of the link endpoint and the data actually stored at it
-				// note that this only works for GRAPHENTRYSIZE == 64
-				ppos = pos << 6;
-				if (ppos == 0)
-					graphdata = realgraphdata;
-				else
-					graphdata = realgraphdata + ROOTOFFSET;
-				p = graphdata[ppos];
-
-				// does the character at this string depth match the relevant character in the node we're currently looking at?
-				if (p == doc[i + depth]) {
-					// it does!
-					// is this graph node marked as being the end of a phrase?
-					if (graphdata[ppos + 1] == 1) {
-						// it is, so store the pointer to the matched phrase.
-						std::string phrase = getItemAtInt(graphdata[ppos + 3]);
-						existingitem = result.find(phrase);
-						if (existingitem == result.end()) {
-							result[phrase] = std::pair<unsigned int, int>(graphdata[ppos + 3], 1);
-						} else {
-							existingitem->second.second++;
-						}
+	const unsigned int *node;
+	const unsigned int *link;
+	const unsigned int *lastlink;
+	unsigned int offset;
+	unsigned int candidates;
+	unsigned char c;
+	const unsigned char *udoc = (const unsigned char*) doc;
+	// iterate over entire document, 32 characters at a time.
+	// reading past the end is safe, as the document is followed by padding,
+	// and anything found there is masked out.
+	for (off_t block = 0; block < len; block += 32) {
+		// only look further at positions where the first character of a phrase
+		// appears, followed by a character which can come second in that phrase
+		candidates = graphfilterkernel(udoc + block, graphfirst);
+		if ((len - block) < 32)
+			candidates &= (1u << (len - block)) - 1;
+		while (candidates != 0) {
+			i = block + __builtin_ctz(candidates);
+			candidates &= candidates - 1;
+			if ((graphpairs[(udoc[i] << 5) | (udoc[i + 1] >> 3)] & (1 << (udoc[i + 1] & 7))) == 0)
+				continue;
+			// go straight to the node for the first letter, then follow
+			// the document's letters down the tree for as long as possible.
+			// there is only ever one child of a given node for a given letter,
+			// so no backtracking is necessary.
+			offset = graphroot[udoc[i]];
+			j = i;
+			while (offset != 0) {
+				node = &graphnodes[offset];
+				// is this node marked as being the end of a phrase?
+				if (node[0] != 0) {
+					// it is, so count a hit on the matched phrase.
+					hits.hit(node[0] - 1);
 #ifdef DGDEBUG
-						std::cout << "Found this phrase: " << phrase << std::endl;
+					std::cout << "Found this phrase: " << getItemAtInt(node[0] - 1) << std::endl;
 #endif
-					}
-					// grab this node's number of children
-					sl = graphdata[ppos + 2];
-					if (sl > 0) {
-						// this is now the node we're interested in looking at the children of
-						currnode = ppos;
-						// zip straight to the first child of the matched node
-						// (this is the magic that makes it depth first)
-						pos = graphdata[ppos + 4];
-						depth++;
-						continue;
-					}
-					// if we just matched a node that has no children,
-					// we can stop searching. there should be no case in
-					// which the node was not also marked as end of phrase.
-					else break;
 				}
-
-				if ((--sl) > 0) {
-					// if we get here, we have discounted one child, but
-					// we still have more children to examine from the last matched node.
-					// we don't keep more than one current interesting node - no backtracking
-					// is necessary, as there is only ever one occurrence of a given character as
-					// a branch of a given node.  backtracking would therefore never
-					// trigger a match down a different route than has been taken thus far, so
-					// don't bother.
-					pos = graphdata[currnode + 4 + (graphdata[currnode + 2] - sl)];
-					continue;
+				// look for the next letter amongst this node's children
+				if (++j >= len)
+					break;
+				c = udoc[j];
+				offset = 0;
+				lastlink = node + 2 + node[1];
+				for (link = node + 2; link < lastlink; link++) {
+					if ((unsigned char) *link >= c) {
+						if ((unsigned char) *link == c)
+							offset = *link >> 8;
+						break;
+					}
 				}
-				// if we get here, we've discounted all branches at this depth, and the search is over.
-				break;
 			}
 		}
 	}
 #ifdef DGDEBUG
-	std::cout << "Map start" << std::endl;
-	for (std::map<std::string, std::pair<unsigned int, int> >::iterator i = result.begin(); i != result.end(); i++) {
-		std::cout << "Map: " << i->first << " " << i->second.second << std::endl;
+	std::cout << "Hits start" << std::endl;
+	for (std::vector<unsigned int>::iterator i = hits.found.begin(); i != hits.found.end(); i++) {
+		std::cout << "Hit: " << getItemAtInt(*i) << " " << hits.count[*i] << std::endl;
 	}
-	std::cout << "Map end" << std::endl;
+	std::cout << "Hits end" << std::endl;
 #endif
 }
 
@@ -1272,35 +1642,8 @@ void ListContainer::graphAdd(String s, const int inx, int item)
 			if (px == 1) {
 				// the exact phrase is already there
 				px = graphdata2[(graphdata[inx * GRAPHENTRYSIZE + 4 + i]) * GRAPHENTRYSIZE + 3];
-
-				// -1=exception
-				// 0=banned
-				// 1=weighted
-				// 10 = combination exception
-				// 11 = combination banned
-				// 12 = combination weighted
-				// 20,21,22 = end of combi marker
-				if ((itemtype[px] > 9 && itemtype[item] < 10) ||
-					(itemtype[px] == 1 && itemtype[item] == 1 && (weight[item] > weight[px])) ||
-					(itemtype[px] == 1 && itemtype[item] == 0) ||
-					itemtype[item] == -1)
-				{
-					// exists as a combi entry already
-					// if got here existing entry must be a combi AND
-					// new entry is not a combi so we overwrite the
-					// existing values as combi values and types are
-					// stored in the combilist
-					// OR
-					// both are weighted phrases and the new phrase is higher weighted
-					// OR
-					// the existing phrase is weighted and the new phrase is banned
-					// OR
-					// new phrase is an exception; exception phrases take precedence
-					itemtype[px] = itemtype[item];
-					weight[px] = weight[item];
-					categoryindex[px] = categoryindex[item];
-					timelimitindex[px] = timelimitindex[item];
-				}
+				canonicalindex[item] = px;
+				graphResolveDuplicate(px, item);
 			}
 		}
 	}
@@ -1622,15 +1965,43 @@ bool ListContainer::isCacheFileNewer(const char *filename)
 
 void ListContainer::increaseMemoryBy(size_t bytes)
 {
-	if (data_memory > 0) {
-		data = (char*) realloc(data, (data_memory + bytes) * sizeof(char));
-		memset(data + data_memory, 0, bytes * sizeof(char));
-		data_memory += bytes;
-	} else {
-		free(data);
-		data = (char*) calloc(bytes, sizeof(char));
-		data_memory = bytes;
-	}
+	protect(false);
+	char *newdata = (char*) listArenaAlloc(data_memory + bytes);
+	if (newdata == NULL)
+		throw std::bad_alloc();
+	if (data_memory > 0)
+		memcpy(newdata, data, data_memory);
+	memset(newdata + data_memory, 0, bytes);
+	listArenaFree(data, data_memory);
+	data = newdata;
+	data_memory += bytes;
+}
+
+// the list is complete - make the arrays it is searched through read-only
+void ListContainer::freeze()
+{
+	protect(true);
+}
+
+void ListContainer::protect(bool readonly)
+{
+	if (frozen == readonly)
+		return;
+	frozen = readonly;
+	listArenaProtect(data, data_memory, readonly);
+	listArrayProtect(list, readonly);
+	listArrayProtect(lengthlist, readonly);
+	listArrayProtect(graphroot, readonly);
+	listArrayProtect(graphnodes, readonly);
+	listArrayProtect(graphpairs, readonly);
+	listArrayProtect(acroot, readonly);
+	listArrayProtect(acfail, readonly);
+	listArrayProtect(acoutput, readonly);
+	listArrayProtect(acdictlink, readonly);
+	listArrayProtect(acfirstchild, readonly);
+	listArrayProtect(acnumchildren, readonly);
+	listArrayProtect(acchildchar, readonly);
+	listArrayProtect(acchildnode, readonly);
 }
 
 size_t getFileLength(const char *filename)
@@ -1741,23 +2112,38 @@ bool ListContainer::readTimeTag(String * tag, TimeLimit& tl)
 // Returns true if the current time is within the limits specified on this list.
 // For phrases, the time limit list index must be passed in -
 // included lists don't have their own ListContainer, so time limits are stored differently.
+bool ListContainer::isTimeLimited()
+{
+	if (istimelimited) {
+		return true;
+	}
+	for (unsigned int i = 0; i < morelists.size(); i++) {
+		if ((*o.lm.l[morelists[i]]).isTimeLimited()) {
+			return true;
+		}
+	}
+	return false;
+}
+
 bool ListContainer::isNow(int index)
 {
 	if (!istimelimited) {
 		return true;
 	}
-	TimeLimit& tl = listtimelimit;
+	// a pointer, not a reference - assigning through a reference would
+	// overwrite the list's own time limit with the phrase's
+	const TimeLimit *tl = &listtimelimit;
 	if (index > -1) {
-		tl = timelimits[index];
+		tl = &timelimits[index];
 	}
 	time_t tnow;  // to hold the result from time()
-	struct tm *tmnow;  // to hold the result from localtime()
+	struct tm tmnow;  // to hold the result from localtime_r()
 	unsigned int hour, min, wday;
 	time(&tnow);  // get the time after the lock so all entries in order
-	tmnow = localtime(&tnow);  // convert to local time (BST, etc)
-	hour = tmnow->tm_hour;
-	min = tmnow->tm_min;
-	wday = tmnow->tm_wday;
+	localtime_r(&tnow, &tmnow);  // convert to local time (BST, etc)
+	hour = tmnow.tm_hour;
+	min = tmnow.tm_min;
+	wday = tmnow.tm_wday;
 	// wrap week to start on Monday
 	if (wday == 0) {
 		wday = 7;
@@ -1765,8 +2151,8 @@ bool ListContainer::isNow(int index)
 	wday--;
 	unsigned char cday = '0' + wday;
 	bool matchday = false;
-	for (unsigned int i = 0; i < tl.days.length(); i++) {
-		if (tl.days[i] == cday) {
+	for (unsigned int i = 0; i < tl->days.length(); i++) {
+		if (tl->days[i] == cday) {
 			matchday = true;
 			break;
 		}
@@ -1774,24 +2160,24 @@ bool ListContainer::isNow(int index)
 	if (!matchday) {
 		return false;
 	}
-	if (hour < tl.sthour) {
+	if (hour < tl->sthour) {
 		return false;
 	}
-	if (hour > tl.endhour) {
+	if (hour > tl->endhour) {
 		return false;
 	}
-	if (hour == tl.sthour) {
-		if (min < tl.stmin) {
+	if (hour == tl->sthour) {
+		if (min < tl->stmin) {
 			return false;
 		}
 	}
-	if (hour == tl.endhour) {
-		if (min > tl.endmin) {
+	if (hour == tl->endhour) {
+		if (min > tl->endmin) {
 			return false;
 		}
 	}
 #ifdef DGDEBUG
-	std::cout << "time match " << tl.sthour << ":" << tl.stmin << "-" << tl.endhour << ":" << tl.endmin << " " << hour << ":" << min << " " << sourcefile << std::endl;
+	std::cout << "time match " << tl->sthour << ":" << tl->stmin << "-" << tl->endhour << ":" << tl->endmin << " " << hour << ":" << min << " " << sourcefile << std::endl;
 #endif
 	return true;
 }
@@ -14,6 +14,8 @@
 #include <deque>
 #include <map>
 #include <string>
+#include <new>
+#include <cstddef>
 #include "String.hpp"
 
 
@@ -28,6 +30,122 @@ struct TimeLimit {
 time_t getFileDate(const char *filename);
 size_t getFileLength(const char *filename);
 
+// memory for the arrays which lists are searched through.  blocks of a page or more
+// are given pages of their own, so that once a list has been loaded they can be made
+// read-only (see ListContainer::freeze) - children then share them with the parent
+// for good, and anything which tries to write to them is caught in the act.
+// blocks of 2MB or more go in huge pages where possible, so that searching big lists
+// takes fewer TLB misses.
+void *listArenaAlloc(size_t bytes);
+void listArenaFree(void *p, size_t bytes);
+void listArenaProtect(void *p, size_t bytes, bool readonly);
+// whether to use huge pages for blocks allocated from now on (hugepagelists)
+void listArenaHugePages(bool enable);
+
+template <class T> class ListAllocator
+{
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template <class U> struct rebind { typedef ListAllocator<U> other; };
+
+	ListAllocator() {};
+	template <class U> ListAllocator(const ListAllocator<U>&) {};
+
+	pointer address(reference x) const { return &x; };
+	const_pointer address(const_reference x) const { return &x; };
+	pointer allocate(size_type n, const void* = 0)
+	{
+		void *p = listArenaAlloc(n * sizeof(T));
+		if (p == NULL)
+			throw std::bad_alloc();
+		return (pointer) p;
+	};
+	void deallocate(pointer p, size_type n) { listArenaFree(p, n * sizeof(T)); };
+	size_type max_size() const { return ((size_t) -1) / sizeof(T); };
+	void construct(pointer p, const T &v) { new ((void*) p) T(v); };
+	void destroy(pointer p) { p->~T(); };
+};
+template <class T, class U> bool operator==(const ListAllocator<T>&, const ListAllocator<U>&) { return true; }
+template <class T, class U> bool operator!=(const ListAllocator<T>&, const ListAllocator<U>&) { return false; }
+
+// hit counters for phrase list searches, indexed by phrase number, along with
+// the list of phrases actually found.  also holds the per-category scores
+// built up while weighting the results.  meant to be kept and reused from one
+// document to the next: once grown to fit the largest list in use, searching
+// and scoring make no heap allocations.
+class PhraseHits
+{
+public:
+	// occurrences of each phrase
+	std::vector<int> count;
+	// phrases with non-zero counts, in the order first found
+	std::vector<unsigned int> found;
+	// occurrences of all phrases put together, so that anyone scoring the
+	// results bit by bit can tell if there's anything new
+	unsigned long total;
+
+	// score of each category, offset by one so that category -1
+	// (embedded URLs) has a slot, and the categories actually scored
+	std::vector<int> catweight;
+	std::vector<bool> catscored;
+	std::vector<int> catfound;
+
+	// combination phrases matched - offsets of their first parts in the list's combilist
+	std::vector<size_t> bannedcombis;
+	std::vector<size_t> weightedcombis;
+
+	PhraseHits(): total(0) {};
+
+	// make room for a list with this many phrases & categories
+	void prepare(size_t phrases, size_t categories);
+	// zero the counters touched by the last document
+	void reset();
+	// zero the category scores & combination matches only, keeping the counts
+	void resetScores();
+
+	void hit(unsigned int index, int n = 1)
+	{
+		if (count[index] == 0)
+			found.push_back(index);
+		count[index] += n;
+		total += n;
+	}
+	// score a category (-1 for embedded URLs): the first time it is scored
+	// its score is set to first, after that further is added to it
+	void scoreCategory(int cat, int first, int further)
+	{
+		if (catscored[cat + 1]) {
+			catweight[cat + 1] += further;
+			return;
+		}
+		catscored[cat + 1] = true;
+		catweight[cat + 1] = first;
+		catfound.push_back(cat);
+	}
+};
+
+class ListContainer;
+
+// details of the item found by an item list lookup.  handed back to the caller
+// rather than remembered by the list, so that one list can be searched by
+// several threads at once.
+struct ListResult
+{
+	ListResult(): list(NULL) {};
+
+	// the (sub)list the item was found in
+	ListContainer *list;
+
+	// category of that list - empty if nothing was found
+	const char *category();
+};
+
 class ListContainer
 {
 public:
@@ -36,6 +154,8 @@ public:
 	bool parent;
 	time_t filedate;
 	bool used;
+	// phrase lists - search with an Aho-Corasick automaton instead of the graph
+	bool aho_corasick;
 	String bannedpfile;
 	String exceptionpfile;
 	String weightedpfile;
@@ -44,7 +164,6 @@ public:
 	time_t weightedpfiledate;
 	String sourcefile;  // used for non-phrase lists only
 	String category;
-	String lastcategory;
 	std::vector<int> morelists;  // has to be non private as reg exp compiler needs to access these
 
 	ListContainer();
@@ -56,14 +175,15 @@ public:
 	bool readItemList(const char *filename, bool startswith, int filters);
 
 	bool inList(const char *string);
-	bool inListEndsWith(const char *string);
-	bool inListStartsWith(const char *string);
+	// lookups fill in result, if given, with details of the item found
+	bool inListEndsWith(const char *string, ListResult *result = NULL);
+	bool inListStartsWith(const char *string, ListResult *result = NULL);
 
-	char *findInList(const char *string);
+	const char *findInList(const char *string, ListResult *result = NULL);
 
-	char *findEndsWith(const char *string);
-	char *findStartsWith(const char *string);
-	char *findStartsWithPartial(const char *string);
+	const char *findEndsWith(const char *string, ListResult *result = NULL);
+	const char *findStartsWith(const char *string, ListResult *result = NULL);
+	const char *findStartsWithPartial(const char *string, ListResult *result = NULL);
 
 
 	int getListLength()
@@ -74,11 +194,26 @@ public:
 
 	int getWeightAt(unsigned int index);
 	int getTypeAt(unsigned int index);
+	int getCategoryIndexAt(unsigned int index);
+	// index of the phrase searches report in place of this one (they differ for duplicates)
+	unsigned int getCanonicalAt(unsigned int index)
+	{
+		return canonicalindex[index];
+	}
+	size_t getCategoryCount()
+	{
+		return listcategory.size();
+	}
+	// sort found phrases into the order of their text
+	void sortHits(PhraseHits &hits);
 
 	void doSort(const bool startsWith);
+	// the list has been loaded - make the memory it is searched through read-only
+	// (sorting does this for item lists).  undone by reset.
+	void freeze();
 
 	bool createCacheFile();
-	bool makeGraph(bool fqs);
+	bool makeGraph(bool fqs, bool ac = false);
 
 	bool previousUseItem(const char *filename, bool startswith, int filters);
 	bool upToDate();
@@ -86,9 +221,16 @@ public:
 	String getListCategoryAt(int index, int *catindex = NULL);
 	String getListCategoryAtD(int index);
 
-	void graphSearch(std::map<std::string, std::pair<unsigned int, int> >& result, char *doc, off_t len);
+	void graphSearch(PhraseHits &hits, char *doc, off_t len);
+	// search a document in pieces - state carries the position in the
+	// automaton from one piece to the next, and must start out as 0.
+	// only possible when searching with Aho-Corasick.
+	bool canStreamSearch() { return aho_corasick; };
+	void streamSearch(PhraseHits &hits, const char *doc, off_t len, int &state);
 	
 	bool isNow(int index = -1);
+	// does this list, or any list it includes, only apply at certain times?
+	bool isTimeLimited();
 	bool checkTimeAt(unsigned int index);
 	bool checkTimeAtD(int index);
 
@@ -103,12 +245,26 @@ private:
 	int sourcefilters;
 	char *data;
 
-	// Format of the data is each entry has 64 int values with format of:
+	// Phrase tree as built by graphAdd - each entry has 64 int values with format of:
 	// [letter][last letter flag][num links][from phrase][link0][link1]...
+	// only needed whilst building; freed once copied into the compact form below.
 
 	int *realgraphdata;
 	int current_graphdata_size;
 
+	// Phrase tree as searched.  graphroot maps the first letter of a phrase
+	// to the offset of its node in graphnodes (0 meaning no such phrase).
+	// Each node is a variable length record:
+	// [from phrase + 1, or 0 if no phrase ends here][num links][link0][link1]...
+	// where each link is (offset of child << 8) | letter, sorted by letter.
+	std::vector<unsigned int, ListAllocator<unsigned int> > graphroot;
+	std::vector<unsigned int, ListAllocator<unsigned int> > graphnodes;
+	// prefilter for the above - the characters which can start a phrase
+	// (see graphFilterScalar), and a bitmap of the first two characters of
+	// every phrase, indexed by (first << 8) | second.
+	unsigned char graphfirst[32];
+	std::vector<unsigned char, ListAllocator<unsigned char> > graphpairs;
+
 #ifdef DGDEBUG
 	bool prolificroot;
 	int secondmaxchildnodes;
@@ -123,11 +279,26 @@ private:
 	bool isSW;
 	bool issorted;
 	bool graphused;
-	std::vector<size_t > list;
-	std::vector<size_t > lengthlist;
+	bool frozen;
+	std::vector<size_t, ListAllocator<size_t> > list;
+	std::vector<size_t, ListAllocator<size_t> > lengthlist;
 	std::vector<int > weight;
 	std::vector<int > itemtype;  // 0=banned, 1=weighted, -1=exception
+	std::vector<unsigned int> canonicalindex;  // for phrase lists - see getCanonicalAt
 	bool force_quick_search;
+
+	// Aho-Corasick automaton, built instead of the graph if requested.
+	// Nodes are held in parallel arrays, node 0 being the root.  The root's
+	// transitions are a full 256-entry table; every other node's transitions
+	// are a run of [char][target] pairs, sorted by char, in acchildchar/acchildnode.
+	std::vector<int, ListAllocator<int> > acroot;
+	std::vector<int, ListAllocator<int> > acfail;  // failure link
+	std::vector<int, ListAllocator<int> > acoutput;  // phrase ending at this node, or -1
+	std::vector<int, ListAllocator<int> > acdictlink;  // next node along the failure chain with an output, or 0
+	std::vector<int, ListAllocator<int> > acfirstchild;
+	std::vector<int, ListAllocator<int> > acnumchildren;
+	std::vector<unsigned char, ListAllocator<unsigned char> > acchildchar;
+	std::vector<int, ListAllocator<int> > acchildnode;
 	
 	//time-limited lists - only items (sites, URLs), not phrases
 	TimeLimit listtimelimit;
@@ -148,9 +319,13 @@ private:
 	bool addToItemListPhrase(const char *s, size_t len, int type, int weighting, bool combi, int catindex, int timeindex);
 	void graphSizeSort(int l, int r, std::deque<size_t > *sizelist);
 	void graphAdd(String s, const int inx, int item);
-	int graphFindBranches(unsigned int pos);
-	void graphCopyNodePhrases(unsigned int pos);
-	int bmsearch(char *file, off_t fl, const std::string& s);
+	void graphResolveDuplicate(unsigned int existing, unsigned int item);
+	bool graphCompact();
+	unsigned int graphCompactNode(unsigned int pos);
+	bool acMakeGraph(const std::deque<size_t> &sizelist);
+	int acGoto(int node, unsigned char c);
+	void acSearch(PhraseHits &hits, char *doc, off_t len);
+	int bmsearch(const char *file, off_t fl, const char *phrase, off_t pl);
 	bool readProcessedItemList(const char *filename, bool startswith, int filters);
 	void addToItemList(const char *s, size_t len);
 	int greaterThanEWF(const char *a, const char *b);  // full match
@@ -160,6 +335,8 @@ private:
 	int search(int (ListContainer::*comparitor)(const char* a, const char* b), int a, int s, const char *p);
 	bool isCacheFileNewer(const char *string);
 	void increaseMemoryBy(size_t bytes);
+	// make the arrays the list is searched through read-only, or writable again
+	void protect(bool readonly);
 	//categorised & time-limited lists support
 	bool readTimeTag(String * tag, TimeLimit& tl);
 	int getCategoryIndex(String * lcat);
@@ -124,7 +124,8 @@ int ListManager::newItemList(const char *filename, bool startswith, int filters,
 // create a new phrase list. check dates on top-level list files to see if a reload is necessary.
 // note: unlike above, doesn't automatically call readPhraseList.
 // pass in exception, banned, and weighted phrase lists all at once.
-int ListManager::newPhraseList(const char *exception, const char *banned, const char *weighted)
+// lists are only re-used by groups asking for the same search engine.
+int ListManager::newPhraseList(const char *exception, const char *banned, const char *weighted, bool aho_corasick)
 {
 	time_t bannedpfiledate = getFileDate(banned);
 	time_t exceptionpfiledate = getFileDate(exception);
@@ -133,7 +134,9 @@ int ListManager::newPhraseList(const char *exception, const char *banned, const
 		if (l[i] == NULL) {
 			continue;
 		}
-		if ((*l[i]).exceptionpfile == String(exception) && (*l[i]).bannedpfile == String(banned) && (*l[i]).weightedpfile == String(weighted)) {
+		if ((*l[i]).exceptionpfile == String(exception) && (*l[i]).bannedpfile == String(banned) && (*l[i]).weightedpfile == String(weighted)
+			&& (*l[i]).aho_corasick == aho_corasick)
+		{
 			if (bannedpfiledate <= (*l[i]).bannedpfiledate && exceptionpfiledate <= (*l[i]).exceptionpfiledate && weightedpfiledate <= (*l[i]).weightedpfiledate) {
 				// Known limitation - only weighted, exception, banned phrase
 				// list checked for changes - not the included files.
@@ -165,13 +168,14 @@ int ListManager::newPhraseList(const char *exception, const char *banned, const
 	(*l[(unsigned) free]).exceptionpfile = exception;
 	(*l[(unsigned) free]).bannedpfile = banned;
 	(*l[(unsigned) free]).weightedpfile = weighted;
+	(*l[(unsigned) free]).aho_corasick = aho_corasick;
 	return (unsigned) free;
 }
 
-bool ListManager::readbplfile(const char *banned, const char *exception, const char *weighted, unsigned int &list, bool force_quick_search)
+bool ListManager::readbplfile(const char *banned, const char *exception, const char *weighted, unsigned int &list, bool force_quick_search, bool aho_corasick)
 {
 
-	int res = newPhraseList(exception, banned, weighted);
+	int res = newPhraseList(exception, banned, weighted, aho_corasick);
 	if (res < 0) {
 		if (!is_daemonised) {
 			std::cerr << "Error opening phraselists" << std::endl;
@@ -208,9 +212,10 @@ bool ListManager::readbplfile(const char *banned, const char *exception, const c
 			syslog(LOG_ERR, "%s", "Error opening weightedphraselist");
 			return false;
 		}
-		if (!(*l[res]).makeGraph(force_quick_search))
+		if (!(*l[res]).makeGraph(force_quick_search, aho_corasick))
 			return false;
 
+		(*l[res]).freeze();
 		(*l[res]).used = true;
 	}
 	list = res;
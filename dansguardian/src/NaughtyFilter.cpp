@@ -49,14 +49,40 @@ public:
 };
 
 
+// append the parts of the combination phrase starting at the given
+// position in the list's combilist, separated by commas
+static void appendCombiParts(std::string &s, ListContainer *list, std::vector<int>::iterator part)
+{
+	bool first = true;
+	while (*part != -2) {
+		if (!first)
+			s += ", ";
+		s += list->getItemAtInt(*part);
+		first = false;
+		part++;
+	}
+}
+
+
 // IMPLEMENTATION
 
 // constructor - set up defaults
 NaughtyFilter::NaughtyFilter()
-:	isItNaughty(false), isException(false), usedisplaycats(false), blocktype(0), store(false), naughtiness(0)
+:	isItNaughty(false), isException(false), usedisplaycats(false), blocktype(0), store(false), naughtiness(0),
+	streaming(false), rawstate(0), smartstate(0), rawscored(0), smartscored(0), streamraw(false), streamsmart(false), streamdone(false),
+	streamgroup(0), streamlist(0), streamlimit(0),
+	phrasefiltermode(o.phrase_filter_mode), preservecase(o.preserve_case)
 {
 }
 
+// set the phrasefiltermode & preservecase to check content with, so that
+// they can be scaled back for one request without touching the options
+void NaughtyFilter::setFilterMode(int phrasemode, int casemode)
+{
+	phrasefiltermode = phrasemode;
+	preservecase = casemode;
+}
+
 void NaughtyFilter::reset()
 {
 	isItNaughty = false;
@@ -64,10 +90,129 @@ void NaughtyFilter::reset()
 	whatIsNaughty = "";
 	whatIsNaughtyLog = "";
 	whatIsNaughtyCategories = "";
+	whatIsNaughtyDisplayCategories = "";
 	usedisplaycats = false;
 	blocktype = 0;
 	store = false;
 	naughtiness = 0;
+	streaming = false;
+}
+
+// get ready to filter a body as it downloads, if possible
+bool NaughtyFilter::startStream(unsigned int filtergroup, unsigned int phraselist, int limit)
+{
+	streaming = false;
+	if (!o.streaming_filter)
+		return false;
+
+	// things which need the whole document at once: PICS, META/title
+	// filtering, scanning twice for case preservation & embedded URLs
+	ListContainer *list = o.lm.l[phraselist];
+	if (o.fg[filtergroup]->enable_PICS || o.fg[filtergroup]->weighted_phrase_mode == 0
+		|| phrasefiltermode == 3 || preservecase == 2 || !list->canStreamSearch())
+	{
+		return false;
+	}
+#ifdef HAVE_PCRE
+	if (o.fg[filtergroup]->embedded_url_weight > 0)
+		return false;
+#endif
+
+#ifdef DGDEBUG
+	std::cout << "Streaming content filtering" << std::endl;
+#endif
+	streamgroup = filtergroup;
+	streamlist = phraselist;
+	streamlimit = limit;
+	streamraw = (phrasefiltermode == 0 || phrasefiltermode == 2);
+	streamsmart = (phrasefiltermode == 1 || phrasefiltermode == 2);
+	streamdone = false;
+
+	hits.reset();
+	hits.prepare(list->getListLength(), list->getCategoryCount());
+	smarthits.reset();
+	smarthits.prepare(list->getListLength(), list->getCategoryCount());
+	rawstate = 0;
+	smartstate = 0;
+	rawscored = 0;
+	smartscored = 0;
+
+	normaliser.startStream(o.hex_decode_content, preservecase == 1, streamsmart);
+	streaming = true;
+	return true;
+}
+
+// scan the newly arrived part of the body, and block straight away if need be
+bool NaughtyFilter::streamBlock(const char *body, off_t bodylen)
+{
+	if (!streaming || streamdone)
+		return isItNaughty;
+	normaliser.streamBlock(body, bodylen, false);
+	streamSearch();
+	streamVerdict(false);
+	return isItNaughty;
+}
+
+// scan whatever is left, then score the views as checkme would have
+void NaughtyFilter::finishStream(const char *body, off_t bodylen)
+{
+	if (!streaming)
+		return;
+	streaming = false;
+	if (streamdone)
+		return;
+	normaliser.streamBlock(body, bodylen, true);
+	streamSearch();
+	streamVerdict(true);
+}
+
+void NaughtyFilter::streamSearch()
+{
+	ListContainer *list = o.lm.l[streamlist];
+	if (streamraw)
+		list->streamSearch(hits, normaliser.lc, normaliser.lclen, rawstate);
+	// the last character of the smart view isn't searched - see Normaliser::streamBlock
+	if (streamsmart)
+		list->streamSearch(smarthits, normaliser.nohtml, normaliser.nohtmllen - 1, smartstate);
+}
+
+void NaughtyFilter::streamVerdict(bool final)
+{
+	ListContainer *list = o.lm.l[streamlist];
+	int naughtinesssofar = naughtiness;
+	std::string noembeddedurls;
+
+	// the raw view is checked first, so an exception
+	// found there decides things, even part way through
+	if (streamraw && (final || hits.total != rawscored)) {
+		rawscored = hits.total;
+		scorePhrases(hits, list, 0, noembeddedurls, streamgroup, streamlimit, false);
+		if (isItNaughty || isException) {
+			streamdone = true;
+			return;
+		}
+		if (!final) {
+			naughtiness = naughtinesssofar;
+			hits.resetScores();
+		}
+	}
+
+	if (streamsmart && (final || smarthits.total != smartscored)) {
+		smartscored = smarthits.total;
+		scorePhrases(smarthits, list, 0, noembeddedurls, streamgroup, streamlimit, false);
+		// an exception in the smart view stands straight away
+		// if there is no raw view to overrule it
+		if (isItNaughty || final || (isException && !streamraw)) {
+			streamdone = true;
+			return;
+		}
+		// an exception in the smart view could yet be overruled by the raw view
+		isException = false;
+		whatIsNaughtyLog = "";
+		whatIsNaughtyCategories = "";
+		naughtiness = naughtinesssofar;
+		smarthits.resetScores();
+	}
 }
 
 // check the given document body for banned, weighted, and exception phrases (and PICS, and regexes, &c.)
@@ -99,63 +244,19 @@ void NaughtyFilter::checkme(const char *rawbody, off_t rawbodylen, const String
 		return;
 	}
 	
-	// hex-decoded data (not case converted)
-	off_t hexdecodedlen = rawbodylen;
-	const char *hexdecoded = rawbody;
-
-	unsigned char c;
-
 	// Hex decode content if desired
-	// Do this now, as it's not especially case-sensitive,
+	// Do this as part of normalisation, as it's not especially case-sensitive,
 	// and the case alteration should modify case post-decoding
 	// Search terms are already hex decoded, as they need to be to strip URL decoding
-	if (!searchterms && o.hex_decode_content) {  // Mod suggested by AFN Tue 8th April 2003
+	bool hexdecode = !searchterms && o.hex_decode_content;  // Mod suggested by AFN Tue 8th April 2003
 #ifdef DGDEBUG
+	if (hexdecode)
 		std::cout << "Hex decoding is enabled" << std::endl;
 #endif
-		char *hexdecoded_buf = new char[rawbodylen + 128 + 1];
-		memset(hexdecoded_buf, 0, rawbodylen + 128 + 1);
-		unsigned char c1;
-		unsigned char c2;
-		unsigned char c3;
-		char hexval[5] = "0x";  // Initializes a "hexadecimal string"
-		hexval[4] = '\0';
-		char *ptr;  // pointer required by strtol
-
-		// make a copy of the escaped document char by char
-		off_t i = 0;
-		off_t j = 0;
-		while (i < rawbodylen - 3) {  // we lose 3 bytes but what the hell..
-			c1 = rawbody[i];
-			c2 = rawbody[i + 1];
-			c3 = rawbody[i + 2];
-			if (c1 == '%' && (((c2 >= '0') && (c2 <= '9')) || ((c2 >= 'a') && (c2 <= 'f')) || ((c2 >= 'A') && (c2 <= 'F')))
-				&& (((c3 >= '0') && (c3 <= '9')) || ((c3 >= 'a') && (c3 <= 'f')) || ((c3 >= 'A') && (c3 <= 'F'))))
-			{
-				hexval[2] = c2;
-				hexval[3] = c3;
-				c = (unsigned char) strtol(hexval, &ptr, 0);
-				i += 3;
-			} else {
-				c = c1;
-				i++;
-			}
-			hexdecoded_buf[j] = c;
-			j++;
-		}
-		// copy any remaining bytes
-		while (i < rawbodylen) {
-			hexdecoded_buf[j++] = rawbody[i++];
-		} 
-		hexdecoded_buf[j] = '\0';
-		hexdecodedlen = j;
-		hexdecoded = hexdecoded_buf;
-	}
 
 	// scan twice, with & without case conversion (if desired) - aids support for exotic char encodings
-	// TODO: move META/title sentinel location outside this loop, as they are not case sensitive operations
-	bool preserve_case = o.preserve_case;
-	if (o.preserve_case == 2) {
+	bool preserve_case = preservecase;
+	if (preservecase == 2) {
 		// scanning twice *is* desired
 		// first time round the loop, don't preserve case (non-exotic encodings)
 #ifdef DGDEBUG
@@ -163,254 +264,64 @@ void NaughtyFilter::checkme(const char *rawbody, off_t rawbodylen, const String
 #endif
 		preserve_case = false;
 	}
-	
-	// Store for the lowercase (maybe) data
-	// The extra 128 is used for various speed tricks to
-	// squeeze as much speed as possible.
-	char* bodylc = new char[hexdecodedlen + 128 + 1];
-	memset(bodylc, 0, hexdecodedlen + 128 + 1);
-	
-	// Store for the tag-stripped data
+
+	// filter meta tags & title only
+	bool metaonly = !searchterms && (phrasefiltermode == 3);
 	// Don't bother tag stripping search terms
-	char* bodynohtml = NULL;
-	if (!searchterms && (o.phrase_filter_mode == 1 || o.phrase_filter_mode == 2))
-	{
-		bodynohtml = new char[hexdecodedlen + 128 + 1];
-		memset(bodynohtml, 0, hexdecodedlen + 128 + 1);
-	}
-	
-	for (int loop = 0; loop < (o.preserve_case == 2 ? 2 : 1); loop++) {
-#ifdef DGDEBUG
-		std::cout << "Preserve case: " << preserve_case << std::endl;
-#endif
+	bool striphtml = !searchterms && (phrasefiltermode == 1 || phrasefiltermode == 2);
 
-		off_t i, j;
+	for (int loop = 0; loop < (preservecase == 2 ? 2 : 1); loop++) {
 #ifdef DGDEBUG
-		if (searchterms || o.phrase_filter_mode == 0 || o.phrase_filter_mode == 2 || o.phrase_filter_mode == 3)
+		std::cout << "Preserve case: " << preserve_case << std::endl;
+		if (searchterms || phrasefiltermode == 0 || phrasefiltermode == 2 || phrasefiltermode == 3)
 			std::cout << "Raw content needed" << std::endl;
+		if (striphtml)
+			std::cout << "\"Smart\" filtering is enabled" << std::endl;
 #endif
-		// use the one that's been hex decoded, but not stripped
-		// make a copy of the document lowercase char by char
-		if (preserve_case) {
-			for (i = 0; i < hexdecodedlen; i++) {
-				c = hexdecoded[i];
-				if (c == 13 || c == 9 || c == 10) {
-					c = 32;  // convert all whitespace to a space
-				}
-				bodylc[i] = c;
-			}
-		} else {
-#ifdef DGDEBUG
-			std::cout << "Not preserving case of raw content" << std::endl;
-#endif
-			for (i = 0; i < hexdecodedlen; i++) {
-				c = hexdecoded[i];
-				if (c >= 'A' && c <= 'Z') {
-					c = 'a' + c - 'A';
-				}
-				else if (c >= 192 && c <= 221) {  // for accented chars
-					c += 32;  // 224 + c - 192
-				} else {
-					if (c == 13 || c == 9 || c == 10) {
-						c = 32;  // convert all whitespace to a space
-					}
-				}
-				bodylc[i] = c;
-			}
-		}
+		// build the hex decoded, case converted (maybe) and tag stripped (maybe)
+		// copies of the document in one go
+		normaliser.normalise(rawbody, rawbodylen, hexdecode, preserve_case, striphtml, metaonly);
 
-		// filter meta tags & title only
-		// based on idea from Nicolas Peyrussie
-		if(!searchterms && (o.phrase_filter_mode == 3)) {
+		if (metaonly) {
 #ifdef DGDEBUG
 			std::cout << "Filtering META/title" << std::endl;
 #endif
-			bool addit = false;  // flag if we should copy this char to filtered version
-			bool needcheck = false;  // flag if we actually find anything worth filtering
-			off_t bodymetalen;
-		
-			// find </head> or <body> as end of search range
-			char* endhead = strstr(bodylc, "</head");
-#ifdef DGDEBUG
-			if (endhead != NULL)
-				std::cout<<"Found '</head', limiting search range"<<std::endl;
-#endif
-			if (endhead == NULL) {
-				endhead = strstr(bodylc, "<body");
-#ifdef DGDEBUG
-				if (endhead != NULL)
-					std::cout<<"Found '<body', limiting search range"<<std::endl;
-#endif
-			}
-
-			// if case preserved, also look for uppercase versions
-			if (preserve_case and (endhead == NULL)) {
-				endhead = strstr(bodylc, "</HEAD");
-#ifdef DGDEBUG
-				if (endhead != NULL)
-					std::cout<<"Found '</HEAD', limiting search range"<<std::endl;
-#endif
-				if (endhead == NULL) {
-					endhead = strstr(bodylc, "<BODY");
-#ifdef DGDEBUG
-					if (endhead != NULL)
-						std::cout<<"Found '<BODY', limiting search range"<<std::endl;
-#endif
-				}
-			}
-
-			if (endhead == NULL)
-				endhead = bodylc+hexdecodedlen;
-
-			char* bodymeta = new char[(endhead - bodylc) + 128 + 1];
-			memset(bodymeta, 0, (endhead - bodylc) + 128 + 1);
-
-			// initialisation for removal of duplicate non-alphanumeric characters
-			j = 1;
-			bodymeta[0] = 32;
-
-			for (i = 0; i < (endhead - bodylc) - 7; i++) {
-				c = bodylc[i];
-				// are we at the start of a tag?
-				if ((!addit) && (c == '<')) {
-					if ((strncmp(bodylc+i+1, "meta", 4) == 0) or (preserve_case and (strncmp(bodylc+i+1, "META", 4) == 0))) {
-#ifdef DGDEBUG
-						std::cout << "Found META" << std::endl;
-#endif
-						// start adding data to the check buffer
-						addit = true;
-						needcheck = true;
-						// skip 'meta '
-						i += 6;
-						c = bodylc[i];
-					}
-					// are we at the start of a title tag?
-					else if ((strncmp(bodylc+i+1, "title", 5) == 0) or (preserve_case and (strncmp(bodylc+i+1, "TITLE", 5) == 0))) {
-#ifdef DGDEBUG
-						std::cout << "Found TITLE" << std::endl;
-#endif
-						// start adding data to the check buffer
-						addit = true;
-						needcheck = true;
-						// skip 'title>'
-						i += 7;
-						c = bodylc[i];
-					}
-				}
-				// meta tags end at a >
-				// title tags end at the next < (opening of </title>)
-				if (addit && ((c == '>') || (c == '<'))) {
-					// stop ading data
-					addit = false;
-					// add a space before the next word in the check buffer
-					bodymeta[j++] = 32;
-				}
-			
-				if (addit) {
-					// if we're in "record" mode (i.e. inside a title/metatag), strip certain characters out
-					// of the data (to sanitise metatags & aid filtering of titles)
-					if ( c== ',' || c == '=' || c == '"' || c  == '\''
-						|| c == '(' || c == ')' || c == '.')
-					{
-						// replace with a space
-						c = 32;
-					}
-					// don't bother duplicating spaces
-					if ((c != 32) || (c == 32 && (bodymeta[j-1] != 32))) {
-						bodymeta[j++] = c;  // copy it to the filtered copy
-					}
-				}
-			}
-			if (needcheck) {
-				bodymeta[j++] = '\0';
+			if (normaliser.extractMeta(preserve_case)) {
 #ifdef DGDEBUG
-				std::cout << bodymeta << std::endl;
+				std::cout << normaliser.meta << std::endl;
 #endif
-				bodymetalen = j;
-				checkphrase(bodymeta, bodymetalen, NULL, NULL, filtergroup, phraselist, limit, searchterms);
+				checkphrase(normaliser.meta, normaliser.metalen, NULL, NULL, filtergroup, phraselist, limit, searchterms);
 			}
 #ifdef DGDEBUG
 			else
 				std::cout<<"Nothing to filter"<<std::endl;
 #endif
-
-			delete[] bodymeta;
 			// surely the intention is to search *only* meta/title, so always exit
-			delete[] bodylc;
-			delete[] bodynohtml;
-			if (hexdecoded != rawbody)
-				delete[]hexdecoded;
 			return;
 		}
 
-		if (searchterms || o.phrase_filter_mode == 0 || o.phrase_filter_mode == 2) {
+		if (searchterms || phrasefiltermode == 0 || phrasefiltermode == 2) {
 #ifdef DGDEBUG
 			std::cout << "Checking raw content" << std::endl;
 #endif
 			// check unstripped content
-			checkphrase(bodylc, hexdecodedlen, url, domain, filtergroup, phraselist, limit, searchterms);
-			if (isItNaughty || isException) {
-				delete[]bodylc;
-				delete[] bodynohtml;
-				if (hexdecoded != rawbody)
-					delete[]hexdecoded;
+			checkphrase(normaliser.lc, normaliser.lclen, url, domain, filtergroup, phraselist, limit, searchterms);
+			if (isItNaughty || isException)
 				return;  // Well there is no point in continuing is there?
-			}
 		}
 
-		if (searchterms || o.phrase_filter_mode == 0) {
-			delete[]bodylc;
-			delete[] bodynohtml;
-			if (hexdecoded != rawbody)
-				delete[]hexdecoded;
+		if (searchterms || phrasefiltermode == 0)
 			return;  // only doing raw mode filtering
-		}
 
-		// if we fell through to here, use the one that's been hex decoded AND stripped
-		// Strip HTML
-#ifdef DGDEBUG
-		std::cout << "\"Smart\" filtering is enabled" << std::endl;
-#endif
-		// we need this extra byte *
-		bool inhtml = false;  // to flag if our pointer is within a html <>
-		bool addit;  // flag if we should copy this char to filtered version
-		j = 1;
-		bodynohtml[0] = 32;  // * for this
-		for (off_t i = 0; i < hexdecodedlen; i++) {
-			addit = true;
-			c = bodylc[i];
-			if (c == '<') {
-				inhtml = true;  // flag we are inside a html <>
-			}
-			if (c == '>') {	// flag we have just left a html <>
-				inhtml = false;
-				c = 32;
-			}
-			if (inhtml) {
-				addit = false;
-			}
-			if (c == 32) {
-				if (bodynohtml[j - 1] == 32) {	// * and this
-					addit = false;
-				}
-			}
-			if (addit) {	// if it passed the filters
-				bodynohtml[j++] = c;  // copy it to the filtered copy
-			}
-		}
 #ifdef DGDEBUG
 		std::cout << "Checking smart content" << std::endl;
 #endif
-		checkphrase(bodynohtml, j - 1, NULL, NULL, filtergroup, phraselist, limit, searchterms);
+		checkphrase(normaliser.nohtml, normaliser.nohtmllen - 1, NULL, NULL, filtergroup, phraselist, limit, searchterms);
 
 		// second time round the case loop (if there is a second time),
 		// do preserve case (exotic encodings)
 		preserve_case = true;
 	}
-	delete[]bodylc;
-	delete[]bodynohtml;
-	if (hexdecoded != rawbody)
-		delete[]hexdecoded;
 }
 
 // check the phrase lists
@@ -418,14 +329,14 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 	unsigned int filtergroup, unsigned int phraselist, int limit, bool searchterms)
 {
 	int weighting = 0;
-	int cat;
-	std::string weightedphrase;
-	
-	// checkme: translate this?
-	String currcat("Embedded URLs");
+	// embedded URLs found, for the log
+	std::string embeddedurls;
 
-	// found categories list & reusable iterators
-	std::map<int, listent> listcategories;
+	ListContainer *list = o.lm.l[phraselist];
+
+	// clear out the results of the last check
+	hits.reset();
+	hits.prepare(list->getListLength(), list->getCategoryCount());
 
 	// check for embedded references to banned sites/URLs.
 	// have regexes that check for URLs in pages (look for attributes (src, href, javascript location)
@@ -448,29 +359,30 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 	// if weighted phrases are enabled, and we have been passed a URL and domain, and embedded URL checking is enabled...
 	// then check for embedded URLs!
 	if (url != NULL && o.fg[filtergroup]->embedded_url_weight > 0) {
-		std::map<int, listent>::iterator ourcat;
 		bool catinited = false;
 		std::map<String, unsigned int> found;
 		std::map<String, unsigned int>::iterator founditem;
 
 		String u;
-		char* j;
+		const char* j;
+		RegResult urls;
+		ListResult listresult;
 
 		// check for absolute URLs
-		if (absurl_re.match(file)) {
+		if (absurl_re.match(file, urls)) {
 			// each match generates 2 results (because of the brackets in the regex), we're only interested in the first
 #ifdef DGDEBUG
-			std::cout << "Found " << absurl_re.numberOfMatches()/2 << " absolute URLs:" << std::endl;
+			std::cout << "Found " << urls.numberOfMatches()/2 << " absolute URLs:" << std::endl;
 #endif
-			for (int i = 0; i < absurl_re.numberOfMatches(); i+=2) {
+			for (int i = 0; i < urls.numberOfMatches(); i+=2) {
 				// chop off quotes
-				u = absurl_re.result(i);
+				u = urls.result(i);
 				u = u.subString(1,u.length()-2);
 #ifdef DGDEBUG
 				std::cout << u << std::endl;
 #endif
-				if ((((j = o.fg[filtergroup]->inBannedSiteList(u)) != NULL) && !(o.lm.l[o.fg[filtergroup]->banned_site_list]->lastcategory.contains("ADs")))
-					|| (((j = o.fg[filtergroup]->inBannedURLList(u)) != NULL) && !(o.lm.l[o.fg[filtergroup]->banned_url_list]->lastcategory.contains("ADs"))))
+				if ((((j = o.fg[filtergroup]->inBannedSiteList(u, false, false, false, &listresult)) != NULL) && !String(listresult.category()).contains("ADs"))
+					|| (((j = o.fg[filtergroup]->inBannedURLList(u, false, false, false, &listresult)) != NULL) && !String(listresult.category()).contains("ADs")))
 				{
 					// duplicate checking
 					// checkme: this should really be being done *before* we search the lists.
@@ -483,17 +395,14 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 					} else {
 						// add the site to the found phrases list
 						found[j] = 1;
-						if (weightedphrase.length() == 0)
-							weightedphrase = "[";
+						if (embeddedurls.length() == 0)
+							embeddedurls = "[";
 						else
-							weightedphrase += " ";
-						weightedphrase += j;
-						if (!catinited) {
-							listcategories[-1] = listent(o.fg[filtergroup]->embedded_url_weight,currcat);
-							ourcat = listcategories.find(-1);
-							catinited = true;
-						} else
-							ourcat->second.weight += o.fg[filtergroup]->embedded_url_weight;
+							embeddedurls += " ";
+						embeddedurls += j;
+						// category -1 is "Embedded URLs"
+						hits.scoreCategory(-1, o.fg[filtergroup]->embedded_url_weight, o.fg[filtergroup]->embedded_url_weight);
+						catinited = true;
 					}
 				}
 			}
@@ -502,7 +411,7 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 		found.clear();
 
 		// check for relative URLs
-		if (relurl_re.match(file)) {
+		if (relurl_re.match(file, urls)) {
 			// we don't want any parameters on the end of the current URL, since we append to it directly
 			// when forming absolute URLs from relative ones. we do want a / on the end, too.
 			String currurl(*url);
@@ -513,10 +422,10 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 
 			// each match generates 2 results (because of the brackets in the regex), we're only interested in the first
 #ifdef DGDEBUG
-			std::cout << "Found " << relurl_re.numberOfMatches()/2 << " relative URLs:" << std::endl;
+			std::cout << "Found " << urls.numberOfMatches()/2 << " relative URLs:" << std::endl;
 #endif
-			for (int i = 0; i < relurl_re.numberOfMatches(); i+=2) {
-				u = relurl_re.result(i);
+			for (int i = 0; i < urls.numberOfMatches(); i+=2) {
+				u = urls.result(i);
 				
 				// can't find a way to negate submatches in PCRE, so it is entirely possible
 				// that some absolute URLs have made their way into this list. we don't want them.
@@ -539,8 +448,8 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 #ifdef DGDEBUG
 				std::cout << "absolute form: " << u << std::endl;
 #endif
-				if ((((j = o.fg[filtergroup]->inBannedSiteList(u)) != NULL) && !(o.lm.l[o.fg[filtergroup]->banned_site_list]->lastcategory.contains("ADs")))
-					|| (((j = o.fg[filtergroup]->inBannedURLList(u)) != NULL) && !(o.lm.l[o.fg[filtergroup]->banned_url_list]->lastcategory.contains("ADs"))))
+				if ((((j = o.fg[filtergroup]->inBannedSiteList(u, false, false, false, &listresult)) != NULL) && !String(listresult.category()).contains("ADs"))
+					|| (((j = o.fg[filtergroup]->inBannedURLList(u, false, false, false, &listresult)) != NULL) && !String(listresult.category()).contains("ADs")))
 				{
 					// duplicate checking
 					// checkme: this should really be being done *before* we search the lists.
@@ -553,58 +462,58 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 					} else {
 						// add the site to the found phrases list
 						found[j] = 1;
-						if (weightedphrase.length() == 0)
-							weightedphrase = "[";
+						if (embeddedurls.length() == 0)
+							embeddedurls = "[";
 						else
-							weightedphrase += " ";
-						weightedphrase += j;
-						if (!catinited) {
-							listcategories[-1] = listent(o.fg[filtergroup]->embedded_url_weight,currcat);
-							ourcat = listcategories.find(-1);
-							catinited = true;
-						} else
-							ourcat->second.weight += o.fg[filtergroup]->embedded_url_weight;
+							embeddedurls += " ";
+						embeddedurls += j;
+						// category -1 is "Embedded URLs"
+						hits.scoreCategory(-1, o.fg[filtergroup]->embedded_url_weight, o.fg[filtergroup]->embedded_url_weight);
+						catinited = true;
 					}
 				}
 			}
 		}
 		if (catinited) {
-			weighting = ourcat->second.weight;
-			weightedphrase += "]";
+			weighting = hits.catweight[0];
+			embeddedurls += "]";
 #ifdef DGDEBUG
-			std::cout << weightedphrase << std::endl;
-			std::cout << "score from embedded URLs: " << ourcat->second.weight << std::endl;
+			std::cout << embeddedurls << std::endl;
+			std::cout << "score from embedded URLs: " << hits.catweight[0] << std::endl;
 #endif
 		}
 	}
 #endif
 
+	// this line here searches for phrases contained in the list - the rest of the code is all sorting
+	// through it to find the categories, weightings, types etc. of what has actually been found.
+	list->graphSearch(hits, file, filelen);
+
+	scorePhrases(hits, list, weighting, embeddedurls, filtergroup, limit, searchterms);
+}
+
+// weigh up the phrases found by searching the given list, flagging the content as naughty
+// or as an exception accordingly.  weighting is the score so far (from embedded URLs).
+void NaughtyFilter::scorePhrases(PhraseHits &results, ListContainer *list, int weighting, const std::string &embeddedurls,
+	unsigned int filtergroup, int limit, bool searchterms)
+{
 	std::string bannedphrase;
 	std::string exceptionphrase;
-	String bannedcategory;
-	int type, index, weight, time;
+	int bannedcat = -1;
+	int type, index, weight, time, cat, count;
 	bool allcmatched = true, bannedcombi = false;
-	std::string s1;
-
-	// this line here searches for phrases contained in the list - the rest of the code is all sorting
-	// through it to find the categories, weightings, types etc. of what has actually been found.
-	std::map<std::string, std::pair<unsigned int, int> > found;
-	o.lm.l[phraselist]->graphSearch(found, file, filelen);
 
-	// cache reusable iterators
-	std::map<std::string, std::pair<unsigned int, int> >::iterator foundend = found.end();
-	std::map<std::string, std::pair<unsigned int, int> >::iterator foundcurrent;
+	// results are looked at in order of phrase text, as they always have been
+	list->sortHits(results);
 
 	// look for combinations first
 	//if banned must wait for exception later
-	std::string combifound;
-	std::string combisofar;
-
-	std::vector<int>::iterator combicurrent = o.lm.l[phraselist]->combilist.begin();
-	std::map<int, listent>::iterator catcurrent;
+	std::vector<int>::iterator combibegin = list->combilist.begin();
+	std::vector<int>::iterator combicurrent = combibegin;
+	std::vector<int>::iterator combistart = combibegin;
 	int lowest_occurrences = 0;
 
-	while (combicurrent != o.lm.l[phraselist]->combilist.end()) {
+	while (combicurrent != list->combilist.end()) {
 		// Grab the current combination phrase part
 		index = *combicurrent;
 		// Do stuff if what we have is an end marker (end of one list of parts)
@@ -614,17 +523,18 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 				type = *(++combicurrent);
 				// check this time limit against the list of time limits
 				time = *(++combicurrent);
-				if (not (o.lm.l[phraselist]->checkTimeAtD(time))) {
+				if (not (list->checkTimeAtD(time))) {
 					// nope - so don't take any notice of it
 #ifdef DGDEBUG
 					combicurrent++;
 					cat = (*++combicurrent);
+					std::string combisofar;
+					appendCombiParts(combisofar, list, combistart);
 					std::cout << "Ignoring combi phrase based on time limits: " << combisofar << "; "
-						<< o.lm.l[phraselist]->getListCategoryAtD(cat) << std::endl;
+						<< list->getListCategoryAtD(cat) << std::endl;
 #else
 					combicurrent += 2;
 #endif
-					combisofar = "";
 				}
 				else if (type == -1) {	// combination exception
 					isItNaughty = false;
@@ -632,11 +542,11 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 					// Combination exception phrase found:
 					// Combination exception search term found:
 					whatIsNaughtyLog = o.language_list.getTranslation(searchterms ? 456 : 605);
-					whatIsNaughtyLog += combisofar;
+					appendCombiParts(whatIsNaughtyLog, list, combistart);
 					whatIsNaughty = "";
 					++combicurrent;
 					cat = *(++combicurrent);
-					whatIsNaughtyCategories = o.lm.l[phraselist]->getListCategoryAtD(cat);
+					whatIsNaughtyCategories = list->getListCategoryAtD(cat);
 					return;
 				}
 				else if (type == 1) {	// combination weighting
@@ -647,45 +557,29 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 						//category index -1 indicates an uncategorised list
 						if (cat >= 0) {
 							//don't output duplicate categories
-							catcurrent = listcategories.find(cat);
-							if (catcurrent != listcategories.end()) {
-								catcurrent->second.weight += weight * (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : lowest_occurrences);
-							} else {
-								currcat = o.lm.l[phraselist]->getListCategoryAtD(cat);
-								listcategories[cat] = listent(weight,currcat);
-							}
+							results.scoreCategory(cat, weight, weight * (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : lowest_occurrences));
 						}
 					} else {
 						// skip past category for negatively weighted phrases
 						combicurrent++;
 					}
-					if (weightedphrase.length() > 0) {
-						weightedphrase += "+";
-					}
-					weightedphrase += "(";
-					if (weight < 0) {
-						weightedphrase += "-" + combisofar;
-					} else {
-						weightedphrase += combisofar;
-					}
+					// remember it for the log
+					results.weightedcombis.push_back(combistart - combibegin);
 #ifdef DGDEBUG
+					std::string combisofar;
+					appendCombiParts(combisofar, list, combistart);
 					std::cout << "found combi weighted phrase ("<< o.fg[filtergroup]->weighted_phrase_mode << "): "
 						<< combisofar << " x" << lowest_occurrences << " (per phrase: "
 						<< weight << ", calculated: "
 						<< (weight * (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : lowest_occurrences)) << ")"
 						<< std::endl;
 #endif
-
-					weightedphrase += ")";
-					combisofar = "";
 				}
 				else if (type == 0) {	// combination banned
 					bannedcombi = true;
-					combifound += "(" + combisofar + ")";
-					combisofar = "";
+					results.bannedcombis.push_back(combistart - combibegin);
 					combicurrent += 2;
-					cat = *(combicurrent);
-					bannedcategory = o.lm.l[phraselist]->getListCategoryAtD(cat);
+					bannedcat = *(combicurrent);
 				}
 			} else {
 				// We had an end marker, but not all the parts so far were matched.
@@ -694,23 +588,20 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 				combicurrent += 4;
 				lowest_occurrences = 0;
 			}
+			// the next chain starts after this end marker
+			combistart = combicurrent + 1;
 		} else {
 			// We didn't get an end marker - just an individual part.
 			// If all parts in the current chain have been matched so far, look for this one as well.
 			if (allcmatched) {
-				s1 =o.lm.l[phraselist]->getItemAtInt(index);
-				if ((foundcurrent = found.find(s1)) == foundend) {
+				count = results.count[list->getCanonicalAt(index)];
+				if (count == 0) {
 					allcmatched = false;
-					combisofar = "";
 				} else {
-					if (combisofar.length() > 0) {
-						combisofar += ", ";
-					}
-					combisofar += s1;
 					// also track lowest number of times any one part occurs in the text
 					// as this will correspond to the number of times the whole chain occurs
-					if ((lowest_occurrences == 0) || (lowest_occurrences > foundcurrent->second.second)) {
-						lowest_occurrences = foundcurrent->second.second;
+					if ((lowest_occurrences == 0) || (lowest_occurrences > count)) {
+						lowest_occurrences = count;
 					}
 				}
 			}
@@ -722,60 +613,44 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 	// even if we already found a combi ban, we must still wait; there may be non-combi exceptions to follow
 
 	// now check non-combi phrases
-	foundcurrent = found.begin();
-	while (foundcurrent != foundend) {
+	int bannedindex = -1;
+	for (std::vector<unsigned int>::iterator foundcurrent = results.found.begin(); foundcurrent != results.found.end(); foundcurrent++) {
+		index = *foundcurrent;
 		// check time for current phrase
-		if (not o.lm.l[phraselist]->checkTimeAt(foundcurrent->second.first)) {
+		if (not list->checkTimeAt(index)) {
 #ifdef DGDEBUG
 			std::cout << "Ignoring phrase based on time limits: "
-				<< foundcurrent->first << ", "
-				<< o.lm.l[phraselist]->getListCategoryAt(foundcurrent->second.first) << std::endl;
+				<< list->getItemAtInt(index) << ", "
+				<< list->getListCategoryAt(index) << std::endl;
 #endif
-			foundcurrent++;
 			continue;
 		}
 		// 0=banned, 1=weighted, -1=exception, 2=combi, 3=weightedcombi
-		type = o.lm.l[phraselist]->getTypeAt(foundcurrent->second.first);
+		type = list->getTypeAt(index);
 		if (type == 0) {
 			// if we already found a combi ban, we don't need to know this stuff
 			if (!bannedcombi) {
 				isItNaughty = true;
-				bannedphrase = foundcurrent->first;
-				bannedcategory = o.lm.l[phraselist]->getListCategoryAt(foundcurrent->second.first, &cat);
+				bannedindex = index;
 			}
 		}
 		else if (type == 1) {
 			// found a weighted phrase - either add one lot of its score, or one lot for every occurrence, depending on phrase filtering mode
-			weight = o.lm.l[phraselist]->getWeightAt(foundcurrent->second.first) * (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : foundcurrent->second.second);
+			count = (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : results.count[index]);
+			weight = list->getWeightAt(index) * count;
 			weighting += weight;
 			if (weight > 0) {
-				currcat = o.lm.l[phraselist]->getListCategoryAt(foundcurrent->second.first, &cat);
+				cat = list->getCategoryIndexAt(index);
 				if (cat >= 0) {
 					//don't output duplicate categories
-					catcurrent = listcategories.find(cat);
-					if (catcurrent != listcategories.end()) {
-						// add one or N times the weight to this category's score
-						catcurrent->second.weight += weight * (o.fg[filtergroup]->weighted_phrase_mode == 2 ? 1 : foundcurrent->second.second);
-					} else {
-						listcategories[cat] = listent(weight,currcat);
-					}
+					// add one or N times the weight to this category's score
+					results.scoreCategory(cat, weight, weight * count);
 				}
 			}
-
-			if (o.show_weighted_found) {
-				if (weightedphrase.length() > 0) {
-					weightedphrase += "+";
-				}
-				if (weight < 0) {
-					weightedphrase += "-";
-				}
-
-				weightedphrase += foundcurrent->first;
-			}
 #ifdef DGDEBUG
 			std::cout << "found weighted phrase ("<< o.fg[filtergroup]->weighted_phrase_mode << "): "
-				<< foundcurrent->first << " x" << foundcurrent->second.second << " (per phrase: "
-				<< o.lm.l[phraselist]->getWeightAt(foundcurrent->second.first)
+				<< list->getItemAtInt(index) << " x" << results.count[index] << " (per phrase: "
+				<< list->getWeightAt(index)
 				<< ", calculated: " << weight << ")" << std::endl;
 #endif
 		}
@@ -785,12 +660,11 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 			// Exception phrase found:
 			// Exception search term found:
 			whatIsNaughtyLog = o.language_list.getTranslation(searchterms ? 457 : 604);
-			whatIsNaughtyLog += foundcurrent->first;
+			whatIsNaughtyLog += list->getItemAtInt(index);
 			whatIsNaughty = "";
-			whatIsNaughtyCategories = o.lm.l[phraselist]->getListCategoryAt(foundcurrent->second.first, NULL);
+			whatIsNaughtyCategories = list->getListCategoryAt(index, NULL);
 			return;  // no point in going further
 		}
-		foundcurrent++;
 	}
 
 #ifdef DGDEBUG
@@ -813,11 +687,15 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 		// Banned combination phrase found:
 		// Banned combination search term found:
 		whatIsNaughtyLog = o.language_list.getTranslation(searchterms ? 452: 400);
-		whatIsNaughtyLog += combifound;
+		for (std::vector<size_t>::iterator i = results.bannedcombis.begin(); i != results.bannedcombis.end(); i++) {
+			whatIsNaughtyLog += "(";
+			appendCombiParts(whatIsNaughtyLog, list, combibegin + *i);
+			whatIsNaughtyLog += ")";
+		}
 		// Banned combination phrase found.
 		// Banned combination search term found.
 		whatIsNaughty = o.language_list.getTranslation(searchterms ? 453 : 401);
-		whatIsNaughtyCategories = bannedcategory.toCharArray();
+		whatIsNaughtyCategories = list->getListCategoryAtD(bannedcat).toCharArray();
 		return;
 	}
 
@@ -825,11 +703,13 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 		// Banned phrase found:
 		// Banned search term found:
 		whatIsNaughtyLog = o.language_list.getTranslation(searchterms ? 450 : 300);
-		whatIsNaughtyLog += bannedphrase;
+		// (we may have been flagged naughty by an earlier pass, without a phrase of our own)
+		if (bannedindex >= 0)
+			whatIsNaughtyLog += list->getItemAtInt(bannedindex);
 		// Banned phrase found.
 		// Banned search term found.
 		whatIsNaughty = o.language_list.getTranslation(searchterms ? 451 : 301);
-		whatIsNaughtyCategories = bannedcategory.toCharArray();
+		whatIsNaughtyCategories = (bannedindex >= 0) ? list->getListCategoryAt(bannedindex).toCharArray() : "";
 		return;
 	}
 
@@ -842,6 +722,34 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 		whatIsNaughtyLog += " : ";
 		whatIsNaughtyLog += String(weighting).toCharArray();
 		if (o.show_weighted_found) {
+			// list what was found: embedded URLs, combinations, then individual phrases
+			std::string weightedphrase(embeddedurls);
+			for (std::vector<size_t>::iterator i = results.weightedcombis.begin(); i != results.weightedcombis.end(); i++) {
+				if (weightedphrase.length() > 0) {
+					weightedphrase += "+";
+				}
+				weightedphrase += "(";
+				// the chain's end marker is followed by its type, time limit, then weight
+				std::vector<int>::iterator j = combibegin + *i;
+				while (*j != -2)
+					j++;
+				if (*(j + 3) < 0) {
+					weightedphrase += "-";
+				}
+				appendCombiParts(weightedphrase, list, combibegin + *i);
+				weightedphrase += ")";
+			}
+			for (std::vector<unsigned int>::iterator i = results.found.begin(); i != results.found.end(); i++) {
+				if (list->getTypeAt(*i) != 1 || not list->checkTimeAt(*i))
+					continue;
+				if (weightedphrase.length() > 0) {
+					weightedphrase += "+";
+				}
+				if (list->getWeightAt(*i) < 0) {
+					weightedphrase += "-";
+				}
+				weightedphrase += list->getItemAtInt(*i);
+			}
 			whatIsNaughtyLog += " (";
 			whatIsNaughtyLog += weightedphrase;
 			whatIsNaughtyLog += ")";
@@ -854,10 +762,11 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 		bool belowthreshold = false;
 		String categories;
 		std::deque<listent> sortable_listcategories;
-		catcurrent = listcategories.begin();
-		while (catcurrent != listcategories.end()) {
-			sortable_listcategories.push_back(catcurrent->second);
-			catcurrent++;
+		// categories are fed to the sort in index order
+		std::sort(results.catfound.begin(), results.catfound.end());
+		for (std::vector<int>::iterator i = results.catfound.begin(); i != results.catfound.end(); i++) {
+			String catname((*i < 0) ? String("Embedded URLs") : list->getListCategoryAtD(*i));
+			sortable_listcategories.push_back(listent(results.catweight[*i + 1], catname));
 		}
 		std::sort(sortable_listcategories.begin(), sortable_listcategories.end());
 		std::deque<listent>::iterator k = sortable_listcategories.begin();
@@ -906,12 +815,12 @@ void NaughtyFilter::checkphrase(char *file, off_t filelen, const String *url, co
 // data must also have been NULL terminated.
 void NaughtyFilter::checkPICS(const char *file, unsigned int filtergroup)
 {
-	(*o.fg[filtergroup]).pics1.match(file);
-	if (!(*o.fg[filtergroup]).pics1.matched()) {
+	RegResult r;
+	if (!(*o.fg[filtergroup]).pics1.match(file, r)) {
 		return;
 	}			// exit if not found
-	for (int i = 0; i < (*o.fg[filtergroup]).pics1.numberOfMatches(); i++) {
-		checkPICSrating((*o.fg[filtergroup]).pics1.result(i), filtergroup);  // pass on result for further
+	for (int i = 0; i < r.numberOfMatches(); i++) {
+		checkPICSrating(r.result(i), filtergroup);  // pass on result for further
 		// tests
 	}
 }
@@ -919,15 +828,15 @@ void NaughtyFilter::checkPICS(const char *file, unsigned int filtergroup)
 // the meat of the process 
 void NaughtyFilter::checkPICSrating(std::string label, unsigned int filtergroup)
 {
-	(*o.fg[filtergroup]).pics2.match(label.c_str());
-	if (!(*o.fg[filtergroup]).pics2.matched()) {
+	RegResult ratings;
+	if (!(*o.fg[filtergroup]).pics2.match(label.c_str(), ratings)) {
 		return;
 	}			// exit if not found
 	String lab(label.c_str());  // convert to a String for easy manip
 	String r;
 	String service;
-	for (int i = 0; i < (*o.fg[filtergroup]).pics2.numberOfMatches(); i++) {
-		r = (*o.fg[filtergroup]).pics2.result(i).c_str();  // ditto
+	for (int i = 0; i < ratings.numberOfMatches(); i++) {
+		r = ratings.result(i).c_str();  // ditto
 		r = r.after("(");
 		r = r.before(")");  // remove the brackets
 
@@ -937,9 +846,9 @@ void NaughtyFilter::checkPICSrating(std::string label, unsigned int filtergroup)
 		// It is possible to have multiple ratings in one pics-label.
 		// This is done on e.g. http://www.jesusfilm.org/
 		if (i == 0) {
-			service = lab.subString(0, (*o.fg[filtergroup]).pics2.offset(i));
+			service = lab.subString(0, ratings.offset(i));
 		} else {
-			service = lab.subString((*o.fg[filtergroup]).pics2.offset(i - 1) + (*o.fg[filtergroup]).pics2.length(i - 1), (*o.fg[filtergroup]).pics2.offset(i));
+			service = lab.subString(ratings.offset(i - 1) + ratings.length(i - 1), ratings.offset(i));
 		}
 
 		if (service.contains("safesurf")) {
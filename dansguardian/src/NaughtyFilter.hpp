@@ -8,6 +8,10 @@
 
 // INCLUDES
 
+#include "ListContainer.hpp"
+#include "Normaliser.hpp"
+
+
 // DECLARATIONS
 
 class NaughtyFilter
@@ -36,6 +40,8 @@ public:
 
 	NaughtyFilter();
 	void reset();
+	// content checking modes (phrasefiltermode & preservecase) - as configured unless set
+	void setFilterMode(int phrasemode, int casemode);
 	void checkme(const char *rawbody, off_t rawbodylen, const String *url, const String *domain,
 		unsigned int filtergroup, unsigned int phraselist, int limit, bool searchterms = false);
 	
@@ -43,7 +49,53 @@ public:
 	// both phrase filtering passes (smart/raw)
 	int naughtiness;
 
+	// streaming content filtering - the body is scanned a block at a time as it
+	// downloads (see DataBuffer::streamfilter), instead of all at once by checkme.
+	// startStream returns false if this body can't be scanned that way, in which
+	// case use checkme as normal once the body has arrived.
+	bool startStream(unsigned int filtergroup, unsigned int phraselist, int limit);
+	// scan the part of the body which has arrived since the last call (body is
+	// everything received so far).  returns true if the content is to be blocked,
+	// in which case the rest of it needn't be downloaded.
+	bool streamBlock(const char *body, off_t bodylen);
+	// scan the rest of the body once it has all arrived, and weigh up the results
+	void finishStream(const char *body, off_t bodylen);
+	// is there a streaming check in progress?
+	bool streaming;
+
 private:
+	// phrase search results - kept between documents to avoid reallocation
+	PhraseHits hits;
+	// decoded/case converted/stripped copies of the document - likewise kept
+	Normaliser normaliser;
+
+	// streaming check state: phrases found in the smart view (those in the raw
+	// view go in hits), and the search positions in each view
+	PhraseHits smarthits;
+	int rawstate;
+	int smartstate;
+	// how many hits each view had when last weighed up
+	unsigned long rawscored;
+	unsigned long smartscored;
+	// which views are being checked
+	bool streamraw;
+	bool streamsmart;
+	// has a verdict already been reached?
+	bool streamdone;
+	unsigned int streamgroup;
+	unsigned int streamlist;
+	int streamlimit;
+	// content checking modes for the current request
+	int phrasefiltermode;
+	int preservecase;
+
+	// search the newly normalised parts of the views
+	void streamSearch();
+	// weigh up what has been found so far; if final is not set, only a
+	// naughty verdict or an exception in the raw view is allowed to stand,
+	// and views with nothing new found since last time aren't looked at again
+	void streamVerdict(bool final);
+
 	// check the banned, weighted & exception lists
 	// pass in both URL & domain to activate embedded URL checking
 	// (this is made optional in this manner because it's pointless
@@ -51,6 +103,9 @@ private:
 	// after HTML has been removed, and in search terms.)
 	void checkphrase(char *file, off_t filelen, const String *url, const String *domain,
 		unsigned int filtergroup, unsigned int phraselist, int limit, bool searchterms);
+	// weigh up the results of a phrase search
+	void scorePhrases(PhraseHits &results, ListContainer *list, int weighting, const std::string &embeddedurls,
+		unsigned int filtergroup, int limit, bool searchterms);
 	
 	// check PICS ratings
 	void checkPICS(const char *file, unsigned int filtergroup);
@@ -0,0 +1,499 @@
+// Normaliser class - prepares document bodies for phrase filtering
+
+// For all support, instructions and copyright go to:
+// http://dansguardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+	#include "dgconfig.h"
+#endif
+#include "Normaliser.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef DGDEBUG
+	#include <iostream>
+#endif
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+	#include <immintrin.h>
+#endif
+
+
+// DEFINES
+
+// zeroed bytes following each view
+#define NORM_PADDING (128 + 1)
+// smallest buffer allocated, so that typical pages don't cause regrowth
+#define NORM_MINSIZE 16384
+// amount of input processed between checks for the end of the document head
+#define NORM_HEADCHUNK 4096
+
+
+// DECLARATIONS
+
+// state of a single normalisation pass
+struct NormState
+{
+	// input document & current position in it
+	const unsigned char *raw;
+	off_t rawlen;
+	off_t i;
+	// raw view & current length
+	unsigned char *lc;
+	off_t j;
+	// smart view & current length
+	unsigned char *nohtml;
+	off_t k;
+	// are we inside an HTML tag?
+	bool inhtml;
+
+	bool hexdecode;
+	bool preservecase;
+	bool striphtml;
+	// case folding & whitespace mapping table in use
+	const unsigned char *fold;
+};
+
+// normalise the document up to the given position
+typedef void (*NormKernel)(NormState &s, off_t end);
+
+// case folding & whitespace mapping tables - with and without case conversion
+static unsigned char foldtable[256];
+static unsigned char whitespacetable[256];
+
+// kernel to use on this machine
+static NormKernel kernel = NULL;
+
+
+// IMPLEMENTATION
+
+// value of a hex digit, or -1 if the character isn't one
+static inline int hexDigit(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// add a character of the raw view to the smart view: drop HTML tags,
+// replace their closing brackets with spaces & collapse runs of spaces
+static inline void stripChar(NormState &s, unsigned char c)
+{
+	if (c == '<') {
+		s.inhtml = true;  // flag we are inside a html <>
+	}
+	else if (c == '>') {  // flag we have just left a html <>
+		s.inhtml = false;
+		c = 32;
+	}
+	if (!s.inhtml && (c != 32 || s.nohtml[s.k - 1] != 32)) {
+		s.nohtml[s.k++] = c;
+	}
+}
+
+// process a single input character, or %XX sequence if hex decoding
+static inline void stepScalar(NormState &s)
+{
+	unsigned char c = s.raw[s.i];
+	// we lose the last 3 bytes but what the hell..
+	if (s.hexdecode && c == '%' && s.i < s.rawlen - 3) {
+		int high = hexDigit(s.raw[s.i + 1]);
+		int low = hexDigit(s.raw[s.i + 2]);
+		if (high >= 0 && low >= 0) {
+			c = (unsigned char) ((high << 4) | low);
+			s.i += 2;
+		}
+	}
+	s.i++;
+	c = s.fold[c];
+	s.lc[s.j++] = c;
+	if (s.striphtml)
+		stripChar(s, c);
+}
+
+// add the n bytes just written to the raw view to the smart view, given
+// bitmasks of the positions of '>' characters, and of '<' & spaces, within them
+static inline void stripBlock(NormState &s, unsigned int gt, unsigned int other, int n)
+{
+	if (s.inhtml) {
+		// nothing in this block ends the tag we're in
+		if (gt == 0)
+			return;
+	}
+	else if ((gt | other) == 0) {
+		// nothing to strip or collapse
+		memcpy(s.nohtml + s.k, s.lc + s.j - n, n);
+		s.k += n;
+		return;
+	}
+	for (off_t x = s.j - n; x < s.j; x++)
+		stripChar(s, s.lc[x]);
+}
+
+static void normaliseScalar(NormState &s, off_t end)
+{
+	while (s.i < end)
+		stepScalar(s);
+}
+
+#ifdef __SSE2__
+// fold case & map whitespace of 16 characters at once
+static inline __m128i foldSSE2(__m128i v, bool preservecase)
+{
+	const __m128i space = _mm_set1_epi8(32);
+	if (!preservecase) {
+		// A-Z and 192-221 (accented chars): move each range to start at -128,
+		// so that a single signed comparison tests for membership
+		__m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char) (0x80 - 'A'))), _mm_set1_epi8(-128 + 26));
+		__m128i accented = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char) (0x80 - 192))), _mm_set1_epi8(-128 + 30));
+		v = _mm_add_epi8(v, _mm_and_si128(_mm_or_si128(upper, accented), space));
+	}
+	__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(13)),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(9)), _mm_cmpeq_epi8(v, _mm_set1_epi8(10))));
+	return _mm_or_si128(_mm_andnot_si128(ws, v), _mm_and_si128(ws, space));
+}
+
+static void normaliseSSE2(NormState &s, off_t end)
+{
+	while (s.i + 16 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s.raw + s.i));
+		if (s.hexdecode) {
+			unsigned int pct = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+			if (pct != 0) {
+				// handle everything up to & including the first % the slow way
+				off_t stop = s.i + __builtin_ctz(pct);
+				while (s.i <= stop)
+					stepScalar(s);
+				continue;
+			}
+		}
+		v = foldSSE2(v, s.preservecase);
+		_mm_storeu_si128((__m128i *) (s.lc + s.j), v);
+		s.i += 16;
+		s.j += 16;
+		if (s.striphtml) {
+			unsigned int gt = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+			unsigned int other = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(32))));
+			stripBlock(s, gt, other, 16);
+		}
+	}
+	normaliseScalar(s, end);
+}
+#endif
+
+#ifdef HAVE_AVX2
+// fold case & map whitespace of 32 characters at once - as foldSSE2
+__attribute__((target("avx2"))) static inline __m256i foldAVX2(__m256i v, bool preservecase)
+{
+	const __m256i space = _mm256_set1_epi8(32);
+	if (!preservecase) {
+		__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8((char) (0x80 - 'A'))));
+		__m256i accented = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 30), _mm256_add_epi8(v, _mm256_set1_epi8((char) (0x80 - 192))));
+		v = _mm256_add_epi8(v, _mm256_and_si256(_mm256_or_si256(upper, accented), space));
+	}
+	__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(13)),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(9)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(10))));
+	return _mm256_or_si256(_mm256_andnot_si256(ws, v), _mm256_and_si256(ws, space));
+}
+
+__attribute__((target("avx2"))) static void normaliseAVX2(NormState &s, off_t end)
+{
+	while (s.i + 32 <= end) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s.raw + s.i));
+		if (s.hexdecode) {
+			unsigned int pct = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+			if (pct != 0) {
+				off_t stop = s.i + __builtin_ctz(pct);
+				while (s.i <= stop)
+					stepScalar(s);
+				continue;
+			}
+		}
+		v = foldAVX2(v, s.preservecase);
+		_mm256_storeu_si256((__m256i *) (s.lc + s.j), v);
+		s.i += 32;
+		s.j += 32;
+		if (s.striphtml) {
+			unsigned int gt = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+			unsigned int other = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8(32))));
+			stripBlock(s, gt, other, 32);
+		}
+	}
+	normaliseScalar(s, end);
+}
+#endif
+
+// constructor - set up the lookup tables & pick a kernel the first time round
+Normaliser::Normaliser()
+:	lc(NULL), lclen(0), nohtml(NULL), nohtmllen(0), meta(NULL), metalen(0),
+	lcsize(0), nohtmlsize(0), metasize(0), headlen(-1), state(new NormState)
+{
+	if (kernel != NULL)
+		return;
+
+	for (int c = 0; c < 256; c++) {
+		unsigned char w = c;
+		if (c == 13 || c == 9 || c == 10)
+			w = 32;  // convert all whitespace to a space
+		whitespacetable[c] = w;
+		if (c >= 'A' && c <= 'Z')
+			foldtable[c] = c + 32;
+		else if (c >= 192 && c <= 221)  // for accented chars
+			foldtable[c] = c + 32;  // 224 + c - 192
+		else
+			foldtable[c] = w;
+	}
+
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+#ifdef DGDEBUG
+		std::cout << "Content normalisation using AVX2" << std::endl;
+#endif
+		kernel = &normaliseAVX2;
+		return;
+	}
+#endif
+#ifdef __SSE2__
+#ifdef DGDEBUG
+	std::cout << "Content normalisation using SSE2" << std::endl;
+#endif
+	kernel = &normaliseSSE2;
+#else
+	kernel = &normaliseScalar;
+#endif
+}
+
+Normaliser::~Normaliser()
+{
+	delete[] lc;
+	delete[] nohtml;
+	delete[] meta;
+	delete state;
+}
+
+// make sure the given buffer can hold len bytes plus padding.
+// never shrinks, and doesn't preserve the contents when growing.
+void Normaliser::reserve(char *&buffer, off_t &size, off_t len)
+{
+	if (size >= len + NORM_PADDING)
+		return;
+	delete[] buffer;
+	size = std::max((off_t) NORM_MINSIZE, len + NORM_PADDING);
+	buffer = new char[size];
+}
+
+// build the raw (and, optionally, smart) views of the given document
+void Normaliser::normalise(const char *raw, off_t rawlen, bool hexdecode, bool preservecase, bool striphtml, bool headonly)
+{
+	if (rawlen < 0)
+		rawlen = 0;
+	reserve(lc, lcsize, rawlen);
+	if (striphtml)
+		reserve(nohtml, nohtmlsize, rawlen + 1);
+
+	startStream(hexdecode, preservecase, striphtml);
+	NormState &s = *state;
+	s.raw = (const unsigned char *) raw;
+	s.rawlen = rawlen;
+	s.lc = (unsigned char *) lc;
+	s.nohtml = (unsigned char *) nohtml;
+
+	// the smart view starts with a space, so that
+	// leading spaces in the document are collapsed
+	if (striphtml)
+		nohtml[0] = 32;
+
+	headlen = -1;
+	if (headonly) {
+		// look for </head as we go - the rest of the document is of no interest
+		static const char endhead[] = "</head";
+		off_t searched = 0;
+		while (s.i < rawlen) {
+			kernel(s, std::min(rawlen, s.i + NORM_HEADCHUNK));
+			char *found = std::search(lc + searched, lc + s.j, endhead, endhead + 6);
+			if (found != lc + s.j) {
+#ifdef DGDEBUG
+				std::cout << "Found '</head', limiting search range" << std::endl;
+#endif
+				headlen = found - lc;
+				break;
+			}
+			// the tag may straddle the boundary with the next chunk
+			searched = std::max((off_t) 0, s.j - 5);
+		}
+	} else {
+		kernel(s, rawlen);
+	}
+
+	lclen = s.j;
+	memset(lc + lclen, 0, NORM_PADDING);
+	if (striphtml) {
+		nohtmllen = s.k;
+		memset(nohtml + nohtmllen, 0, NORM_PADDING);
+	} else {
+		nohtmllen = 0;
+	}
+}
+
+// get ready to normalise a new document a piece at a time
+void Normaliser::startStream(bool hexdecode, bool preservecase, bool striphtml)
+{
+	NormState &s = *state;
+	s.i = 0;
+	s.j = 0;
+	s.k = 1;
+	s.inhtml = false;
+	s.hexdecode = hexdecode;
+	s.preservecase = preservecase;
+	s.striphtml = striphtml;
+	s.fold = preservecase ? whitespacetable : foldtable;
+	lclen = 0;
+	// the held back "last character" of the smart view is
+	// initially the space it always starts with
+	nohtmllen = 1;
+	if (striphtml) {
+		reserve(nohtml, nohtmlsize, 1);
+		nohtml[0] = 32;
+	}
+}
+
+// normalise the part of the document which has arrived since the last call
+void Normaliser::streamBlock(const char *raw, off_t rawlen, bool last)
+{
+	NormState &s = *state;
+	// hold back the last three bytes until the end of the document,
+	// as we don't yet know whether a %XX sequence there gets decoded
+	off_t end = last ? rawlen : rawlen - 3;
+	off_t len = (end > s.i) ? (end - s.i) : 0;
+
+	char carry = s.striphtml ? nohtml[nohtmllen - 1] : 0;
+	reserve(lc, lcsize, len);
+	if (s.striphtml) {
+		reserve(nohtml, nohtmlsize, len + 1);
+		nohtml[0] = carry;
+	}
+
+	s.raw = (const unsigned char *) raw;
+	s.rawlen = rawlen;
+	s.lc = (unsigned char *) lc;
+	s.j = 0;
+	s.nohtml = (unsigned char *) nohtml;
+	s.k = 1;
+	if (len > 0)
+		kernel(s, end);
+
+	lclen = s.j;
+	memset(lc + lclen, 0, NORM_PADDING);
+	if (s.striphtml) {
+		nohtmllen = s.k;
+		memset(nohtml + nohtmllen, 0, NORM_PADDING);
+	}
+}
+
+// find </head> or <body> as end of search range, when normalise
+// didn't come across a </head tag
+off_t Normaliser::findEndHead(bool preservecase)
+{
+	// if case preserved, also look for uppercase versions
+	static const char *ends[] = { "<body", "</HEAD", "<BODY" };
+	for (int n = 0; n < (preservecase ? 3 : 1); n++) {
+		char *found = std::search(lc, lc + lclen, ends[n], ends[n] + strlen(ends[n]));
+		if (found != lc + lclen) {
+#ifdef DGDEBUG
+			std::cout << "Found '" << ends[n] << "', limiting search range" << std::endl;
+#endif
+			return found - lc;
+		}
+	}
+	return lclen;
+}
+
+// build the META/title view from the head of the raw view
+// based on idea from Nicolas Peyrussie
+bool Normaliser::extractMeta(bool preservecase)
+{
+	off_t end = headlen;
+	if (end < 0)
+		end = findEndHead(preservecase);
+
+	reserve(meta, metasize, end);
+
+	bool addit = false;  // flag if we should copy this char to filtered version
+	bool needcheck = false;  // flag if we actually find anything worth filtering
+	unsigned char c;
+
+	// initialisation for removal of duplicate non-alphanumeric characters
+	off_t j = 1;
+	meta[0] = 32;
+
+	for (off_t i = 0; i < end - 7; i++) {
+		c = lc[i];
+		// are we at the start of a tag?
+		if ((!addit) && (c == '<')) {
+			if ((strncmp(lc + i + 1, "meta", 4) == 0) || (preservecase && (strncmp(lc + i + 1, "META", 4) == 0))) {
+#ifdef DGDEBUG
+				std::cout << "Found META" << std::endl;
+#endif
+				// start adding data to the check buffer
+				addit = true;
+				needcheck = true;
+				// skip 'meta '
+				i += 6;
+				c = lc[i];
+			}
+			// are we at the start of a title tag?
+			else if ((strncmp(lc + i + 1, "title", 5) == 0) || (preservecase && (strncmp(lc + i + 1, "TITLE", 5) == 0))) {
+#ifdef DGDEBUG
+				std::cout << "Found TITLE" << std::endl;
+#endif
+				// start adding data to the check buffer
+				addit = true;
+				needcheck = true;
+				// skip 'title>'
+				i += 7;
+				c = lc[i];
+			}
+		}
+		// meta tags end at a >
+		// title tags end at the next < (opening of </title>)
+		if (addit && ((c == '>') || (c == '<'))) {
+			// stop ading data
+			addit = false;
+			// add a space before the next word in the check buffer
+			meta[j++] = 32;
+		}
+
+		if (addit) {
+			// if we're in "record" mode (i.e. inside a title/metatag), strip certain characters out
+			// of the data (to sanitise metatags & aid filtering of titles)
+			if (c == ',' || c == '=' || c == '"' || c == '\''
+				|| c == '(' || c == ')' || c == '.')
+			{
+				// replace with a space
+				c = 32;
+			}
+			// don't bother duplicating spaces
+			if ((c != 32) || (meta[j - 1] != 32)) {
+				meta[j++] = c;  // copy it to the filtered copy
+			}
+		}
+	}
+	meta[j++] = '\0';
+	metalen = j;
+	memset(meta + metalen, 0, NORM_PADDING);
+	return needcheck;
+}
@@ -0,0 +1,81 @@
+// Normaliser class - prepares document bodies for phrase filtering
+
+// For all support, instructions and copyright go to:
+// http://dansguardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_NORMALISER
+#define __HPP_NORMALISER
+
+
+// INCLUDES
+
+#include <sys/types.h>
+
+
+// DECLARATIONS
+
+struct NormState;
+
+// produces the views of a document which NaughtyFilter searches for phrases:
+// hex decoded, case folded & whitespace mapped ("raw"), the same with HTML
+// removed ("smart"), and META/title text.  all views are written during a
+// single pass over the original document, into buffers which only ever grow,
+// so an instance kept from one document to the next doesn't allocate memory.
+// every view is followed by at least 128 bytes of zeroes, as required by the
+// speed tricks in the phrase searching code.
+class Normaliser
+{
+public:
+	// raw view
+	char *lc;
+	off_t lclen;
+	// smart view - starts with a space
+	char *nohtml;
+	off_t nohtmllen;
+	// META/title view - see extractMeta
+	char *meta;
+	off_t metalen;
+
+	Normaliser();
+	~Normaliser();
+
+	// build the raw (and, optionally, smart) views of the given document.
+	// if headonly is set, only the document head is of interest, so stop
+	// once the end of it has been found.
+	void normalise(const char *raw, off_t rawlen, bool hexdecode, bool preservecase, bool striphtml, bool headonly = false);
+
+	// normalise a document a piece at a time, as it arrives: raw is the whole
+	// document received so far, each call carries on from where the last one
+	// left off, and the raw and smart views then hold only the newly normalised
+	// text.  the last character of the smart view is held back until the next
+	// call, so searching all but the last character of each piece of the smart
+	// view searches the same text as a single normalise would.
+	void startStream(bool hexdecode, bool preservecase, bool striphtml);
+	void streamBlock(const char *raw, off_t rawlen, bool last);
+
+	// build the META/title view from the head of the raw view.
+	// returns false if there were no META or title tags.
+	bool extractMeta(bool preservecase);
+
+private:
+	// allocated buffer sizes
+	off_t lcsize;
+	off_t nohtmlsize;
+	off_t metasize;
+	// length of the document head within the raw view
+	off_t headlen;
+	// position in the document - kept between calls to streamBlock
+	NormState *state;
+
+	// disallow copying
+	Normaliser(const Normaliser&);
+	Normaliser& operator=(const Normaliser&);
+
+	// make sure the given buffer can hold len bytes plus padding
+	void reserve(char *&buffer, off_t &size, off_t len);
+	// find the end of the document head in the raw view
+	off_t findEndHead(bool preservecase);
+};
+
+#endif
@@ -17,6 +17,7 @@
 #include <sstream>
 #include <syslog.h>
 #include <dirent.h>
+#include <cstdlib>
 
 #include <unistd.h>		// checkme: remove?
 
@@ -29,7 +30,7 @@ extern bool is_daemonised;
 // IMPLEMENTATION
 
 OptionContainer::OptionContainer():use_filter_groups_list(false), use_group_names_list(false),
-auth_needs_proxy_query(false), prefer_cached_lists(false), no_daemon(false), no_logger(false),
+auth_needs_proxy_query(false), auth_connection_based(false), prefer_cached_lists(false), no_daemon(false), no_logger(false),
 log_syslog(false),  anonymise_logs(false), log_ad_blocks(false),log_timestamp(false),
 log_user_agent(false), soft_restart(false),delete_downloaded_temp_files(false),
 max_logitem_length(0), max_content_filter_size(0),
@@ -60,9 +61,64 @@ void OptionContainer::reset()
 	if (use_filter_groups_list) filter_groups_list.reset();
 	filter_ip.clear();
 	filter_ports.clear();
+	priority_ports.clear();
 	auth_map.clear();
 }
 
+// content checking settings at the given load shedding tier - tier 0 is as configured.
+// tier 1 scans content once, as it is; tier 2 also scans less of it; tier 3 (no content
+// checks at all) is up to the caller.  the options themselves are left alone, as they're
+// shared by every request.
+int OptionContainer::phraseFilterMode(int tier) const
+{
+	if (tier >= 1 && phrase_filter_mode == 2)
+		return 0;
+	return phrase_filter_mode;
+}
+
+int OptionContainer::preserveCase(int tier) const
+{
+	if (tier >= 1 && preserve_case == 2)
+		return 0;
+	return preserve_case;
+}
+
+off_t OptionContainer::maxContentFilterSize(int tier) const
+{
+	if (tier >= 2 && max_content_filter_size > load_shed_filter_size)
+		return load_shed_filter_size;
+	return max_content_filter_size;
+}
+
+// pre-render the response for clients turned away when all children are busy,
+// so that the parent can send it without any work
+bool OptionContainer::readOverloadPage(const std::string &filename)
+{
+	std::string body;
+	if (filename.length() > 0) {
+		std::ifstream page(filename.c_str(), std::ios::in);
+		if (!page.good()) {
+			if (!is_daemonised) {
+				std::cerr << "Error reading overloadpage: " << filename << std::endl;
+			}
+			syslog(LOG_ERR, "Error reading overloadpage: %s", filename.c_str());
+			return false;
+		}
+		std::stringstream text;
+		text << page.rdbuf();
+		body = text.str();
+	} else {
+		body = "<HTML><HEAD><TITLE>DansGuardian - 503 Service Unavailable</TITLE></HEAD><BODY>"
+			"<H1>503 Service Unavailable</H1>The web filter is too busy to deal with your request. "
+			"Please try again in a few moments.</BODY></HTML>\n";
+	}
+	std::stringstream response;
+	response << "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 10\r\nContent-Type: text/html\r\n"
+		<< "Content-Length: " << body.length() << "\r\nConnection: close\r\n\r\n" << body;
+	overload_response = response.str();
+	return true;
+}
+
 void OptionContainer::deleteFilterGroups()
 {
 	for (int i = 0; i < numfg; i++) {
@@ -137,12 +193,12 @@ bool OptionContainer::read(const char *filename, int type)
 			if ((ipc_filename = findoptionS("ipcfilename")) == "")
 				ipc_filename = "/tmp/.dguardianipc";
 
-			if ((urlipc_filename = findoptionS("urlipcfilename")) == "")
-				urlipc_filename = "/tmp/.dguardianurlipc";
-
 			if ((ipipc_filename = findoptionS("ipipcfilename")) == "")
 				ipipc_filename = "/tmp/.dguardianipipc";
 
+			if ((status_filename = findoptionS("statusfilename")) == "")
+				status_filename = "/tmp/.dguardianstatus";
+
 			if ((pid_filename = findoptionS("pidfilename")) == "") {
 				pid_filename = __PIDDIR;
 				pid_filename += "/dansguardian.pid";
@@ -271,6 +327,88 @@ bool OptionContainer::read(const char *filename, int type)
 		if (!realitycheck(maxage_children, 1, 0, "maxagechildren")) {
 			return false;
 		}		// check its a reasonable value
+		max_child_memory = findoptionI("maxchildmemory");
+		if (!realitycheck(max_child_memory, 0, 0, "maxchildmemory")) {
+			return false;
+		}
+		max_child_heap = findoptionI("maxchildheap");
+		if (!realitycheck(max_child_heap, 0, 0, "maxchildheap")) {
+			return false;
+		}
+		max_child_lifetime = findoptionI("maxchildlifetime");
+		if (!realitycheck(max_child_lifetime, 0, 0, "maxchildlifetime")) {
+			return false;
+		}
+		child_recycling = (max_child_memory > 0 || max_child_heap > 0 || max_child_lifetime > 0);
+		if (findoptionS("adaptivechildren") == "on") {
+			adaptive_children = true;
+			adaptive_headroom = findoptionI("adaptiveheadroom");
+			if (!realitycheck(adaptive_headroom, 100, 1000, "adaptiveheadroom")) {
+				return false;
+			}		// check its a reasonable value
+			adaptive_shrink_delay = findoptionI("adaptiveshrinkdelay");
+			if (!realitycheck(adaptive_shrink_delay, 1, 3600, "adaptiveshrinkdelay")) {
+				return false;
+			}		// check its a reasonable value
+		} else {
+			adaptive_children = false;
+		}
+		if (findoptionS("childaccept") == "on") {
+			child_accept = true;
+		} else {
+			child_accept = false;
+		}
+		child_connections = findoptionI("childconnections");
+		if (!realitycheck(child_connections, 1, 0, "childconnections")) {
+			return false;
+		}		// check its a reasonable value
+		child_threads = findoptionI("childthreads");
+		if (!realitycheck(child_threads, 1, 0, "childthreads")) {
+			return false;
+		}		// check its a reasonable value
+		parked_connections = findoptionI("parkedconnections");
+		if (!realitycheck(parked_connections, 0, 0, "parkedconnections")) {
+			return false;
+		}		// check its a reasonable value
+		if (findoptionS("deferaccept") == "on") {
+			defer_accept = true;
+		} else {
+			defer_accept = false;
+		}
+		overload_queue = findoptionI("overloadqueue");
+		if (!realitycheck(overload_queue, 0, 0, "overloadqueue")) {
+			return false;
+		}		// check its a reasonable value
+		std::deque<String> ports = findoptionM("priorityports");
+		priority_ports.clear();
+		for (std::deque<String>::iterator i = ports.begin(); i != ports.end(); i++)
+			priority_ports.push_back(i->toInteger());
+		if (!readOverloadPage(findoptionS("overloadpage"))) {
+			return false;
+		}
+		max_client_connections = findoptionI("maxclientconnections");
+		if (!realitycheck(max_client_connections, 0, 0, "maxclientconnections")) {
+			return false;
+		}
+		max_client_rate = findoptionI("maxclientrate");
+		if (!realitycheck(max_client_rate, 0, 0, "maxclientrate")) {
+			return false;
+		}
+		max_user_connections = findoptionI("maxuserconnections");
+		if (!realitycheck(max_user_connections, 0, 0, "maxuserconnections")) {
+			return false;
+		}
+		max_user_rate = findoptionI("maxuserrate");
+		if (!realitycheck(max_user_rate, 0, 0, "maxuserrate")) {
+			return false;
+		}
+		client_limits = (max_client_connections > 0 || max_client_rate > 0 || max_user_connections > 0 || max_user_rate > 0);
+		if (client_limits) {
+			client_limit_wait = findoptionI("clientlimitwait");
+			if (!realitycheck(client_limit_wait, 0, 60, "clientlimitwait")) {
+				return false;
+			}
+		}
 
 		max_ips = findoptionI("maxips");
 		if (!realitycheck(max_ips, 0, 0, "maxips")) {
@@ -387,6 +525,47 @@ bool OptionContainer::read(const char *filename, int type)
 		} else {
 			force_quick_search = false;
 		}
+		if (findoptionS("streamingfilter") == "on") {
+			streaming_filter = true;
+		} else {
+			streaming_filter = false;
+		}
+		// needs setting before any lists are read
+		if (findoptionS("hugepagelists") == "off") {
+			huge_page_lists = false;
+		} else {
+			huge_page_lists = true;
+		}
+		listArenaHugePages(huge_page_lists);
+
+		// load shedding
+		load_shed_max_tier = findoptionI("loadshedmaxtier");
+		if (!realitycheck(load_shed_max_tier, 0, 3, "loadshedmaxtier")) {
+			return false;
+		}
+		if (load_shed_max_tier > 0) {
+			load_shed_busy = findoptionI("loadshedbusy");
+			if (!realitycheck(load_shed_busy, 1, 100, "loadshedbusy")) {
+				return false;
+			}
+			load_shed_runqueue = findoptionI("loadshedrunqueue");
+			if (!realitycheck(load_shed_runqueue, 1, 0, "loadshedrunqueue")) {
+				return false;
+			}
+			load_shed_response = findoptionI("loadshedresponse");
+			if (!realitycheck(load_shed_response, 1, 0, "loadshedresponse")) {
+				return false;
+			}
+			load_shed_delay = findoptionI("loadsheddelay");
+			if (!realitycheck(load_shed_delay, 1, 3600, "loadsheddelay")) {
+				return false;
+			}
+			load_shed_filter_size = findoptionI("loadshedfiltersize");
+			if (!realitycheck(load_shed_filter_size, 1, 0, "loadshedfiltersize")) {
+				return false;
+			}
+			load_shed_filter_size *= 1024;
+		}
 		
 		if (findoptionS("usecustombannedimage") == "off") {
 			use_custom_banned_image = false;
@@ -1010,6 +1189,7 @@ bool OptionContainer::readAnotherFilterGroupConf(const char *filename, const cha
 	// pass all the vars from OptionContainer needed
 	(*fg[numfg]).weighted_phrase_mode = weighted_phrase_mode;
 	(*fg[numfg]).force_quick_search = force_quick_search;
+	(*fg[numfg]).streaming_filter = streaming_filter;
 	(*fg[numfg]).createlistcachefiles = createlistcachefiles;
 	(*fg[numfg]).reverse_lookups = reverse_lookups;
 	
@@ -1159,6 +1339,8 @@ bool OptionContainer::loadAuthPlugins()
 {
 	// Assume no auth plugins need an upstream proxy query (NTLM, BASIC) until told otherwise
 	auth_needs_proxy_query = false;
+	// likewise for plugins which identify a whole connection at once (NTLM)
+	auth_connection_based = false;
 
 	std::deque<String > dq = findoptionM("authplugin");
 	unsigned int numplugins = dq.size();
@@ -1204,6 +1386,8 @@ bool OptionContainer::loadAuthPlugins()
 			std::cout << "Auth plugin relies on querying parent proxy" << std::endl;
 #endif
 		}
+		if (app->is_connection_based)
+			auth_connection_based = true;
 		authplugins.push_back(app);
 	}
 	// cache reusable iterators
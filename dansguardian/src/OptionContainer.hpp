@@ -53,6 +53,10 @@ public:
 	int preserve_case;
 	bool hex_decode_content;
 	bool force_quick_search;
+	// scan content for phrases as it downloads, rather than once it has all arrived
+	bool streaming_filter;
+	// keep big lists in huge pages (see listArenaAlloc)
+	bool huge_page_lists;
 	int filter_port;
 	int proxy_port;
 	std::string proxy_ip;
@@ -70,6 +74,36 @@ public:
 	int prefork_children;
 	int minspare_children;
 	int maxage_children;
+	// replace children which have grown by more than this (in MB) or are older (in seconds) - 0 for no limit
+	int max_child_memory;
+	int max_child_heap;
+	int max_child_lifetime;
+	bool child_recycling;
+	bool adaptive_children;
+	int adaptive_headroom;
+	int adaptive_shrink_delay;
+	bool child_accept;
+	int child_connections;
+	int child_threads;
+	int parked_connections;
+	bool defer_accept;
+	int overload_queue;
+	std::deque<int> priority_ports;
+	// complete HTTP response for clients turned away when overloaded
+	std::string overload_response;
+	int load_shed_max_tier;
+	int load_shed_busy;
+	int load_shed_runqueue;
+	int load_shed_response;
+	int load_shed_delay;
+	off_t load_shed_filter_size;
+	// per client IP & user limits (maxclientconnections & co.)
+	bool client_limits;
+	int max_client_connections;
+	int max_client_rate;
+	int max_user_connections;
+	int max_user_rate;
+	int client_limit_wait;
 	std::string daemon_user_name;
 	std::string daemon_group_name;
 	int proxy_user;
@@ -81,6 +115,7 @@ public:
 	bool use_filter_groups_list;
 	bool use_group_names_list;
 	bool auth_needs_proxy_query;
+	bool auth_connection_based;
 	bool prefer_cached_lists;
 
 	std::string languagepath;
@@ -89,8 +124,8 @@ public:
 	std::string log_location;
 	std::string stat_location;
 	std::string ipc_filename;
-	std::string urlipc_filename;
 	std::string ipipc_filename;
+	std::string status_filename;
 	std::string pid_filename;
 	std::string blocked_content_store;
 
@@ -185,6 +220,10 @@ public:
 	bool readFilterGroupConf();
 	// public so fc_controlit can reload filter group config files
 	bool doReadItemList(const char *filename, ListContainer *lc, const char *fname, bool swsort);
+	// content checking settings scaled back to the given load shedding tier (loadshedmaxtier)
+	int phraseFilterMode(int tier) const;
+	int preserveCase(int tier) const;
+	off_t maxContentFilterSize(int tier) const;
 
 	// per-room blocking: see if given IP is in a room; if it is, return true and put the room name in "room"
 	bool inRoom(const std::string& ip, std::string& room, std::string *&host) const;
@@ -209,6 +248,7 @@ private:
 	bool realitycheck(long int l, long int minl, long int maxl, const char *emessage);
 	bool readAnotherFilterGroupConf(const char *filename, const char *groupname, bool &need_html);
 	std::deque<String> findoptionM(const char *option);
+	bool readOverloadPage(const std::string &filename);
 
 	bool inIPList(const std::string *ip, ListContainer& list, std::string *&host);
 
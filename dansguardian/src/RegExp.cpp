@@ -15,28 +15,14 @@
 #include <iostream>
 
 // constructor - set defaults
-RegExp::RegExp():reg(), imatched(false), wascompiled(false)
+RegExp::RegExp():reg(), wascompiled(false)
 {
 }
 
 // copy constructor
 RegExp::RegExp(const RegExp & r)
 {
-	results.clear();
-	offsets.clear();
-	lengths.clear();
-	unsigned int i;
-	for (i = 0; i < r.results.size(); i++) {
-		results.push_back(r.results[i]);
-	}
-	for (i = 0; i < r.offsets.size(); i++) {
-		offsets.push_back(r.offsets[i]);
-	}
-	for (i = 0; i < r.lengths.size(); i++) {
-		lengths.push_back(r.lengths[i]);
-	}
-
-	imatched = r.imatched;
+	lastresult = r.lastresult;
 	wascompiled = r.wascompiled;
 	searchstring = r.searchstring;
 	if (wascompiled == true) {
@@ -46,7 +32,7 @@ RegExp::RegExp(const RegExp & r)
 		if (regcomp(&reg, searchstring.c_str(), REG_ICASE | REG_EXTENDED) != 0 ) {
 #endif
 			regfree(&reg);
-			imatched = false;
+			lastresult.imatched = false;
 			wascompiled = false;
 		}
 	}
@@ -61,7 +47,7 @@ RegExp::~RegExp()
 }
 
 // return the i'th match result
-std::string RegExp::result(int i)
+std::string RegResult::result(int i)
 {
 	if (i >= (signed) results.size() || i < 0) {	// reality check
 		return "";  // maybe exception?
@@ -70,7 +56,7 @@ std::string RegExp::result(int i)
 }
 
 // get the position of the i'th match result in the overall text
-unsigned int RegExp::offset(int i)
+unsigned int RegResult::offset(int i)
 {
 	if (i >= (signed) offsets.size() || i < 0) {	// reality check
 		return 0;  // maybe exception?
@@ -79,7 +65,7 @@ unsigned int RegExp::offset(int i)
 }
 
 // get the length of the i'th match
-unsigned int RegExp::length(int i)
+unsigned int RegResult::length(int i)
 {
 	if (i >= (signed) lengths.size() || i < 0) {	// reality check
 		return 0;  // maybe exception?
@@ -88,18 +74,53 @@ unsigned int RegExp::length(int i)
 }
 
 // how many matches did the last run generate?
-int RegExp::numberOfMatches()
+int RegResult::numberOfMatches()
 {
 	int i = (signed) results.size();
 	return i;
 }
 
 // did it, in fact, generate any?
-bool RegExp::matched()
+bool RegResult::matched()
 {
 	return imatched;  // regexp matches only - not search/replace
 }
 
+// forget the results of the last run
+void RegResult::clear()
+{
+	results.clear();
+	offsets.clear();
+	lengths.clear();
+	imatched = false;
+}
+
+// results of the last match(text), for those who keep them in the RegExp
+std::string RegExp::result(int i)
+{
+	return lastresult.result(i);
+}
+
+unsigned int RegExp::offset(int i)
+{
+	return lastresult.offset(i);
+}
+
+unsigned int RegExp::length(int i)
+{
+	return lastresult.length(i);
+}
+
+int RegExp::numberOfMatches()
+{
+	return lastresult.numberOfMatches();
+}
+
+bool RegExp::matched()
+{
+	return lastresult.matched();
+}
+
 // compile the given regular expression
 bool RegExp::comp(const char *exp)
 {
@@ -107,10 +128,7 @@ bool RegExp::comp(const char *exp)
 		regfree(&reg);
 		wascompiled = false;
 	}
-	results.clear();
-	offsets.clear();
-	lengths.clear();
-	imatched = false;
+	lastresult.clear();
 #ifdef DGDEBUG
 	std::cout << "Compiling " << exp << std::endl;
 #endif
@@ -137,25 +155,26 @@ bool RegExp::comp(const char *exp)
 // match the given text against the pre-compiled expression
 bool RegExp::match(const char *text)
 {
+	return match(text, lastresult);
+}
+
+// match the given text against the pre-compiled expression, putting the results in r
+bool RegExp::match(const char *text, RegResult &r) const
+{
+	r.clear();
 	if (!wascompiled) {
 		return false;  // need exception?
 	}
 	char *pos = (char *) text;
 	int i;
-	results.clear();
-	offsets.clear();
-	lengths.clear();
-	imatched = false;
 	regmatch_t *pmatch = new regmatch_t[reg.re_nsub + 1];  // to hold result
 	if (!pmatch) {  // if it failed
 		delete[]pmatch;
-		imatched = false;
 		return false;
 		// exception?
 	}
 	if (regexec(&reg, pos, reg.re_nsub + 1, pmatch, 0)) {  // run regex
 		delete[]pmatch;
-		imatched = false;
 //        #ifdef DGDEBUG
 //            std::cout << "no match for:" << searchstring << std::endl;
 //        #endif
@@ -173,9 +192,9 @@ bool RegExp::match(const char *text)
 				submatch = new char[matchlen + 1];
 				strncpy(submatch, pos + pmatch[i].rm_so, matchlen);
 				submatch[matchlen] = '\0';
-				results.push_back(std::string(submatch));
-				offsets.push_back(pmatch[i].rm_so + (pos - text));
-				lengths.push_back(matchlen);
+				r.results.push_back(std::string(submatch));
+				r.offsets.push_back(pmatch[i].rm_so + (pos - text));
+				r.lengths.push_back(matchlen);
 				delete[]submatch;
 				if ((pmatch[i].rm_so + matchlen) > largestoffset) {
 					largestoffset = pmatch[i].rm_so + matchlen;
@@ -190,7 +209,7 @@ bool RegExp::match(const char *text)
 		}
 
 	}
-	imatched = true;
+	r.imatched = true;
 	delete[]pmatch;
 #ifdef DGDEBUG
 	std::cout << "match(s) for:" << searchstring << std::endl;
@@ -24,6 +24,40 @@
 
 // DECLARATIONS
 
+// the results of matching a RegExp against some text.  keep one of these per
+// caller when the same compiled expression may be matched by several threads.
+class RegResult
+{
+public:
+	RegResult():imatched(false) {};
+
+	// how many matches did the run generate?
+	int numberOfMatches();
+	// did it generate any at all?
+	bool matched();
+
+	// the i'th match from the run
+	std::string result(int i);
+	// position of the i'th match in the overall text
+	unsigned int offset(int i);
+	// length of the i'th match
+	unsigned int length(int i);
+
+	// forget the results of the last run
+	void clear();
+
+private:
+	friend class RegExp;
+
+	// the match results, their positions in the text & their lengths
+	std::deque<std::string> results;
+	std::deque<unsigned int> offsets;
+	std::deque<unsigned int> lengths;
+
+	// have we matched something yet?
+	bool imatched;
+};
+
 class RegExp
 {
 public:
@@ -38,6 +72,9 @@ public:
 	bool comp(const char *exp);
 	// match the given text against the pre-compiled expression
 	bool match(const char *text);
+	// as above, but put the results in the given object instead of this one.
+	// leaves this one untouched, so is safe to use from several threads at once.
+	bool match(const char *text, RegResult &r) const;
 	
 	// how many matches did the last run generate?
 	int numberOfMatches();
@@ -55,17 +92,12 @@ public:
 	char *search(char *file, char *fileend, char *phrase, char *phraseend);
 
 private:
-	// the match results, their positions in the text & their lengths
-	std::deque<std::string> results;
-	std::deque<unsigned int> offsets;
-	std::deque<unsigned int> lengths;
+	// results of the last run of match(text)
+	RegResult lastresult;
 
 	// the expression itself
 	regex_t reg;
 
-	// have we matched something yet?
-	bool imatched;
-
 	// whether it's been pre-compiled
 	bool wascompiled;
 	
@@ -0,0 +1,852 @@
+// For all support, instructions and copyright go to:
+// http://dansguardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+
+// INCLUDES
+
+#ifdef HAVE_CONFIG_H
+	#include "dgconfig.h"
+#endif
+#include "OptionContainer.hpp"
+#include "Scoreboard.hpp"
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <csignal>
+#include <iostream>
+
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+
+// GLOBALS
+
+extern OptionContainer o;
+
+
+// DEFINES
+
+// marks a scoreboard file as one of ours, of this layout
+#define SB_MAGIC 0x44475362
+
+// how far along the client table to look for a client, before giving up on keeping track of it
+#define SB_CLIENTPROBE 32
+// how long the entry of a client with nothing in progress is kept after its last request
+#define SB_CLIENTAGE 300
+// how often a child looks at how much memory it's using, in seconds
+#define SB_MEMINTERVAL 10
+
+
+// DECLARATIONS
+
+struct ScoreboardHeader
+{
+	unsigned int magic;
+	int slots;
+	pid_t parent;
+	time_t started;
+	// counts of slots in the idle & starting states
+	volatile int idle;
+	volatile int starting;
+	// does the parent want waking when a child becomes idle?
+	volatile int starved;
+	// requests finished, and the milliseconds spent on them, for the pool controller
+	volatile unsigned long served;
+	volatile unsigned long servicemsecs;
+	// connections the parent is holding for want of a free child, and how many it has
+	// held & turned away (overloadqueue)
+	volatile int waiting;
+	volatile unsigned long queued;
+	volatile unsigned long rejected;
+	// request times, for load shedding, and the tier the parent has chosen
+	volatile unsigned long servicehist[SB_HISTBUCKETS];
+	volatile int loadtier;
+	// size of the client table, and the PID of the process which has it locked
+	int clients;
+	volatile pid_t clientlock;
+};
+
+struct ScoreboardSlot
+{
+	volatile pid_t pid;
+	volatile int state;
+	volatile int activity;
+	// when the state last changed, and when the current request started
+	volatile time_t statetime;
+	volatile time_t requesttime;
+	volatile unsigned long requests;
+	volatile int connections;
+	// odd whilst the text below is being written
+	volatile unsigned int seq;
+	// held whilst writing the text, as several threads may want to
+	volatile int textlock;
+	char url[SB_URLLEN];
+	char ip[SB_IPLEN];
+	char user[SB_USERLEN];
+	// entries in the client table counting requests this child has in progress
+	volatile int clientsheld;
+	// resident memory shared with other processes (mostly the lists, inherited from
+	// the parent) & the child's own - of which how much has been written to - and
+	// the size of its heap, in kB, as of memorytime
+	volatile unsigned long sharedkb;
+	volatile unsigned long privatekb;
+	volatile unsigned long dirtykb;
+	volatile unsigned long heapkb;
+	volatile time_t memorytime;
+	// when the child was started, and whether it wants replacing
+	volatile time_t started;
+	volatile int retiring;
+};
+
+// a client IP address or user, and what it's up to
+struct ScoreboardClient
+{
+	// 'i' for an IP address, 'u' for a user, or 0 if the entry has never been used
+	char type;
+	char key[SB_USERLEN];
+	// requests in progress, and the number started in the second given by window
+	int active;
+	time_t window;
+	int requests;
+	// when it last tried to start a request, & how many it has started & been refused
+	time_t seen;
+	unsigned long total;
+	unsigned long refused;
+};
+
+
+// IMPLEMENTATION
+
+Scoreboard::Scoreboard()
+:	header(NULL), slots(NULL), clients(NULL), regionlen(0), myslot(-1), memorytime(0), basedirtykb(0), baseheapkb(0)
+{
+	wakefd[0] = wakefd[1] = -1;
+	limits[0] = limits[1] = limits[2] = limits[3] = 0;
+}
+
+Scoreboard::~Scoreboard()
+{
+	release();
+}
+
+void Scoreboard::release()
+{
+	if (header != NULL) {
+		munmap(header, regionlen);
+		header = NULL;
+		slots = NULL;
+		clients = NULL;
+	}
+	if (wakefd[0] >= 0) {
+		close(wakefd[0]);
+		if (wakefd[1] != wakefd[0])
+			close(wakefd[1]);
+	}
+	wakefd[0] = wakefd[1] = -1;
+	myslot = -1;
+}
+
+// create the file & map it, with room for the given number of children & clients
+bool Scoreboard::create(const char *filename, int numslots, int numclients)
+{
+	release();
+	regionlen = sizeof(ScoreboardHeader) + (numslots * sizeof(ScoreboardSlot)) + (numclients * sizeof(ScoreboardClient));
+	unlink(filename);
+	int fd = open(filename, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		syslog(LOG_ERR, "Error creating scoreboard file %s: %s", filename, strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, regionlen) < 0) {
+		syslog(LOG_ERR, "Error sizing scoreboard file %s: %s", filename, strerror(errno));
+		close(fd);
+		return false;
+	}
+	void *region = mmap(NULL, regionlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		syslog(LOG_ERR, "Error mapping scoreboard file %s: %s", filename, strerror(errno));
+		return false;
+	}
+	memset(region, 0, regionlen);
+	header = (ScoreboardHeader*) region;
+	slots = (ScoreboardSlot*) (header + 1);
+	clients = (ScoreboardClient*) (slots + numslots);
+	header->slots = numslots;
+	header->clients = numclients;
+	header->parent = getpid();
+	header->started = time(NULL);
+	header->magic = SB_MAGIC;
+
+	// children write to this to wake the parent - never block doing so, as
+	// a wakeup already waiting is as good as another
+#ifdef HAVE_SYS_EVENTFD_H
+	wakefd[0] = wakefd[1] = eventfd(0, EFD_NONBLOCK);
+	if (wakefd[0] < 0) {
+#else
+	if (pipe(wakefd) < 0 || fcntl(wakefd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(wakefd[1], F_SETFL, O_NONBLOCK) < 0) {
+#endif
+		syslog(LOG_ERR, "Error creating scoreboard wakeup descriptor: %s", strerror(errno));
+		release();
+		return false;
+	}
+	return true;
+}
+
+// wake the parent
+void Scoreboard::wake()
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+	if (write(wakefd[1], &one, sizeof(one)) < 0) {}
+#else
+	if (write(wakefd[1], "W", 1) < 0) {}
+#endif
+}
+
+// clear any wakeups waiting for the parent
+void Scoreboard::clearWake()
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t count;
+	if (read(wakefd[0], &count, sizeof(count)) < 0) {}
+#else
+	char buff[64];
+	while (read(wakefd[0], buff, sizeof(buff)) > 0);
+#endif
+}
+
+// change a slot's state from one thing to another, keeping the counts up to date
+bool Scoreboard::transition(int slot, int from, int to)
+{
+	ScoreboardSlot &s = slots[slot];
+	if (!__sync_bool_compare_and_swap(&s.state, from, to))
+		return false;
+	if (from == SB_IDLE)
+		__sync_fetch_and_sub(&header->idle, 1);
+	else if (from == SB_STARTING)
+		__sync_fetch_and_sub(&header->starting, 1);
+	if (to == SB_IDLE)
+		__sync_fetch_and_add(&header->idle, 1);
+	else if (to == SB_STARTING)
+		__sync_fetch_and_add(&header->starting, 1);
+	s.statetime = time(NULL);
+	return true;
+}
+
+// parent: find an empty slot and fill it in for a new child, returning its number.
+// the pid is filled in separately, so the slot can be set up before forking.
+int Scoreboard::addChild(pid_t pid)
+{
+	for (int i = 0; i < header->slots; i++) {
+		if (slots[i].state != SB_EMPTY)
+			continue;
+		ScoreboardSlot &s = slots[i];
+		s.pid = pid;
+		s.activity = SB_WAITING;
+		s.requesttime = 0;
+		s.requests = 0;
+		s.connections = 0;
+		s.clientsheld = 0;
+		s.sharedkb = s.privatekb = s.dirtykb = s.heapkb = 0;
+		s.memorytime = 0;
+		s.started = time(NULL);
+		s.retiring = SB_KEEP;
+		s.url[0] = s.ip[0] = s.user[0] = '\0';
+		transition(i, SB_EMPTY, SB_STARTING);
+		return i;
+	}
+	return -1;
+}
+
+void Scoreboard::setPid(int slot, pid_t pid)
+{
+	slots[slot].pid = pid;
+}
+
+// parent: forget a child which has exited
+void Scoreboard::deleteChild(int slot)
+{
+	int state;
+	do {
+		state = slots[slot].state;
+	} while (state != SB_EMPTY && !transition(slot, state, SB_EMPTY));
+	slots[slot].pid = 0;
+}
+
+// parent: mark an idle child as dying - fails if it has just become busy
+bool Scoreboard::cullChild(int slot)
+{
+	return transition(slot, SB_IDLE, SB_DYING);
+}
+
+// parent: mark a child as dying, whatever it's doing
+void Scoreboard::killChild(int slot)
+{
+	int state;
+	do {
+		state = slots[slot].state;
+	} while (state != SB_EMPTY && state != SB_DYING && !transition(slot, state, SB_DYING));
+}
+
+// parent: mark an idle child as busy, as it's being given a connection
+bool Scoreboard::giveConnection(int slot)
+{
+	return transition(slot, SB_IDLE, SB_BUSY);
+}
+
+int Scoreboard::findChild(pid_t pid)
+{
+	for (int i = 0; i < header->slots; i++) {
+		if (slots[i].state != SB_EMPTY && slots[i].pid == pid)
+			return i;
+	}
+	return -1;
+}
+
+pid_t Scoreboard::pidAt(int slot)
+{
+	return slots[slot].pid;
+}
+
+int Scoreboard::stateAt(int slot)
+{
+	return slots[slot].state;
+}
+
+int Scoreboard::idleChildren()
+{
+	return header->idle;
+}
+
+int Scoreboard::startingChildren()
+{
+	return header->starting;
+}
+
+void Scoreboard::setStarved(bool starved)
+{
+	header->starved = starved ? 1 : 0;
+}
+
+void Scoreboard::serviceStats(unsigned long &served, unsigned long &servicemsecs)
+{
+	served = header->served;
+	servicemsecs = header->servicemsecs;
+}
+
+void Scoreboard::serviceHistogram(unsigned long *hist)
+{
+	for (int i = 0; i < SB_HISTBUCKETS; i++)
+		hist[i] = header->servicehist[i];
+}
+
+void Scoreboard::setLoadTier(int tier)
+{
+	header->loadtier = tier;
+}
+
+int Scoreboard::loadTier()
+{
+	return header->loadtier;
+}
+
+void Scoreboard::setAdmissions(int waiting, unsigned long queued, unsigned long rejected)
+{
+	header->waiting = waiting;
+	header->queued = queued;
+	header->rejected = rejected;
+}
+
+// child: change our state, waking the parent if it needs to know
+bool Scoreboard::setState(int state)
+{
+	int old;
+	do {
+		old = slots[myslot].state;
+		if (old == SB_DYING)
+			return false;  // parent wants us gone
+		if (old == state)
+			return true;
+	} while (!transition(myslot, old, state));
+	// the parent needs to know when we're ready for the first time, when it may
+	// need to start more children, and when it has connections waiting for a free
+	// one; culling spares is left for it to do in its own time
+	if (old == SB_STARTING || (state == SB_BUSY && (header->idle < 1 || header->idle < o.minspare_children))
+		|| (state == SB_IDLE && header->starved))
+		wake();
+	if (state == SB_IDLE)
+		publishMemory();
+	return true;
+}
+
+void Scoreboard::setConnections(int n)
+{
+	slots[myslot].connections = n;
+}
+
+// lock & unlock the text in our slot against other threads writing it
+void Scoreboard::lockText()
+{
+	ScoreboardSlot &s = slots[myslot];
+	while (__sync_lock_test_and_set(&s.textlock, 1))
+		usleep(1);
+	__sync_fetch_and_add(&s.seq, 1);
+}
+
+void Scoreboard::unlockText()
+{
+	ScoreboardSlot &s = slots[myslot];
+	__sync_fetch_and_add(&s.seq, 1);
+	__sync_lock_release(&s.textlock);
+}
+
+// child: publish the start of a request
+void Scoreboard::startRequest(const char *url, const char *ip)
+{
+	if (myslot < 0)
+		return;
+	ScoreboardSlot &s = slots[myslot];
+	lockText();
+	strncpy(s.url, url, SB_URLLEN - 1);
+	s.url[SB_URLLEN - 1] = '\0';
+	strncpy(s.ip, ip, SB_IPLEN - 1);
+	s.ip[SB_IPLEN - 1] = '\0';
+	s.user[0] = '\0';
+	unlockText();
+	s.requesttime = time(NULL);
+	s.activity = SB_CHECKING;
+	__sync_fetch_and_add(&s.requests, 1);
+}
+
+void Scoreboard::setUser(const char *user)
+{
+	if (myslot < 0)
+		return;
+	ScoreboardSlot &s = slots[myslot];
+	lockText();
+	strncpy(s.user, user, SB_USERLEN - 1);
+	s.user[SB_USERLEN - 1] = '\0';
+	unlockText();
+}
+
+void Scoreboard::setActivity(int activity)
+{
+	if (myslot < 0)
+		return;
+	slots[myslot].activity = activity;
+}
+
+void Scoreboard::endRequest(const struct timeval *start)
+{
+	if (myslot < 0)
+		return;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long msecs = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+	if (msecs < 0)
+		msecs = 0;  // clock went backwards
+	__sync_fetch_and_add(&header->servicemsecs, (unsigned long) msecs);
+	__sync_fetch_and_add(&header->served, 1UL);
+	int bucket = 0;
+	while (bucket < SB_HISTBUCKETS - 1 && msecs >= (1L << bucket))
+		bucket++;
+	__sync_fetch_and_add(&header->servicehist[bucket], 1UL);
+	publishMemory();
+}
+
+// how much of this process's resident memory is shared with other processes, and how
+// much is its own - and of that, how much has been written to - in kB.  shared pages are
+// only told apart from private ones properly by smaps_rollup (Linux 4.14 on) - statm
+// only counts those mapped from files as shared, and doesn't count written pages at all.
+static bool readMemory(unsigned long &sharedkb, unsigned long &privatekb, unsigned long &dirtykb)
+{
+	char line[256];
+	unsigned long kb;
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (f != NULL) {
+		sharedkb = privatekb = dirtykb = 0;
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "Shared_%*[^:]: %lu kB", &kb) == 1)
+				sharedkb += kb;
+			else if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+				privatekb += kb;
+				dirtykb += kb;
+			}
+			else if (sscanf(line, "Private_%*[^:]: %lu kB", &kb) == 1)
+				privatekb += kb;
+		}
+		fclose(f);
+		return true;
+	}
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return false;
+	unsigned long size, resident, shared;
+	int rc = fscanf(f, "%lu %lu %lu", &size, &resident, &shared);
+	fclose(f);
+	if (rc != 3)
+		return false;
+	kb = sysconf(_SC_PAGESIZE) / 1024;
+	sharedkb = shared * kb;
+	privatekb = dirtykb = (resident - shared) * kb;
+	return true;
+}
+
+// memory the C library has taken from the system for the heap, in kB, or 0 if it can't say
+static unsigned long heapSize()
+{
+#if defined(HAVE_MALLINFO2)
+	struct mallinfo2 mi = mallinfo2();
+	return (mi.arena + mi.hblkhd) / 1024;
+#elif defined(HAVE_MALLINFO)
+	struct mallinfo mi = mallinfo();
+	return ((unsigned long) (unsigned int) mi.arena + (unsigned long) (unsigned int) mi.hblkhd) / 1024;
+#else
+	return 0;
+#endif
+}
+
+void Scoreboard::publishMemory()
+{
+	if (myslot < 0)
+		return;
+	time_t now = time(NULL);
+	if (now - memorytime < SB_MEMINTERVAL)
+		return;
+	memorytime = now;
+	unsigned long sharedkb, privatekb, dirtykb;
+	if (!readMemory(sharedkb, privatekb, dirtykb))
+		return;
+	ScoreboardSlot &s = slots[myslot];
+	s.sharedkb = sharedkb;
+	s.privatekb = privatekb;
+	s.dirtykb = dirtykb;
+	s.heapkb = heapSize();
+	if (s.memorytime == 0) {
+		// some of the heap, at least, comes with us from the parent
+		basedirtykb = s.dirtykb;
+		baseheapkb = s.heapkb;
+	}
+	s.memorytime = now;
+}
+
+const char *Scoreboard::outgrown(unsigned long maxdirtykb, unsigned long maxheapkb, int maxage)
+{
+	if (myslot < 0)
+		return NULL;
+	ScoreboardSlot &s = slots[myslot];
+	if (maxdirtykb > 0 && s.dirtykb > basedirtykb + maxdirtykb)
+		return "private memory";
+	if (maxheapkb > 0 && s.heapkb > baseheapkb + maxheapkb)
+		return "heap size";
+	if (maxage > 0 && time(NULL) - s.started > maxage)
+		return "age";
+	return NULL;
+}
+
+bool Scoreboard::retire()
+{
+	if (myslot < 0 || slots[myslot].retiring != SB_KEEP)
+		return false;
+	slots[myslot].retiring = SB_RETIRE;
+	wake();
+	return true;
+}
+
+int Scoreboard::retiringAt(int slot)
+{
+	return slots[slot].retiring;
+}
+
+void Scoreboard::setRetiring(int slot, int retiring)
+{
+	slots[slot].retiring = retiring;
+}
+
+time_t Scoreboard::startedAt(int slot)
+{
+	return slots[slot].started;
+}
+
+void Scoreboard::setClientLimits(int ipactive, int iprate, int useractive, int userrate)
+{
+	limits[0] = ipactive;
+	limits[1] = iprate;
+	limits[2] = useractive;
+	limits[3] = userrate;
+}
+
+// the client table lock holds the PID of the process which has it, so that
+// it can be taken back from one which died holding it
+void Scoreboard::lockClients()
+{
+	pid_t me = getpid();
+	int spins = 0;
+	while (!__sync_bool_compare_and_swap(&header->clientlock, 0, me)) {
+		pid_t holder = header->clientlock;
+		if (++spins % 1000 == 0 && holder != 0 && kill(holder, 0) < 0 && errno == ESRCH
+			&& __sync_bool_compare_and_swap(&header->clientlock, holder, me))
+		{
+			break;
+		}
+		usleep(1);
+	}
+}
+
+void Scoreboard::unlockClients()
+{
+	__sync_lock_release(&header->clientlock);
+}
+
+// look for the client near where its key hashes to.  entries are never emptied, only
+// reused once their clients have been quiet for a while, so an entry which has never
+// been used means the client isn't any further along.
+int Scoreboard::findClient(char type, const char *key, bool claim, time_t now)
+{
+	int n = header->clients;
+	if (n < 1 || key == NULL || key[0] == '\0')
+		return -1;
+	unsigned int hash = 2166136261U ^ (unsigned char) type;
+	for (const char *p = key; *p; p++)
+		hash = (hash ^ (unsigned char) *p) * 16777619U;
+	int spare = -1;
+	for (int i = 0; i < SB_CLIENTPROBE && i < n; i++) {
+		int c = (hash + i) % n;
+		ScoreboardClient &e = clients[c];
+		if (e.type == type && strncmp(e.key, key, SB_USERLEN - 1) == 0)
+			return c;
+		if (spare < 0 && (e.type == 0 || (e.active < 1 && now - e.seen > SB_CLIENTAGE)))
+			spare = c;
+		if (e.type == 0)
+			break;
+	}
+	if (!claim || spare < 0)
+		return -1;
+	ScoreboardClient &e = clients[spare];
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	strncpy(e.key, key, SB_USERLEN - 1);
+	return spare;
+}
+
+int Scoreboard::clientOver(int c, int maxactive, int maxrate, time_t now)
+{
+	ScoreboardClient &e = clients[c];
+	if (maxactive > 0 && e.active >= maxactive)
+		return SB_TOOMANY;
+	if (maxrate > 0 && e.window == now && e.requests >= maxrate)
+		return SB_TOOFAST;
+	return SB_CLIENTOK;
+}
+
+// child: start a request, if neither the client's IP nor user is over its limits
+int Scoreboard::clientBegin(const char *ip, const char *user, int held[2], bool lasttry)
+{
+	held[0] = held[1] = -1;
+	if (header == NULL || header->clients < 1)
+		return SB_CLIENTOK;
+	time_t now = time(NULL);
+	int c[2];
+	int rc = SB_CLIENTOK;
+	lockClients();
+	c[0] = findClient('i', ip, true, now);
+	c[1] = findClient('u', user, true, now);
+	for (int i = 0; i < 2 && rc == SB_CLIENTOK; i++) {
+		if (c[i] >= 0)
+			rc = clientOver(c[i], limits[i * 2], limits[i * 2 + 1], now);
+	}
+	int n = 0;
+	for (int i = 0; i < 2; i++) {
+		if (c[i] < 0)
+			continue;
+		ScoreboardClient &e = clients[c[i]];
+		e.seen = now;
+		if (rc != SB_CLIENTOK) {
+			if (lasttry)
+				e.refused++;
+			continue;
+		}
+		if (e.window != now) {
+			e.window = now;
+			e.requests = 0;
+		}
+		e.requests++;
+		e.active++;
+		e.total++;
+		held[i] = c[i];
+		n++;
+	}
+	unlockClients();
+	if (n > 0 && myslot >= 0)
+		__sync_fetch_and_add(&slots[myslot].clientsheld, n);
+	return rc;
+}
+
+// child: a request started by clientBegin is over
+void Scoreboard::clientEnd(int held[2])
+{
+	if (header == NULL || (held[0] < 0 && held[1] < 0))
+		return;
+	int n = 0;
+	lockClients();
+	for (int i = 0; i < 2; i++) {
+		if (held[i] < 0)
+			continue;
+		if (clients[held[i]].active > 0)
+			clients[held[i]].active--;
+		held[i] = -1;
+		n++;
+	}
+	unlockClients();
+	if (myslot >= 0)
+		__sync_fetch_and_sub(&slots[myslot].clientsheld, n);
+}
+
+// parent: would a request from this client be within its limits?
+bool Scoreboard::clientAllowed(const char *ip, const char *user)
+{
+	if (header == NULL || header->clients < 1)
+		return true;
+	time_t now = time(NULL);
+	lockClients();
+	int c = findClient('i', ip, false, now);
+	bool ok = (c < 0 || clientOver(c, limits[0], limits[1], now) == SB_CLIENTOK);
+	if (ok && (c = findClient('u', user, false, now)) >= 0)
+		ok = (clientOver(c, limits[2], limits[3], now) == SB_CLIENTOK);
+	unlockClients();
+	return ok;
+}
+
+bool Scoreboard::clientsHeld(int slot)
+{
+	return slots[slot].clientsheld > 0;
+}
+
+// parent: a child died without finishing its requests, and we don't know which
+// clients they were for - so let everyone start afresh, rather than lock any out
+void Scoreboard::clientReset()
+{
+	if (header == NULL || header->clients < 1)
+		return;
+	lockClients();
+	for (int i = 0; i < header->clients; i++)
+		clients[i].active = 0;
+	unlockClients();
+}
+
+// print the state of the children of a running copy of DG, from the given file
+int Scoreboard::showStatus(const char *filename)
+{
+	static const char *states[] = { "empty", "starting", "idle", "busy", "dying" };
+	static const char *activities[] = { "waiting", "checking", "fetching", "scanning", "sending" };
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Error opening status file " << filename << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	struct stat st;
+	void *region = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(ScoreboardHeader))
+		region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		std::cerr << "Error reading status file " << filename << std::endl;
+		return 1;
+	}
+	ScoreboardHeader *h = (ScoreboardHeader*) region;
+	if (h->magic != SB_MAGIC || st.st_size < (off_t) (sizeof(ScoreboardHeader) + h->slots * sizeof(ScoreboardSlot)
+		+ h->clients * sizeof(ScoreboardClient)))
+	{
+		std::cerr << "Status file " << filename << " is not in a format this version understands" << std::endl;
+		munmap(region, st.st_size);
+		return 1;
+	}
+	ScoreboardSlot *s = (ScoreboardSlot*) (h + 1);
+	time_t now = time(NULL);
+
+	int children = 0;
+	for (int i = 0; i < h->slots; i++) {
+		if (s[i].state != SB_EMPTY)
+			children++;
+	}
+	std::cout << "Parent PID " << h->parent << ", up " << (now - h->started) << "s; "
+		<< children << " children (" << h->idle << " idle, " << h->starting << " starting)" << std::endl;
+	std::cout << h->waiting << " connection(s) waiting for a child; " << h->queued << " queued & "
+		<< h->rejected << " turned away since startup; load shedding tier " << h->loadtier << std::endl;
+	unsigned long sharedkb = 0, privatekb = 0;
+	for (int i = 0; i < h->slots; i++) {
+		if (s[i].state == SB_EMPTY)
+			continue;
+		privatekb += s[i].privatekb;
+		if (s[i].sharedkb > sharedkb)
+			sharedkb = s[i].sharedkb;
+	}
+	std::cout << "Children's memory: " << privatekb << "kB private between them; up to " << sharedkb
+		<< "kB each shared with other processes" << std::endl;
+	std::cout << "PID\tstate\tfor\tage\trequests\tconnections\tshared\tprivate\tdirty\theap\tactivity\tfor\tclient\tuser\tURL" << std::endl;
+
+	char url[SB_URLLEN], ip[SB_IPLEN], user[SB_USERLEN];
+	for (int i = 0; i < h->slots; i++) {
+		ScoreboardSlot &c = s[i];
+		int state = c.state;
+		if (state == SB_EMPTY || state > SB_DYING)
+			continue;
+		// copy the text out, trying again if it changed underneath us
+		unsigned int seq;
+		int tries = 0;
+		do {
+			seq = c.seq;
+			__sync_synchronize();
+			memcpy(url, c.url, SB_URLLEN);
+			memcpy(ip, c.ip, SB_IPLEN);
+			memcpy(user, c.user, SB_USERLEN);
+			__sync_synchronize();
+		} while (((seq & 1) || seq != c.seq) && ++tries < 100);
+		url[SB_URLLEN - 1] = ip[SB_IPLEN - 1] = user[SB_USERLEN - 1] = '\0';
+		int activity = c.activity;
+		std::cout << c.pid << '\t' << states[state] << (c.retiring != SB_KEEP ? ",retiring\t" : "\t")
+			<< (now - c.statetime) << "s\t" << (now - c.started) << "s\t" << c.requests << '\t' << c.connections << '\t';
+		if (c.memorytime > 0)
+			std::cout << c.sharedkb << "kB\t" << c.privatekb << "kB\t" << c.dirtykb << "kB\t" << c.heapkb << "kB\t";
+		else
+			std::cout << "-\t-\t-\t-\t";
+		if (c.requesttime > 0 && activity >= SB_WAITING && activity <= SB_SENDING) {
+			std::cout << activities[activity] << '\t' << (now - c.requesttime) << "s\t"
+				<< ip << '\t' << (user[0] ? user : "-") << '\t' << url << std::endl;
+		} else
+			std::cout << "-\t-\t-\t-\t-" << std::endl;
+	}
+
+	// clients seen lately (this is only a snapshot - the table isn't locked)
+	if (h->clients > 0) {
+		ScoreboardClient *cl = (ScoreboardClient*) (s + h->slots);
+		char key[SB_USERLEN];
+		std::cout << std::endl << "type\tclient\tat once\trequests\trefused\tlast seen" << std::endl;
+		for (int i = 0; i < h->clients; i++) {
+			ScoreboardClient &e = cl[i];
+			if (e.type == 0 || (e.active < 1 && now - e.seen > SB_CLIENTAGE))
+				continue;
+			memcpy(key, e.key, SB_USERLEN);
+			key[SB_USERLEN - 1] = '\0';
+			std::cout << (e.type == 'u' ? "user\t" : "ip\t") << key << '\t' << e.active << '\t'
+				<< e.total << '\t' << e.refused << '\t' << (now - e.seen) << "s ago" << std::endl;
+		}
+	}
+	munmap(region, st.st_size);
+	return 0;
+}
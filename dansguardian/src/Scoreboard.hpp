@@ -0,0 +1,201 @@
+// For all support, instructions and copyright go to:
+// http://dansguardian.org/
+// Released under the GPL v2, with the OpenSSL exception described in the README file.
+
+#ifndef __HPP_SCOREBOARD
+#define __HPP_SCOREBOARD
+
+
+// INCLUDES
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <ctime>
+
+
+// DEFINES
+
+// states of a child process, as far as the parent is concerned.  children which
+// hold many connections at once are idle whilst they have room for more.
+#define SB_EMPTY 0  // slot not in use
+#define SB_STARTING 1  // forked, but not yet ready for connections
+#define SB_IDLE 2  // waiting for connections
+#define SB_BUSY 3  // handling a connection
+#define SB_DYING 4  // told to exit by the parent
+
+// what a child is doing with its current request
+#define SB_WAITING 0  // waiting for a request
+#define SB_CHECKING 1  // checking the request against the lists
+#define SB_FETCHING 2  // waiting for the response from upstream
+#define SB_SCANNING 3  // downloading & filtering or scanning the response
+#define SB_SENDING 4  // sending the response to the client
+
+// lengths of the text published with each request
+#define SB_URLLEN 256
+#define SB_IPLEN 48
+#define SB_USERLEN 64
+
+// buckets in the histogram of request times - bucket n counts requests taking
+// under 2^n milliseconds, and the last bucket everything longer
+#define SB_HISTBUCKETS 18
+
+// whether a child wants to be replaced (maxchildmemory & co.)
+#define SB_KEEP 0
+#define SB_RETIRE 1  // has asked the parent to replace it
+#define SB_REPLACED 2  // its replacement has been started
+
+// whether a client can start another request (maxclientconnections & co.)
+#define SB_CLIENTOK 0
+#define SB_TOOMANY 1  // too many requests at once
+#define SB_TOOFAST 2  // too many requests this second
+
+
+// DECLARATIONS
+
+struct ScoreboardHeader;
+struct ScoreboardSlot;
+struct ScoreboardClient;
+
+// the scoreboard - a file mapped into shared memory by the parent, holding a slot for
+// each child process.  children publish their state & current request in their own
+// slot, and wake the parent (through an eventfd or pipe) when they change between idle
+// and busy, so that the parent doesn't need to talk to, or look at, each of them in
+// turn to keep the right number running.  the same file can be read by other processes
+// to see what all the children are doing (see showStatus).
+// state changes are made with compare-and-swap, so that parent & child can't both
+// change a slot's state at once; counts of idle & starting children are kept up to
+// date alongside them.  the text published with a request has a sequence number,
+// which is odd whilst it is being written, so readers can tell if they caught it half done.
+// after the slots is an optional table of client IPs & users, counting their requests so
+// that no one client can take over the children.
+class Scoreboard
+{
+public:
+	Scoreboard();
+	~Scoreboard();
+
+	// create the file & map it, with room for the given number of children,
+	// and of client IPs & users to keep track of
+	bool create(const char *filename, int slots, int clients = 0);
+	// unmap the file (the file itself is left for showStatus to read)
+	void release();
+
+	// descriptor for the parent to wait on, and clear once woken
+	int wakeFD() { return wakefd[0]; };
+	void clearWake();
+
+	// parent: find an empty slot and fill it in for a new child, returning its number
+	int addChild(pid_t pid);
+	// parent: set a child's pid once it has been forked
+	void setPid(int slot, pid_t pid);
+	// parent: forget a child which has exited
+	void deleteChild(int slot);
+	// parent: mark an idle child as dying - fails if it has just become busy
+	bool cullChild(int slot);
+	// parent: mark a child as dying, whatever it's doing
+	void killChild(int slot);
+	// parent: mark an idle child as busy, as it's being given a connection - fails if it isn't idle
+	bool giveConnection(int slot);
+
+	// slot holding the given child, or -1
+	int findChild(pid_t pid);
+	pid_t pidAt(int slot);
+	int stateAt(int slot);
+
+	// counts of children which are idle, and which haven't yet become ready
+	int idleChildren();
+	int startingChildren();
+	// parent: have a child wake us as soon as it becomes idle, as we have connections waiting for one
+	void setStarved(bool starved);
+	// parent: number of requests finished so far, and the total time taken over them
+	void serviceStats(unsigned long &served, unsigned long &servicemsecs);
+	// parent: publish the number of connections waiting for a free child, and how
+	// many have been made to wait, or turned away, so far
+	void setAdmissions(int waiting, unsigned long queued, unsigned long rejected);
+	// parent: histogram of the time taken over requests finished so far (see SB_HISTBUCKETS)
+	void serviceHistogram(unsigned long *hist);
+	// how much content checking children should scale back (loadshedmaxtier)
+	void setLoadTier(int tier);
+	int loadTier();
+
+	// child: which slot is ours?
+	void setSlot(int slot) { myslot = slot; };
+	// child: change our state, waking the parent if it needs to know.  if told to
+	// exit by the parent, stays dying and returns false.
+	bool setState(int state);
+	// child: number of connections we are holding
+	void setConnections(int n);
+	// child: publish the start of a request, and what we're doing with it
+	void startRequest(const char *url, const char *ip);
+	void setUser(const char *user);
+	void setActivity(int activity);
+	// child: a request which started at the given time has been dealt with
+	void endRequest(const struct timeval *start);
+	// child: publish how much of our memory is shared & how much is ours alone -
+	// done when idle & after requests, but at most every few seconds
+	void publishMemory();
+	// child: why we should be replaced - for our private dirty memory or heap having
+	// grown by too much since we started (in kB), or having been around too long (in
+	// seconds) - or NULL if we're fine (0 = no limit).  uses the figures last published.
+	const char *outgrown(unsigned long maxdirtykb, unsigned long maxheapkb, int maxage);
+	// child: ask the parent to replace us, carrying on until it tells us to exit.
+	// returns false if we already have.
+	bool retire();
+	// parent: whether the child in this slot wants replacing (SB_KEEP, SB_RETIRE or SB_REPLACED)
+	int retiringAt(int slot);
+	void setRetiring(int slot, int retiring);
+	// when the child in this slot was started
+	time_t startedAt(int slot);
+
+	// limits on each client IP & each user: requests at once, and started per second (0 = none)
+	void setClientLimits(int ipactive, int iprate, int useractive, int userrate);
+	// child: start a request from the given client IP & user (blank if not known), unless
+	// either is over its limits.  returns SB_CLIENTOK, with held filled in for clientEnd,
+	// or which limit was hit - counting the request as refused if told it's the last try.
+	int clientBegin(const char *ip, const char *user, int held[2], bool lasttry);
+	// child: the request has finished
+	void clientEnd(int held[2]);
+	// parent: could a request from this client start right now?
+	bool clientAllowed(const char *ip, const char *user);
+	// parent: has the child in this slot got requests it hasn't finished?
+	bool clientsHeld(int slot);
+	// parent: forget all requests in progress, after a child died part way through some
+	void clientReset();
+
+	// print the state of the children of a running copy of DG, from the given file
+	static int showStatus(const char *filename);
+
+private:
+	ScoreboardHeader *header;
+	ScoreboardSlot *slots;
+	ScoreboardClient *clients;
+	size_t regionlen;
+	int limits[4];
+	int wakefd[2];
+	int myslot;
+	// child: when we last published our memory, and how much we had when we first did
+	time_t memorytime;
+	unsigned long basedirtykb;
+	unsigned long baseheapkb;
+
+	// disallow copying
+	Scoreboard(const Scoreboard&);
+	Scoreboard& operator=(const Scoreboard&);
+
+	// change a slot's state from one thing to another, keeping the counts up to date
+	bool transition(int slot, int from, int to);
+	// wake the parent
+	void wake();
+	// lock & unlock the text in our slot against other threads writing it
+	void lockText();
+	void unlockText();
+	// lock & unlock the client table
+	void lockClients();
+	void unlockClients();
+	// entry for the given client, claiming a spare one if asked - or -1.  call with the table locked.
+	int findClient(char type, const char *key, bool claim, time_t now);
+	// would another request take this client over the given limits?
+	int clientOver(int c, int maxactive, int maxrate, time_t now);
+};
+
+#endif
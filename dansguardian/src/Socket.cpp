@@ -116,13 +116,15 @@ Socket::Socket(int newfd, struct sockaddr_in myip, struct sockaddr_in peerip):Ba
 // find the ip to which the client has connected
 std::string Socket::getLocalIP()
 {
-	return inet_ntoa(my_adr.sin_addr);
+	char ip[INET_ADDRSTRLEN];
+	return inet_ntop(AF_INET, &my_adr.sin_addr, ip, sizeof(ip));
 }
 
 // find the ip of the client connecting to us
 std::string Socket::getPeerIP()
 {
-	return inet_ntoa(peer_adr.sin_addr);
+	char ip[INET_ADDRSTRLEN];
+	return inet_ntop(AF_INET, &peer_adr.sin_addr, ip, sizeof(ip));
 }
 
 // find the port of the client connecting to us
@@ -268,7 +270,7 @@ int Socket::startSslClient(const std::string& certificate_path)
 	//fcntl(this->getFD() ,F_SETFL, O_NONBLOCK);
 	SSL_set_fd(ssl, this->getFD());
 	
-	//make io non blocking as select wont tell us if we can do a read without blocking
+	//make io non blocking as poll wont tell us if we can do a read without blocking
 	//BIO_set_nbio(SSL_get_rbio(ssl),1l);
 	//BIO_set_nbio(SSL_get_wbio(ssl),1l);
 	int rc = SSL_connect(ssl);
@@ -593,7 +595,7 @@ int Socket::startSslServer(X509 * x, EVP_PKEY * privKey)
 
 	SSL_set_fd(ssl, this->getFD());
 	
-	//make io non blocking as select wont tell us if we can do a read without blocking
+	//make io non blocking as poll wont tell us if we can do a read without blocking
 
 	if (SSL_accept(ssl) < 0){
 #ifdef DGDEBUG		
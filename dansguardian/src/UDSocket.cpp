@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <stddef.h>
+#include <sys/socket.h>
 
 #ifdef DGDEBUG
 #include <iostream>
@@ -120,3 +121,56 @@ int UDSocket::bind(const char *path)
 
 	return ::bind(sck, (struct sockaddr *) &my_adr, my_adr_length);
 }
+
+// send a message along with a copy of the given FD
+bool UDSocket::sendFD(int fd, const void *data, int len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void*) data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	int rc;
+	do {
+		rc = sendmsg(sck, &msg, 0);
+	} while (rc < 0 && errno == EINTR);
+	return rc == len;
+}
+
+// receive a message, and the FD sent along with it if there is one
+int UDSocket::receiveFD(int &fd, void *data, int len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	fd = -1;
+	int rc;
+	do {
+		rc = recvmsg(sck, &msg, MSG_DONTWAIT);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return rc;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return rc;
+}
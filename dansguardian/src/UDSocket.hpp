@@ -32,6 +32,12 @@ public:
 	
 	// accept incoming connection & return new UDSocket
 	UDSocket* accept();
+
+	// send a message along with a copy of the given FD, and receive one without
+	// blocking, setting fd to the copy received (or -1 if none was).  messages are
+	// read in one go, so must be small enough to arrive in one piece.
+	bool sendFD(int fd, const void *data, int len);
+	int receiveFD(int &fd, void *data, int len);
 	
 	// close connection & clear address structs
 	void reset();
@@ -366,8 +366,8 @@ int ntlminstance::identify(Socket& peercon, Socket& proxycon, HTTPHeader &h, std
 
 		ntlm_authenticate auth;
 		ntlm_auth *a = &(auth.a);
-		static char username[256]; // fixed size
-		static char username2[256];
+		char username[256]; // fixed size
+		char username2[256];
 		char* inptr = username;
 		char* outptr = username2;
 		size_t l,o;
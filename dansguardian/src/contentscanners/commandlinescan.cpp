@@ -322,9 +322,9 @@ int commandlineinstance::scanFile(HTTPHeader * requestheader, HTTPHeader * doche
 	lastvirusname = "Unknown";
 
 	if (usevirusregexp) {
-		virusregexp.match(result.c_str());
-		if (virusregexp.matched()) {
-			lastvirusname = virusregexp.result(submatch);
+		RegResult res;
+		if (virusregexp.match(result.c_str(), res)) {
+			lastvirusname = res.result(submatch);
 			blockFile(NULL,NULL,checkme);
 			return DGCS_INFECTED;
 		}
@@ -10,6 +10,7 @@
 #endif
 #include "FatController.hpp"
 #include "SysV.hpp"
+#include "Scoreboard.hpp"
 
 #include <cstdlib>
 #include <iostream>
@@ -28,16 +29,14 @@
 
 #ifdef __BENCHMARK
 #include <sys/times.h>
+#include <sys/time.h>
 #include "NaughtyFilter.hpp"
+#include <sstream>
 #endif
 
 
 // GLOBALS
 
-#ifndef FD_SETSIZE
-#define FD_SETSIZE 256
-#endif
-
 OptionContainer o;
 
 bool is_daemonised;
@@ -77,6 +76,22 @@ void read_config(const char *configfile, int type)
 	}
 }
 
+#ifdef __BENCHMARK
+// how much of our memory is in huge pages, in kB - for comparing runs with
+// hugepagelists on & off
+unsigned long hugepages_kb()
+{
+	std::ifstream smaps("/proc/self/smaps_rollup");
+	std::string line;
+	unsigned long kb = 0;
+	while (std::getline(smaps, line)) {
+		if (line.compare(0, 14, "AnonHugePages:") == 0 || line.find("_Hugetlb:") != std::string::npos)
+			kb += strtoul(line.c_str() + line.find(':') + 1, NULL, 10);
+	}
+	return kb;
+}
+#endif
+
 // program entry point
 int main(int argc, char *argv[])
 {
@@ -114,13 +129,15 @@ int main(int argc, char *argv[])
 						sleep(1);
 					unlink(o.pid_filename.c_str());
 					unlink(o.ipc_filename.c_str());
-					unlink(o.urlipc_filename.c_str());
 					// remember to reset config before continuing
 					needreset = true;
 					break;
 				case 's':
 					read_config(configfile.c_str(), 0);
 					return sysv_showpid(o.pid_filename);
+				case 'S':
+					read_config(configfile.c_str(), 0);
+					return Scoreboard::showStatus(o.status_filename.c_str());
 				case 'r':
 					read_config(configfile.c_str(), 0);
 					return sysv_hup(o.pid_filename);
@@ -144,7 +161,7 @@ int main(int argc, char *argv[])
 					}
 					break;
 				case 'h':
-					std::cout << "Usage: " << argv[0] << " [{-c ConfigFileName|-v|-P|-h|-N|-q|-s|-r|-g}]" << std::endl;
+					std::cout << "Usage: " << argv[0] << " [{-c ConfigFileName|-v|-P|-h|-N|-q|-s|-S|-r|-g}]" << std::endl;
 					std::cout << "  -v gives the version number and build options." << std::endl;
 					std::cout << "  -h gives this message." << std::endl;
 					std::cout << "  -c allows you to specify a different configuration file location." << std::endl;
@@ -152,15 +169,20 @@ int main(int argc, char *argv[])
 					std::cout << "  -q causes DansGuardian to kill any running copy." << std::endl;
 					std::cout << "  -Q kill any running copy AND start a new one with current options." << std::endl;
 					std::cout << "  -s shows the parent process PID and exits." << std::endl;
-					std::cout << "  -r closes all connections and reloads config files by issuing a HUP," << std::endl;
-					std::cout << "     but this does not reset the maxchildren option (amongst others)." << std::endl;
-					std::cout << "  -g gently restarts by not closing all current connections; only reloads" << std::endl
-						<< "     filter group config files. (Issues a USR1)" << std::endl;
+					std::cout << "  -S shows what each child process is doing and exits." << std::endl;
+					std::cout << "  -r reloads config files by issuing a HUP; a new set of processes takes" << std::endl;
+					std::cout << "     over once loaded, and the old ones finish their current connections." << std::endl;
+					std::cout << "     Filter IPs & ports are not changed (amongst others)." << std::endl;
+					std::cout << "  -g as -r, but only reloads filter group config files. (Issues a USR1)" << std::endl;
 #ifdef __BENCHMARK
 					std::cout << "  --bs benchmark searching filter group 1's bannedsitelist" << std::endl;
 					std::cout << "  --bu benchmark searching filter group 1's bannedurllist" << std::endl;
 					std::cout << "  --bp benchmark searching filter group 1's phrase lists" << std::endl;
 					std::cout << "  --bn benchmark filter group 1's NaughtyFilter in its entirety" << std::endl;
+					std::cout << "  --bc check both phrase search engines give filter group 1's NaughtyFilter" << std::endl;
+					std::cout << "       the same verdict, reason & categories" << std::endl;
+					std::cout << "  --bd check filter group 1's NaughtyFilter gives the same verdict, reason &" << std::endl;
+					std::cout << "       categories filtering as the document downloads as it does filtering it whole" << std::endl;
 #endif
 					return 0;
 #ifdef __BENCHMARK
@@ -192,8 +214,11 @@ int main(int argc, char *argv[])
 	// run benchmarks instead of starting the daemon
 	if (benchmark) {
 		std::string results;
-		char* found;
+		const char* found;
 		struct tms then, now;
+		struct timeval wallthen, wallnow;
+		long elapsed = 0;
+		unsigned long searches = 0;
 		std::string line;
 		std::deque<String*> lines;
 		while (!std::cin.eof()) {
@@ -203,34 +228,32 @@ int main(int argc, char *argv[])
 		}
 		String* strline = NULL;
 		times(&then);
+		gettimeofday(&wallthen, NULL);
 		switch (benchmark) {
 		case 's':
-			// bannedsitelist
-			while (!lines.empty()) {
-				strline = lines.back();
-				lines.pop_back();
-				if ((found = o.fg[0]->inBannedSiteList(*strline))) {
-					results += found;
-					results += '\n';
-				}
-				delete strline;
-			}
-			break;
 		case 'u':
-			// bannedurllist
+			// bannedsitelist or bannedurllist - go through the lines again & again
+			// for at least a second, so that the time per lookup means something
+			do {
+				for (std::deque<String*>::iterator i = lines.begin(); i != lines.end(); i++) {
+					found = (benchmark == 's') ? o.fg[0]->inBannedSiteList(**i) : o.fg[0]->inBannedURLList(**i);
+					if (found && searches < lines.size()) {
+						results += found;
+						results += '\n';
+					}
+					searches++;
+				}
+				gettimeofday(&wallnow, NULL);
+				elapsed = (wallnow.tv_sec - wallthen.tv_sec) * 1000000 + (wallnow.tv_usec - wallthen.tv_usec);
+			} while (elapsed < 1000000 && !lines.empty());
 			while (!lines.empty()) {
-				strline = lines.back();
+				delete lines.back();
 				lines.pop_back();
-				if ((found = o.fg[0]->inBannedURLList(*strline))) {
-					results += found;
-					results += '\n';
-				}
-				delete strline;
 			}
 			break;
 		case 'p': {
 				// phraselists
-				std::deque<unsigned int> found;
+				PhraseHits found;
 				std::string file;
 				while (!lines.empty()) {
 					strline = lines.back();
@@ -240,8 +263,10 @@ int main(int argc, char *argv[])
 				}
 				char cfile[file.length() + 129];
 				memcpy(cfile, file.c_str(), sizeof(char)*file.length());
+				found.prepare(o.lm.l[o.fg[0]->banned_phrase_list]->getListLength(), 0);
 				o.lm.l[o.fg[0]->banned_phrase_list]->graphSearch(found, cfile, file.length());
-				for (std::deque<unsigned int>::iterator i = found.begin(); i != found.end(); i++) {
+				searches = 1;
+				for (std::vector<unsigned int>::iterator i = found.found.begin(); i != found.found.end(); i++) {
 					results += o.lm.l[o.fg[0]->banned_phrase_list]->getItemAtInt(*i);
 					results += '\n';
 				}
@@ -257,18 +282,138 @@ int main(int argc, char *argv[])
 					file += strline->toCharArray();
 					delete strline;
 				}
-				DataBuffer d(file.c_str(), file.length());
 				String f;
-				n.checkme(&d, f, f);
+				n.checkme(file.c_str(), file.length(), &f, &f, 0, o.fg[0]->banned_phrase_list, o.fg[0]->naughtyness_limit);
+				searches = 1;
 				std::cout << n.isItNaughty << std::endl << n.whatIsNaughty << std::endl << n.whatIsNaughtyLog << std::endl << n.whatIsNaughtyCategories << std::endl;
 			}
 			break;
+		case 'c': {
+				// check that both phrase search engines give the same verdict, reason
+				// and categories for a document - load filter group 1's phrase lists
+				// again with whichever engine the group isn't using
+				std::string file;
+				while (!lines.empty()) {
+					strline = lines.back();
+					lines.pop_back();
+					file += strline->toCharArray();
+					delete strline;
+				}
+				ListContainer *lc = o.lm.l[o.fg[0]->banned_phrase_list];
+				unsigned int lists[2];
+				lists[0] = o.fg[0]->banned_phrase_list;
+				if (!o.lm.readbplfile(lc->bannedpfile.toCharArray(), lc->exceptionpfile.toCharArray(), lc->weightedpfile.toCharArray(),
+					lists[1], false, !lc->canStreamSearch()))
+				{
+					std::cerr << "Error reading phrase lists for the other search engine" << std::endl;
+					return 1;
+				}
+				std::string verdicts[2];
+				String f;
+				for (int e = 0; e < 2; e++) {
+					NaughtyFilter n;
+					n.checkme(file.c_str(), file.length(), &f, &f, 0, lists[e], o.fg[0]->naughtyness_limit);
+					std::ostringstream verdict;
+					verdict << n.isItNaughty << std::endl << n.isException << std::endl << n.whatIsNaughty << std::endl
+						<< n.whatIsNaughtyLog << std::endl << n.whatIsNaughtyCategories << std::endl;
+					verdicts[e] = verdict.str();
+					if (o.lm.l[lists[e]]->canStreamSearch())
+						std::cout << "ahocorasick:" << std::endl;
+					else
+						std::cout << ((e == 0 && o.fg[0]->force_quick_search) ? "quick search:" : "graph:") << std::endl;
+					std::cout << verdicts[e];
+				}
+				searches = 2;
+				if (verdicts[0] != verdicts[1]) {
+					std::cout << "search engines differ" << std::endl;
+					return 1;
+				}
+				results = "search engines agree";
+			}
+			break;
+		case 'd': {
+				// check that filtering the document block by block as it downloads
+				// (streamingfilter) gives the same verdict, reason and categories as
+				// filtering it whole - feeding it in 1 byte, small and single blocks
+				std::string file;
+				while (!lines.empty()) {
+					strline = lines.back();
+					lines.pop_back();
+					file += strline->toCharArray();
+					delete strline;
+				}
+				ListContainer *lc = o.lm.l[o.fg[0]->banned_phrase_list];
+				unsigned int list = o.fg[0]->banned_phrase_list;
+				if (!lc->canStreamSearch() && !o.lm.readbplfile(lc->bannedpfile.toCharArray(), lc->exceptionpfile.toCharArray(),
+					lc->weightedpfile.toCharArray(), list, false, true))
+				{
+					std::cerr << "Error reading phrase lists for the Aho-Corasick search engine" << std::endl;
+					return 1;
+				}
+				o.streaming_filter = true;
+				int limit = o.fg[0]->naughtyness_limit;
+				String f;
+				NaughtyFilter whole;
+				whole.checkme(file.c_str(), file.length(), &f, &f, 0, list, limit);
+				std::ostringstream verdict;
+				verdict << whole.isItNaughty << std::endl << whole.isException << std::endl << whole.whatIsNaughty << std::endl
+					<< whole.whatIsNaughtyLog << std::endl << whole.whatIsNaughtyCategories << std::endl;
+				std::cout << "whole:" << std::endl << verdict.str();
+				off_t blocksizes[3] = { 1, 64, file.length() };
+				bool differ = false;
+				for (int b = 0; b < 3; b++) {
+					NaughtyFilter n;
+					if (!n.startStream(0, list, limit)) {
+						std::cerr << "Filter group 1 can't be filtered as the document downloads" << std::endl;
+						return 1;
+					}
+					off_t got = 0;
+					bool early = false;
+					while (got < (off_t) file.length()) {
+						got += (file.length() - got < (size_t) blocksizes[b]) ? file.length() - got : blocksizes[b];
+						if (n.streamBlock(file.c_str(), got)) {
+							early = (got < (off_t) file.length());
+							break;
+						}
+					}
+					n.finishStream(file.c_str(), got);
+					std::ostringstream streamed;
+					streamed << n.isItNaughty << std::endl << n.isException << std::endl << n.whatIsNaughty << std::endl
+						<< n.whatIsNaughtyLog << std::endl << n.whatIsNaughtyCategories << std::endl;
+					std::cout << blocksizes[b] << " byte blocks: ";
+					if (streamed.str() == verdict.str())
+						std::cout << "same" << std::endl;
+					else if (early && n.isItNaughty) {
+						// the expected cost of streaming: exception & negatively weighted
+						// phrases after this point can no longer clear the document
+						std::cout << "blocked at byte " << got << ", before the end"
+							<< (whole.isItNaughty ? " - as it is whole" : " - though whole it isn't") << std::endl << streamed.str();
+					} else {
+						std::cout << "different" << std::endl << streamed.str();
+						differ = true;
+					}
+				}
+				searches = 4;
+				if (differ) {
+					std::cout << "streaming differs" << std::endl;
+					return 1;
+				}
+				results = "streaming agrees";
+			}
+			break;
 		default:
 			std::cerr << "Invalid benchmark option" << std::endl;
 			return 1;
 		}
 		times(&now);
+		gettimeofday(&wallnow, NULL);
+		elapsed = (wallnow.tv_sec - wallthen.tv_sec) * 1000000 + (wallnow.tv_usec - wallthen.tv_usec);
 		std::cout << results << std::endl << "time: " << now.tms_utime - then.tms_utime << std::endl;
+		if (searches > 0) {
+			std::cout << "searches: " << searches << ", " << (elapsed * 1000.0 / searches) << "ns each" << std::endl;
+		}
+		std::cout << "memory in huge pages: " << hugepages_kb() << "kB (hugepagelists "
+			<< (o.huge_page_lists ? "on" : "off") << ")" << std::endl;
 		return 0;
 	}
 #endif
@@ -283,13 +428,6 @@ int main(int argc, char *argv[])
 		o.no_daemon = 1;
 	}
 
-	if ((o.max_children + 6) > FD_SETSIZE) {
-		syslog(LOG_ERR, "%s", "maxchildren option in dansguardian.conf has a value too high.");
-		std::cerr << "maxchildren option in dansguardian.conf has a value too high." << std::endl;
-		std::cerr << "Dammit Jim, I'm a filtering proxy, not a rabbit." << std::endl;
-		return 1;  // we can't have rampant proccesses can we?
-	}
-
 	unsigned int rootuid;  // prepare a struct for use later
 	rootuid = geteuid();
 	o.root_user = rootuid;
@@ -367,6 +505,10 @@ int main(int argc, char *argv[])
 		// all the ground work and non-daemon stuff
 		// away from the daemon class
 		// However the line is not so fine.
+		if (rc == 3) {
+			// filter groups reloaded - take over from the old parent with the options we have
+			continue;
+		}
 		if (rc == 2) {
 
 			// In order to re-read the conf files and create cache files
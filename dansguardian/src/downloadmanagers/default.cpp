@@ -12,6 +12,7 @@
 
 #include "../DownloadManager.hpp"
 #include "../OptionContainer.hpp"
+#include "../NaughtyFilter.hpp"
 
 #include <string.h>
 #include <syslog.h>
@@ -99,9 +100,11 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 	if ((bytesremaining < 0) && !(docheader->isPersistent()))
 		geteverything = true;
 
-	char *block = NULL;  // buffer for storing a grabbed block from the
-	// imput stream
 	char *temp = NULL;
+	// how much room d->data has - the whole of the body is kept, as it goes
+	// to the client (or content scanners) once the verdict is in, but it is
+	// read straight into d->data rather than into a block & then copied
+	off_t capacity = d->buffer_length;
 
 	bool swappedtodisk = false;
 	bool doneinitialdelay = false;
@@ -113,8 +116,8 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 	// buffer size for streaming downloads
 	off_t blocksize = 32768;
 	// set to a sensible minimum
-	if (!wantall && (blocksize > o.max_content_filter_size))
-		blocksize = o.max_content_filter_size;
+	if (!wantall && (blocksize > d->filtersize))
+		blocksize = d->filtersize;
 	else if (wantall && (blocksize > o.max_content_ramcache_scan_size))
 		blocksize = o.max_content_ramcache_scan_size;
 #ifdef DGDEBUG
@@ -171,7 +174,7 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 				break;
 			}
 		} else {
-			if (d->buffer_length > o.max_content_filter_size) {
+			if (d->buffer_length > d->filtersize) {
 				// if we aren't downloading for virus scanning, and file too large for filtering, give up
 #ifdef DGDEBUG
 				std::cout << "defaultdm: file too big to be filtered, halting download" << std::endl;
@@ -193,15 +196,24 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 			// if not getting everything until connection close, grab only what is left
 			if (!geteverything && (newsize > bytesremaining))
 				newsize = bytesremaining;
-			delete[] block;
-			block = new char[newsize];
+			// make room for it on the end of the body.  the buffer grows by
+			// at least double each time, so on average the body is copied no
+			// more than once whatever size the reads turn out to be.
+			if (d->buffer_length + newsize + 1 > capacity) {
+				capacity = (capacity * 2 > d->buffer_length + newsize + 1) ? capacity * 2 : d->buffer_length + newsize + 1;
+				temp = new char[capacity];
+				memcpy(temp, d->data, d->buffer_length);  // copy the current data
+				delete[]d->data;  // delete the current data block
+				d->data = temp;
+				temp = NULL;
+			}
 			try {
 				sock->checkForInput(d->timeout);
 			} catch(std::exception & e) {
 				break;
 			}
 			// improved more efficient socket read which uses the buffer better
-			rc = d->bufferReadFromSocket(sock, block, newsize, d->timeout);
+			rc = d->bufferReadFromSocket(sock, d->data + d->buffer_length, newsize, d->timeout);
 			// grab a block of input, doubled each time
 
 			if (rc <= 0) {
@@ -210,16 +222,18 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 			}
 			else {
 				bytesremaining -= rc;
-				/*if (d->data != temp)
-					delete[] temp;*/
-				temp = new char[d->buffer_length + rc + 1];  // replacement store
-				temp[d->buffer_length + rc] = '\0';
-				memcpy(temp, d->data, d->buffer_length);  // copy the current data
-				memcpy(temp + d->buffer_length, block, rc);  // copy the new data
-				delete[]d->data;  // delete the current data block
-				d->data = temp;
-				temp = NULL;
 				d->buffer_length += rc;  // update data size counter
+				d->data[d->buffer_length] = '\0';
+
+				// filter what we have so far, if streaming - no point
+				// downloading any more once the content has been blocked
+				if (d->streamfilter != NULL && d->streamfilter->streamBlock(d->data, d->buffer_length)) {
+#ifdef DGDEBUG
+					std::cout << "defaultdm: content blocked during download, halting download" << std::endl;
+#endif
+					(*toobig) = true;
+					break;
+				}
 			}
 		} else {
 			try {
@@ -264,7 +278,6 @@ int dminstance::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPH
 #ifdef DGDEBUG
 	std::cout << "Leaving default download manager plugin" << std::endl;
 #endif
-	delete[] block;
 	/*if (d->data != temp)
 		delete[] temp;*/
 	return 0;
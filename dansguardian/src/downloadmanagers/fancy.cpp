@@ -35,13 +35,13 @@ class fancydm:public DMPlugin
 {
 public:
 	fancydm(ConfigVar & definition):DMPlugin(definition),
-		upperlimit(0), toobig_unscanned(false), toobig_notdownloaded(false) {};
+		upperlimit(0) {};
 	int in(DataBuffer * d, Socket * sock, Socket * peersock, HTTPHeader * requestheader,
 		HTTPHeader * docheader, bool wantall, int *headersent, bool * toobig);
 
 	int init(void* args);
 
-	void sendLink(Socket &peersock, String &linkurl, String &prettyurl);
+	void sendLink(DataBuffer *d, Socket &peersock, String &linkurl, String &prettyurl);
 
 private:
 	// customisable fancy DM template
@@ -53,12 +53,8 @@ private:
 	// - if too large, warn the user, but keep downloading (won't be scanned)
 	// - if larger than upper limit also, kill download.
 	off_t upperlimit;
-	
-	// was file too large to be scanned?
-	bool toobig_unscanned;
-
-	// was file so large as to not even be downloaded?
-	bool toobig_notdownloaded;
+	// whether the file was too large to be scanned, or even to be downloaded,
+	// is kept in the DataBuffer (toobig_unscanned, toobig_notdownloaded)
 
 	// format an integer in seconds as hours:minutes:seconds
 	std::string timestring(const int seconds);
@@ -110,10 +106,10 @@ int fancydm::init(void* args)
 }
 
 // call template's downloadlink JavaScript function
-void fancydm::sendLink(Socket &peersock, String &linkurl, String &prettyurl)
+void fancydm::sendLink(DataBuffer *d, Socket &peersock, String &linkurl, String &prettyurl)
 {
 	String mess("<script language='javascript'>\n<!--\ndownloadlink(\""+linkurl+"\",\""+prettyurl
-		+ "\"," + (toobig_notdownloaded ? "2" : (toobig_unscanned ? "1" : "0"))
+		+ "\"," + (d->toobig_notdownloaded ? "2" : (d->toobig_unscanned ? "1" : "0"))
 		+ ");\n//-->\n</script>\n");
 	peersock.writeString(mess.toCharArray());
 	// send text-only version for non-JS-enabled browsers
@@ -121,12 +117,12 @@ void fancydm::sendLink(Socket &peersock, String &linkurl, String &prettyurl)
 	// 1221 "Download complete; file not scanned.</p><p>Click here to download: "
 	// 1222 "File too large to cache.</p><p>Click here to re-download, bypassing virus scanning: "
 	mess = "<noscript><p>";
-	mess += o.language_list.getTranslation(toobig_notdownloaded ? 1222 : (toobig_unscanned ? 1221 : 1220));
+	mess += o.language_list.getTranslation(d->toobig_notdownloaded ? 1222 : (d->toobig_unscanned ? 1221 : 1220));
 	mess += "<a href=\"" + linkurl + "\">" + prettyurl + "</a></p></noscript>";
 	peersock.writeString(mess.toCharArray());
 	peersock.writeString("<!-- force flush -->\r\n");
 	peersock.writeString("</body></html>\n");
-	if (toobig_notdownloaded) {
+	if (d->toobig_notdownloaded) {
 		// add URL to clean cache (for all groups)
 		addToClean(prettyurl, o.filter_groups + 1);
 	}
@@ -183,15 +179,15 @@ int fancydm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHead
 	gettimeofday(&themdays, NULL);
 	gettimeofday(&starttime, NULL);
 	
-	toobig_unscanned = false;
-	toobig_notdownloaded = false;
+	d->toobig_unscanned = false;
+	d->toobig_notdownloaded = false;
 	bool secondstage = false;
 	
 	// buffer size for streaming downloads
 	off_t blocksize = 32768;
 	// set to a sensible minimum
-	if (!wantall && (blocksize > o.max_content_filter_size))
-		blocksize = o.max_content_filter_size;
+	if (!wantall && (blocksize > d->filtersize))
+		blocksize = d->filtersize;
 	else if (wantall && (blocksize > o.max_content_ramcache_scan_size))
 		blocksize = o.max_content_ramcache_scan_size;
 #ifdef DGDEBUG
@@ -301,7 +297,7 @@ int fancydm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHead
 				}
 			} else if (bytesgot > o.max_content_filecache_scan_size) {
 				(*toobig) = true;
-				toobig_unscanned = true;
+				d->toobig_unscanned = true;
 				if (geteverything && (upperlimit > 0)) {
 					// multi-stage download enabled, and we don't know content length
 					if ((!secondstage) && initialsent) {
@@ -332,8 +328,8 @@ int fancydm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHead
 #ifdef DGDEBUG
 						std::cout << "fancydm: file too big to be downloaded, halting second stage of download" << std::endl;
 #endif
-						toobig_unscanned = false;
-						toobig_notdownloaded = true;
+						d->toobig_unscanned = false;
+						d->toobig_notdownloaded = true;
 						break;
 					}
 				} else {
@@ -342,13 +338,13 @@ int fancydm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHead
 #ifdef DGDEBUG
 					std::cout << "fancydm: file too big to be scanned, halting download" << std::endl;
 #endif
-					toobig_unscanned = false;
-					toobig_notdownloaded = true;
+					d->toobig_unscanned = false;
+					d->toobig_notdownloaded = true;
 					break;
 				}
 			}
 		} else {
-			if (bytesgot > o.max_content_filter_size) {
+			if (bytesgot > d->filtersize) {
 				// if we aren't downloading for virus scanning, and file too large for filtering, give up
 #ifdef DGDEBUG
 				std::cout << "fancydm: file too big to be filtered, halting download" << std::endl;
@@ -454,14 +450,14 @@ int fancydm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHead
 		peersock->writeString("<script language='javascript'>\n<!--\nnowscanning();\n//-->\n</script>\n");
 		// send text-only version
 		// 1210 "Download Complete. Starting scan..."
-		if (!(toobig_unscanned || toobig_notdownloaded)) {
+		if (!(d->toobig_unscanned || d->toobig_notdownloaded)) {
 			message = "<noscript><p>";
 			message += o.language_list.getTranslation(1210);
 			message += "</p></noscript>\n";
 			peersock->writeString(message.toCharArray());
 		}
 		// only keep full downloads
-		if (!toobig_notdownloaded)
+		if (!d->toobig_notdownloaded)
 			(*d).preservetemp = true;
 		(*d).dontsendbody = true;
 	}
@@ -119,8 +119,8 @@ int trickledm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHe
 	// buffer size for streaming downloads
 	off_t blocksize = 32768;
 	// set to a sensible minimum
-	if (!wantall && (blocksize > o.max_content_filter_size))
-		blocksize = o.max_content_filter_size;
+	if (!wantall && (blocksize > d->filtersize))
+		blocksize = d->filtersize;
 	else if (wantall && (blocksize > o.max_content_ramcache_scan_size))
 		blocksize = o.max_content_ramcache_scan_size;
 #ifdef DGDEBUG
@@ -203,7 +203,7 @@ int trickledm::in(DataBuffer * d, Socket * sock, Socket * peersock, class HTTPHe
 				break;
 			}
 		} else {
-			if (d->buffer_length > o.max_content_filter_size) {
+			if (d->buffer_length > d->filtersize) {
 				// if we aren't downloading for virus scanning, and file too large for filtering, give up
 #ifdef DGDEBUG
 				std::cout << "defaultdm: file too big to be filtered, halting download" << std::endl;